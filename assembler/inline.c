@@ -0,0 +1,236 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inline.h"
+
+static int is_call(int command)
+{
+    return (command == CALL) || (command == SPAWN);
+}
+
+/*
+ * Slots of the body of the routine at start if it can be inlined: it ends
+ * with its first RET within limit slots, keeps no local slots, does not
+ * call itself and jumps nowhere out of itself. Returns -1 otherwise.
+ */
+static int routine_length(const CPU_command_t* commands, int commands_cnt, int start, int limit)
+{
+    int end = -1;
+    for (int i = start; (i < commands_cnt) && (i - start <= limit); i += CPU_command_length(&commands[i]))
+    {
+        int command = commands[i].command;
+        if ((command == ENTER) || (command == LOAD_LOCAL) || (command == STORE_LOCAL))
+            return -1;
+        if (command == RET)
+        {
+            end = i;
+            break;
+        }
+    }
+    if (end < 0)
+        return -1;
+
+    for (int i = start; i < end; ++i)
+    {
+        if (!(CPU_command_operands(commands[i].command) & OPERAND_TARGET))
+            continue;
+        int target = commands[i].parameter;
+        int inside = (target >= start) && (target <= end);
+        if (is_call(commands[i].command) == inside)
+            return -1;
+    }
+    return end - start;
+}
+
+// the routine at start is reached from the command before it too
+static int falls_into(const CPU_command_t* commands, const char* starts, int start)
+{
+    if (start == 0)
+        return 1;
+    int previous = start - 1;
+    while ((previous > 0) && !starts[previous])
+        --previous;
+    int command = commands[previous].command;
+    return (command != JMP) && (command != RET) && (command != END);
+}
+
+/*
+ * Drops the inlined routines nothing jumps or calls into any more and that
+ * are not reached by falling through. A routine is given by its slots in
+ * the result from its first command to its RET; a routine starting inside
+ * another one goes with the outer one. map gets the new index of every
+ * slot, -1 for the removed ones. Returns the new number of commands.
+ */
+static int remove_routines(const CPU_command_t* commands, const char* starts, CPU_command_t* result,
+                           int result_cnt, const int* index_map, Inline_routine_t* routines, int routines_cnt,
+                           int* map, Inline_stats_t* stats)
+{
+    int* owner = (int*) malloc(result_cnt * sizeof(*owner));
+    char* kept = (char*) calloc(routines_cnt, sizeof(*kept));
+    for (int i = 0; i < result_cnt; ++i)
+        owner[i] = -1;
+    for (int r = 0; r < routines_cnt; ++r)
+    {
+        Inline_routine_t* routine = &routines[r];
+        int first = index_map[routine->start];
+        int last = index_map[routine->start + routine->length];
+        kept[r] = falls_into(commands, starts, routine->start);
+        for (int i = first; i <= last; ++i)
+            if ((owner[i] < 0) || (routines[owner[i]].start > routine->start))
+                owner[i] = r;
+    }
+    for (int i = 0; i < result_cnt; ++i)
+    {
+        if (!(CPU_command_operands(result[i].command) & OPERAND_TARGET))
+            continue;
+        int target = result[i].parameter;
+        if ((target >= 0) && (target < result_cnt) && (owner[target] >= 0) && (owner[target] != owner[i]))
+            kept[owner[target]] = 1;
+    }
+
+    int kept_cnt = 0;
+    for (int i = 0; i < result_cnt; ++i)
+    {
+        if ((owner[i] >= 0) && !kept[owner[i]])
+        {
+            map[i] = -1;
+            continue;
+        }
+        map[i] = kept_cnt;
+        result[kept_cnt++] = result[i];
+    }
+    map[result_cnt] = kept_cnt;
+    for (int r = 0; r < routines_cnt; ++r)
+        if (map[index_map[routines[r].start + routines[r].length]] < 0)
+        {
+            routines[r].removed = 1;
+            ++stats->removed_cnt;
+        }
+    for (int i = 0; i < kept_cnt; ++i)
+        if ((CPU_command_operands(result[i].command) & OPERAND_TARGET) &&
+            (result[i].parameter >= 0) && (result[i].parameter <= result_cnt))
+            result[i].parameter = map[(int) result[i].parameter];
+
+    free(owner);
+    free(kept);
+
+    return kept_cnt;
+}
+
+/*
+ * Replaces calls of routines of at most limit slots by copies of their
+ * bodies, jumps within a body going to its copy, then removes the routines
+ * that are not used any more. Copies are taken from the source program, so
+ * calls inside them stay calls. *result gets a new array, index_map the
+ * new index of every slot of the source program, -1 for removed ones, and
+ * routines and copies, with room for commands_cnt each, what was inlined.
+ * Returns the new number of commands.
+ */
+int inline_routines(const CPU_command_t* commands, int commands_cnt, int limit, CPU_command_t** result,
+                    int* index_map, Inline_routine_t* routines, Inline_copy_t* copies, Inline_stats_t* stats)
+{
+    assert(commands);
+    assert(result);
+    assert(index_map);
+    assert(routines);
+    assert(copies);
+    assert(stats);
+
+    *stats = (Inline_stats_t) {};
+    // routine of every call target plus one, -1 where the routine cannot be inlined
+    int* routine_of = (int*) calloc(commands_cnt, sizeof(*routine_of));
+    char* starts = (char*) calloc(commands_cnt, sizeof(*starts));
+    int result_cnt = 0;
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+    {
+        starts[i] = 1;
+        int target = commands[i].parameter;
+        if ((commands[i].command != CALL) || (target < 0) || (target >= commands_cnt) || (routine_of[target] < 0))
+        {
+            result_cnt += CPU_command_length(&commands[i]);
+            continue;
+        }
+        if (routine_of[target] == 0)
+        {
+            int length = routine_length(commands, commands_cnt, target, limit);
+            if (length < 0)
+            {
+                routine_of[target] = -1;
+                result_cnt += 1;
+                continue;
+            }
+            routines[stats->routines_cnt] = (Inline_routine_t) {target, length, 0, 0};
+            routine_of[target] = ++stats->routines_cnt;
+        }
+        result_cnt += routines[routine_of[target] - 1].length;
+    }
+
+    CPU_command_t* code = (CPU_command_t*) calloc(result_cnt + 1, sizeof(*code));
+    char* moved = (char*) calloc(result_cnt + 1, sizeof(*moved));     // targets already in the result
+    int copies_cnt = 0;
+    result_cnt = 0;
+    for (int i = 0; i < commands_cnt;)
+    {
+        int length = CPU_command_length(&commands[i]);
+        int target = commands[i].parameter;
+        if ((commands[i].command == CALL) && (target >= 0) && (target < commands_cnt) && (routine_of[target] > 0))
+        {
+            Inline_routine_t* routine = &routines[routine_of[target] - 1];
+            copies[copies_cnt++] = (Inline_copy_t) {routine_of[target] - 1, result_cnt, i};
+            ++routine->calls_cnt;
+            ++stats->calls_cnt;
+            index_map[i] = result_cnt;
+            for (int j = 0; j < routine->length; ++j)
+            {
+                CPU_command_t command = commands[routine->start + j];
+                if ((CPU_command_operands(command.command) & OPERAND_TARGET) && !is_call(command.command))
+                {
+                    command.parameter = result_cnt + ((int) command.parameter - routine->start);
+                    moved[result_cnt + j] = 1;
+                }
+                code[result_cnt + j] = command;
+            }
+            result_cnt += routine->length;
+        } else
+        {
+            for (int j = 0; j < length; ++j)
+                index_map[i + j] = result_cnt + j;
+            memcpy(&code[result_cnt], &commands[i], length * sizeof(*code));
+            result_cnt += length;
+        }
+        i += length;
+    }
+    index_map[commands_cnt] = result_cnt;
+    for (int i = 0; i < result_cnt; ++i)
+        if ((CPU_command_operands(code[i].command) & OPERAND_TARGET) && !moved[i] &&
+            (code[i].parameter >= 0) && (code[i].parameter <= commands_cnt))
+            code[i].parameter = index_map[(int) code[i].parameter];
+    free(moved);
+    free(routine_of);
+
+    int* map = (int*) calloc(result_cnt + 1, sizeof(*map));
+    result_cnt = remove_routines(commands, starts, code, result_cnt, index_map, routines, stats->routines_cnt,
+                                 map, stats);
+    for (int i = 0; i <= commands_cnt; ++i)
+        index_map[i] = map[index_map[i]];
+    // copies in the removed routines went with them
+    int kept_cnt = 0;
+    for (int c = 0; c < copies_cnt; ++c)
+    {
+        if (map[copies[c].start] < 0)
+        {
+            --routines[copies[c].routine].calls_cnt;
+            --stats->calls_cnt;
+            continue;
+        }
+        copies[kept_cnt] = copies[c];
+        copies[kept_cnt++].start = map[copies[c].start];
+    }
+    for (int c = kept_cnt; c < commands_cnt; ++c)
+        copies[c].start = -1;
+    free(map);
+    free(starts);
+
+    *result = code;
+    return result_cnt;
+}
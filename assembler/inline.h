@@ -0,0 +1,31 @@
+#ifndef INLINE_H_INCLUDED
+#define INLINE_H_INCLUDED
+
+#include "../processor/commands.h"
+
+typedef struct
+{
+    int start;          // first command of the routine in the source program
+    int length;         // slots of its body, the RET is not copied
+    int calls_cnt;      // call sites it was inlined at
+    int removed;        // nothing referenced it any more
+} Inline_routine_t;
+
+typedef struct
+{
+    int routine;        // index in the routines
+    int start;          // first command of the copy in the result
+    int call;           // index of the call it replaced in the source program
+} Inline_copy_t;
+
+typedef struct
+{
+    int routines_cnt;
+    int calls_cnt;
+    int removed_cnt;
+} Inline_stats_t;
+
+int inline_routines(const CPU_command_t* commands, int commands_cnt, int limit, CPU_command_t** result,
+                    int* index_map, Inline_routine_t* routines, Inline_copy_t* copies, Inline_stats_t* stats);
+
+#endif // INLINE_H_INCLUDED
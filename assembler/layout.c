@@ -0,0 +1,349 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "layout.h"
+
+typedef struct
+{
+    int start;
+    int end;                // first slot after the block
+    int taken;              // block the last command jumps to, -1 if none
+    int next;               // block it falls through to, -1 if none
+    long long count;
+    long long taken_cnt;
+    long long next_cnt;
+    int placed;
+} Block;
+
+static int is_stack_jump(int command)
+{
+    return (command >= JA) && (command <= JNE);
+}
+
+static int is_conditional(int command)
+{
+    return is_stack_jump(command) || ((command >= JA_RR) && (command <= JNE_RR)) ||
+           ((command >= JA_RI) && (command <= JNE_RI)) || (command == LOOP);
+}
+
+static int ends_block(int command)
+{
+    return is_conditional(command) || (command == JMP) || (command == RET) || (command == END) || (command == SWITCH);
+}
+
+// JE and JNE are exact opposites, the ordered compares are not once NaN is compared
+static int inverted(int command)
+{
+    switch (command)
+    {
+    case JE:
+        return JNE;
+    case JNE:
+        return JE;
+    case JE_RR:
+        return JNE_RR;
+    case JNE_RR:
+        return JE_RR;
+    case JE_RI:
+        return JNE_RI;
+    case JNE_RI:
+        return JE_RI;
+    default:
+        return -1;
+    }
+}
+
+// stack jump with its operands the other way round: "push rax, push 5, ja" is "jb rax, 5"
+static int swapped(int command)
+{
+    switch (command)
+    {
+    case JA:
+        return JB;
+    case JAE:
+        return JBE;
+    case JB:
+        return JA;
+    case JBE:
+        return JAE;
+    default:
+        return command;
+    }
+}
+
+static int is_register(CPU_word_t value)
+{
+    return (value >= RAX) && (value <= RDX) && (value == (int) value);
+}
+
+/*
+ * Writes the register form of the stack sequence at the start of src if
+ * there is one, the first command as it is otherwise. Returns the number of
+ * slots written, consumed gets the number of slots taken from src.
+ */
+static int fuse(const CPU_command_t* src, int src_cnt, CPU_command_t* out, int* consumed)
+{
+    int c0 = src[0].command;
+    int c1 = (src_cnt > 1) ? src[1].command : -1;
+    int c2 = (src_cnt > 2) ? src[2].command : -1;
+    int c3 = (src_cnt > 3) ? src[3].command : -1;
+
+    // push rX, push n, jcc -> jcc' rX, n; push n, push rX, jcc -> jcc rX, n
+    if ((((c0 == PUSH_VAR) && (c1 == PUSH)) || ((c0 == PUSH) && (c1 == PUSH_VAR))) && is_stack_jump(c2))
+    {
+        const CPU_command_t* reg = (c0 == PUSH_VAR) ? &src[0] : &src[1];
+        const CPU_command_t* value = (c0 == PUSH_VAR) ? &src[1] : &src[0];
+        if (is_register(reg->parameter))
+        {
+            int jump = (c0 == PUSH_VAR) ? swapped(c2) : c2;
+            out[0] = (CPU_command_t) {JA_RI + (jump - JA), reg->parameter, 0, src[2].parameter};
+            out[1] = (CPU_command_t) {EXT, 0, 0, value->parameter};
+            *consumed = 3;
+            return 2;
+        }
+    }
+    // push rX, push rY, jcc -> jcc rY, rX
+    if ((c0 == PUSH_VAR) && (c1 == PUSH_VAR) && is_stack_jump(c2) && is_register(src[0].parameter) &&
+        is_register(src[1].parameter))
+    {
+        out[0] = (CPU_command_t) {JA_RR + (c2 - JA), src[1].parameter, src[0].parameter, src[2].parameter};
+        *consumed = 3;
+        return 1;
+    }
+    // push rX, push n, add|mul, pop rX and the other order -> add|mul rX, n
+    if ((((c0 == PUSH_VAR) && (c1 == PUSH)) || ((c0 == PUSH) && (c1 == PUSH_VAR))) && ((c2 == ADD) || (c2 == MUL)) &&
+        (c3 == POP))
+    {
+        const CPU_command_t* reg = (c0 == PUSH_VAR) ? &src[0] : &src[1];
+        const CPU_command_t* value = (c0 == PUSH_VAR) ? &src[1] : &src[0];
+        if (is_register(reg->parameter) && (reg->parameter == src[3].parameter))
+        {
+            out[0] = (CPU_command_t) {(c2 == ADD) ? ADD_RI : MUL_RI, reg->parameter, 0, value->parameter};
+            *consumed = 4;
+            return 1;
+        }
+    }
+    // push rY, pop rX -> mov rX, rY; push n, pop rX -> mov rX, n
+    if (((c0 == PUSH_VAR) || (c0 == PUSH)) && (c1 == POP) && is_register(src[1].parameter) &&
+        ((c0 == PUSH) || is_register(src[0].parameter)))
+    {
+        if (c0 == PUSH_VAR)
+            out[0] = (CPU_command_t) {MOV_RR, src[1].parameter, src[0].parameter, 0};
+        else
+            out[0] = (CPU_command_t) {MOV_RI, src[1].parameter, 0, src[0].parameter};
+        *consumed = 2;
+        return 1;
+    }
+
+    int length = CPU_command_length(&src[0]);
+    memcpy(out, src, length * sizeof(*out));
+    *consumed = length;
+    return length;
+}
+
+// splits the commands into blocks, returns their number or -1 for a jump out of the program
+static int find_blocks(const CPU_command_t* commands, int commands_cnt, const CPU_profile_t* profile,
+                       Block* blocks, int* block_of)
+{
+    char* leader = (char*) calloc(commands_cnt + 1, sizeof(*leader));
+    leader[0] = 1;
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+    {
+        int length = CPU_command_length(&commands[i]);
+        for (int j = i; j < i + length; ++j)
+        {
+            if (!(CPU_command_operands(commands[j].command) & OPERAND_TARGET))
+                continue;
+            int target = commands[j].parameter;
+            if ((target < 0) || (target >= commands_cnt))
+            {
+                free(leader);
+                return -1;
+            }
+            leader[target] = 1;
+        }
+        if (ends_block(commands[i].command))
+            leader[i + length] = 1;
+    }
+
+    int blocks_cnt = 0;
+    int last = 0;
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+    {
+        if (leader[i])
+        {
+            if (blocks_cnt)
+                blocks[blocks_cnt - 1].end = i;
+            blocks[blocks_cnt] = (Block) {i, commands_cnt, -1, -1, profile->counts[i], 0, 0, 0};
+            ++blocks_cnt;
+        }
+        block_of[i] = blocks_cnt - 1;
+        last = i;
+    }
+    free(leader);
+
+    // successors of the blocks by their last commands
+    for (int b = 0, i = 0; b < blocks_cnt; ++b)
+    {
+        Block* block = &blocks[b];
+        for (i = block->start; i + CPU_command_length(&commands[i]) < block->end; i += CPU_command_length(&commands[i]))
+            ;
+        int command = commands[i].command;
+        long long count = profile->counts[i];
+        if ((command == JMP) || is_conditional(command))
+        {
+            block->taken = block_of[(int) commands[i].parameter];
+            block->taken_cnt = profile->taken[i];
+        }
+        if ((command != JMP) && (command != RET) && (command != END) && (command != SWITCH) && (i != last))
+        {
+            block->next = b + 1;
+            // calls come back to the next command
+            block->next_cnt = is_conditional(command) ? count - profile->taken[i] : count;
+        }
+    }
+
+    return blocks_cnt;
+}
+
+// hot blocks chained along their likely successors from the entry, then the cold ones in source order
+static int order_blocks(Block* blocks, int blocks_cnt, int* order, Layout_stats_t* stats)
+{
+    int order_cnt = 0;
+    int current = 0;
+    while (current >= 0)
+    {
+        blocks[current].placed = 1;
+        order[order_cnt++] = current;
+
+        Block* block = &blocks[current];
+        current = -1;
+        if ((block->next >= 0) && !blocks[block->next].placed && block->next_cnt)
+            current = block->next;
+        if ((block->taken >= 0) && !blocks[block->taken].placed && block->taken_cnt &&
+            ((current < 0) || (block->taken_cnt > block->next_cnt)))
+            current = block->taken;
+        if (current >= 0)
+            continue;
+        // a new chain starts at the hottest block left
+        for (int b = 0; b < blocks_cnt; ++b)
+            if (!blocks[b].placed && blocks[b].count && ((current < 0) || (blocks[b].count > blocks[current].count)))
+                current = b;
+    }
+    for (int b = 0; b < blocks_cnt; ++b)
+    {
+        if (blocks[b].placed)
+            continue;
+        order[order_cnt++] = b;
+        ++stats->cold_cnt;
+    }
+
+    return order_cnt;
+}
+
+/*
+ * Lays the blocks out by the profile: the likely successor of every block
+ * follows it, blocks that never ran go to the end, and the sequences of hot
+ * blocks are fused into register commands. Jump targets are old indices
+ * until the end, when they are moved by index_map, which gets the new index
+ * of every old slot. result needs room for 2 * commands_cnt commands.
+ * Returns the new number of commands or -1 if the program cannot be laid out.
+ */
+int layout_commands(const CPU_command_t* commands, int commands_cnt, const CPU_profile_t* profile,
+                    CPU_command_t* result, int* index_map, Layout_stats_t* stats)
+{
+    assert(commands);
+    assert(profile);
+    assert(result);
+    assert(index_map);
+    assert(stats);
+
+    *stats = (Layout_stats_t) {};
+    Block* blocks = (Block*) calloc(commands_cnt, sizeof(*blocks));
+    int* block_of = (int*) calloc(commands_cnt, sizeof(*block_of));
+    int* order = (int*) calloc(commands_cnt, sizeof(*order));
+    int blocks_cnt = find_blocks(commands, commands_cnt, profile, blocks, block_of);
+    if (blocks_cnt < 0)
+    {
+        free(blocks);
+        free(block_of);
+        free(order);
+        return -1;
+    }
+    stats->blocks_cnt = blocks_cnt;
+    order_blocks(blocks, blocks_cnt, order, stats);
+
+    long long hottest = 0;
+    for (int b = 0; b < blocks_cnt; ++b)
+        if (blocks[b].count > hottest)
+            hottest = blocks[b].count;
+
+    int result_cnt = 0;
+    for (int k = 0; k < blocks_cnt; ++k)
+    {
+        Block* block = &blocks[order[k]];
+        int following = (k + 1 < blocks_cnt) ? order[k + 1] : -1;
+        int hot = block->count && (block->count * LAYOUT_HOT_SHARE >= hottest);
+
+        int last = result_cnt;
+        for (int i = block->start; i < block->end;)
+        {
+            int consumed = 0;
+            int written = 0;
+            if (hot)
+                written = fuse(&commands[i], block->end - i, &result[result_cnt], &consumed);
+            else
+            {
+                consumed = CPU_command_length(&commands[i]);
+                written = consumed;
+                memcpy(&result[result_cnt], &commands[i], consumed * sizeof(*result));
+            }
+            if (consumed > CPU_command_length(&commands[i]))
+                ++stats->fused_cnt;
+            // slots of a fused sequence all start it, EXT slots keep their place
+            for (int j = 0; j < consumed; ++j)
+                index_map[i + j] = result_cnt + ((written == consumed) ? j : 0);
+            last = result_cnt;
+            result_cnt += written;
+            i += consumed;
+        }
+
+        int command = result[last].command;
+        if (command == JMP)
+        {
+            if (block->taken == following)
+            {
+                // its slot now starts the following block
+                result_cnt = last;
+                ++stats->jumps_removed;
+            }
+        } else if (is_conditional(command) && (block->next >= 0) && (block->next != following))
+        {
+            if ((block->taken == following) && (inverted(command) >= 0))
+            {
+                result[last].command = inverted(command);
+                result[last].parameter = blocks[block->next].start;
+                ++stats->inverted_cnt;
+            } else
+            {
+                result[result_cnt++] = (CPU_command_t) {JMP, 0, 0, blocks[block->next].start};
+                ++stats->jumps_added;
+            }
+        } else if (!is_conditional(command) && (block->next >= 0) && (block->next != following))
+        {
+            result[result_cnt++] = (CPU_command_t) {JMP, 0, 0, blocks[block->next].start};
+            ++stats->jumps_added;
+        }
+    }
+    index_map[commands_cnt] = result_cnt;
+
+    for (int i = 0; i < result_cnt; ++i)
+        if (CPU_command_operands(result[i].command) & OPERAND_TARGET)
+            result[i].parameter = index_map[(int) result[i].parameter];
+
+    free(blocks);
+    free(block_of);
+    free(order);
+
+    return result_cnt;
+}
@@ -0,0 +1,21 @@
+#ifndef LAYOUT_H_INCLUDED
+#define LAYOUT_H_INCLUDED
+
+#include "../processor/commands.h"
+
+#define LAYOUT_HOT_SHARE 64     // blocks run at least 1/64 as often as the hottest one get fused
+
+typedef struct
+{
+    int blocks_cnt;
+    int cold_cnt;       // blocks never run, moved to the end
+    int inverted_cnt;   // conditional jumps turned around to fall through to the likely block
+    int fused_cnt;      // stack sequences replaced by register commands
+    int jumps_added;
+    int jumps_removed;
+} Layout_stats_t;
+
+int layout_commands(const CPU_command_t* commands, int commands_cnt, const CPU_profile_t* profile,
+                    CPU_command_t* result, int* index_map, Layout_stats_t* stats);
+
+#endif // LAYOUT_H_INCLUDED
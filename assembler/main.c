@@ -2,18 +2,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <strings.h>
 #include "../processor/commands.h"
+#include "layout.h"
+#include "inline.h"
 
 #define DEFAULT_INPUT "source.in"
 #define DEFAULT_OUTPUT "code.out"
-
-#define NOT_COMMAND 0
-#define SIMPLE_COMMAND 1
-#define COMPLEX_COMMAND 2
+#define OUTPUT_SUFFIX ".out"
+#define OBJECT_SUFFIX ".o"
 
 #define STR_(x) #x
 #define STR(x) STR_(x)
 #define MAX_LABELNAME 64
+#define LABELNAME_FORMAT "%63s"     // MAX_LABELNAME - 1 characters
+#define MAX_OPERANDS 256
+#define MAX_COMMAND_LENGTH MAX_OPERANDS
+#define MAX_INLINE_LIMIT 4096
 
 #define MY_NAME "GavYur"
 #define VERSION "0.1"
@@ -26,24 +32,74 @@ typedef struct
     int index;
 } Label;
 
-int assemble_code(const char* inputfile, const char* outputfile);
+typedef struct
+{
+    int object_mode;
+    int debug_info;
+    const char* profile;    // of --profile-use
+    int inline_limit;       // of -finline-limit, 0 when routines are not inlined
+} Options;
+
+int assemble_code(const char* inputfile, const char* outputfile, const Options* options);
 int count_commands(FILE* stream, int* commands_cnt, int* params_cnt, int* labels_cnt);
-int is_command(char* str);
-int fill_commands(FILE* stream, CPU_command_t* commands, Label* labels, int labels_cnt, int warn_label);
+int read_operands(FILE* stream, char operands[][MAX_LABELNAME], int max_operands);
+int get_register(const char* str);
+int get_number(const char* str, CPU_word_t* value);
+int get_target(const char* str, int cmd, Label* labels, int labels_cnt, int warn_label,
+               Label* imports, int* imports_cnt, int cmd_index, CPU_word_t* target);
+int get_native(const char* str, Label* labels, int labels_cnt, Label* natives, int* natives_cnt);
+int parse_command(char* mnemonic, char operands[][MAX_LABELNAME], int operands_cnt, CPU_command_t* command,
+                  Label* labels, int labels_cnt, int warn_label, Label* imports, int* imports_cnt,
+                  Label* natives, int* natives_cnt, int cmd_index);
+int fill_commands(FILE* stream, CPU_command_t* commands, Label* labels, int labels_cnt, int warn_label,
+                  Label* imports, int* imports_cnt, Label* natives, int* natives_cnt, CPU_debug_t* debug);
 int get_cmd_number(char* str);
 int str_lower(char* str);
-int write_assembled(const char* filename, const CPU_command_t* commands, int commands_cnt, int params_cnt);
+int write_commands(FILE* stream, const CPU_command_t* commands, int commands_cnt);
+int write_assembled(const char* filename, const CPU_command_t* commands, int commands_cnt, int params_cnt,
+                    const Label* natives, int natives_cnt, const CPU_debug_t* debug);
+int write_object(const char* filename, const CPU_command_t* commands, int commands_cnt, int params_cnt,
+                 const Label* labels, int labels_cnt, const Label* imports, int imports_cnt);
 int print_help();
 int print_version();
 int label_ctor(Label* This, const char* str, int index);
 int label_destruct(Label* This);
 int find_index_by_labelname(Label* labels, int labels_cnt, const char* name);
+int apply_profile(const char* filename, CPU_command_t** commands, int* commands_cnt, int* params_cnt,
+                  Label* labels, int labels_cnt, CPU_debug_t* debug);
+int apply_inlining(int limit, CPU_command_t** commands, int* commands_cnt, int* params_cnt,
+                   Label** labels, int* labels_cnt, CPU_debug_t* debug);
 
 int main(int argc, char* argv[])
 {
+    Options options = {};
+    while ((argc > 1) && (!strcmp(argv[1], "-c") || !strcmp(argv[1], "-g") ||
+                          !strncmp(argv[1], "--profile-use=", strlen("--profile-use=")) ||
+                          !strncmp(argv[1], "-finline-limit=", strlen("-finline-limit="))))
+    {
+        if (!strcmp(argv[1], "-c"))
+            options.object_mode = 1;
+        else if (!strcmp(argv[1], "-g"))
+            options.debug_info = 1;
+        else if (!strncmp(argv[1], "-finline-limit=", strlen("-finline-limit=")))
+        {
+            char* end = 0;
+            long limit = strtol(argv[1] + strlen("-finline-limit="), &end, 10);
+            if (*end || (end == argv[1] + strlen("-finline-limit=")) || (limit < 0) || (limit > MAX_INLINE_LIMIT))
+                return print_help();
+            options.inline_limit = limit;
+        }
+        else
+            options.profile = argv[1] + strlen("--profile-use=");
+        --argc;
+        ++argv;
+    }
+    if (options.object_mode && (options.profile || options.inline_limit))
+        return print_help();
+
     if (argc == 1)
     {
-        return assemble_code(DEFAULT_INPUT, DEFAULT_OUTPUT);
+        return assemble_code(DEFAULT_INPUT, DEFAULT_OUTPUT, &options);
     } else if (argc == 2)
     {
         if (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))
@@ -53,10 +109,11 @@ int main(int argc, char* argv[])
         else
         {
             char* inputname = argv[1];
-            char* outputname = (char*) calloc(strlen(inputname) + 4, sizeof(*outputname));
+            const char* suffix = options.object_mode ? OBJECT_SUFFIX : OUTPUT_SUFFIX;
+            char* outputname = (char*) calloc(strlen(inputname) + strlen(suffix) + 1, sizeof(*outputname));
             strcat(outputname, inputname);
-            strcat(outputname, ".out");
-            int result = assemble_code(inputname, outputname);
+            strcat(outputname, suffix);
+            int result = assemble_code(inputname, outputname, &options);
             free(outputname);
             return result;
         }
@@ -67,7 +124,7 @@ int main(int argc, char* argv[])
         else if (!strcmp(argv[1], "--version") || !strcmp(argv[1], "-v") || !strcmp(argv[2], "--version") || !strcmp(argv[2], "-v"))
             return print_version();
         else
-            return assemble_code(argv[1], argv[2]);
+            return assemble_code(argv[1], argv[2], &options);
     } else
     {
         return print_help();
@@ -80,9 +137,39 @@ int print_help()
     printf("\nusage: assembler [options] [input_file] [output_file]\n\n"
            "Options:\n"
            "  -h, --help\t\tprints this message\n"
-           "  -v, --version\t\tprints version of this program\n\n"
+           "  -v, --version\t\tprints version of this program\n"
+           "  -c\t\t\tassemble to a relocatable object file for the linker\n"
+           "  -g\t\t\tappend source lines and labels of the commands for the processor to report\n"
+           "\t\t\tpositions with (executables only)\n"
+           "  --profile-use=FILE\tlays the code out by a profile of processor --profile: likely branches\n"
+           "\t\t\tfall through, blocks that never ran go to the end and hot stack sequences\n"
+           "\t\t\tbecome register commands (executables only)\n"
+           "  -finline-limit=N\treplaces calls of routines of at most N commands ending with their first\n"
+           "\t\t\tret by copies of them and removes the routines nothing uses any more; routines\n"
+           "\t\t\twith locals or calling themselves are left (executables only, 0 by default)\n\n"
            "If no input and output file specified, program will use \"%s\" as input file and \"%s\" as output.\n"
-           "If only input file specified, program will use input_file + \".out\" as output\n",
+           "If only input file specified, program will use input_file + \"" OUTPUT_SUFFIX "\" as output\n"
+           "(input_file + \"" OBJECT_SUFFIX "\" with -c).\n\n"
+           "In object files all labels are exported except ones starting with '.', which stay local\n"
+           "to the module. Unknown jump and call labels are left for the linker to resolve.\n\n"
+           "Register operand forms: mov/add/sub/mul/div reg, reg|number; inc/dec reg;\n"
+           "ja/jae/jb/jbe/je/jne reg, reg|number, label: compare a register without touching the stack;\n"
+           "loop reg, label: decrements reg and jumps unless it became zero;\n"
+           "switch reg, base, label0:, label1:, ..., default: jumps through a table by reg - base.\n\n"
+           "A routine declares its local slots right after its label with \"locals N\"; load_local i\n"
+           "and store_local i push and pop slot i of the current call frame.\n\n"
+           "\"call name\" of a name that is not a label calls the native function registered in the\n"
+           "processor under that name, \"native name\" always does. In object files such calls are left\n"
+           "to the linker, which makes native calls of the names no module exports.\n\n"
+           "spawn label: starts a context with its own stack running from label and pushes its id;\n"
+           "join pops an id, waits for that context to end and pushes the top of its stack.\n"
+           "send N pops a value into channel N, recv N pushes the next value from it (N < " STR(CHANNELS_CNT) ");\n"
+           "both wait while the channel is full or empty.\n\n"
+           "load reg|address and store reg|address push and pop a cell of the linear memory.\n"
+           "Bulk memory commands take their operands from the stack, pushed in this order:\n"
+           "vadd/vmul/vfma dst, a, b, count: dst[i] = a[i] + b[i], a[i] * b[i], dst[i] + a[i] * b[i];\n"
+           "vsum/vmin/vmax a, count and vdot a, b, count push the result; vin dst, count and vout a, count\n"
+           "read and print count cells.\n",
            DEFAULT_INPUT, DEFAULT_OUTPUT);
 
     return 0;
@@ -116,10 +203,13 @@ int label_destruct(Label* This)
     return 0;
 }
 
-int assemble_code(const char* inputfile, const char* outputfile)
+int assemble_code(const char* inputfile, const char* outputfile, const Options* options)
 {
     assert(inputfile);
     assert(outputfile);
+    assert(options);
+
+    int object_mode = options->object_mode;
 
     FILE* stream = fopen(inputfile, "rb");
     if (!stream)
@@ -137,13 +227,47 @@ int assemble_code(const char* inputfile, const char* outputfile)
 
     Label* labels = (Label*) calloc(labels_cnt, sizeof(*labels));
     CPU_command_t* commands = (CPU_command_t*) calloc(commands_cnt, sizeof(*commands));
+    Label* imports = 0;
+    int imports_cnt = 0;
+    Label* natives = 0;
+    int natives_cnt = 0;
+    if (object_mode)
+        imports = (Label*) calloc(commands_cnt, sizeof(*imports));
+    else
+        natives = (Label*) calloc(commands_cnt, sizeof(*natives));
 
-    if (fill_commands(stream, commands, labels, labels_cnt, 0) != 0)
+    CPU_debug_t debug = {};
+    if (options->debug_info && !object_mode)
+    {
+        debug.source = strdup(inputfile);
+        debug.lines = (CPU_line_t*) calloc(commands_cnt, sizeof(*debug.lines));
+    }
+
+    if (fill_commands(stream, commands, labels, labels_cnt, 0, 0, 0, 0, 0, 0) != 0)
         return 3;
-    if (fill_commands(stream, commands, labels, labels_cnt, 1) != 0)
+    if (fill_commands(stream, commands, labels, labels_cnt, 1, imports, &imports_cnt, natives, &natives_cnt,
+                      debug.source ? &debug : 0) != 0)
         return 3;
+    if (options->inline_limit)
+        apply_inlining(options->inline_limit, &commands, &commands_cnt, &params_cnt, &labels, &labels_cnt, &debug);
+    if (options->profile &&
+        (apply_profile(options->profile, &commands, &commands_cnt, &params_cnt, labels, labels_cnt, &debug) != 0))
+        return 5;
+    // the labels keep their names, the debug section only points at them; labels of removed code are left out
+    if (debug.source)
+        debug.symbols = (CPU_symbol_t*) calloc(labels_cnt, sizeof(*debug.symbols));
+    for (int i = 0; debug.source && (i < labels_cnt); ++i)
+        if (labels[i].index >= 0)
+            debug.symbols[debug.symbols_cnt++] = (CPU_symbol_t) {labels[i].name, labels[i].index};
 
-    if (write_assembled(outputfile, commands, commands_cnt, params_cnt) != 0)
+    int write_result = 0;
+    if (object_mode)
+        write_result = write_object(outputfile, commands, commands_cnt, params_cnt,
+                                    labels, labels_cnt, imports, imports_cnt);
+    else
+        write_result = write_assembled(outputfile, commands, commands_cnt, params_cnt, natives, natives_cnt,
+                                       debug.source ? &debug : 0);
+    if (write_result != 0)
     {
         printf("Error writing assembled code to ");
         perror(outputfile);
@@ -154,9 +278,257 @@ int assemble_code(const char* inputfile, const char* outputfile)
 
     fclose(stream);
     free(commands);
+    free(debug.source);
+    free(debug.lines);
+    free(debug.symbols);
     for (int i = 0; i < labels_cnt; ++i)
         label_destruct(&labels[i]);
     free(labels);
+    for (int i = 0; i < imports_cnt; ++i)
+        label_destruct(&imports[i]);
+    free(imports);
+    for (int i = 0; i < natives_cnt; ++i)
+        label_destruct(&natives[i]);
+    free(natives);
+
+    return 0;
+}
+
+typedef struct
+{
+    CPU_line_t line;
+    int dropped;    // JMP commands dropped by the layout and inlined calls share the index of the next command
+} Moved_line;
+
+static int compare_lines(const void* a, const void* b)
+{
+    const Moved_line* x = (const Moved_line*) a;
+    const Moved_line* y = (const Moved_line*) b;
+    if (x->line.index != y->line.index)
+        return x->line.index - y->line.index;
+    if (x->dropped != y->dropped)
+        return x->dropped - y->dropped;
+    return x->line.line - y->line.line;
+}
+
+/*
+ * Lays the commands out by the profile, moving labels and source lines with
+ * them. A profile of another program is only warned about, the commands are
+ * then left as they are. Returns -1 if the profile cannot be read.
+ */
+int apply_profile(const char* filename, CPU_command_t** commands, int* commands_cnt, int* params_cnt,
+                  Label* labels, int labels_cnt, CPU_debug_t* debug)
+{
+    assert(filename);
+    assert(commands);
+    assert(debug);
+
+    FILE* stream = fopen(filename, "rb");
+    if (!stream)
+    {
+        printf("Error opening profile ");
+        perror(filename);
+        return -1;
+    }
+    CPU_profile_t profile = {};
+    int read_result = CPU_profile_read(stream, &profile);
+    fclose(stream);
+    if (read_result != 0)
+    {
+        printf("Profile %s is corrupt\n", filename);
+        return -1;
+    }
+    if ((profile.commands_cnt != *commands_cnt) || (profile.hash != CPU_commands_hash(*commands, *commands_cnt)))
+    {
+        printf("Profile %s is of another program, the code is left in source order\n", filename);
+        CPU_profile_free(&profile);
+        return 0;
+    }
+
+    CPU_command_t* result = (CPU_command_t*) calloc(2 * *commands_cnt, sizeof(*result));
+    int* index_map = (int*) calloc(*commands_cnt + 1, sizeof(*index_map));
+    Layout_stats_t stats = {};
+    int result_cnt = layout_commands(*commands, *commands_cnt, &profile, result, index_map, &stats);
+    CPU_profile_free(&profile);
+    if (result_cnt < 0)
+    {
+        printf("Jump out of the program, the code is left in source order\n");
+        free(result);
+        free(index_map);
+        return 0;
+    }
+
+    for (int i = 0; i < labels_cnt; ++i)
+        if (labels[i].index >= 0)
+            labels[i].index = index_map[labels[i].index];
+    // fused commands keep the line of their first one
+    Moved_line* lines = (Moved_line*) calloc(debug->lines_cnt + 1, sizeof(*lines));
+    for (int i = 0; i < debug->lines_cnt; ++i)
+    {
+        int index = debug->lines[i].index;
+        lines[i].line = debug->lines[i];
+        lines[i].line.index = index_map[index];
+        lines[i].dropped = ((*commands)[index].command == JMP);
+    }
+    qsort(lines, debug->lines_cnt, sizeof(*lines), compare_lines);
+    int lines_cnt = 0;
+    for (int i = 0; i < debug->lines_cnt; ++i)
+        if ((lines_cnt == 0) || (debug->lines[lines_cnt - 1].index != lines[i].line.index))
+            debug->lines[lines_cnt++] = lines[i].line;
+    debug->lines_cnt = lines_cnt;
+    free(lines);
+
+    *params_cnt = 0;
+    for (int i = 0; i < result_cnt; ++i)
+        *params_cnt += CPU_command_operands_cnt(result[i].command);
+    free(*commands);
+    free(index_map);
+    *commands = result;
+    *commands_cnt = result_cnt;
+
+    printf("Laid out %d blocks by %s: %d never run moved to the end, %d jumps inverted, %d added, %d removed, "
+           "%d sequences fused\n", stats.blocks_cnt, filename, stats.cold_cnt, stats.inverted_cnt,
+           stats.jumps_added, stats.jumps_removed, stats.fused_cnt);
+
+    return 0;
+}
+
+// first source line of a command at index or after it, lines go by growing index
+static int find_line(const CPU_debug_t* debug, int index)
+{
+    int low = 0;
+    int high = debug->lines_cnt;
+    while (low < high)
+    {
+        int middle = low + (high - low) / 2;
+        if (debug->lines[middle].index < index)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/*
+ * Inlines the routines of at most limit commands at their calls, moving
+ * labels and source lines with the commands. Every copy gets the labels of
+ * its routine named after the number of the copy, "name.1", "name.2"...,
+ * labels of removed routines get index -1.
+ */
+int apply_inlining(int limit, CPU_command_t** commands, int* commands_cnt, int* params_cnt,
+                   Label** labels, int* labels_cnt, CPU_debug_t* debug)
+{
+    assert(commands);
+    assert(labels);
+    assert(debug);
+
+    CPU_command_t* result = 0;
+    int* index_map = (int*) calloc(*commands_cnt + 1, sizeof(*index_map));
+    Inline_routine_t* routines = (Inline_routine_t*) calloc(*commands_cnt, sizeof(*routines));
+    Inline_copy_t* copies = (Inline_copy_t*) calloc(*commands_cnt, sizeof(*copies));
+    Inline_stats_t stats = {};
+    int result_cnt = inline_routines(*commands, *commands_cnt, limit, &result, index_map, routines, copies, &stats);
+
+    for (int r = 0; r < stats.routines_cnt; ++r)
+    {
+        const char* name = "?";
+        for (int i = 0; i < *labels_cnt; ++i)
+            if ((*labels)[i].index == routines[r].start)
+            {
+                name = (*labels)[i].name;
+                break;
+            }
+        if (routines[r].calls_cnt)
+            printf("Inlined %s (%d commands) at %d call%s%s\n", name, routines[r].length, routines[r].calls_cnt,
+                   (routines[r].calls_cnt == 1) ? "" : "s", routines[r].removed ? ", removed it" : "");
+    }
+
+    int* numbers = (int*) calloc(stats.routines_cnt + 1, sizeof(*numbers));
+    int renamed_cnt = 0;
+    for (int c = 0; c < stats.calls_cnt; ++c)
+        for (int i = 0; i < *labels_cnt; ++i)
+        {
+            Inline_routine_t* routine = &routines[copies[c].routine];
+            renamed_cnt += ((*labels)[i].index >= routine->start) &&
+                           ((*labels)[i].index < routine->start + routine->length);
+        }
+    int old_labels_cnt = *labels_cnt;
+    *labels = (Label*) realloc(*labels, (old_labels_cnt + renamed_cnt) * sizeof(**labels));
+    for (int c = 0; c < stats.calls_cnt; ++c)
+    {
+        Inline_routine_t* routine = &routines[copies[c].routine];
+        int number = ++numbers[copies[c].routine];
+        for (int i = 0; i < old_labels_cnt; ++i)
+        {
+            int index = (*labels)[i].index;
+            if ((index < routine->start) || (index >= routine->start + routine->length))
+                continue;
+            char suffix[16] = {};
+            char name[MAX_LABELNAME] = {};
+            snprintf(suffix, sizeof(suffix), ".%d", number);
+            snprintf(name, sizeof(name), "%.*s%s", (int) (MAX_LABELNAME - 1 - strlen(suffix)), (*labels)[i].name,
+                     suffix);
+            label_ctor(&(*labels)[(*labels_cnt)++], name, copies[c].start + (index - routine->start));
+        }
+    }
+    for (int i = 0; i < old_labels_cnt; ++i)
+        if ((*labels)[i].index >= 0)
+            (*labels)[i].index = index_map[(*labels)[i].index];
+    free(numbers);
+
+    // copies take the lines of their routines, the replaced calls give way to them
+    int lines_cnt = debug->lines_cnt;
+    for (int c = 0; c < stats.calls_cnt; ++c)
+    {
+        Inline_routine_t* routine = &routines[copies[c].routine];
+        lines_cnt += find_line(debug, routine->start + routine->length) - find_line(debug, routine->start);
+    }
+    Moved_line* lines = (Moved_line*) calloc(lines_cnt + 1, sizeof(*lines));
+    char* inlined = (char*) calloc(*commands_cnt, sizeof(*inlined));
+    for (int c = 0; c < stats.calls_cnt; ++c)
+        inlined[copies[c].call] = 1;
+    lines_cnt = 0;
+    for (int i = 0; i < debug->lines_cnt; ++i)
+    {
+        int index = debug->lines[i].index;
+        if (index_map[index] < 0)
+            continue;
+        lines[lines_cnt].line = debug->lines[i];
+        lines[lines_cnt].line.index = index_map[index];
+        lines[lines_cnt++].dropped = inlined[index];
+    }
+    for (int c = 0; c < stats.calls_cnt; ++c)
+    {
+        Inline_routine_t* routine = &routines[copies[c].routine];
+        int end = find_line(debug, routine->start + routine->length);
+        for (int i = find_line(debug, routine->start); i < end; ++i)
+        {
+            lines[lines_cnt].line = debug->lines[i];
+            lines[lines_cnt++].line.index = copies[c].start + (debug->lines[i].index - routine->start);
+        }
+    }
+    qsort(lines, lines_cnt, sizeof(*lines), compare_lines);
+    free(debug->lines);
+    debug->lines = (CPU_line_t*) calloc(lines_cnt + 1, sizeof(*debug->lines));
+    debug->lines_cnt = 0;
+    for (int i = 0; i < lines_cnt; ++i)
+        if ((debug->lines_cnt == 0) || (debug->lines[debug->lines_cnt - 1].index != lines[i].line.index))
+            debug->lines[debug->lines_cnt++] = lines[i].line;
+    free(lines);
+    free(inlined);
+
+    printf("Inlined %d calls of routines of at most %d commands, removed %d routines: %d commands instead of %d\n",
+           stats.calls_cnt, limit, stats.removed_cnt, result_cnt, *commands_cnt);
+
+    *params_cnt = 0;
+    for (int i = 0; i < result_cnt; ++i)
+        *params_cnt += CPU_command_operands_cnt(result[i].command);
+    free(*commands);
+    free(index_map);
+    free(routines);
+    free(copies);
+    *commands = result;
+    *commands_cnt = result_cnt;
 
     return 0;
 }
@@ -179,104 +551,351 @@ int find_index_by_labelname(Label* labels, int labels_cnt, const char* name)
 int count_commands(FILE* stream, int* commands_cnt, int* params_cnt, int* labels_cnt)
 {
     char wrd[MAX_LABELNAME] = {};
-    while (fscanf(stream, "%" STR(MAX_LABELNAME) "s", wrd) != EOF)
+    while (fscanf(stream, LABELNAME_FORMAT, wrd) != EOF)
     {
-        wrd[MAX_LABELNAME - 1] = '\0';
-        str_lower(wrd);
-        int is_cmd = is_command(wrd);
-        if (is_cmd)
-        {
-            float tmp_fl = 0;
-            if (is_cmd == COMPLEX_COMMAND)
-            {
-                if (fscanf(stream, "%f", &tmp_fl) != 1)
-                {
-                    char param[MAX_LABELNAME] = {};
-                    fscanf(stream, "%" STR(MAX_LABELNAME) "s", param);
-                    param[MAX_LABELNAME - 1] = '\0';
-                    str_lower(param);
-                    if (!strcmp(wrd, "push") || !strcmp(wrd, "pop"))
-                    {
-                        if (strcmp(param, "rax") &&
-                            strcmp(param, "rbx") &&
-                            strcmp(param, "rcx") &&
-                            strcmp(param, "rdx"))
-                        {
-                            printf("Incorrect parameter %s found\n", param);
-                            rewind(stream);
-                            return -1;
-                        }
-                    } else if (!strcmp(wrd, "ja") ||
-                               !strcmp(wrd, "jae") ||
-                               !strcmp(wrd, "jb") ||
-                               !strcmp(wrd, "jbe") ||
-                               !strcmp(wrd, "je") ||
-                               !strcmp(wrd, "jne") ||
-                               !strcmp(wrd, "jmp"))
-                    {
-                        if (param[strlen(param) - 1] != ':')
-                        {
-                            printf("Incorrect parameter %s found\n", param);
-                            rewind(stream);
-                            return -1;
-                        }
-                    }
-                }
-                ++(*params_cnt);
-            }
-            ++(*commands_cnt);
-        } else if (wrd[strlen(wrd) - 1] == ':')
+        if (wrd[strlen(wrd) - 1] == ':')
         {
             ++(*labels_cnt);
-        } else
+            continue;
+        }
+
+        str_lower(wrd);
+        char operands[MAX_OPERANDS][MAX_LABELNAME] = {};
+        int operands_cnt = read_operands(stream, operands, MAX_OPERANDS);
+        CPU_command_t command[MAX_COMMAND_LENGTH] = {};
+        int length = -1;
+        if ((operands_cnt < 0) ||
+            ((length = parse_command(wrd, operands, operands_cnt, command, 0, 0, 0, 0, 0, 0, 0, *commands_cnt)) < 0))
         {
-            printf("Incorrect command %s found\n", wrd);
             rewind(stream);
             return -1;
         }
+        for (int i = 0; i < length; ++i)
+            *params_cnt += CPU_command_operands_cnt(command[i].command);
+        *commands_cnt += length;
     }
     rewind(stream);
     return 0;
 }
 
-int is_command(char* str)
+// reads operands till the end of the line, they are separated by spaces or commas
+int read_operands(FILE* stream, char operands[][MAX_LABELNAME], int max_operands)
+{
+    int operands_cnt = 0;
+    for (;;)
+    {
+        int c = getc(stream);
+        while ((c == ' ') || (c == '\t') || (c == '\r') || (c == ','))
+            c = getc(stream);
+        if ((c == '\n') || (c == EOF))
+            return operands_cnt;
+
+        if (operands_cnt == max_operands)
+        {
+            printf("Too many operands found\n");
+            return -1;
+        }
+        int length = 0;
+        while ((c != EOF) && !isspace(c) && (c != ','))
+        {
+            if (length < MAX_LABELNAME - 1)
+                operands[operands_cnt][length++] = c;
+            c = getc(stream);
+        }
+        operands[operands_cnt][length] = '\0';
+        ++operands_cnt;
+        if (c != EOF)
+            ungetc(c, stream);
+    }
+}
+
+int get_register(const char* str)
+{
+    if (!strcasecmp(str, "rax"))
+        return RAX;
+    else if (!strcasecmp(str, "rbx"))
+        return RBX;
+    else if (!strcasecmp(str, "rcx"))
+        return RCX;
+    else if (!strcasecmp(str, "rdx"))
+        return RDX;
+    return -1;
+}
+
+// the whole operand has to be a number, so labels like inf_roots: are not taken for one
+int get_number(const char* str, CPU_word_t* value)
+{
+    int length = 0;
+    return (sscanf(str, WORD_SCAN "%n", value, &length) == 1) && (str[length] == '\0');
+}
+
+int get_target(const char* str, int cmd, Label* labels, int labels_cnt, int warn_label,
+               Label* imports, int* imports_cnt, int cmd_index, CPU_word_t* target)
+{
+    if (get_number(str, target))
+        return 0;
+
+    char name[MAX_LABELNAME] = {};
+    strcpy(name, str);
+    int length = strlen(name);
+    if (name[length - 1] == ':')
+        name[length - 1] = '\0';
+    else if (cmd != CALL)
+    {
+        printf("Incorrect argument found: %s\n", str);
+        return -1;
+    }
+
+    int index = find_index_by_labelname(labels, labels_cnt, name);
+    *target = index;
+    if ((index == -1) && warn_label && imports)
+    {
+        Label import = {};
+        label_ctor(&import, name, cmd_index);
+        imports[*imports_cnt] = import;
+        ++(*imports_cnt);
+    } else if ((index == -1) && warn_label)
+    {
+        printf("Unknown label found: %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// index of the native function in the natives table, added there if needed; -1 for a number or a known label
+int get_native(const char* str, Label* labels, int labels_cnt, Label* natives, int* natives_cnt)
 {
-    if (!strcmp(str, "push") ||
-        !strcmp(str, "pop") ||
-        !strcmp(str, "ja") ||
-        !strcmp(str, "jae") ||
-        !strcmp(str, "jb") ||
-        !strcmp(str, "jbe") ||
-        !strcmp(str, "je") ||
-        !strcmp(str, "jne") ||
-        !strcmp(str, "jmp") ||
-        !strcmp(str, "call"))
-        return COMPLEX_COMMAND;
-    if (!strcmp(str, "add") ||
-        !strcmp(str, "sub") ||
-        !strcmp(str, "mul") ||
-        !strcmp(str, "div") ||
-        !strcmp(str, "pow") ||
-        !strcmp(str, "dup") ||
-        !strcmp(str, "out") ||
-        !strcmp(str, "nop") ||
-        !strcmp(str, "in") ||
-        !strcmp(str, "ret") ||
-        !strcmp(str, "end"))
-        return SIMPLE_COMMAND;
-    return NOT_COMMAND;
+    CPU_word_t value = 0;
+    if (get_number(str, &value))
+        return -1;
+
+    char name[MAX_LABELNAME] = {};
+    strcpy(name, str);
+    int length = strlen(name);
+    if (name[length - 1] == ':')
+        name[length - 1] = '\0';
+    if (find_index_by_labelname(labels, labels_cnt, name) != -1)
+        return -1;
+
+    int index = find_index_by_labelname(natives, *natives_cnt, name);
+    if (index != -1)
+        return index;
+    if ((*natives_cnt == COMMANDS_MAX_NATIVES) || (strlen(name) >= MAX_NATIVE_NAME))
+    {
+        printf("Too many native functions or too long name: %s\n", name);
+        return -2;
+    }
+    label_ctor(&natives[*natives_cnt], name, *natives_cnt);
+    return (*natives_cnt)++;
+}
+
+// fills the command and its EXT operands if any, returns the number of slots taken or -1
+int parse_command(char* mnemonic, char operands[][MAX_LABELNAME], int operands_cnt, CPU_command_t* command,
+                  Label* labels, int labels_cnt, int warn_label, Label* imports, int* imports_cnt,
+                  Label* natives, int* natives_cnt, int cmd_index)
+{
+    int cmd = get_cmd_number(mnemonic);
+    if (cmd == -1)
+    {
+        printf("Incorrect command %s found\n", mnemonic);
+        return -1;
+    }
+    CPU_command_ctor(command, cmd, 0);
+
+    int reg = (operands_cnt > 0) ? get_register(operands[0]) : -1;
+    int reg2 = (operands_cnt > 1) ? get_register(operands[1]) : -1;
+    CPU_word_t value = 0;
+    int correct = 1;
+    switch (cmd)
+    {
+    case PUSH:
+        if ((operands_cnt == 1) && (reg >= 0))
+        {
+            command->command = PUSH_VAR;
+            command->parameter = reg;
+        } else if ((operands_cnt == 1) && get_number(operands[0], &value))
+            command->parameter = value;
+        else
+            correct = 0;
+        break;
+    case POP:
+        correct = (operands_cnt == 1) && (reg >= 0);
+        command->parameter = reg;
+        break;
+    case JA:
+    case JAE:
+    case JB:
+    case JBE:
+    case JE:
+    case JNE:
+        if ((operands_cnt == 3) && (reg >= 0) && (reg2 >= 0))
+        {
+            command->command = JA_RR + (cmd - JA);
+            command->reg = reg;
+            command->reg2 = reg2;
+            return (get_target(operands[2], cmd, labels, labels_cnt, warn_label, imports, imports_cnt, cmd_index,
+                               &command->parameter) == 0) ? 1 : -1;
+        } else if ((operands_cnt == 3) && (reg >= 0) && get_number(operands[1], &value))
+        {
+            // the immediate does not fit next to the target, it goes to the following EXT command
+            command->command = JA_RI + (cmd - JA);
+            command->reg = reg;
+            CPU_command_ctor(&command[1], EXT, value);
+            return (get_target(operands[2], cmd, labels, labels_cnt, warn_label, imports, imports_cnt, cmd_index,
+                               &command->parameter) == 0) ? 2 : -1;
+        }
+        // fall through
+    case JMP:
+    case CALL:
+    case SPAWN:
+        if ((cmd == CALL) && (operands_cnt == 1) && natives && warn_label)
+        {
+            int native = get_native(operands[0], labels, labels_cnt, natives, natives_cnt);
+            if (native == -2)
+                return -1;
+            if (native >= 0)
+            {
+                command->command = NATIVE;
+                command->parameter = native;
+                return 1;
+            }
+        }
+        if (operands_cnt == 1)
+            return (get_target(operands[0], cmd, labels, labels_cnt, warn_label, imports, imports_cnt, cmd_index,
+                               &command->parameter) == 0) ? 1 : -1;
+        correct = 0;
+        break;
+    case SWITCH:
+        // switch reg, base, case labels..., default label
+        if ((operands_cnt >= 3) && (reg >= 0) && get_number(operands[1], &value))
+        {
+            int cases_cnt = operands_cnt - 3;
+            command->reg = reg;
+            command->parameter = cases_cnt;
+            CPU_command_ctor(&command[1], EXT, value);
+            for (int i = 0; i <= cases_cnt; ++i)
+            {
+                const char* label = operands[(i == 0) ? operands_cnt - 1 : i + 1];
+                CPU_command_ctor(&command[2 + i], CASE, 0);
+                if (get_target(label, JMP, labels, labels_cnt, warn_label, imports, imports_cnt, cmd_index + 2 + i,
+                               &command[2 + i].parameter) != 0)
+                    return -1;
+            }
+            return 3 + cases_cnt;
+        }
+        correct = 0;
+        break;
+    case LOOP:
+        if ((operands_cnt == 2) && (reg >= 0))
+        {
+            command->reg = reg;
+            return (get_target(operands[1], cmd, labels, labels_cnt, warn_label, imports, imports_cnt, cmd_index,
+                               &command->parameter) == 0) ? 1 : -1;
+        }
+        correct = 0;
+        break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case MOV_RR:
+        if ((operands_cnt == 0) && (cmd != MOV_RR))
+            break;
+        correct = (operands_cnt == 2) && (reg >= 0);
+        command->reg = reg;
+        // register forms go in pairs: OP_RR, OP_RI
+        if (cmd != MOV_RR)
+            command->command = ADD_RR + 2 * (cmd - ADD);
+        if (reg2 >= 0)
+            command->reg2 = reg2;
+        else if (correct && get_number(operands[1], &value))
+        {
+            command->command += 1;
+            command->parameter = value;
+        } else
+            correct = 0;
+        break;
+    case INC:
+    case DEC:
+        correct = (operands_cnt == 1) && (reg >= 0);
+        command->reg = reg;
+        break;
+    case ENTER:
+    case LOAD_LOCAL:
+    case STORE_LOCAL:
+    case SEND:
+    case RECV:
+        correct = (operands_cnt == 1) && get_number(operands[0], &value) && (value >= 0) && (value == (int) value) &&
+                  (((cmd != SEND) && (cmd != RECV)) || (value < CHANNELS_CNT));
+        command->parameter = value;
+        break;
+    case NATIVE:
+        if (operands_cnt != 1)
+            correct = 0;
+        else if (imports)
+        {
+            // left to the linker as a call of an unknown label
+            command->command = CALL;
+            return (get_target(operands[0], CALL, 0, 0, warn_label, imports, imports_cnt, cmd_index,
+                               &command->parameter) == 0) ? 1 : -1;
+        } else if (natives && warn_label)
+        {
+            command->parameter = get_native(operands[0], 0, 0, natives, natives_cnt);
+            correct = (command->parameter >= 0);
+        }
+        break;
+    case LOAD_R:
+    case STORE_R:
+        // memory address in a register or an immediate: OP_R, OP_I
+        if ((operands_cnt == 1) && (reg >= 0))
+            command->reg = reg;
+        else if ((operands_cnt == 1) && get_number(operands[0], &value) && (value >= 0) && (value == (int) value))
+        {
+            command->command += 1;
+            command->parameter = value;
+        } else
+            correct = 0;
+        break;
+    default:
+        correct = (operands_cnt == 0);
+        break;
+    }
+
+    if (!correct)
+    {
+        printf("Incorrect arguments for %s command found\n", mnemonic);
+        return -1;
+    }
+    return 1;
 }
 
-int fill_commands(FILE* stream, CPU_command_t* commands, Label* labels, int labels_cnt, int warn_label)
+// fills commands and, if debug is given, the source position of every one of them
+int fill_commands(FILE* stream, CPU_command_t* commands, Label* labels, int labels_cnt, int warn_label,
+                  Label* imports, int* imports_cnt, Label* natives, int* natives_cnt, CPU_debug_t* debug)
 {
     int cmd_index = 0;
     int lbl_index = 0;
     int lenwrd = 0;
+    int line = 1;
+    int column = 1;
     char wrd[MAX_LABELNAME] = {};
-    while (fscanf(stream, "%" STR(MAX_LABELNAME) "s", wrd) != EOF)
+    for (;;)
     {
-        wrd[MAX_LABELNAME - 1] = '\0';
+        int c = getc(stream);
+        for (; isspace(c); c = getc(stream))
+        {
+            if (c == '\n')
+            {
+                ++line;
+                column = 1;
+            } else
+                ++column;
+        }
+        if ((c == EOF) || (ungetc(c, stream) == EOF) || (fscanf(stream, LABELNAME_FORMAT, wrd) == EOF))
+            break;
         lenwrd = strlen(wrd);
+        int wrd_column = column;
+        column += lenwrd;
         if (wrd[lenwrd - 1] == ':')
         {
             wrd[lenwrd - 1] = '\0';
@@ -287,94 +906,22 @@ int fill_commands(FILE* stream, CPU_command_t* commands, Label* labels, int labe
         } else
         {
             str_lower(wrd);
-            int cmd = get_cmd_number(wrd);
-            CPU_command_t command = {};
-            CPU_command_ctor(&command, cmd, 0);
-            float param = 0;
-            switch (cmd)
+            char operands[MAX_OPERANDS][MAX_LABELNAME] = {};
+            int operands_cnt = read_operands(stream, operands, MAX_OPERANDS);
+            int length = -1;
+            if ((operands_cnt < 0) ||
+                ((length = parse_command(wrd, operands, operands_cnt, &commands[cmd_index], labels, labels_cnt,
+                                         warn_label, imports, imports_cnt, natives, natives_cnt, cmd_index)) < 0))
             {
-            case PUSH:
-                if (fscanf(stream, "%f", &param) == 1)
-                {
-                    command.parameter = param;
-                } else
-                {
-                    fscanf(stream, "%" STR(MAX_LABELNAME) "s", wrd);
-                    command.command = PUSH_VAR;
-                    wrd[63] = '\0';
-                    str_lower(wrd);
-                    if (!strcmp(wrd, "rax"))
-                        command.parameter = RAX;
-                    else if (!strcmp(wrd, "rbx"))
-                        command.parameter = RBX;
-                    else if (!strcmp(wrd, "rcx"))
-                        command.parameter = RCX;
-                    else if (!strcmp(wrd, "rdx"))
-                        command.parameter = RDX;
-                }
-                break;
-            case POP:
-                if (fscanf(stream, "%f", &param) == 1)
-                {
-                    printf("Incorrect argument for pop command found: %g\n", param);
-                    rewind(stream);
-                    return -1;
-                } else
-                {
-                    fscanf(stream, "%" STR(MAX_LABELNAME) "s", wrd);
-                    wrd[MAX_LABELNAME - 1] = '\0';
-                    str_lower(wrd);
-                    if (!strcmp(wrd, "rax"))
-                        command.parameter = RAX;
-                    else if (!strcmp(wrd, "rbx"))
-                        command.parameter = RBX;
-                    else if (!strcmp(wrd, "rcx"))
-                        command.parameter = RCX;
-                    else if (!strcmp(wrd, "rdx"))
-                        command.parameter = RDX;
-                }
-                break;
-            case JA:
-            case JAE:
-            case JB:
-            case JBE:
-            case JE:
-            case JNE:
-            case JMP:
-            case CALL:
-                if (fscanf(stream, "%f", &param) == 1)
-                {
-                    command.parameter = param;
-                } else
-                {
-                    fscanf(stream, "%" STR(MAX_LABELNAME) "s", wrd);
-                    wrd[MAX_LABELNAME - 1] = '\0';
-                    lenwrd = strlen(wrd);
-                    if ((wrd[lenwrd - 1] == ':') || (cmd == CALL))
-                    {
-                        if (wrd[lenwrd - 1] == ':')
-                            wrd[lenwrd - 1] = '\0';
-                        int index = find_index_by_labelname(labels, labels_cnt, wrd);
-                        command.parameter = index;
-                        if ((index == -1) && warn_label)
-                        {
-                            printf("Unknown label found: %s\n", wrd);
-                            rewind(stream);
-                            return -1;
-                        }
-                    } else
-                    {
-                        printf("Incorrect argument found: %s\n", wrd);
-                        rewind(stream);
-                        return -1;
-                    }
-                }
-                break;
-            default:
-                break;
+                rewind(stream);
+                return -1;
             }
-            commands[cmd_index] = command;
-            ++cmd_index;
+            if (debug)
+                debug->lines[debug->lines_cnt++] = (CPU_line_t) {cmd_index, line, wrd_column};
+            cmd_index += length;
+            // read_operands() stops after the end of the line
+            ++line;
+            column = 1;
         }
     }
     rewind(stream);
@@ -425,10 +972,71 @@ int get_cmd_number(char* str)
         return END;
     else if (!strcmp(str, "nop"))
         return NOP;
+    else if (!strcmp(str, "mov"))
+        return MOV_RR;
+    else if (!strcmp(str, "inc"))
+        return INC;
+    else if (!strcmp(str, "dec"))
+        return DEC;
+    else if (!strcmp(str, "loop"))
+        return LOOP;
+    else if (!strcmp(str, "switch"))
+        return SWITCH;
+    else if (!strcmp(str, "locals"))
+        return ENTER;
+    else if (!strcmp(str, "load_local"))
+        return LOAD_LOCAL;
+    else if (!strcmp(str, "store_local"))
+        return STORE_LOCAL;
+    else if (!strcmp(str, "load"))
+        return LOAD_R;
+    else if (!strcmp(str, "store"))
+        return STORE_R;
+    else if (!strcmp(str, "vadd"))
+        return VADD;
+    else if (!strcmp(str, "vmul"))
+        return VMUL;
+    else if (!strcmp(str, "vfma"))
+        return VFMA;
+    else if (!strcmp(str, "vsum"))
+        return VSUM;
+    else if (!strcmp(str, "vmin"))
+        return VMIN;
+    else if (!strcmp(str, "vmax"))
+        return VMAX;
+    else if (!strcmp(str, "vdot"))
+        return VDOT;
+    else if (!strcmp(str, "vin"))
+        return VIN;
+    else if (!strcmp(str, "vout"))
+        return VOUT;
+    else if (!strcmp(str, "native"))
+        return NATIVE;
+    else if (!strcmp(str, "spawn"))
+        return SPAWN;
+    else if (!strcmp(str, "join"))
+        return JOIN;
+    else if (!strcmp(str, "send"))
+        return SEND;
+    else if (!strcmp(str, "recv"))
+        return RECV;
     return -1;
 }
 
-int write_assembled(const char* filename, const CPU_command_t* commands, int commands_cnt, int params_cnt)
+int write_commands(FILE* stream, const CPU_command_t* commands, int commands_cnt)
+{
+    assert(stream);
+    assert(commands);
+
+    for (int i = 0; i < commands_cnt; ++i)
+        CPU_command_write(&commands[i], stream);
+    fprintf(stream, "\n");
+
+    return 0;
+}
+
+int write_assembled(const char* filename, const CPU_command_t* commands, int commands_cnt, int params_cnt,
+                    const Label* natives, int natives_cnt, const CPU_debug_t* debug)
 {
     assert(filename);
     assert(commands);
@@ -438,27 +1046,56 @@ int write_assembled(const char* filename, const CPU_command_t* commands, int com
     if (!stream)
         return 1;
 
+    const char** names = (const char**) calloc(natives_cnt + 1, sizeof(*names));
+    for (int i = 0; i < natives_cnt; ++i)
+        names[i] = natives[i].name;
+    CPU_word_write(stream);
+    CPU_natives_write(stream, names, natives_cnt);
+    free(names);
     fprintf(stream, "%d ", commands_cnt);
     fprintf(stream, "%d ", params_cnt);
+    write_commands(stream, commands, commands_cnt);
+    if (debug)
+        CPU_debug_write(stream, debug);
 
-    for (int i = 0; i < commands_cnt; ++i)
-    {
-        CPU_command_t cmd = commands[i];
-        fprintf(stream, "%d ", cmd.command);
-        if ((cmd.command == PUSH) ||
-            (cmd.command == PUSH_VAR) ||
-            (cmd.command == POP) ||
-            (cmd.command == JA) ||
-            (cmd.command == JAE) ||
-            (cmd.command == JB) ||
-            (cmd.command == JBE) ||
-            (cmd.command == JE) ||
-            (cmd.command == JNE) ||
-            (cmd.command == JMP) ||
-            (cmd.command == CALL))
-            fprintf(stream, "%g ", cmd.parameter);
-    }
-    fprintf(stream, "\n");
+    fclose(stream);
+
+    return 0;
+}
+
+/*
+ * Object file layout (text, like the executable one):
+ *   [word <name>]                   -- words other than float, see CPU_word_read()
+ *   obj <commands_cnt> <params_cnt> <exports_cnt> <imports_cnt>
+ *   <label> <command index>         -- exports_cnt times
+ *   <label> <referring command>     -- imports_cnt times
+ *   <commands>
+ * Jump and call targets are relative to the start of the module.
+ */
+int write_object(const char* filename, const CPU_command_t* commands, int commands_cnt, int params_cnt,
+                 const Label* labels, int labels_cnt, const Label* imports, int imports_cnt)
+{
+    assert(filename);
+    assert(commands);
+    assert(commands_cnt > 0);
+
+    FILE* stream = fopen(filename, "wb");
+    if (!stream)
+        return 1;
+
+    int exports_cnt = 0;
+    for (int i = 0; i < labels_cnt; ++i)
+        if (labels[i].name[0] != '.')
+            ++exports_cnt;
+
+    CPU_word_write(stream);
+    fprintf(stream, "obj %d %d %d %d\n", commands_cnt, params_cnt, exports_cnt, imports_cnt);
+    for (int i = 0; i < labels_cnt; ++i)
+        if (labels[i].name[0] != '.')
+            fprintf(stream, "%s %d\n", labels[i].name, labels[i].index);
+    for (int i = 0; i < imports_cnt; ++i)
+        fprintf(stream, "%s %d\n", imports[i].name, imports[i].index);
+    write_commands(stream, commands, commands_cnt);
 
     fclose(stream);
 
@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "../processor/commands.h"
 
 #define DEFAULT_INPUT "code.in"
@@ -11,8 +14,28 @@
 #define VERSION "0.1"
 #define PRINT_VER(program) printf(program " v" VERSION " (%s %s) by " MY_NAME "\n", __DATE__, __TIME__)
 
+#define LABEL_PREFIX ".L"           // of labels made up for jump targets without a name in the debug section
+#define MAX_LINE 256                // longest command line but for switch
+#define PARALLEL_MIN_COMMANDS 65536 // smaller programs are written by one thread
+#define MAX_THREADS 64
+
+typedef struct
+{
+    CPU_command_t* commands;
+    int commands_cnt;
+    char** natives;
+    int natives_cnt;
+    char* starts;           // 1 for slots where a command starts
+    unsigned char* targets; // bit per slot, set for jump, call and case targets
+    const char** names;     // label of every slot from the debug section, 0 where it has none
+    CPU_debug_t debug;
+} Program;
+
 int disassemble_code(const char* inputfile, const char* outputfile);
-int write_disassembled(FILE* input, FILE* output);
+int read_program(const char* data, size_t size, Program* program);
+int find_labels(Program* program);
+int write_disassembled(const Program* program, FILE* output);
+void program_free(Program* program);
 int print_help();
 int print_version();
 
@@ -59,7 +82,9 @@ int print_help()
            "  -h, --help\t\tprints this message\n"
            "  -v, --version\t\tprints version of this program\n\n"
            "If no input and output file specified, program will use \"%s\" as input file and \"%s\" as output.\n"
-           "If only input file specified, program will use input_file + \".out\" as output\n",
+           "If only input file specified, program will use input_file + \".out\" as output\n\n"
+           "Jump targets get the labels of the debug section (assembler -g) or \"" LABEL_PREFIX "<index>\" ones,\n"
+           "the output assembles back to the same program.\n",
            DEFAULT_INPUT, DEFAULT_OUTPUT);
 
     return 0;
@@ -84,24 +109,48 @@ int disassemble_code(const char* inputfile, const char* outputfile)
         perror(inputfile);
         return 1;
     }
+    // the whole file is taken in one read, commands are decoded from memory
+    fseek(inp, 0, SEEK_END);
+    long size = ftell(inp);
+    rewind(inp);
+    char* data = (char*) calloc((size > 0) ? size + 1 : 1, sizeof(*data));
+    int read_ok = (size >= 0) && (fread(data, 1, size, inp) == (size_t) size);
+    fclose(inp);
+    if (!read_ok)
+    {
+        printf("Error reading input file %s\n", inputfile);
+        free(data);
+        return 1;
+    }
+
+    Program program = {};
+    int disasm_result = read_program(data, size, &program);
+    free(data);
+    if (disasm_result == 0)
+        disasm_result = find_labels(&program);
+    if (disasm_result != 0)
+    {
+        if (disasm_result == -2)
+            printf("Program file corrupt\n");
+        program_free(&program);
+        return 3;
+    }
 
     FILE* out = fopen(outputfile, "wb");
     if (!out)
     {
         printf("Error opening output file ");
         perror(outputfile);
+        program_free(&program);
         return 2;
     }
-
-    int disasm_result = write_disassembled(inp, out);
-    fclose(inp);
+    disasm_result = write_disassembled(&program, out);
     fclose(out);
-
+    program_free(&program);
     if (disasm_result != 0)
     {
-        if (disasm_result == -2)
-            printf("Program file corrupt\n");
-        return 3;
+        printf("Error writing output file %s\n", outputfile);
+        return 2;
     }
 
     printf("Disassembled code has successfully written to %s!\n", outputfile);
@@ -109,150 +158,396 @@ int disassemble_code(const char* inputfile, const char* outputfile)
     return 0;
 }
 
-#define WRITE_CMD_WITH_IARG(cmd) \
-if (fscanf(input, "%d", &param) == 1) \
-{ \
-    fprintf(output, cmd " %d\n", param); \
-    ++_params_count; \
-} else \
-{ \
-    printf("Incorrect argument for " cmd " command\n"); \
-    return -1; \
+void program_free(Program* program)
+{
+    assert(program);
+
+    free(program->commands);
+    CPU_natives_free(program->natives, program->natives_cnt);
+    free(program->starts);
+    free(program->targets);
+    free(program->names);
+    CPU_debug_free(&program->debug);
+    *program = (Program) {};
 }
 
-int write_disassembled(FILE* input, FILE* output)
+static int read_int(const char** position, int* value)
 {
-    assert(input);
-    assert(output);
+    char* end = 0;
+    long number = strtol(*position, &end, 10);
+    if ((end == *position) || (*end && !isspace((unsigned char) *end)))
+        return 0;
+    *value = number;
+    *position = end;
+    return 1;
+}
+
+static int read_word(const char** position, CPU_word_t* value)
+{
+    char* end = 0;
+    *value = word_parse(*position, &end);
+    if ((end == *position) || (*end && !isspace((unsigned char) *end)))
+        return 0;
+    *position = end;
+    return 1;
+}
 
-    int commands_count = 0;
-    int _commands_count = 0;
-    int params_count = 0;
-    int _params_count = 0;
-    fscanf(input, "%d %d", &commands_count, &params_count);
+/*
+ * Decodes the program from data, which ends with '\0'. The header and the
+ * debug section are read by the stream functions of commands.c, the
+ * commands in between straight from memory. Returns 0, -1 for a program of
+ * another word and -2 for a corrupt one.
+ */
+int read_program(const char* data, size_t size, Program* program)
+{
+    assert(data);
+    assert(program);
 
-    for (int i = 0; i < commands_count; ++i)
+    FILE* stream = fmemopen((void*) data, size ? size : 1, "rb");
+    if (!stream)
+        return -2;
+    int word = CPU_word_read(stream);
+    int params_cnt = 0;
+    if ((word != 0) || (CPU_natives_read(stream, &program->natives, &program->natives_cnt) != 0) ||
+        (fscanf(stream, "%d %d", &program->commands_cnt, &params_cnt) != 2) || (program->commands_cnt <= 0))
     {
+        fclose(stream);
+        return (word > 0) ? -1 : -2;
+    }
+    const char* position = data + ftell(stream);
+    fclose(stream);
+
+    int commands_cnt = program->commands_cnt;
+    program->commands = (CPU_command_t*) calloc(commands_cnt, sizeof(*program->commands));
+    int _params_cnt = 0;
+    for (int i = 0; i < commands_cnt; ++i)
+    {
+        CPU_command_t* command = &program->commands[i];
         int cmd = 0;
-        fscanf(input, "%d", &cmd);
-        int param = 0;
-        switch (cmd)
+        int reg = 0;
+        int reg2 = 0;
+        if (!read_int(&position, &cmd) || (cmd < END) || (cmd >= COMMANDS_CNT))
+            return -2;
+        int operands = CPU_command_operands(cmd);
+        if (((operands & OPERAND_REG) && !read_int(&position, &reg)) ||
+            ((operands & OPERAND_REG2) && !read_int(&position, &reg2)) ||
+            ((operands & OPERAND_PARAM) && !read_word(&position, &command->parameter)))
+            return -2;
+        command->command = cmd;
+        command->reg = reg;
+        command->reg2 = reg2;
+        _params_cnt += CPU_command_operands_cnt(cmd);
+    }
+    if ((_params_cnt != params_cnt) || (CPU_commands_check(program->commands, commands_cnt) != 0))
+        return -2;
+
+    // only the debug section may follow, its labels name the jump targets
+    while (isspace((unsigned char) *position))
+        ++position;
+    if (*position == '\0')
+        return 0;
+    stream = fmemopen((void*) position, data + size - position, "rb");
+    int debug_result = stream ? CPU_debug_read(stream, &program->debug) : -1;
+    if (stream)
+        fclose(stream);
+
+    return (debug_result == 0) ? 0 : -2;
+}
+
+static void set_target(Program* program, int target)
+{
+    program->targets[target / 8] |= 1 << (target % 8);
+}
+
+static int is_target(const Program* program, int index)
+{
+    return (program->targets[index / 8] >> (index % 8)) & 1;
+}
+
+// marks where commands start and which of them are jumped to, returns -2 for a broken operand
+int find_labels(Program* program)
+{
+    assert(program);
+
+    int commands_cnt = program->commands_cnt;
+    const CPU_command_t* commands = program->commands;
+    program->starts = (char*) calloc(commands_cnt, sizeof(*program->starts));
+    program->targets = (unsigned char*) calloc(commands_cnt / 8 + 1, sizeof(*program->targets));
+    program->names = (const char**) calloc(commands_cnt, sizeof(*program->names));
+
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+        program->starts[i] = 1;
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+    {
+        int cmd = commands[i].command;
+        int length = CPU_command_length(&commands[i]);
+        if (((cmd == PUSH_VAR) || (cmd == POP)) &&
+            ((commands[i].parameter < RAX) || (commands[i].parameter > RDX) ||
+             (commands[i].parameter != (int) commands[i].parameter)))
+            return -2;
+        if ((cmd == NATIVE) && (commands[i].parameter >= program->natives_cnt))
+            return -2;
+        // targets inside another command or out of the program are written as numbers
+        for (int j = i; j < i + length; ++j)
         {
-        case PUSH:
-            WRITE_CMD_WITH_IARG("push");
-            break;
-        case PUSH_VAR:
-            if (fscanf(input, "%d", &param) == 1)
-            {
-                fprintf(output, "push ");
-                if (param == RAX)
-                    fprintf(output, "rax\n");
-                else if (param == RBX)
-                    fprintf(output, "rbx\n");
-                else if (param == RCX)
-                    fprintf(output, "rcx\n");
-                else if (param == RDX)
-                    fprintf(output, "rdx\n");
-                else
-                {
-                    printf("Incorrect argument for push command\n");
-                    return -1;
-                }
-                ++_params_count;
-            } else
-            {
-                printf("Incorrect argument for push command\n");
-                return -1;
-            }
-            break;
-        case POP:
-            if (fscanf(input, "%d", &param) == 1)
-            {
-                fprintf(output, "pop ");
-                if (param == RAX)
-                    fprintf(output, "rax\n");
-                else if (param == RBX)
-                    fprintf(output, "rbx\n");
-                else if (param == RCX)
-                    fprintf(output, "rcx\n");
-                else if (param == RDX)
-                    fprintf(output, "rdx\n");
-                else
-                {
-                    printf("Incorrect argument for pop command\n");
-                    return -1;
-                }
-                ++_params_count;
-            } else
-            {
-                printf("Incorrect argument for pop command\n");
-                return -1;
-            }
-            break;
-        case JA:
-            WRITE_CMD_WITH_IARG("ja");
-            break;
-        case JAE:
-            WRITE_CMD_WITH_IARG("jae");
-            break;
-        case JB:
-            WRITE_CMD_WITH_IARG("jb");
-            break;
-        case JBE:
-            WRITE_CMD_WITH_IARG("jbe");
-            break;
-        case JE:
-            WRITE_CMD_WITH_IARG("je");
-            break;
-        case JNE:
-            WRITE_CMD_WITH_IARG("jne");
-            break;
-        case JMP:
-            WRITE_CMD_WITH_IARG("jmp");
-            break;
-        case CALL:
-            WRITE_CMD_WITH_IARG("call");
-            break;
-        case RET:
-            fprintf(output, "ret\n");
-            break;
-        case ADD:
-            fprintf(output, "add\n");
-            break;
-        case SUB:
-            fprintf(output, "sub\n");
-            break;
-        case MUL:
-            fprintf(output, "mul\n");
-            break;
-        case DIV:
-            fprintf(output, "div\n");
-            break;
-        case POW:
-            fprintf(output, "pow\n");
-            break;
-        case DUP:
-            fprintf(output, "dup\n");
-            break;
-        case IN:
-            fprintf(output, "in\n");
-            break;
-        case OUT:
-            fprintf(output, "out\n");
-            break;
-        case NOP:
-            fprintf(output, "nop\n");
-            break;
-        case END:
-            fprintf(output, "end\n");
-            break;
-        default:
-            break;
+            CPU_word_t target = commands[j].parameter;
+            if ((CPU_command_operands(commands[j].command) & OPERAND_TARGET) && (target >= 0) &&
+                (target < commands_cnt) && (target == (int) target) && program->starts[(int) target])
+                set_target(program, target);
         }
-        ++_commands_count;
     }
-    if ((commands_count == _commands_count) && (params_count == _params_count))
-        return 0;
+    for (int i = 0; i < program->debug.symbols_cnt; ++i)
+    {
+        const CPU_symbol_t* symbol = &program->debug.symbols[i];
+        if ((symbol->index >= 0) && (symbol->index < commands_cnt) && program->starts[symbol->index] &&
+            !program->names[symbol->index])
+            program->names[symbol->index] = symbol->name;
+    }
+
+    return 0;
+}
+
+// text growing in large blocks, so that output costs one write per block
+typedef struct
+{
+    char* data;
+    size_t size;
+    size_t capacity;
+} Text;
+
+static char* text_reserve(Text* text, size_t length)
+{
+    if (text->size + length > text->capacity)
+    {
+        size_t capacity = text->capacity ? 2 * text->capacity : 1 << 16;
+        while (capacity < text->size + length)
+            capacity *= 2;
+        text->data = (char*) realloc(text->data, capacity);
+        text->capacity = capacity;
+    }
+    return text->data + text->size;
+}
+
+static void text_add(Text* text, const char* str)
+{
+    size_t length = strlen(str);
+    memcpy(text_reserve(text, length), str, length);
+    text->size += length;
+}
+
+static void text_add_int(Text* text, int value)
+{
+    char digits[16] = {};
+    int length = 0;
+    unsigned magnitude = (value < 0) ? -(unsigned) value : (unsigned) value;
+    do
+    {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    char* out = text_reserve(text, length + 1);
+    if (value < 0)
+        *out++ = '-';
+    while (length)
+        *out++ = digits[--length];
+    text->size = out - text->data;
+}
+
+// immediates are written in the format of the program file, so they read back exactly as they were
+static void text_add_word(Text* text, CPU_word_t value)
+{
+    char* out = text_reserve(text, MAX_LINE);
+    text->size += snprintf(out, MAX_LINE, WORD_WRITE, value);
+}
+
+static void text_add_label(Text* text, const Program* program, int index)
+{
+    if (program->names[index])
+        text_add(text, program->names[index]);
     else
-        return -2;
+    {
+        text_add(text, LABEL_PREFIX);
+        text_add_int(text, index);
+    }
+}
+
+// jump target as a label when there is one at that command, as a number otherwise
+static void text_add_target(Text* text, const Program* program, CPU_word_t target)
+{
+    if ((target >= 0) && (target < program->commands_cnt) && (target == (int) target) &&
+        is_target(program, target))
+    {
+        text_add_label(text, program, target);
+        text_add(text, ":");
+    } else
+        text_add_word(text, target);
+}
+
+static void write_command(Text* text, const Program* program, int index)
+{
+    static const char* registers[] = {"rax", "rbx", "rcx", "rdx"};
+    const CPU_command_t* command = &program->commands[index];
+    int cmd = command->command;
+    int operands = CPU_command_operands(cmd);
+
+    text_add(text, CPU_command_name(cmd));
+    if ((cmd == PUSH_VAR) || (cmd == POP))
+    {
+        text_add(text, " ");
+        text_add(text, registers[(int) command->parameter]);
+    } else if (cmd == NATIVE)
+    {
+        text_add(text, " ");
+        text_add(text, program->natives[(int) command->parameter]);
+    } else if (cmd == SWITCH)
+    {
+        // switch reg, base, case targets..., default target
+        int cases_cnt = command->parameter;
+        text_add(text, " ");
+        text_add(text, registers[(int) command->reg]);
+        text_add(text, ", ");
+        text_add_word(text, command[1].parameter);
+        for (int i = 1; i <= cases_cnt + 1; ++i)
+        {
+            text_add(text, ", ");
+            text_add_target(text, program, command[2 + ((i <= cases_cnt) ? i : 0)].parameter);
+        }
+    } else
+    {
+        const char* separator = " ";
+        if (operands & OPERAND_REG)
+        {
+            text_add(text, separator);
+            text_add(text, registers[(int) command->reg]);
+            separator = ", ";
+        }
+        if (operands & OPERAND_REG2)
+        {
+            text_add(text, separator);
+            text_add(text, registers[(int) command->reg2]);
+            separator = ", ";
+        }
+        // the immediate of the compare jumps is in the EXT slot and comes before the target
+        if (CPU_command_length(command) == 2)
+        {
+            text_add(text, separator);
+            text_add_word(text, command[1].parameter);
+            separator = ", ";
+        }
+        if (operands & OPERAND_PARAM)
+        {
+            text_add(text, separator);
+            if (operands & OPERAND_TARGET)
+                text_add_target(text, program, command->parameter);
+            else
+                text_add_word(text, command->parameter);
+        }
+    }
+    text_add(text, "\n");
+}
+
+// writes the labels at index: every name of the debug section and the made up one of an unnamed target
+static void write_labels(Text* text, const Program* program, int index, int* symbol)
+{
+    const CPU_debug_t* debug = &program->debug;
+    while ((*symbol < debug->symbols_cnt) && (debug->symbols[*symbol].index <= index))
+    {
+        if (debug->symbols[*symbol].index == index)
+        {
+            text_add(text, debug->symbols[*symbol].name);
+            text_add(text, ":\n");
+        }
+        ++*symbol;
+    }
+    if (!program->names[index] && is_target(program, index))
+    {
+        text_add_label(text, program, index);
+        text_add(text, ":\n");
+    }
+}
+
+typedef struct
+{
+    const Program* program;
+    int begin;              // first slot, a command start
+    int end;
+    Text text;
+} Chunk;
+
+static int compare_symbols(const void* a, const void* b)
+{
+    return ((const CPU_symbol_t*) a)->index - ((const CPU_symbol_t*) b)->index;
+}
+
+static void* write_chunk(void* argument)
+{
+    Chunk* chunk = (Chunk*) argument;
+    const Program* program = chunk->program;
+    const CPU_debug_t* debug = &program->debug;
+
+    // first symbol of the chunk, symbols are sorted by index
+    int symbol = 0;
+    for (int low = 0, high = debug->symbols_cnt; low < high;)
+    {
+        int middle = (low + high) / 2;
+        if (debug->symbols[middle].index < chunk->begin)
+            low = symbol = middle + 1;
+        else
+            high = middle;
+    }
+    for (int i = chunk->begin; i < chunk->end; i += CPU_command_length(&program->commands[i]))
+    {
+        write_labels(&chunk->text, program, i, &symbol);
+        write_command(&chunk->text, program, i);
+    }
+
+    return 0;
+}
+
+/*
+ * Formats the commands into text and writes it in large blocks. Big
+ * programs are split into chunks at command starts, formatted by a thread
+ * each and written in their order. Returns 0 or -1 if writing failed.
+ */
+int write_disassembled(const Program* program, FILE* output)
+{
+    assert(program);
+    assert(output);
+
+    qsort(program->debug.symbols, program->debug.symbols_cnt, sizeof(*program->debug.symbols), compare_symbols);
+
+    int commands_cnt = program->commands_cnt;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int chunks_cnt = (commands_cnt < PARALLEL_MIN_COMMANDS) || (cores < 2) ? 1 :
+                     (cores > MAX_THREADS) ? MAX_THREADS : cores;
+    Chunk chunks[MAX_THREADS] = {};
+    int begin = 0;
+    for (int c = 0; c < chunks_cnt; ++c)
+    {
+        int end = (c == chunks_cnt - 1) ? commands_cnt : (int) ((long long) commands_cnt * (c + 1) / chunks_cnt);
+        while ((end < commands_cnt) && !program->starts[end])
+            ++end;
+        if (end < begin)
+            end = begin;
+        chunks[c] = (Chunk) {program, begin, end, {}};
+        begin = end;
+    }
+
+    pthread_t threads[MAX_THREADS] = {};
+    for (int c = 1; c < chunks_cnt; ++c)
+        if (pthread_create(&threads[c], 0, write_chunk, &chunks[c]) != 0)
+            write_chunk(&chunks[c]);
+    write_chunk(&chunks[0]);
+
+    int result = 0;
+    for (int c = 0; c < chunks_cnt; ++c)
+    {
+        if (threads[c])
+            pthread_join(threads[c], 0);
+        if (fwrite(chunks[c].text.data, 1, chunks[c].text.size, output) != chunks[c].text.size)
+            result = -1;
+        free(chunks[c].text.data);
+    }
+
+    return result;
 }
@@ -0,0 +1,502 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../processor/commands.h"
+
+#define DEFAULT_OUTPUT "code.out"
+#define DEFAULT_ASSEMBLER "assembler"
+#define ASSEMBLER_ENV "CPU_ASSEMBLER"
+#define OBJECT_SUFFIX ".o"
+
+#define MAX_LABELNAME 64
+#define LABELNAME_FORMAT "%63s"     // MAX_LABELNAME - 1 characters
+
+#define MY_NAME "GavYur"
+#define VERSION "0.1"
+#define PRINT_VER(program) printf(program " v" VERSION " (%s %s) by " MY_NAME "\n", __DATE__, __TIME__)
+
+typedef struct
+{
+    char* name;
+    int index;
+} Symbol;
+
+typedef struct
+{
+    const char* filename;
+    int commands_cnt;
+    int params_cnt;
+    int exports_cnt;
+    int imports_cnt;
+    Symbol* exports;
+    Symbol* imports;
+    CPU_command_t* commands;
+    int base;
+} Module;
+
+// open addressing hash table of exported symbols, slots point into Module::exports
+typedef struct
+{
+    int size;
+    Symbol** slots;
+} Symtab;
+
+int print_help();
+int print_version();
+int build_modules(char** sources, char** objects, int sources_cnt, int jobs);
+int is_outdated(const char* source, const char* object);
+int run_assembler(const char* source, const char* object);
+int link_modules(char** objects, int objects_cnt, const char* outputfile);
+int module_read(Module* This, const char* filename);
+int module_dtor(Module* This);
+int symtab_ctor(Symtab* This, int symbols_cnt);
+int symtab_dtor(Symtab* This);
+int symtab_insert(Symtab* This, Symbol* symbol);
+Symbol* symtab_find(Symtab* This, const char* name);
+int find_native(const char** natives, int* natives_cnt, const char* name);
+int write_linked(const char* filename, const Module* modules, int modules_cnt, const char** natives, int natives_cnt);
+
+int main(int argc, char* argv[])
+{
+    const char* outputname = DEFAULT_OUTPUT;
+    int build = 0;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int i = 1;
+    for (; (i < argc) && (argv[i][0] == '-'); ++i)
+    {
+        if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            return print_help();
+        else if (!strcmp(argv[i], "--version") || !strcmp(argv[i], "-v"))
+            return print_version();
+        else if (!strcmp(argv[i], "--build") || !strcmp(argv[i], "-b"))
+            build = 1;
+        else if (!strcmp(argv[i], "-o") && (i + 1 < argc))
+            outputname = argv[++i];
+        else if (!strcmp(argv[i], "-j") && (i + 1 < argc))
+            jobs = atoi(argv[++i]);
+        else
+            return print_help();
+    }
+    if (i == argc)
+        return print_help();
+    if (jobs < 1)
+        jobs = 1;
+
+    int inputs_cnt = argc - i;
+    char** inputs = argv + i;
+    if (!build)
+        return link_modules(inputs, inputs_cnt, outputname);
+
+    char** objects = (char**) calloc(inputs_cnt, sizeof(*objects));
+    for (int j = 0; j < inputs_cnt; ++j)
+    {
+        objects[j] = (char*) calloc(strlen(inputs[j]) + strlen(OBJECT_SUFFIX) + 1, sizeof(*objects[j]));
+        strcat(objects[j], inputs[j]);
+        strcat(objects[j], OBJECT_SUFFIX);
+    }
+
+    int result = build_modules(inputs, objects, inputs_cnt, jobs);
+    if (result == 0)
+        result = link_modules(objects, inputs_cnt, outputname);
+
+    for (int j = 0; j < inputs_cnt; ++j)
+        free(objects[j]);
+    free(objects);
+
+    return result;
+}
+
+int print_help()
+{
+    PRINT_VER("Linker");
+    printf("\nusage: linker [options] object_file...\n"
+           "       linker --build [options] source_file...\n\n"
+           "Options:\n"
+           "  -h, --help\t\tprints this message\n"
+           "  -v, --version\t\tprints version of this program\n"
+           "  -o output_file\twrites linked program to output_file instead of \"%s\"\n"
+           "  -b, --build\t\ttreats inputs as sources: reassembles every source newer than\n"
+           "\t\t\tsource_file + \"" OBJECT_SUFFIX "\" and links the objects\n"
+           "  -j jobs\t\tnumber of assemblers run in parallel by --build (default: number of cores)\n\n"
+           "The first module is the entry point. Assembler is taken from $" ASSEMBLER_ENV ",\n"
+           "\"" DEFAULT_ASSEMBLER "\" from PATH otherwise.\n"
+           "Calls of names no module exports become calls of native functions of the processor.\n",
+           DEFAULT_OUTPUT);
+
+    return 0;
+}
+
+int print_version()
+{
+    PRINT_VER("Linker");
+
+    return 0;
+}
+
+int is_outdated(const char* source, const char* object)
+{
+    assert(source);
+    assert(object);
+
+    struct stat src_stat = {};
+    struct stat obj_stat = {};
+    if (stat(object, &obj_stat) != 0)
+        return 1;
+    if (stat(source, &src_stat) != 0)
+        return 1;
+    if (src_stat.st_mtim.tv_sec != obj_stat.st_mtim.tv_sec)
+        return src_stat.st_mtim.tv_sec > obj_stat.st_mtim.tv_sec;
+    return src_stat.st_mtim.tv_nsec > obj_stat.st_mtim.tv_nsec;
+}
+
+int run_assembler(const char* source, const char* object)
+{
+    assert(source);
+    assert(object);
+
+    // the child gets a copy of the output not written yet
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        const char* assembler = getenv(ASSEMBLER_ENV);
+        if (!assembler)
+            assembler = DEFAULT_ASSEMBLER;
+        execlp(assembler, assembler, "-c", source, object, (char*) 0);
+        // _exit() does not flush stdout
+        printf("Error running assembler ");
+        fflush(stdout);
+        perror(assembler);
+        _exit(127);
+    }
+    return pid;
+}
+
+int build_modules(char** sources, char** objects, int sources_cnt, int jobs)
+{
+    assert(sources);
+    assert(objects);
+
+    int running = 0;
+    int failed = 0;
+    for (int i = 0; (i < sources_cnt) || (running > 0);)
+    {
+        if ((i < sources_cnt) && (running < jobs) && !failed)
+        {
+            if (is_outdated(sources[i], objects[i]))
+            {
+                if (run_assembler(sources[i], objects[i]) < 0)
+                {
+                    perror("fork");
+                    failed = 1;
+                } else
+                    ++running;
+            }
+            ++i;
+            continue;
+        }
+        if (running == 0)
+            break;
+
+        int status = 0;
+        if (wait(&status) < 0)
+            break;
+        --running;
+        if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+            failed = 1;
+    }
+
+    if (failed)
+    {
+        printf("Build failed\n");
+        return 5;
+    }
+    return 0;
+}
+
+int module_read(Module* This, const char* filename)
+{
+    assert(This);
+    assert(filename);
+
+    FILE* stream = fopen(filename, "rb");
+    if (!stream)
+    {
+        printf("Error opening file ");
+        perror(filename);
+        return 1;
+    }
+
+    This->filename = filename;
+    char magic[4] = {};
+    int word = CPU_word_read(stream);
+    if (word > 0)
+    {
+        fclose(stream);
+        return 2;
+    }
+    if ((word < 0) || (fscanf(stream, "%3s %d %d %d %d", magic, &This->commands_cnt, &This->params_cnt,
+                &This->exports_cnt, &This->imports_cnt) != 5) ||
+        strcmp(magic, "obj") || (This->commands_cnt <= 0) || (This->exports_cnt < 0) || (This->imports_cnt < 0))
+    {
+        printf("%s is not an object file\n", filename);
+        fclose(stream);
+        return 2;
+    }
+
+    This->exports = (Symbol*) calloc(This->exports_cnt, sizeof(*This->exports));
+    This->imports = (Symbol*) calloc(This->imports_cnt, sizeof(*This->imports));
+    This->commands = (CPU_command_t*) calloc(This->commands_cnt, sizeof(*This->commands));
+
+    char name[MAX_LABELNAME] = {};
+    for (int i = 0; i < This->exports_cnt + This->imports_cnt; ++i)
+    {
+        Symbol* symbol = (i < This->exports_cnt) ? &This->exports[i] : &This->imports[i - This->exports_cnt];
+        if (fscanf(stream, LABELNAME_FORMAT " %d", name, &symbol->index) != 2)
+        {
+            printf("Object file %s corrupt\n", filename);
+            fclose(stream);
+            return 2;
+        }
+        name[MAX_LABELNAME - 1] = '\0';
+        symbol->name = strdup(name);
+    }
+
+    for (int i = 0; i < This->commands_cnt; ++i)
+        if (CPU_command_read(&This->commands[i], stream) != 0)
+        {
+            printf("Object file %s corrupt\n", filename);
+            fclose(stream);
+            return 2;
+        }
+
+    fclose(stream);
+    return 0;
+}
+
+int module_dtor(Module* This)
+{
+    assert(This);
+
+    for (int i = 0; This->exports && (i < This->exports_cnt); ++i)
+        free(This->exports[i].name);
+    for (int i = 0; This->imports && (i < This->imports_cnt); ++i)
+        free(This->imports[i].name);
+    free(This->exports);
+    free(This->imports);
+    free(This->commands);
+    This->exports = 0;
+    This->imports = 0;
+    This->commands = 0;
+
+    return 0;
+}
+
+static unsigned symtab_hash(const char* name)
+{
+    unsigned hash = 2166136261u;
+    for (; *name; ++name)
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    return hash;
+}
+
+int symtab_ctor(Symtab* This, int symbols_cnt)
+{
+    assert(This);
+
+    This->size = 16;
+    while (This->size < 2 * symbols_cnt)
+        This->size *= 2;
+    This->slots = (Symbol**) calloc(This->size, sizeof(*This->slots));
+
+    return 0;
+}
+
+int symtab_dtor(Symtab* This)
+{
+    assert(This);
+
+    free(This->slots);
+    This->slots = 0;
+    This->size = 0;
+
+    return 0;
+}
+
+int symtab_insert(Symtab* This, Symbol* symbol)
+{
+    assert(This);
+    assert(symbol);
+
+    unsigned mask = This->size - 1;
+    for (unsigned i = symtab_hash(symbol->name) & mask; ; i = (i + 1) & mask)
+    {
+        if (!This->slots[i])
+        {
+            This->slots[i] = symbol;
+            return 0;
+        }
+        if (!strcmp(This->slots[i]->name, symbol->name))
+            return -1;
+    }
+}
+
+Symbol* symtab_find(Symtab* This, const char* name)
+{
+    assert(This);
+    assert(name);
+
+    unsigned mask = This->size - 1;
+    for (unsigned i = symtab_hash(name) & mask; This->slots[i]; i = (i + 1) & mask)
+        if (!strcmp(This->slots[i]->name, name))
+            return This->slots[i];
+    return 0;
+}
+
+int link_modules(char** objects, int objects_cnt, const char* outputfile)
+{
+    assert(objects);
+    assert(outputfile);
+
+    Module* modules = (Module*) calloc(objects_cnt, sizeof(*modules));
+    Symtab symtab = {};
+    const char* natives[COMMANDS_MAX_NATIVES] = {};
+    int natives_cnt = 0;
+    int result = 0;
+    int exports_cnt = 0;
+    int base = 0;
+
+    for (int i = 0; i < objects_cnt; ++i)
+    {
+        if (module_read(&modules[i], objects[i]) != 0)
+        {
+            result = 2;
+            goto cleanup;
+        }
+        modules[i].base = base;
+        base += modules[i].commands_cnt;
+        exports_cnt += modules[i].exports_cnt;
+    }
+
+    symtab_ctor(&symtab, exports_cnt);
+    for (int i = 0; i < objects_cnt; ++i)
+        for (int j = 0; j < modules[i].exports_cnt; ++j)
+        {
+            Symbol* symbol = &modules[i].exports[j];
+            symbol->index += modules[i].base;
+            if (symtab_insert(&symtab, symbol) != 0)
+            {
+                printf("Duplicate label %s in %s\n", symbol->name, modules[i].filename);
+                result = 3;
+            }
+        }
+    if (result != 0)
+        goto cleanup;
+
+    for (int i = 0; i < objects_cnt; ++i)
+    {
+        Module* module = &modules[i];
+        for (int j = 0; j < module->commands_cnt; ++j)
+            if ((CPU_command_operands(module->commands[j].command) & OPERAND_TARGET) &&
+                (module->commands[j].parameter >= 0))
+                module->commands[j].parameter += module->base;
+        for (int j = 0; j < module->imports_cnt; ++j)
+        {
+            Symbol* symbol = symtab_find(&symtab, module->imports[j].name);
+            int index = module->imports[j].index;
+            if ((index < 0) || (index >= module->commands_cnt))
+            {
+                printf("Object file %s corrupt\n", module->filename);
+                result = 2;
+            } else if (symbol)
+                module->commands[index].parameter = symbol->index;
+            else if (module->commands[index].command == CALL)
+            {
+                // no module exports the name, it is left to the processor as a native function
+                int native = find_native(natives, &natives_cnt, module->imports[j].name);
+                if (native < 0)
+                {
+                    printf("Too many native functions in %s\n", module->filename);
+                    result = 3;
+                } else
+                    CPU_command_ctor(&module->commands[index], NATIVE, native);
+            } else
+            {
+                printf("Unknown label found: %s in %s\n", module->imports[j].name, module->filename);
+                result = 3;
+            }
+        }
+    }
+    if (result != 0)
+        goto cleanup;
+
+    if (write_linked(outputfile, modules, objects_cnt, natives, natives_cnt) != 0)
+    {
+        printf("Error writing linked code to ");
+        perror(outputfile);
+        result = 4;
+        goto cleanup;
+    }
+
+    printf("Linked code has successfully written to %s!\n", outputfile);
+
+cleanup:
+    symtab_dtor(&symtab);
+    for (int i = 0; i < objects_cnt; ++i)
+        module_dtor(&modules[i]);
+    free(modules);
+
+    return result;
+}
+
+// index of the name in the natives table, added there if needed; -1 if the table is full
+int find_native(const char** natives, int* natives_cnt, const char* name)
+{
+    assert(natives);
+    assert(name);
+
+    for (int i = 0; i < *natives_cnt; ++i)
+        if (!strcmp(natives[i], name))
+            return i;
+    if ((*natives_cnt == COMMANDS_MAX_NATIVES) || (strlen(name) >= MAX_NATIVE_NAME))
+        return -1;
+    natives[*natives_cnt] = name;
+    return (*natives_cnt)++;
+}
+
+int write_linked(const char* filename, const Module* modules, int modules_cnt, const char** natives, int natives_cnt)
+{
+    assert(filename);
+    assert(modules);
+
+    FILE* stream = fopen(filename, "wb");
+    if (!stream)
+        return 1;
+
+    int commands_cnt = 0;
+    int params_cnt = 0;
+    for (int i = 0; i < modules_cnt; ++i)
+    {
+        commands_cnt += modules[i].commands_cnt;
+        params_cnt += modules[i].params_cnt;
+    }
+
+    CPU_word_write(stream);
+    CPU_natives_write(stream, natives, natives_cnt);
+    fprintf(stream, "%d ", commands_cnt);
+    fprintf(stream, "%d ", params_cnt);
+    for (int i = 0; i < modules_cnt; ++i)
+        for (int j = 0; j < modules[i].commands_cnt; ++j)
+            CPU_command_write(&modules[i].commands[j], stream);
+    fprintf(stream, "\n");
+
+    fclose(stream);
+
+    return 0;
+}
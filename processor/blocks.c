@@ -0,0 +1,761 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "blocks.h"
+#include "commands.h"
+#include "processor.h"
+#include "myassert.h"
+#include "stack.h"
+#include "natives.h"
+#include "symbols.h"
+
+/*
+ * Handlers of straight-line commands, returning -1 if the command fails.
+ * Stack bounds for the whole block are checked once at its entry, so they
+ * work on the stack data directly.
+ */
+
+#define TOP(This) This->cstack->data[This->cstack->count - 1]
+#define PUSH_RAW(This, value) This->cstack->data[This->cstack->count++] = (value)
+#define POP_RAW(This) This->cstack->data[--This->cstack->count]
+#define REG(This, reg) (This)->registers[(int) (reg)]
+
+static int op_push(CPU_t* This, const Block_op_t* op)
+{
+    PUSH_RAW(This, op->parameter);
+    return 0;
+}
+
+static int op_push_rax(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    PUSH_RAW(This, This->rax);
+    return 0;
+}
+
+static int op_push_rbx(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    PUSH_RAW(This, This->rbx);
+    return 0;
+}
+
+static int op_push_rcx(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    PUSH_RAW(This, This->rcx);
+    return 0;
+}
+
+static int op_push_rdx(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    PUSH_RAW(This, This->rdx);
+    return 0;
+}
+
+static int op_pop_rax(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    This->rax = POP_RAW(This);
+    return 0;
+}
+
+static int op_pop_rbx(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    This->rbx = POP_RAW(This);
+    return 0;
+}
+
+static int op_pop_rcx(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    This->rcx = POP_RAW(This);
+    return 0;
+}
+
+static int op_pop_rdx(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    This->rdx = POP_RAW(This);
+    return 0;
+}
+
+static int op_add(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    CPU_word_t a = POP_RAW(This);
+    TOP(This) = word_add(a, TOP(This));
+    return 0;
+}
+
+static int op_sub(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    CPU_word_t a = POP_RAW(This);
+    TOP(This) = word_sub(a, TOP(This));
+    return 0;
+}
+
+static int op_mul(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    CPU_word_t a = POP_RAW(This);
+    TOP(This) = word_mul(a, TOP(This));
+    return 0;
+}
+
+static int op_div(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    CPU_word_t a = POP_RAW(This);
+    TOP(This) = word_div(a, TOP(This));
+    return 0;
+}
+
+static int op_pow(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    CPU_word_t a = POP_RAW(This);
+    TOP(This) = word_pow(a, TOP(This));
+    return 0;
+}
+
+static int op_dup(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    CPU_word_t a = TOP(This);
+    PUSH_RAW(This, a);
+    return 0;
+}
+
+static int op_in(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    CPU_in(This);
+    return 0;
+}
+
+static int op_out(CPU_t* This, const Block_op_t* op)
+{
+    (void) op;
+    CPU_out(This);
+    return 0;
+}
+
+static int op_mov_rr(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = REG(This, op->reg2);
+    return 0;
+}
+
+static int op_mov_ri(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = op->parameter;
+    return 0;
+}
+
+static int op_add_rr(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_add(REG(This, op->reg), REG(This, op->reg2));
+    return 0;
+}
+
+static int op_add_ri(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_add(REG(This, op->reg), op->parameter);
+    return 0;
+}
+
+static int op_sub_rr(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_sub(REG(This, op->reg), REG(This, op->reg2));
+    return 0;
+}
+
+static int op_sub_ri(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_sub(REG(This, op->reg), op->parameter);
+    return 0;
+}
+
+static int op_mul_rr(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_mul(REG(This, op->reg), REG(This, op->reg2));
+    return 0;
+}
+
+static int op_mul_ri(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_mul(REG(This, op->reg), op->parameter);
+    return 0;
+}
+
+static int op_div_rr(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_div(REG(This, op->reg), REG(This, op->reg2));
+    return 0;
+}
+
+static int op_div_ri(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_div(REG(This, op->reg), op->parameter);
+    return 0;
+}
+
+static int op_inc(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_add(REG(This, op->reg), 1);
+    return 0;
+}
+
+static int op_dec(CPU_t* This, const Block_op_t* op)
+{
+    REG(This, op->reg) = word_sub(REG(This, op->reg), 1);
+    return 0;
+}
+
+static int op_load_local(CPU_t* This, const Block_op_t* op)
+{
+    if (!((op->parameter >= 0) && (op->parameter < This->frames->count - This->frame)))
+    {
+        printf("Local slot " WORD_PRINT " is out of the frame\n", op->parameter);
+        return -1;
+    }
+    int index = This->frame + (int) op->parameter;
+    PUSH_RAW(This, This->frames->data[index]);
+    return 0;
+}
+
+static int op_store_local(CPU_t* This, const Block_op_t* op)
+{
+    if (!((op->parameter >= 0) && (op->parameter < This->frames->count - This->frame)))
+    {
+        printf("Local slot " WORD_PRINT " is out of the frame\n", op->parameter);
+        return -1;
+    }
+    int index = This->frame + (int) op->parameter;
+    This->frames->data[index] = POP_RAW(This);
+    return 0;
+}
+
+static int op_load(CPU_t* This, CPU_word_t address)
+{
+    if (CPU_memory_check(This, address, 1) != 0)
+        return -1;
+    PUSH_RAW(This, This->memory[(int) address]);
+    return 0;
+}
+
+static int op_store(CPU_t* This, CPU_word_t address)
+{
+    if (CPU_memory_check(This, address, 1) != 0)
+        return -1;
+    This->memory[(int) address] = POP_RAW(This);
+    return 0;
+}
+
+static int op_load_r(CPU_t* This, const Block_op_t* op)
+{
+    return op_load(This, REG(This, op->reg));
+}
+
+static int op_load_i(CPU_t* This, const Block_op_t* op)
+{
+    return op_load(This, op->parameter);
+}
+
+static int op_store_r(CPU_t* This, const Block_op_t* op)
+{
+    return op_store(This, REG(This, op->reg));
+}
+
+static int op_store_i(CPU_t* This, const Block_op_t* op)
+{
+    return op_store(This, op->parameter);
+}
+
+static int op_native(CPU_t* This, const Block_op_t* op)
+{
+    return CPU_native(This, op->parameter);
+}
+
+static Block_handler_t push_var_handlers[] = {op_push_rax, op_push_rbx, op_push_rcx, op_push_rdx};
+static Block_handler_t pop_handlers[] = {op_pop_rax, op_pop_rbx, op_pop_rcx, op_pop_rdx};
+
+// returns handler of a straight-line command, 0 if the command has to end a block
+static Block_handler_t straight_handler(const CPU_command_t* command)
+{
+    // the parameter is cast only once it is known to be a register
+    int reg = ((command->parameter >= RAX) && (command->parameter <= RDX)) ? (int) command->parameter : -1;
+    switch (command->command)
+    {
+    case PUSH:
+        return op_push;
+    case PUSH_VAR:
+        return ((reg >= 0) && (reg == command->parameter)) ? push_var_handlers[reg] : 0;
+    case POP:
+        return ((reg >= 0) && (reg == command->parameter)) ? pop_handlers[reg] : 0;
+    case ADD:
+        return op_add;
+    case SUB:
+        return op_sub;
+    case MUL:
+        return op_mul;
+    case DIV:
+        return op_div;
+    case POW:
+        return op_pow;
+    case DUP:
+        return op_dup;
+    case IN:
+        return op_in;
+    case OUT:
+        return op_out;
+    case MOV_RR:
+        return op_mov_rr;
+    case MOV_RI:
+        return op_mov_ri;
+    case ADD_RR:
+        return op_add_rr;
+    case ADD_RI:
+        return op_add_ri;
+    case SUB_RR:
+        return op_sub_rr;
+    case SUB_RI:
+        return op_sub_ri;
+    case MUL_RR:
+        return op_mul_rr;
+    case MUL_RI:
+        return op_mul_ri;
+    case DIV_RR:
+        return op_div_rr;
+    case DIV_RI:
+        return op_div_ri;
+    case INC:
+        return op_inc;
+    case DEC:
+        return op_dec;
+    case LOAD_LOCAL:
+        return op_load_local;
+    case STORE_LOCAL:
+        return op_store_local;
+    case LOAD_R:
+        return op_load_r;
+    case LOAD_I:
+        return op_load_i;
+    case STORE_R:
+        return op_store_r;
+    case STORE_I:
+        return op_store_i;
+    case NATIVE:
+        return op_native;
+    default:
+        return 0;
+    }
+}
+
+// stack values popped and pushed by a command handled by the block engine itself
+static void stack_effect(const CPU_command_t* command, int* pops, int* pushes)
+{
+    *pops = 0;
+    *pushes = 0;
+    switch (command->command)
+    {
+    case PUSH:
+    case PUSH_VAR:
+    case IN:
+    case LOAD_LOCAL:
+    case LOAD_R:
+    case LOAD_I:
+        *pushes = 1;
+        break;
+    case POP:
+    case OUT:
+    case STORE_LOCAL:
+    case STORE_R:
+    case STORE_I:
+        *pops = 1;
+        break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case POW:
+        *pops = 2;
+        *pushes = 1;
+        break;
+    case DUP:
+        *pops = 1;
+        *pushes = 2;
+        break;
+    case JA:
+    case JAE:
+    case JB:
+    case JBE:
+    case JE:
+    case JNE:
+        *pops = 2;
+        break;
+    case NATIVE:
+    {
+        const Native_t* native = Natives_get(command->parameter);
+        *pops = native->arity;
+        *pushes = native->results;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+int Blocks_find_leaders(const CPU_command_t* commands, int commands_cnt, char* leaders)
+{
+    assert(commands);
+    assert(leaders);
+
+    for (int i = 0; i < commands_cnt; ++i)
+        leaders[i] = 0;
+    if (commands_cnt > 0)
+        leaders[0] = 1;
+
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+    {
+        const CPU_command_t* command = &commands[i];
+        if ((command->command == NOP) || straight_handler(command))
+            continue;
+        int length = CPU_command_length(command);
+        if (i + length < commands_cnt)
+            leaders[i + length] = 1;
+        // targets of a jump table are in its CASE commands
+        for (int j = i; j < i + length; ++j)
+        {
+            int target = commands[j].parameter;
+            if ((CPU_command_operands(commands[j].command) & OPERAND_TARGET) && (target >= 0) && (target < commands_cnt))
+                leaders[target] = 1;
+        }
+    }
+    // operands of a command cannot start a block, jumps there are left to CPU_step()
+    for (int i = 0; i < commands_cnt; ++i)
+        if ((commands[i].command == EXT) || (commands[i].command == CASE))
+            leaders[i] = 0;
+
+    return 0;
+}
+
+int Blocks_ctor(Blocks_t* This, const CPU_command_t* commands, int commands_cnt)
+{
+    assert(This);
+    assert(commands);
+    assert(commands_cnt > 0);
+
+    This->commands = commands;
+    This->commands_cnt = commands_cnt;
+    This->by_index = (Block_t**) calloc(commands_cnt, sizeof(*This->by_index));
+    This->ops = (Block_op_t*) calloc(commands_cnt, sizeof(*This->ops));
+
+    char* leaders = (char*) calloc(commands_cnt, sizeof(*leaders));
+    Blocks_find_leaders(commands, commands_cnt, leaders);
+    This->blocks_cnt = 0;
+    for (int i = 0; i < commands_cnt; ++i)
+        This->blocks_cnt += leaders[i];
+    This->blocks = (Block_t*) calloc(This->blocks_cnt, sizeof(*This->blocks));
+
+    int ops_cnt = 0;
+    int block_index = 0;
+    for (int i = 0; i < commands_cnt; ++block_index)
+    {
+        Block_t* block = &This->blocks[block_index];
+        block->start = i;
+        block->exit = -1;
+        block->ops = &This->ops[ops_cnt];
+        This->by_index[i] = block;
+
+        int depth = 0;
+        do
+        {
+            const CPU_command_t* command = &commands[i];
+            Block_handler_t handler = straight_handler(command);
+            if (!handler && (command->command != NOP))
+                block->exit = i;
+
+            int pops = 0;
+            int pushes = 0;
+            stack_effect(command, &pops, &pushes);
+            depth -= pops;
+            if (-depth > block->need)
+                block->need = -depth;
+            depth += pushes;
+            if (depth > block->peak)
+                block->peak = depth;
+
+            if (handler)
+            {
+                block->ops[block->ops_cnt].handler = handler;
+                block->ops[block->ops_cnt].parameter = command->parameter;
+                block->ops[block->ops_cnt].reg = command->reg;
+                block->ops[block->ops_cnt].reg2 = command->reg2;
+                ++block->ops_cnt;
+            }
+            i += CPU_command_length(command);
+        } while ((block->exit < 0) && (i < commands_cnt) && !leaders[i]);
+
+        block->end = i;
+        ops_cnt += block->ops_cnt;
+    }
+    free(leaders);
+
+    for (int i = 0; i < This->blocks_cnt; ++i)
+    {
+        Block_t* block = &This->blocks[i];
+        if (block->end < commands_cnt)
+            block->next = This->by_index[block->end];
+        if (block->exit >= 0)
+        {
+            const CPU_command_t* command = &commands[block->exit];
+            int target = command->parameter;
+            if ((CPU_command_operands(command->command) & OPERAND_TARGET) && (target >= 0) && (target < commands_cnt))
+                block->taken = This->by_index[target];
+        }
+    }
+
+    ASSERT_OK(Blocks, This);
+
+    return 0;
+}
+
+int Blocks_dtor(Blocks_t* This)
+{
+    assert(This);
+
+    free(This->blocks);
+    free(This->by_index);
+    free(This->ops);
+    This->blocks = 0;
+    This->by_index = 0;
+    This->ops = 0;
+    This->blocks_cnt = -1;
+    This->commands_cnt = -1;
+    This->commands = 0;
+
+    return 0;
+}
+
+int Blocks_ok(Blocks_t* This)
+{
+    if (!This)
+        return 0;
+    if (!This->commands || !This->blocks || !This->by_index || !This->ops)
+        return 0;
+    if ((This->commands_cnt <= 0) || (This->blocks_cnt <= 0) || (This->blocks_cnt > This->commands_cnt))
+        return 0;
+    if (This->by_index[0] != &This->blocks[0])
+        return 0;
+    return 1;
+}
+
+int Blocks_dump(Blocks_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Blocks_t(%s)\n"
+           "{\n"
+           "    commands_cnt = %d\n"
+           "    blocks_cnt = %d\n"
+           "    blocks = \n"
+           "    {\n",
+           name, Blocks_ok(This) ? "ok" : "NOT OK!!!", This->commands_cnt, This->blocks_cnt);
+    if (This->blocks)
+        for (int i = 0; i < This->blocks_cnt; ++i)
+        {
+            Block_t* block = &This->blocks[i];
+            printf("        [%d] commands %d..%d, ops %d, exit %d, need %d, peak %d, taken %d, next %d\n",
+                   i, block->start, block->end - 1, block->ops_cnt, block->exit, block->need, block->peak,
+                   block->taken ? block->taken->start : -1, block->next ? block->next->start : -1);
+        }
+    else
+        printf("        NULL pointer here :(\n");
+    printf("    }\n"
+           "}\n");
+
+    return 0;
+}
+
+/*
+ * Finds the block to continue with at command index, interpreting commands
+ * that do not start one. *result gets a nonzero result of CPU_step().
+ */
+static Block_t* Blocks_enter(CPU_t* This, Blocks_t* blocks, int index, int* finished, int* result)
+{
+    while ((index >= 0) && (index < blocks->commands_cnt) && !blocks->by_index[index])
+    {
+        if (blocks->commands[index].command == END)
+        {
+            *finished = 1;
+            return 0;
+        }
+        if ((*result = CPU_step(This, blocks->commands, &index)) != 0)
+            return 0;
+    }
+    if ((index < 0) || (index >= blocks->commands_cnt))
+        return 0;
+    return blocks->by_index[index];
+}
+
+int CPU_run_blocks(CPU_t* This, Blocks_t* blocks)
+{
+    ASSERT_OK(CPU, This);
+    ASSERT_OK(Blocks, blocks);
+
+    Stack_t* stack = This->cstack;
+    int finished = 0;
+    int result = 0;
+    Block_t* block = Blocks_enter(This, blocks, This->start, &finished, &result);
+    while (block)
+    {
+        This->position = block->start;
+        if (stack->count < block->need)
+        {
+            printf("Stack underflow in block at %s\n", Symbols_where(block->start));
+            return -1;
+        }
+        if (stack->count + block->peak > stack->size)
+        {
+            printf("Stack overflow in block at %s\n", Symbols_where(block->start));
+            return -1;
+        }
+
+        for (int i = 0; i < block->ops_cnt; ++i)
+            if (block->ops[i].handler(This, &block->ops[i]) != 0)
+                return -1;
+
+        if (block->exit < 0)
+        {
+            if (!block->next)
+                printf("Program has no end command\n");
+            block = block->next;
+            continue;
+        }
+
+        const CPU_command_t* exit = &blocks->commands[block->exit];
+        Block_t* following = block->next;
+        CPU_word_t a = 0;
+        CPU_word_t b = 0;
+        switch (exit->command)
+        {
+        case JA:
+        case JAE:
+        case JB:
+        case JBE:
+        case JE:
+        case JNE:
+            a = POP_RAW(This);
+            b = POP_RAW(This);
+            if (((exit->command == JA) && (a > b)) ||
+                ((exit->command == JAE) && (a >= b)) ||
+                ((exit->command == JB) && (a < b)) ||
+                ((exit->command == JBE) && (a <= b)) ||
+                ((exit->command == JE) && (a == b)) ||
+                ((exit->command == JNE) && (a != b)))
+                following = block->taken;
+            break;
+        case JA_RR:
+        case JAE_RR:
+        case JB_RR:
+        case JBE_RR:
+        case JE_RR:
+        case JNE_RR:
+            a = REG(This, exit->reg);
+            b = REG(This, exit->reg2);
+            if (((exit->command == JA_RR) && (a > b)) ||
+                ((exit->command == JAE_RR) && (a >= b)) ||
+                ((exit->command == JB_RR) && (a < b)) ||
+                ((exit->command == JBE_RR) && (a <= b)) ||
+                ((exit->command == JE_RR) && (a == b)) ||
+                ((exit->command == JNE_RR) && (a != b)))
+                following = block->taken;
+            break;
+        case LOOP:
+            REG(This, exit->reg) = word_sub(REG(This, exit->reg), 1);
+            if (REG(This, exit->reg) != 0)
+                following = block->taken;
+            break;
+        case JA_RI:
+        case JAE_RI:
+        case JB_RI:
+        case JBE_RI:
+        case JE_RI:
+        case JNE_RI:
+            a = REG(This, exit->reg);
+            b = exit[1].parameter;
+            if (((exit->command == JA_RI) && (a > b)) ||
+                ((exit->command == JAE_RI) && (a >= b)) ||
+                ((exit->command == JB_RI) && (a < b)) ||
+                ((exit->command == JBE_RI) && (a <= b)) ||
+                ((exit->command == JE_RI) && (a == b)) ||
+                ((exit->command == JNE_RI) && (a != b)))
+                following = block->taken;
+            break;
+        case SWITCH:
+            following = Blocks_enter(This, blocks, CPU_switch_target(This, exit), &finished, &result);
+            break;
+        case JMP:
+            following = block->taken;
+            break;
+        case CALL:
+            if (This->call_stack->count >= This->call_stack->size)
+            {
+                printf("Call stack overflow at %s\n", Symbols_where(block->exit));
+                return -1;
+            }
+            This->call_stack->data[This->call_stack->count++] = block->end;
+            CPU_frame_push(This);
+            following = block->taken;
+            break;
+        case RET:
+        {
+            if (This->call_stack->count <= 0)
+            {
+                printf("Call stack underflow at %s\n", Symbols_where(block->exit));
+                return -1;
+            }
+            int address = This->call_stack->data[--This->call_stack->count];
+            CPU_frame_pop(This);
+            following = Blocks_enter(This, blocks, address, &finished, &result);
+            break;
+        }
+        case END:
+            return 0;
+        default:
+        {
+            int index = block->exit;
+            if ((result = CPU_step(This, blocks->commands, &index)) != 0)
+                return result;
+            following = Blocks_enter(This, blocks, index, &finished, &result);
+            break;
+        }
+        }
+        if (!following && !finished)
+        {
+            if (result != 0)
+                return result;
+            printf("Bad jump from command %s\n", Symbols_where(block->exit));
+            return -1;
+        }
+        // the watchdog is charged at backward jumps, calls and returns between blocks
+        if (This->watchdog && following)
+        {
+            int backward = following->start <= block->exit;
+            if ((backward || (exit->command == CALL) || (exit->command == RET)) &&
+                (CPU_checkpoint(This, block->exit, backward ? block->exit + 1 - following->start : 1) != 0))
+                return CPU_EXPIRED;
+        }
+        block = following;
+    }
+    if (result != 0)
+        return result;
+
+    return finished ? 0 : -1;
+}
@@ -0,0 +1,51 @@
+#ifndef BLOCKS_H_INCLUDED
+#define BLOCKS_H_INCLUDED
+
+#include "commands.h"
+#include "processor.h"
+
+typedef struct Block_op_t Block_op_t;
+
+typedef int (*Block_handler_t)(CPU_t* This, const Block_op_t* op);
+
+struct Block_op_t
+{
+    Block_handler_t handler;
+    CPU_word_t parameter;
+    char reg;
+    char reg2;
+};
+
+typedef struct Block_t Block_t;
+
+struct Block_t
+{
+    int start;          // index of the first command of the block
+    int end;            // index of the command following the block
+    int ops_cnt;        // straight-line commands, run through ops
+    Block_op_t* ops;
+    int exit;           // command transferring control out of the block or -1 for fall-through
+    int need;           // stack values the block consumes below its entry depth
+    int peak;           // maximal stack growth above the entry depth
+    Block_t* taken;     // successor when the exit jumps (or calls)
+    Block_t* next;      // successor when control falls through
+};
+
+typedef struct
+{
+    int commands_cnt;
+    const CPU_command_t* commands;
+    int blocks_cnt;
+    Block_t* blocks;
+    Block_t** by_index; // block starting at the command, 0 if it is not a leader
+    Block_op_t* ops;
+} Blocks_t;
+
+int Blocks_ctor(Blocks_t* This, const CPU_command_t* commands, int commands_cnt);
+int Blocks_dtor(Blocks_t* This);
+int Blocks_ok(Blocks_t* This);
+int Blocks_dump(Blocks_t* This, char* name);
+int Blocks_find_leaders(const CPU_command_t* commands, int commands_cnt, char* leaders);
+int CPU_run_blocks(CPU_t* This, Blocks_t* blocks);
+
+#endif // BLOCKS_H_INCLUDED
@@ -0,0 +1,110 @@
+#include <assert.h>
+#include <stdio.h>
+#include "channel.h"
+#include "myassert.h"
+
+int Channel_ctor(Channel_t* This)
+{
+    assert(This);
+
+    for (size_t i = 0; i < CHANNEL_CAPACITY; ++i)
+    {
+        atomic_init(&This->cells[i].sequence, i);
+        This->cells[i].value = 0;
+    }
+    atomic_init(&This->enqueue_position, 0);
+    atomic_init(&This->dequeue_position, 0);
+
+    ASSERT_OK(Channel, This);
+
+    return 0;
+}
+
+int Channel_dtor(Channel_t* This)
+{
+    assert(This);
+
+    atomic_store(&This->enqueue_position, 0);
+    atomic_store(&This->dequeue_position, 0);
+
+    return 0;
+}
+
+int Channel_ok(Channel_t* This)
+{
+    if (!This)
+        return 0;
+    size_t enqueue = atomic_load(&This->enqueue_position);
+    size_t dequeue = atomic_load(&This->dequeue_position);
+    // positions are read one after the other, so a racing receiver may be ahead by a little
+    if ((enqueue - dequeue > CHANNEL_CAPACITY) && (dequeue - enqueue > CHANNEL_CAPACITY))
+        return 0;
+    return 1;
+}
+
+int Channel_dump(Channel_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Channel_t(%s)\n"
+           "{\n"
+           "    enqueue_position = %zu\n"
+           "    dequeue_position = %zu\n"
+           "}\n",
+           name, Channel_ok(This) ? "ok" : "NOT OK!!!", atomic_load(&This->enqueue_position),
+           atomic_load(&This->dequeue_position));
+
+    return 0;
+}
+
+// returns 0 if the value was queued, -1 if the channel is full
+int Channel_send(Channel_t* This, CPU_word_t value)
+{
+    size_t position = atomic_load_explicit(&This->enqueue_position, memory_order_relaxed);
+    for (;;)
+    {
+        Channel_cell_t* cell = &This->cells[position & (CHANNEL_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        ptrdiff_t difference = (ptrdiff_t) sequence - (ptrdiff_t) position;
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&This->enqueue_position, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                cell->value = value;
+                atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+                return 0;
+            }
+        } else if (difference < 0)
+            return -1;
+        else
+            position = atomic_load_explicit(&This->enqueue_position, memory_order_relaxed);
+    }
+}
+
+// returns 0 if a value was taken, -1 if the channel is empty
+int Channel_recv(Channel_t* This, CPU_word_t* value)
+{
+    assert(value);
+
+    size_t position = atomic_load_explicit(&This->dequeue_position, memory_order_relaxed);
+    for (;;)
+    {
+        Channel_cell_t* cell = &This->cells[position & (CHANNEL_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        ptrdiff_t difference = (ptrdiff_t) sequence - (ptrdiff_t) (position + 1);
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&This->dequeue_position, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                *value = cell->value;
+                atomic_store_explicit(&cell->sequence, position + CHANNEL_CAPACITY, memory_order_release);
+                return 0;
+            }
+        } else if (difference < 0)
+            return -1;
+        else
+            position = atomic_load_explicit(&This->dequeue_position, memory_order_relaxed);
+    }
+}
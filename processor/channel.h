@@ -0,0 +1,37 @@
+#ifndef CHANNEL_H_INCLUDED
+#define CHANNEL_H_INCLUDED
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "word.h"
+
+#define CHANNEL_CAPACITY 64     // power of two
+#define CACHE_LINE 64
+
+/*
+ * Bounded lock-free queue for any number of senders and receivers. Every
+ * cell has a sequence number telling whose turn it is: a sender may fill
+ * the cell when it equals the enqueue position, a receiver may take it when
+ * it is one more. Positions only grow, cells are reused modulo capacity.
+ */
+typedef struct
+{
+    atomic_size_t sequence;
+    CPU_word_t value;
+} Channel_cell_t;
+
+typedef struct
+{
+    Channel_cell_t cells[CHANNEL_CAPACITY];
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_position;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_position;
+} Channel_t;
+
+int Channel_ctor(Channel_t* This);
+int Channel_dtor(Channel_t* This);
+int Channel_ok(Channel_t* This);
+int Channel_dump(Channel_t* This, char* name);
+int Channel_send(Channel_t* This, CPU_word_t value);
+int Channel_recv(Channel_t* This, CPU_word_t* value);
+
+#endif // CHANNEL_H_INCLUDED
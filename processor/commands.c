@@ -1,12 +1,17 @@
 #include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 #include "myassert.h"
 #include "commands.h"
 
-int CPU_command_ctor(CPU_command_t* This, int command, float param)
+int CPU_command_ctor(CPU_command_t* This, int command, CPU_word_t param)
 {
     assert(This);
 
     This->command = command;
+    This->reg = 0;
+    This->reg2 = 0;
     This->parameter = param;
 
     ASSERT_OK(CPU_command, This);
@@ -19,6 +24,8 @@ int CPU_command_dtor(CPU_command_t* This)
     assert(This);
 
     This->command = -1;
+    This->reg = 0;
+    This->reg2 = 0;
     This->parameter = 0;
 
     return 0;
@@ -28,7 +35,21 @@ int CPU_command_ok(CPU_command_t* This)
 {
     if (!This)
         return 0;
-    if ((This->command < END) || (This->command > NOP))
+    if ((This->command < END) || (This->command >= COMMANDS_CNT))
+        return 0;
+    int operands = CPU_command_operands(This->command);
+    if ((operands & OPERAND_REG) && ((This->reg < RAX) || (This->reg > RDX)))
+        return 0;
+    if ((operands & OPERAND_REG2) && ((This->reg2 < RAX) || (This->reg2 > RDX)))
+        return 0;
+    if ((This->command == SWITCH) && ((This->parameter < 0) || (This->parameter > COMMANDS_MAX_CASES) ||
+                                      (This->parameter != (int) This->parameter)))
+        return 0;
+    if ((This->command == NATIVE) && ((This->parameter < 0) || (This->parameter >= COMMANDS_MAX_NATIVES) ||
+                                      (This->parameter != (int) This->parameter)))
+        return 0;
+    if (((This->command == SEND) || (This->command == RECV)) &&
+        ((This->parameter < 0) || (This->parameter >= CHANNELS_CNT) || (This->parameter != (int) This->parameter)))
         return 0;
 
     return 1;
@@ -41,9 +62,488 @@ int CPU_command_dump(CPU_command_t* This, char* name)
     printf("%s = CPU_command_t(%s)\n"
            "{\n"
            "    command = %d\n"
-           "    parameter = %g\n"
+           "    reg = %d\n"
+           "    reg2 = %d\n"
+           "    parameter = " WORD_PRINT "\n"
            "}\n",
-           name, CPU_command_ok(This) ? "ok" : "NOT OK!!!", This->command, This->parameter);
+           name, CPU_command_ok(This) ? "ok" : "NOT OK!!!", This->command, This->reg, This->reg2, This->parameter);
+
+    return 0;
+}
+
+int CPU_command_operands(int command)
+{
+    switch (command)
+    {
+    case PUSH:
+    case PUSH_VAR:
+    case POP:
+        return OPERAND_PARAM;
+    case JA:
+    case JAE:
+    case JB:
+    case JBE:
+    case JE:
+    case JNE:
+    case JMP:
+    case CALL:
+    case SPAWN:
+        return OPERAND_PARAM | OPERAND_TARGET;
+    case MOV_RR:
+    case ADD_RR:
+    case SUB_RR:
+    case MUL_RR:
+    case DIV_RR:
+        return OPERAND_REG | OPERAND_REG2;
+    case MOV_RI:
+    case ADD_RI:
+    case SUB_RI:
+    case MUL_RI:
+    case DIV_RI:
+        return OPERAND_REG | OPERAND_PARAM;
+    case INC:
+    case DEC:
+        return OPERAND_REG;
+    case JA_RR:
+    case JAE_RR:
+    case JB_RR:
+    case JBE_RR:
+    case JE_RR:
+    case JNE_RR:
+        return OPERAND_REG | OPERAND_REG2 | OPERAND_PARAM | OPERAND_TARGET;
+    case LOOP:
+    case JA_RI:
+    case JAE_RI:
+    case JB_RI:
+    case JBE_RI:
+    case JE_RI:
+    case JNE_RI:
+        return OPERAND_REG | OPERAND_PARAM | OPERAND_TARGET;
+    case LOAD_R:
+    case STORE_R:
+        return OPERAND_REG;
+    case LOAD_I:
+    case STORE_I:
+    case EXT:
+    case ENTER:
+    case LOAD_LOCAL:
+    case STORE_LOCAL:
+    case NATIVE:
+    case SEND:
+    case RECV:
+        return OPERAND_PARAM;
+    case SWITCH:
+        return OPERAND_REG | OPERAND_PARAM;
+    case CASE:
+        return OPERAND_PARAM | OPERAND_TARGET;
+    default:
+        return 0;
+    }
+}
+
+// number of values following the command in program files
+int CPU_command_operands_cnt(int command)
+{
+    int operands = CPU_command_operands(command);
+    return ((operands & OPERAND_REG) != 0) + ((operands & OPERAND_REG2) != 0) + ((operands & OPERAND_PARAM) != 0);
+}
+
+// mnemonic of the command as the assembler takes it
+const char* CPU_command_name(int command)
+{
+    static const char* names[COMMANDS_CNT] = {
+        [END] = "end", [PUSH] = "push", [PUSH_VAR] = "push", [POP] = "pop",
+        [JA] = "ja", [JAE] = "jae", [JB] = "jb", [JBE] = "jbe", [JE] = "je", [JNE] = "jne",
+        [JMP] = "jmp", [CALL] = "call", [RET] = "ret",
+        [ADD] = "add", [SUB] = "sub", [MUL] = "mul", [DIV] = "div", [POW] = "pow", [DUP] = "dup",
+        [IN] = "in", [OUT] = "out", [NOP] = "nop",
+        [MOV_RR] = "mov", [MOV_RI] = "mov", [ADD_RR] = "add", [ADD_RI] = "add", [SUB_RR] = "sub",
+        [SUB_RI] = "sub", [MUL_RR] = "mul", [MUL_RI] = "mul", [DIV_RR] = "div", [DIV_RI] = "div",
+        [INC] = "inc", [DEC] = "dec",
+        [JA_RR] = "ja", [JAE_RR] = "jae", [JB_RR] = "jb", [JBE_RR] = "jbe", [JE_RR] = "je", [JNE_RR] = "jne",
+        [LOOP] = "loop",
+        [JA_RI] = "ja", [JAE_RI] = "jae", [JB_RI] = "jb", [JBE_RI] = "jbe", [JE_RI] = "je", [JNE_RI] = "jne",
+        [EXT] = "ext", [SWITCH] = "switch", [CASE] = "case",
+        [ENTER] = "locals", [LOAD_LOCAL] = "load_local", [STORE_LOCAL] = "store_local",
+        [LOAD_R] = "load", [LOAD_I] = "load", [STORE_R] = "store", [STORE_I] = "store",
+        [VADD] = "vadd", [VMUL] = "vmul", [VFMA] = "vfma", [VSUM] = "vsum", [VMIN] = "vmin", [VMAX] = "vmax",
+        [VDOT] = "vdot", [VIN] = "vin", [VOUT] = "vout",
+        [NATIVE] = "native", [SPAWN] = "spawn", [JOIN] = "join", [SEND] = "send", [RECV] = "recv"
+    };
+
+    if (command == BREAK)
+        return "break";
+    if ((command < END) || (command >= COMMANDS_CNT) || !names[command])
+        return "?";
+    return names[command];
+}
+
+// number of slots the command takes in the program, its EXT operands included
+int CPU_command_length(const CPU_command_t* This)
+{
+    assert(This);
+
+    switch (This->command)
+    {
+    case JA_RI:
+    case JAE_RI:
+    case JB_RI:
+    case JBE_RI:
+    case JE_RI:
+    case JNE_RI:
+        return 2;
+    case SWITCH:
+        return 3 + (int) This->parameter;
+    default:
+        return 1;
+    }
+}
+
+// checks that EXT and CASE commands follow exactly the commands owning them, returns 0 if so
+int CPU_commands_check(const CPU_command_t* commands, int commands_cnt)
+{
+    assert(commands);
+
+    int i = 0;
+    while (i < commands_cnt)
+    {
+        const CPU_command_t* command = &commands[i];
+        if ((command->command == EXT) || (command->command == CASE) || !CPU_command_ok((CPU_command_t*) command))
+            return -1;
+        int length = CPU_command_length(command);
+        if ((length <= 0) || (length > commands_cnt - i))
+            return -1;
+        for (int j = 1; j < length; ++j)
+        {
+            int expected = ((command->command == SWITCH) && (j > 1)) ? CASE : EXT;
+            if (commands[i + j].command != expected)
+                return -1;
+        }
+        i += length;
+    }
+
+    return 0;
+}
+
+// returns 0 on success, 1 at the end of the stream, -1 for a broken command
+int CPU_command_read(CPU_command_t* This, FILE* stream)
+{
+    assert(This);
+    assert(stream);
+
+    int command = 0;
+    int reg = 0;
+    int reg2 = 0;
+    CPU_word_t param = 0;
+    int result = fscanf(stream, "%d", &command);
+    if (result == EOF)
+        return 1;
+    if ((result != 1) || (command < END) || (command >= COMMANDS_CNT))
+        return -1;
+
+    int operands = CPU_command_operands(command);
+    if ((operands & OPERAND_REG) && (fscanf(stream, "%d", &reg) != 1))
+        return -1;
+    if ((operands & OPERAND_REG2) && (fscanf(stream, "%d", &reg2) != 1))
+        return -1;
+    if ((operands & OPERAND_PARAM) && (fscanf(stream, WORD_SCAN, &param) != 1))
+        return -1;
+
+    This->command = command;
+    This->reg = reg;
+    This->reg2 = reg2;
+    This->parameter = param;
+
+    return CPU_command_ok(This) ? 0 : -1;
+}
+
+int CPU_command_write(const CPU_command_t* This, FILE* stream)
+{
+    assert(This);
+    assert(stream);
+
+    int operands = CPU_command_operands(This->command);
+    fprintf(stream, "%d ", This->command);
+    if (operands & OPERAND_REG)
+        fprintf(stream, "%d ", This->reg);
+    if (operands & OPERAND_REG2)
+        fprintf(stream, "%d ", This->reg2);
+    if (operands & OPERAND_PARAM)
+        fprintf(stream, WORD_WRITE " ", This->parameter);
+
+    return 0;
+}
+
+/*
+ * Reads the word tag if the stream starts with one, returns 0 if the program
+ * is of the word of this build, 1 if it is of another one and -1 for a broken
+ * tag. Float programs have no tag.
+ */
+int CPU_word_read(FILE* stream)
+{
+    assert(stream);
+
+    int c = getc(stream);
+    while (isspace(c))
+        c = getc(stream);
+    if (c != EOF)
+        ungetc(c, stream);
+
+    char name[MAX_WORD_NAME] = "float";
+    if ((c == WORD_MAGIC[0]) &&
+        ((fscanf(stream, WORD_NAME_FORMAT, name) != 1) || strcmp(name, WORD_MAGIC) ||
+         (fscanf(stream, WORD_NAME_FORMAT, name) != 1)))
+        return -1;
+    if (strcmp(name, WORD_NAME))
+    {
+        printf("Program is written for %s words, this build runs " WORD_NAME " ones\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+// writes the word tag, nothing for float programs
+int CPU_word_write(FILE* stream)
+{
+    assert(stream);
+
+    if (WORD_KIND != WORD_FLOAT)
+        fprintf(stream, WORD_MAGIC " " WORD_NAME "\n");
+
+    return 0;
+}
+
+// reads the natives table if the stream starts with one, returns 0 on success and -1 for a broken table
+int CPU_natives_read(FILE* stream, char*** names, int* natives_cnt)
+{
+    assert(stream);
+    assert(names);
+    assert(natives_cnt);
+
+    *names = 0;
+    *natives_cnt = 0;
+
+    int c = getc(stream);
+    while (isspace(c))
+        c = getc(stream);
+    if (c == EOF)
+        return 0;
+    ungetc(c, stream);
+    if (c != NATIVES_MAGIC[0])
+        return 0;
+
+    char word[MAX_NATIVE_NAME] = {};
+    int count = 0;
+    if ((fscanf(stream, NATIVE_NAME_FORMAT " %d", word, &count) != 2) || strcmp(word, NATIVES_MAGIC) ||
+        (count < 0) || (count > COMMANDS_MAX_NATIVES))
+        return -1;
+
+    *names = (char**) calloc(count, sizeof(**names));
+    for (int i = 0; i < count; ++i)
+    {
+        if (fscanf(stream, NATIVE_NAME_FORMAT, word) != 1)
+        {
+            CPU_natives_free(*names, i);
+            *names = 0;
+            return -1;
+        }
+        (*names)[i] = strdup(word);
+    }
+    *natives_cnt = count;
+
+    return 0;
+}
+
+// writes the natives table, nothing for a program without native calls
+int CPU_natives_write(FILE* stream, const char* const* names, int natives_cnt)
+{
+    assert(stream);
+
+    if (natives_cnt == 0)
+        return 0;
+    fprintf(stream, NATIVES_MAGIC " %d", natives_cnt);
+    for (int i = 0; i < natives_cnt; ++i)
+        fprintf(stream, " %s", names[i]);
+    fprintf(stream, "\n");
+
+    return 0;
+}
+
+int CPU_natives_free(char** names, int natives_cnt)
+{
+    for (int i = 0; names && (i < natives_cnt); ++i)
+        free(names[i]);
+    free(names);
+
+    return 0;
+}
+
+// reads the debug section following the commands, returns 0 on success, 1 if there is none and -1 if it is broken
+int CPU_debug_read(FILE* stream, CPU_debug_t* debug)
+{
+    assert(stream);
+    assert(debug);
+
+    *debug = (CPU_debug_t) {};
+
+    char word[MAX_SOURCE_NAME] = {};
+    if (fscanf(stream, SOURCE_NAME_FORMAT, word) != 1)
+        return 1;
+    int lines_cnt = 0;
+    int symbols_cnt = 0;
+    if (strcmp(word, DEBUG_MAGIC) || (fscanf(stream, SOURCE_NAME_FORMAT " %d %d", word, &lines_cnt, &symbols_cnt) != 3) ||
+        (lines_cnt < 0) || (symbols_cnt < 0))
+        return -1;
+
+    debug->source = strdup(word);
+    debug->lines = (CPU_line_t*) calloc(lines_cnt, sizeof(*debug->lines));
+    debug->symbols = (CPU_symbol_t*) calloc(symbols_cnt, sizeof(*debug->symbols));
+    int index = 0;
+    int line = 0;
+    for (; debug->lines_cnt < lines_cnt; ++debug->lines_cnt)
+    {
+        int index_step = 0;
+        int line_step = 0;
+        int column = 0;
+        if ((fscanf(stream, "%d %d %d", &index_step, &line_step, &column) != 3) || (index_step < 0))
+        {
+            CPU_debug_free(debug);
+            return -1;
+        }
+        index += index_step;
+        line += line_step;
+        debug->lines[debug->lines_cnt] = (CPU_line_t) {index, line, column};
+    }
+    for (; debug->symbols_cnt < symbols_cnt; ++debug->symbols_cnt)
+    {
+        char name[MAX_SYMBOL_NAME] = {};
+        if (fscanf(stream, SYMBOL_NAME_FORMAT " %d", name, &index) != 2)
+        {
+            CPU_debug_free(debug);
+            return -1;
+        }
+        debug->symbols[debug->symbols_cnt] = (CPU_symbol_t) {strdup(name), index};
+    }
+
+    return 0;
+}
+
+int CPU_debug_write(FILE* stream, const CPU_debug_t* debug)
+{
+    assert(stream);
+    assert(debug);
+
+    fprintf(stream, "\n" DEBUG_MAGIC " %s %d %d\n", debug->source, debug->lines_cnt, debug->symbols_cnt);
+    int index = 0;
+    int line = 0;
+    for (int i = 0; i < debug->lines_cnt; ++i)
+    {
+        fprintf(stream, "%d %d %d ", debug->lines[i].index - index, debug->lines[i].line - line, debug->lines[i].column);
+        index = debug->lines[i].index;
+        line = debug->lines[i].line;
+    }
+    fprintf(stream, "\n");
+    for (int i = 0; i < debug->symbols_cnt; ++i)
+        fprintf(stream, "%s %d\n", debug->symbols[i].name, debug->symbols[i].index);
+
+    return 0;
+}
+
+int CPU_debug_free(CPU_debug_t* debug)
+{
+    assert(debug);
+
+    free(debug->source);
+    free(debug->lines);
+    for (int i = 0; i < debug->symbols_cnt; ++i)
+        free(debug->symbols[i].name);
+    free(debug->symbols);
+    *debug = (CPU_debug_t) {};
+
+    return 0;
+}
+
+// FNV-1a of the commands, NATIVE parameters are left out as the processor rebinds them on loading
+unsigned CPU_commands_hash(const CPU_command_t* commands, int commands_cnt)
+{
+    assert(commands);
+
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < commands_cnt; ++i)
+    {
+        CPU_word_t parameter = (commands[i].command == NATIVE) ? 0 : commands[i].parameter;
+        unsigned long long word = 0;
+        memcpy(&word, &parameter, sizeof(parameter));
+        unsigned bits = word ^ (word >> 32);
+        unsigned values[] = {commands[i].command, commands[i].reg, commands[i].reg2, bits};
+        for (size_t j = 0; j < sizeof(values) / sizeof(*values); ++j)
+            hash = (hash ^ values[j]) * 16777619u;
+    }
+
+    return hash;
+}
+
+// returns 0 on success and -1 for a broken profile
+int CPU_profile_read(FILE* stream, CPU_profile_t* profile)
+{
+    assert(stream);
+    assert(profile);
+
+    *profile = (CPU_profile_t) {};
+
+    char word[sizeof(PROFILE_MAGIC)] = {};
+    int commands_cnt = 0;
+    unsigned hash = 0;
+    if ((fscanf(stream, "%7s %d %u", word, &commands_cnt, &hash) != 3) || strcmp(word, PROFILE_MAGIC) ||
+        (commands_cnt <= 0))
+        return -1;
+
+    profile->commands_cnt = commands_cnt;
+    profile->hash = hash;
+    profile->counts = (long long*) calloc(commands_cnt, sizeof(*profile->counts));
+    profile->taken = (long long*) calloc(commands_cnt, sizeof(*profile->taken));
+    int index = 0;
+    long long count = 0;
+    long long taken = 0;
+    int result = 0;
+    while ((result = fscanf(stream, "%d %lld %lld", &index, &count, &taken)) == 3)
+    {
+        if ((index < 0) || (index >= commands_cnt) || (count < 0) || (taken < 0) || (taken > count))
+            break;
+        profile->counts[index] = count;
+        profile->taken[index] = taken;
+    }
+    if (result != EOF)
+    {
+        CPU_profile_free(profile);
+        return -1;
+    }
+
+    return 0;
+}
+
+// writes the commands that were run, one per line
+int CPU_profile_write(FILE* stream, const CPU_profile_t* profile)
+{
+    assert(stream);
+    assert(profile);
+
+    fprintf(stream, PROFILE_MAGIC " %d %u\n", profile->commands_cnt, profile->hash);
+    for (int i = 0; i < profile->commands_cnt; ++i)
+        if (profile->counts[i])
+            fprintf(stream, "%d %lld %lld\n", i, profile->counts[i], profile->taken[i]);
+
+    return 0;
+}
+
+int CPU_profile_free(CPU_profile_t* profile)
+{
+    assert(profile);
+
+    free(profile->counts);
+    free(profile->taken);
+    *profile = (CPU_profile_t) {};
 
     return 0;
 }
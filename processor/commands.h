@@ -1,6 +1,9 @@
 #ifndef ASM_COMMANDS_H_INCLUDED
 #define ASM_COMMANDS_H_INCLUDED
 
+#include <stdio.h>
+#include "word.h"
+
 // registers
 #define RAX 0
 #define RBX 1
@@ -29,18 +32,178 @@ enum COMMAND {
     DUP = 18,
     IN = 19,
     OUT = 20,
-    NOP = 21
+    NOP = 21,
+    // register operand commands: reg = reg op reg2 / reg op parameter
+    MOV_RR = 22,
+    MOV_RI = 23,
+    ADD_RR = 24,
+    ADD_RI = 25,
+    SUB_RR = 26,
+    SUB_RI = 27,
+    MUL_RR = 28,
+    MUL_RI = 29,
+    DIV_RR = 30,
+    DIV_RI = 31,
+    INC = 32,
+    DEC = 33,
+    // jump to parameter if reg compares to reg2
+    JA_RR = 34,
+    JAE_RR = 35,
+    JB_RR = 36,
+    JBE_RR = 37,
+    JE_RR = 38,
+    JNE_RR = 39,
+    // decrement reg, jump to parameter unless it became zero
+    LOOP = 40,
+    // jump to parameter if reg compares to the immediate kept in the following EXT command
+    JA_RI = 41,
+    JAE_RI = 42,
+    JB_RI = 43,
+    JBE_RI = 44,
+    JE_RI = 45,
+    JNE_RI = 46,
+    EXT = 47,   // extra operand of the previous command, never run by itself
+    /*
+     * jump table: SWITCH {reg, cases count}, EXT {base}, CASE {default target},
+     * then CASE {target} for reg == base, base + 1, ...
+     */
+    SWITCH = 48,
+    CASE = 49,
+    // call frames: ENTER gives the current frame parameter local slots
+    ENTER = 50,
+    LOAD_LOCAL = 51,
+    STORE_LOCAL = 52,
+    // linear memory: address in reg or parameter
+    LOAD_R = 53,
+    LOAD_I = 54,
+    STORE_R = 55,
+    STORE_I = 56,
+    // bulk memory commands, operands are taken from the stack
+    VADD = 57,
+    VMUL = 58,
+    VFMA = 59,
+    VSUM = 60,
+    VMIN = 61,
+    VMAX = 62,
+    VDOT = 63,
+    VIN = 64,
+    VOUT = 65,
+    // call of a host function, parameter is its index in the natives table of the program
+    NATIVE = 66,
+    /*
+     * concurrency, run by the scheduler: SPAWN starts a context at its target and
+     * pushes its id, JOIN pops an id and pushes the result of that context,
+     * SEND and RECV move a value through channel parameter
+     */
+    SPAWN = 67,
+    JOIN = 68,
+    SEND = 69,
+    RECV = 70,
+    COMMANDS_CNT
 };
 
+// reserved command the debugger patches over breakpoints, never found in program files
+#define BREAK COMMANDS_CNT
+
+#define COMMANDS_MAX_CASES 4096
+#define CHANNELS_CNT 64
+
+/*
+ * Programs calling native functions start with a table of their names:
+ *   natives <count> <name>...
+ * followed by the usual header and commands.
+ */
+#define NATIVES_MAGIC "natives"
+#define COMMANDS_MAX_NATIVES 256
+#define MAX_NATIVE_NAME 64
+#define NATIVE_NAME_FORMAT "%63s"    // MAX_NATIVE_NAME - 1 characters
+
+// tag of the machine word ahead of everything else, see CPU_word_read()
+#define MAX_WORD_NAME 16
+#define WORD_NAME_FORMAT "%15s"         // MAX_WORD_NAME - 1 characters
+
+// debug section after the commands, written by the assembler with -g
+#define DEBUG_MAGIC "debug"
+#define MAX_SOURCE_NAME 256
+#define SOURCE_NAME_FORMAT "%255s"      // MAX_SOURCE_NAME - 1 characters
+#define MAX_SYMBOL_NAME 64
+#define SYMBOL_NAME_FORMAT "%63s"       // MAX_SYMBOL_NAME - 1 characters
+
+// profile written by the processor with --profile, read by the assembler with --profile-use
+#define PROFILE_MAGIC "profile"
+
+// operand kinds, see CPU_command_operands()
+#define OPERAND_PARAM 1
+#define OPERAND_TARGET 2
+#define OPERAND_REG 4
+#define OPERAND_REG2 8
+
 typedef struct
 {
-    int command;
-    float parameter;
+    short command;
+    char reg;
+    char reg2;
+    CPU_word_t parameter;
 } CPU_command_t;
 
-int CPU_command_ctor(CPU_command_t* This, int command, float param);
+typedef struct
+{
+    int index;
+    int line;
+    int column;
+} CPU_line_t;
+
+typedef struct
+{
+    char* name;
+    int index;
+} CPU_symbol_t;
+
+/*
+ * Source positions of command starts by growing index and the labels of the
+ * program. In files both tables are delta encoded: an entry of the lines one
+ * is the index and line steps from the previous entry and the column.
+ */
+typedef struct
+{
+    char* source;
+    CPU_line_t* lines;
+    int lines_cnt;
+    CPU_symbol_t* symbols;
+    int symbols_cnt;
+} CPU_debug_t;
+
+// execution counts of a program, matched to it by the commands count and CPU_commands_hash()
+typedef struct
+{
+    int commands_cnt;
+    unsigned hash;
+    long long* counts;      // times every command was run
+    long long* taken;       // times it went on elsewhere than the command after it
+} CPU_profile_t;
+
+int CPU_command_ctor(CPU_command_t* This, int command, CPU_word_t param);
 int CPU_command_dtor(CPU_command_t* This);
 int CPU_command_ok(CPU_command_t* This);
 int CPU_command_dump(CPU_command_t* This, char* name);
+int CPU_command_operands(int command);
+int CPU_command_operands_cnt(int command);
+int CPU_command_length(const CPU_command_t* This);
+const char* CPU_command_name(int command);
+int CPU_commands_check(const CPU_command_t* commands, int commands_cnt);
+int CPU_command_read(CPU_command_t* This, FILE* stream);
+int CPU_command_write(const CPU_command_t* This, FILE* stream);
+int CPU_word_read(FILE* stream);
+int CPU_word_write(FILE* stream);
+int CPU_natives_read(FILE* stream, char*** names, int* natives_cnt);
+int CPU_natives_write(FILE* stream, const char* const* names, int natives_cnt);
+int CPU_natives_free(char** names, int natives_cnt);
+int CPU_debug_read(FILE* stream, CPU_debug_t* debug);
+int CPU_debug_write(FILE* stream, const CPU_debug_t* debug);
+int CPU_debug_free(CPU_debug_t* debug);
+unsigned CPU_commands_hash(const CPU_command_t* commands, int commands_cnt);
+int CPU_profile_read(FILE* stream, CPU_profile_t* profile);
+int CPU_profile_write(FILE* stream, const CPU_profile_t* profile);
+int CPU_profile_free(CPU_profile_t* profile);
 
 #endif // ASM_COMMANDS_H_INCLUDED
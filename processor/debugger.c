@@ -0,0 +1,368 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debugger.h"
+#include "commands.h"
+#include "processor.h"
+#include "myassert.h"
+#include "stack.h"
+#include "symbols.h"
+
+int Debugger_ctor(Debugger_t* This, CPU_command_t* commands, int commands_cnt)
+{
+    assert(This);
+    assert(commands);
+
+    This->commands = commands;
+    This->commands_cnt = commands_cnt;
+    This->starts = (char*) calloc(commands_cnt, sizeof(*This->starts));
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+        This->starts[i] = 1;
+    This->breakpoints_cnt = 0;
+
+    ASSERT_OK(Debugger, This);
+
+    return 0;
+}
+
+int Debugger_dtor(Debugger_t* This)
+{
+    assert(This);
+
+    // the program is given back as it was loaded
+    while (This->breakpoints_cnt)
+        Debugger_clear(This, This->breakpoints[0].index);
+    free(This->starts);
+    This->starts = 0;
+    This->commands = 0;
+    This->commands_cnt = 0;
+
+    return 0;
+}
+
+int Debugger_ok(Debugger_t* This)
+{
+    if (!This || !This->commands || !This->starts || (This->commands_cnt <= 0) ||
+        (This->breakpoints_cnt < 0) || (This->breakpoints_cnt > MAX_BREAKPOINTS))
+        return 0;
+    for (int i = 0; i < This->breakpoints_cnt; ++i)
+    {
+        int index = This->breakpoints[i].index;
+        if ((index < 0) || (index >= This->commands_cnt) || !This->starts[index] ||
+            (This->commands[index].command != BREAK))
+            return 0;
+    }
+    return 1;
+}
+
+int Debugger_dump(Debugger_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Debugger_t(%s)\n"
+           "{\n"
+           "    commands = %p\n"
+           "    commands_cnt = %d\n"
+           "    breakpoints_cnt = %d\n",
+           name, Debugger_ok(This) ? "ok" : "NOT OK!!!", This->commands, This->commands_cnt,
+           This->breakpoints_cnt);
+    for (int i = 0; i < This->breakpoints_cnt; ++i)
+        printf("    breakpoints[%d] = %d (%s)\n", i, This->breakpoints[i].index,
+               CPU_command_name(This->breakpoints[i].original.command));
+    printf("}\n");
+
+    return 0;
+}
+
+static Breakpoint_t* find_breakpoint(Debugger_t* This, int index)
+{
+    for (int i = 0; i < This->breakpoints_cnt; ++i)
+        if (This->breakpoints[i].index == index)
+            return &This->breakpoints[i];
+    return 0;
+}
+
+// patches BREAK over the command at index, returns -1 if there is no command starting there
+int Debugger_set(Debugger_t* This, int index)
+{
+    ASSERT_OK(Debugger, This);
+
+    if ((index < 0) || (index >= This->commands_cnt) || !This->starts[index])
+    {
+        printf("No command starts at %d\n", index);
+        return -1;
+    }
+    if (find_breakpoint(This, index))
+        return 0;
+    if (This->breakpoints_cnt == MAX_BREAKPOINTS)
+    {
+        printf("Too many breakpoints\n");
+        return -1;
+    }
+
+    Breakpoint_t* breakpoint = &This->breakpoints[This->breakpoints_cnt++];
+    breakpoint->index = index;
+    breakpoint->original = This->commands[index];
+    This->commands[index].command = BREAK;
+
+    ASSERT_OK(Debugger, This);
+    return 0;
+}
+
+int Debugger_clear(Debugger_t* This, int index)
+{
+    ASSERT_OK(Debugger, This);
+
+    Breakpoint_t* breakpoint = find_breakpoint(This, index);
+    if (!breakpoint)
+    {
+        printf("No breakpoint at %d\n", index);
+        return -1;
+    }
+    This->commands[index] = breakpoint->original;
+    *breakpoint = This->breakpoints[--This->breakpoints_cnt];
+
+    ASSERT_OK(Debugger, This);
+    return 0;
+}
+
+// command at index as the assembler would take it, the saved one under a breakpoint
+static int print_command(Debugger_t* This, int index)
+{
+    static const char* registers[] = {"rax", "rbx", "rcx", "rdx"};
+
+    Breakpoint_t* breakpoint = find_breakpoint(This, index);
+    const CPU_command_t* command = breakpoint ? &breakpoint->original : &This->commands[index];
+    int operands = CPU_command_operands(command->command);
+
+    printf("%s%s: %s", breakpoint ? "*" : " ", Symbols_where(index), CPU_command_name(command->command));
+    if ((command->command == PUSH_VAR) || (command->command == POP))
+    {
+        int reg = command->parameter;
+        printf(" %s\n", ((reg >= RAX) && (reg <= RDX)) ? registers[reg] : "?");
+        return 0;
+    }
+    const char* separator = " ";
+    if (operands & OPERAND_REG)
+    {
+        printf("%s%s", separator, registers[(int) command->reg]);
+        separator = ", ";
+    }
+    if (operands & OPERAND_REG2)
+    {
+        printf("%s%s", separator, registers[(int) command->reg2]);
+        separator = ", ";
+    }
+    if (operands & OPERAND_PARAM)
+        printf("%s" WORD_PRINT, separator, command->parameter);
+    if (CPU_command_length(command) == 2)
+        printf(", " WORD_PRINT, This->commands[index + 1].parameter);
+    printf("\n");
+
+    return 0;
+}
+
+// the program stops at END, which may be under a breakpoint
+static int is_end(Debugger_t* This, int index)
+{
+    Breakpoint_t* breakpoint = find_breakpoint(This, index);
+    return (breakpoint ? breakpoint->original.command : This->commands[index].command) == END;
+}
+
+// runs the command at current_command, the saved one if it is under a breakpoint
+static int debugger_step(CPU_t* This, Debugger_t* debugger, int* current_command)
+{
+    if (is_end(debugger, *current_command))
+        return 0;
+
+    int index = *current_command;
+    Breakpoint_t* breakpoint = find_breakpoint(debugger, index);
+    if (breakpoint)
+        debugger->commands[index] = breakpoint->original;
+    CPU_step(This, debugger->commands, current_command);
+    if (breakpoint)
+        debugger->commands[index].command = BREAK;
+
+    return 0;
+}
+
+// runs until END or the next breakpoint without any check of its own
+static int debugger_continue(CPU_t* This, Debugger_t* debugger, int* current_command)
+{
+    const CPU_command_t* commands = debugger->commands;
+    debugger_step(This, debugger, current_command);
+    while ((commands[*current_command].command != END) && (CPU_step(This, commands, current_command) == 0))
+        ;
+
+    return 0;
+}
+
+static int print_registers(CPU_t* This)
+{
+    printf("rax = " WORD_PRINT "\n"
+           "rbx = " WORD_PRINT "\n"
+           "rcx = " WORD_PRINT "\n"
+           "rdx = " WORD_PRINT "\n",
+           This->rax, This->rbx, This->rcx, This->rdx);
+
+    return 0;
+}
+
+static int print_stack(CPU_t* This)
+{
+    if (This->cstack->count == 0)
+        printf("Stack is empty\n");
+    for (int i = This->cstack->count - 1; i >= 0; --i)
+        printf("  [%d] " WORD_PRINT "\n", i, This->cstack->data[i]);
+
+    return 0;
+}
+
+static int print_calls(CPU_t* This, int current_command)
+{
+    printf("  #0 at %s\n", Symbols_where(current_command));
+    for (int i = This->call_stack->count - 1, depth = 1; i >= 0; --i, ++depth)
+        printf("  #%d returns to %s\n", depth, Symbols_where(This->call_stack->data[i]));
+
+    return 0;
+}
+
+static int print_memory(CPU_t* This, int address, int count)
+{
+    if (CPU_memory_check(This, address, count) != 0)
+        return -1;
+    for (int i = address; i < address + count; ++i)
+        printf("  [%d] " WORD_PRINT "\n", i, This->memory[i]);
+
+    return 0;
+}
+
+static int print_breakpoints(Debugger_t* This)
+{
+    if (This->breakpoints_cnt == 0)
+        printf("No breakpoints\n");
+    for (int i = 0; i < This->breakpoints_cnt; ++i)
+        print_command(This, This->breakpoints[i].index);
+
+    return 0;
+}
+
+static int print_debugger_help()
+{
+    printf("  break N|label, b\tstops before the command at N or at the label\n"
+           "  delete N, d N\t\tremoves the breakpoint at N\n"
+           "  breakpoints, i\tlists breakpoints\n"
+           "  continue, c\t\truns to the next breakpoint or the end\n"
+           "  step [N], s [N]\truns N commands (1 by default)\n"
+           "  where, w\t\tprints the next command\n"
+           "  registers, r\t\tprints registers\n"
+           "  stack, st\t\tprints the stack from its top\n"
+           "  calls, bt\t\tprints return addresses of the active calls\n"
+           "  memory A [N], m A [N]\tprints N memory cells from A (1 by default)\n"
+           "  quit, q\t\tstops the program\n");
+
+    return 0;
+}
+
+// reads a number operand, returns -1 if there is none
+static int read_number(const char* argument, int* number)
+{
+    char* end = 0;
+    long value = strtol(argument, &end, 10);
+    if ((end == argument) || (*end != '\0'))
+        return -1;
+    *number = value;
+    return 0;
+}
+
+/*
+ * Runs the program under commands read from input, stopped before its first
+ * command. Program input shares the stream, empty lines left by it are skipped.
+ */
+int CPU_run_debugger(CPU_t* This, Debugger_t* debugger, FILE* input)
+{
+    ASSERT_OK(CPU, This);
+    ASSERT_OK(Debugger, debugger);
+    assert(input);
+
+    int current_command = 0;
+    char line[MAX_DEBUGGER_LINE] = "";
+    print_command(debugger, current_command);
+    for (;;)
+    {
+        if (is_end(debugger, current_command))
+        {
+            printf("Program finished\n");
+            return 0;
+        }
+        printf("(debug) ");
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), input))
+        {
+            printf("\n");
+            return 0;
+        }
+
+        char name[MAX_DEBUGGER_LINE] = "";
+        char argument[MAX_DEBUGGER_LINE] = "";
+        char argument2[MAX_DEBUGGER_LINE] = "";
+        int words = sscanf(line, "%255s %255s %255s", name, argument, argument2);
+        int number = 0;
+        int number2 = 1;
+        if (words <= 0)
+            continue;
+
+        if (!strcmp(name, "break") || !strcmp(name, "b"))
+        {
+            if (words < 2)
+                printf("Usage: break N|label\n");
+            else if ((read_number(argument, &number) != 0) && ((number = Symbols_find(argument)) < 0))
+                printf("Unknown label %s, labels are known in programs assembled with -g\n", argument);
+            else if (Debugger_set(debugger, number) == 0)
+                print_command(debugger, number);
+        } else if (!strcmp(name, "delete") || !strcmp(name, "d"))
+        {
+            if ((words < 2) || (read_number(argument, &number) != 0))
+                printf("Usage: delete N\n");
+            else
+                Debugger_clear(debugger, number);
+        } else if (!strcmp(name, "breakpoints") || !strcmp(name, "i"))
+            print_breakpoints(debugger);
+        else if (!strcmp(name, "continue") || !strcmp(name, "c"))
+        {
+            debugger_continue(This, debugger, &current_command);
+            print_command(debugger, current_command);
+        } else if (!strcmp(name, "step") || !strcmp(name, "s"))
+        {
+            if ((words >= 2) && ((read_number(argument, &number2) != 0) || (number2 <= 0)))
+            {
+                printf("Usage: step [N]\n");
+                continue;
+            }
+            for (int i = 0; (i < number2) && !is_end(debugger, current_command); ++i)
+                debugger_step(This, debugger, &current_command);
+            print_command(debugger, current_command);
+        } else if (!strcmp(name, "where") || !strcmp(name, "w"))
+            print_command(debugger, current_command);
+        else if (!strcmp(name, "registers") || !strcmp(name, "r"))
+            print_registers(This);
+        else if (!strcmp(name, "stack") || !strcmp(name, "st"))
+            print_stack(This);
+        else if (!strcmp(name, "calls") || !strcmp(name, "bt"))
+            print_calls(This, current_command);
+        else if (!strcmp(name, "memory") || !strcmp(name, "m"))
+        {
+            if ((words < 2) || (read_number(argument, &number) != 0) ||
+                ((words == 3) && (read_number(argument2, &number2) != 0)))
+                printf("Usage: memory A [N]\n");
+            else
+                print_memory(This, number, number2);
+        } else if (!strcmp(name, "quit") || !strcmp(name, "q"))
+            return 0;
+        else if (!strcmp(name, "help") || !strcmp(name, "h"))
+            print_debugger_help();
+        else
+            printf("Unknown debugger command %s, try help\n", name);
+    }
+}
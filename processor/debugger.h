@@ -0,0 +1,40 @@
+#ifndef DEBUGGER_H_INCLUDED
+#define DEBUGGER_H_INCLUDED
+
+#include <stdio.h>
+#include "commands.h"
+#include "processor.h"
+
+#define MAX_BREAKPOINTS 256
+#define MAX_DEBUGGER_LINE 256
+
+typedef struct
+{
+    int index;
+    CPU_command_t original;
+} Breakpoint_t;
+
+/*
+ * Breakpoints are set by writing BREAK over the command in the program, the
+ * interpreter stops there on its own, so running between breakpoints costs
+ * exactly as much as running without the debugger. Leaving a breakpoint
+ * runs the saved command once and writes BREAK back.
+ */
+typedef struct
+{
+    CPU_command_t* commands;
+    int commands_cnt;
+    char* starts;           // 1 for slots where a command starts, EXT and CASE slots are 0
+    Breakpoint_t breakpoints[MAX_BREAKPOINTS];
+    int breakpoints_cnt;
+} Debugger_t;
+
+int Debugger_ctor(Debugger_t* This, CPU_command_t* commands, int commands_cnt);
+int Debugger_dtor(Debugger_t* This);
+int Debugger_ok(Debugger_t* This);
+int Debugger_dump(Debugger_t* This, char* name);
+int Debugger_set(Debugger_t* This, int index);
+int Debugger_clear(Debugger_t* This, int index);
+int CPU_run_debugger(CPU_t* This, Debugger_t* debugger, FILE* input);
+
+#endif // DEBUGGER_H_INCLUDED
@@ -0,0 +1,820 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "dense.h"
+#include "commands.h"
+#include "processor.h"
+#include "myassert.h"
+#include "stack.h"
+#include "symbols.h"
+
+#define PUSH_RAW(stack, value) (stack)->data[(stack)->count++] = (value)
+#define POP_RAW(stack) (stack)->data[--(stack)->count]
+#define REG(This, reg) (This)->registers[reg]
+
+// the longest command: opcode, registers, 4-byte target and 4-byte value, then the EXT slot
+#define MAX_CODE_LENGTH 11
+
+// commands run by the dense engine itself, the others are left to CPU_step()
+static int is_dense(const CPU_command_t* commands, int commands_cnt, int index)
+{
+    const CPU_command_t* command = &commands[index];
+    int operands = CPU_command_operands(command->command);
+    if ((operands & OPERAND_TARGET) &&
+        ((command->parameter < 0) || (command->parameter >= commands_cnt) ||
+         (command->parameter != (int) command->parameter) ||
+         (commands[(int) command->parameter].command == EXT) || (commands[(int) command->parameter].command == CASE)))
+        return 0;
+    if ((command->command >= JA_RI) && (command->command <= JNE_RI) &&
+        ((index + 1 >= commands_cnt) || (commands[index + 1].command != EXT)))
+        return 0;
+    // the command a call returns to needs an entry
+    if ((command->command == CALL) && (index + 1 >= commands_cnt))
+        return 0;
+
+    switch (command->command)
+    {
+    case PUSH_VAR:
+    case POP:
+        return (command->parameter >= RAX) && (command->parameter <= RDX) &&
+               (command->parameter == (int) command->parameter);
+    case END:
+    case PUSH:
+    case JA:
+    case JAE:
+    case JB:
+    case JBE:
+    case JE:
+    case JNE:
+    case JMP:
+    case CALL:
+    case RET:
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case POW:
+    case DUP:
+    case IN:
+    case OUT:
+    case NOP:
+    case MOV_RR:
+    case MOV_RI:
+    case ADD_RR:
+    case ADD_RI:
+    case SUB_RR:
+    case SUB_RI:
+    case MUL_RR:
+    case MUL_RI:
+    case DIV_RR:
+    case DIV_RI:
+    case INC:
+    case DEC:
+    case JA_RR:
+    case JAE_RR:
+    case JB_RR:
+    case JBE_RR:
+    case JE_RR:
+    case JNE_RR:
+    case LOOP:
+    case JA_RI:
+    case JAE_RI:
+    case JB_RI:
+    case JBE_RI:
+    case JE_RI:
+    case JNE_RI:
+    case ENTER:
+    case LOAD_LOCAL:
+    case STORE_LOCAL:
+    case LOAD_R:
+    case LOAD_I:
+    case STORE_R:
+    case STORE_I:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// values a dense command carries: its parameter unless it is a target or register, the EXT one of RI jumps
+static int dense_values(const CPU_command_t* commands, int index, CPU_word_t* values)
+{
+    const CPU_command_t* command = &commands[index];
+    int values_cnt = 0;
+    if ((command->command == PUSH_VAR) || (command->command == POP))
+        return 0;
+    if ((CPU_command_operands(command->command) & (OPERAND_PARAM | OPERAND_TARGET)) == OPERAND_PARAM)
+        values[values_cnt++] = command->parameter;
+    if ((command->command >= JA_RI) && (command->command <= JNE_RI))
+        values[values_cnt++] = commands[index + 1].parameter;
+    return values_cnt;
+}
+
+// integers of DENSE_SMALL_MIN..DENSE_SMALL_MAX take one byte, -0.0 and fractions do not
+static int is_small(CPU_word_t value)
+{
+    if (!((value >= DENSE_SMALL_MIN) && (value <= DENSE_SMALL_MAX)))
+        return 0;
+    CPU_word_t small = (int) value;
+    return !memcmp(&small, &value, sizeof(value));
+}
+
+static uint64_t word_bits(CPU_word_t value)
+{
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(value));
+    return bits;
+}
+
+/*
+ * Constant pool of the program, values are told apart by their bits so
+ * that -0.0 and NaNs keep theirs. slots is an open addressing table of
+ * pool indices, -1 where empty.
+ */
+typedef struct
+{
+    CPU_word_t* values;
+    int values_cnt;
+    int* slots;
+    int slots_cnt;      // power of two above twice the number of values
+} Pool_t;
+
+static int pool_index(Pool_t* This, CPU_word_t value)
+{
+    uint64_t bits = word_bits(value);
+    int slot = (int) ((bits * 0x9e3779b97f4a7c15ULL) >> 32) & (This->slots_cnt - 1);
+    while (This->slots[slot] >= 0)
+    {
+        if (word_bits(This->values[This->slots[slot]]) == bits)
+            return This->slots[slot];
+        slot = (slot + 1) & (This->slots_cnt - 1);
+    }
+    This->slots[slot] = This->values_cnt;
+    This->values[This->values_cnt] = value;
+    return This->values_cnt++;
+}
+
+static unsigned char* emit_entry(unsigned char* code, int value, int wide)
+{
+    *code++ = value & 0xff;
+    *code++ = (value >> 8) & 0xff;
+    if (wide)
+    {
+        *code++ = (value >> 16) & 0xff;
+        *code++ = (value >> 24) & 0xff;
+    }
+    return code;
+}
+
+static unsigned char* emit_value(unsigned char* code, Pool_t* pool, CPU_word_t value, int wide)
+{
+    if (is_small(value))
+    {
+        *code++ = (int) value & 0x7f;
+        return code;
+    }
+    // big-endian, so that the flag is in the first byte
+    int index = pool_index(pool, value);
+    if (wide)
+    {
+        *code++ = 0x80 | ((index >> 24) & 0x7f);
+        *code++ = (index >> 16) & 0xff;
+        *code++ = (index >> 8) & 0xff;
+    }
+    else
+        *code++ = 0x80 | ((index >> 8) & 0x7f);
+    *code++ = index & 0xff;
+    return code;
+}
+
+// marks the command indices that get an entry
+static void mark_entries(const CPU_command_t* commands, int commands_cnt, char* marks)
+{
+    for (int i = 0; i < commands_cnt; i += DENSE_ENTRY_SPACING)
+        marks[i] = 1;
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+    {
+        const CPU_command_t* command = &commands[i];
+        int length = CPU_command_length(command);
+        if ((command->command == CALL) && (i + 1 < commands_cnt))
+            marks[i + 1] = 1;
+        if (!is_dense(commands, commands_cnt, i))
+        {
+            // CPU_step() may jump to any target of the command and its slots
+            marks[i] = 1;
+            for (int j = i; (j < i + length) && (j < commands_cnt); ++j)
+                if ((CPU_command_operands(commands[j].command) & OPERAND_TARGET) && (commands[j].parameter >= 0) &&
+                    (commands[j].parameter < commands_cnt) && (commands[j].parameter == (int) commands[j].parameter))
+                    marks[(int) commands[j].parameter] = 1;
+            continue;
+        }
+        if (command->command == RET)
+            marks[i] = 1;
+        if (CPU_command_operands(command->command) & OPERAND_TARGET)
+            marks[(int) command->parameter] = 1;
+    }
+}
+
+int Dense_ctor(Dense_t* This, const CPU_command_t* commands, int commands_cnt)
+{
+    assert(This);
+    assert(commands);
+    assert(commands_cnt > 0);
+
+    This->commands = commands;
+    This->commands_cnt = commands_cnt;
+    This->code = (unsigned char*) calloc((size_t) commands_cnt * MAX_CODE_LENGTH, sizeof(*This->code));
+
+    Pool_t pool = {};
+    pool.values = (CPU_word_t*) calloc(2 * commands_cnt, sizeof(*pool.values));
+    pool.slots_cnt = 1;
+    while (pool.slots_cnt < 4 * commands_cnt)
+        pool.slots_cnt *= 2;
+    pool.slots = (int*) malloc(pool.slots_cnt * sizeof(*pool.slots));
+    memset(pool.slots, -1, pool.slots_cnt * sizeof(*pool.slots));
+
+    // the pool and the entries are found first, their numbers decide whether the code is wide
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+    {
+        CPU_word_t values[2] = {};
+        if (!is_dense(commands, commands_cnt, i))
+            continue;
+        for (int j = dense_values(commands, i, values) - 1; j >= 0; --j)
+            if (!is_small(values[j]))
+                pool_index(&pool, values[j]);
+    }
+    char* marks = (char*) calloc(commands_cnt, sizeof(*marks));
+    int* entry_of = (int*) malloc(commands_cnt * sizeof(*entry_of));
+    mark_entries(commands, commands_cnt, marks);
+    This->entries_cnt = 0;
+    for (int i = 0; i < commands_cnt; ++i)
+        entry_of[i] = marks[i] ? This->entries_cnt++ : -1;
+    This->entries = (Dense_entry_t*) calloc(This->entries_cnt, sizeof(*This->entries));
+    This->wide = (This->entries_cnt > DENSE_NARROW_ENTRIES) || (pool.values_cnt > DENSE_NARROW_POOL);
+
+    unsigned char* code = This->code;
+    for (int i = 0; i < commands_cnt;)
+    {
+        const CPU_command_t* command = &commands[i];
+        int length = CPU_command_length(command);
+        if (marks[i])
+            This->entries[entry_of[i]] = (Dense_entry_t) {i, (int) (code - This->code)};
+        if (!is_dense(commands, commands_cnt, i))
+        {
+            *code++ = DENSE_STEP;
+            code = emit_entry(code, entry_of[i], This->wide);
+        }
+        else if ((command->command == PUSH_VAR) || (command->command == POP))
+            *code++ = ((command->command == PUSH_VAR) ? DENSE_PUSH_REG : DENSE_POP_REG) + (int) command->parameter;
+        else
+        {
+            int operands = CPU_command_operands(command->command);
+            int backward = (operands & OPERAND_TARGET) && (command->command != CALL) && (command->parameter <= i);
+            *code++ = command->command | (backward ? DENSE_BACKWARD : 0);
+            if (operands & (OPERAND_REG | OPERAND_REG2))
+                *code++ = (command->reg & 3) | ((command->reg2 & 3) << 2);
+            if (operands & OPERAND_TARGET)
+                code = emit_entry(code, entry_of[(int) command->parameter], This->wide);
+            // a count too long for the narrow form is 0, the engine finds the jump by its code then
+            if (backward)
+            {
+                int count = i + 1 - (int) command->parameter;
+                code = emit_entry(code, (This->wide || (count < DENSE_NARROW_ENTRIES)) ? count : 0, This->wide);
+            }
+            if (command->command == CALL)
+                code = emit_entry(code, entry_of[i + 1], This->wide);
+            CPU_word_t values[2] = {};
+            int values_cnt = dense_values(commands, i, values);
+            for (int j = 0; j < values_cnt; ++j)
+                code = emit_value(code, &pool, values[j], This->wide);
+        }
+        // operand slots are no-ops of their own, jumps into them go on after the command as CPU_step() does
+        for (int j = i + 1; (j < i + length) && (j < commands_cnt); ++j)
+        {
+            if (marks[j])
+                This->entries[entry_of[j]] = (Dense_entry_t) {j, (int) (code - This->code)};
+            *code++ = NOP;
+        }
+        i += length;
+    }
+    This->code_size = code - This->code;
+    This->code = (unsigned char*) realloc(This->code, This->code_size);
+    free(marks);
+    free(entry_of);
+
+    free(pool.slots);
+    This->pool_cnt = pool.values_cnt;
+    This->pool = (CPU_word_t*) realloc(pool.values, (This->pool_cnt ? This->pool_cnt : 1) * sizeof(*This->pool));
+
+    ASSERT_OK(Dense, This);
+
+    return 0;
+}
+
+int Dense_dtor(Dense_t* This)
+{
+    assert(This);
+
+    free(This->code);
+    free(This->entries);
+    free(This->pool);
+    This->code = 0;
+    This->entries = 0;
+    This->pool = 0;
+    This->code_size = -1;
+    This->entries_cnt = -1;
+    This->pool_cnt = -1;
+    This->commands_cnt = -1;
+    This->commands = 0;
+
+    return 0;
+}
+
+int Dense_ok(Dense_t* This)
+{
+    if (!This)
+        return 0;
+    if (!This->commands || !This->code || !This->entries || !This->pool)
+        return 0;
+    if ((This->commands_cnt <= 0) || (This->code_size < This->commands_cnt) || (This->entries_cnt <= 0) ||
+        (This->pool_cnt < 0))
+        return 0;
+    if ((This->entries[0].index != 0) || (This->entries[0].offset != 0))
+        return 0;
+    return 1;
+}
+
+// bytes of the instruction at code, the operand slots of a command are instructions of their own
+static int code_length(const unsigned char* code, int wide)
+{
+    int op = code[0] & ~DENSE_BACKWARD;
+    int index_length = wide ? 4 : 2;
+    if (op == DENSE_STEP)
+        return 1 + index_length;
+    if (op >= DENSE_PUSH_REG)
+        return 1;
+
+    int operands = CPU_command_operands(op);
+    int length = 1;
+    if (operands & (OPERAND_REG | OPERAND_REG2))
+        ++length;
+    if (operands & OPERAND_TARGET)
+        length += index_length;
+    if (code[0] & DENSE_BACKWARD)
+        length += index_length;
+    if (op == CALL)
+        length += index_length;
+    int values_cnt = ((operands & (OPERAND_PARAM | OPERAND_TARGET)) == OPERAND_PARAM) + ((op >= JA_RI) && (op <= JNE_RI));
+    for (int i = 0; i < values_cnt; ++i)
+        length += !(code[length] & 0x80) ? 1 : (wide ? 4 : 2);
+    return length;
+}
+
+int Dense_dump(Dense_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Dense_t(%s)\n"
+           "{\n"
+           "    commands_cnt = %d\n"
+           "    code_size = %d\n"
+           "    entries_cnt = %d\n"
+           "    pool_cnt = %d\n"
+           "    wide = %d\n"
+           "    code = \n"
+           "    {\n",
+           name, Dense_ok(This) ? "ok" : "NOT OK!!!", This->commands_cnt, This->code_size, This->entries_cnt,
+           This->pool_cnt, This->wide);
+    if (This->code)
+        for (int i = 0, offset = 0; offset < This->code_size; ++i)
+        {
+            int end = offset + code_length(This->code + offset, This->wide);
+            printf("        [%d] %d:", i, offset);
+            for (; offset < end; ++offset)
+                printf(" %02x", This->code[offset]);
+            printf("\n");
+        }
+    else
+        printf("        NULL pointer here :(\n");
+    printf("    }\n"
+           "}\n");
+
+    return 0;
+}
+
+// last entry at or before command index
+static const Dense_entry_t* entry_by_index(const Dense_t* This, int index)
+{
+    int low = 0;
+    int high = This->entries_cnt - 1;
+    while (low < high)
+    {
+        int middle = low + (high - low + 1) / 2;
+        if (This->entries[middle].index <= index)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return &This->entries[low];
+}
+
+// last entry at or before offset in the code
+static const Dense_entry_t* entry_by_offset(const Dense_t* This, int offset)
+{
+    int low = 0;
+    int high = This->entries_cnt - 1;
+    while (low < high)
+    {
+        int middle = low + (high - low + 1) / 2;
+        if (This->entries[middle].offset <= offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return &This->entries[low];
+}
+
+// command whose code holds the byte at offset
+int Dense_index(const Dense_t* This, int offset)
+{
+    const Dense_entry_t* entry = entry_by_offset(This, offset);
+    int index = entry->index;
+    for (int at = entry->offset; at + code_length(This->code + at, This->wide) <= offset; ++index)
+        at += code_length(This->code + at, This->wide);
+    return index;
+}
+
+// code of command index
+int Dense_offset(const Dense_t* This, int index)
+{
+    const Dense_entry_t* entry = entry_by_index(This, index);
+    int offset = entry->offset;
+    for (int i = entry->index; i < index; ++i)
+        offset += code_length(This->code + offset, This->wide);
+    return offset;
+}
+
+int Dense_print_stats(Dense_t* This)
+{
+    ASSERT_OK(Dense, This);
+
+    int entries_size = This->entries_cnt * (int) sizeof(*This->entries);
+    int pool_size = This->pool_cnt * (int) sizeof(*This->pool);
+    int total = This->code_size + entries_size + pool_size;
+    printf("Dense code: %d bytes for %d commands (%d of code%s, %d for %d entries, %d for %d pool values), "
+           "%.2f a command instead of %d\n",
+           total, This->commands_cnt, This->code_size, This->wide ? ", wide" : "", entries_size, This->entries_cnt,
+           pool_size, This->pool_cnt, (double) total / This->commands_cnt, (int) sizeof(CPU_command_t));
+
+    return 0;
+}
+
+static inline int read_entry(const unsigned char** pc, int wide)
+{
+    const unsigned char* code = *pc;
+    if (!wide)
+    {
+        *pc += 2;
+        return code[0] | (code[1] << 8);
+    }
+    *pc += 4;
+    return code[0] | (code[1] << 8) | (code[2] << 16) | ((unsigned) code[3] << 24);
+}
+
+static inline CPU_word_t read_value(const unsigned char** pc, const CPU_word_t* pool, int wide)
+{
+    const unsigned char* code = *pc;
+    if (!(code[0] & 0x80))
+    {
+        *pc += 1;
+        return (code[0] ^ 0x40) - 0x40;
+    }
+    if (!wide)
+    {
+        *pc += 2;
+        return pool[((code[0] & 0x7f) << 8) | code[1]];
+    }
+    *pc += 4;
+    return pool[((code[0] & 0x7f) << 24) | (code[1] << 16) | (code[2] << 8) | code[3]];
+}
+
+#define NEED(values) \
+    if (stack->count < (values)) \
+    { \
+        printf("Stack underflow at %s\n", Symbols_where(Dense_index(dense, at - code))); \
+        return -1; \
+    }
+
+#define ROOM(values) \
+    if (stack->count + (values) > stack->size) \
+    { \
+        printf("Stack overflow at %s\n", Symbols_where(Dense_index(dense, at - code))); \
+        return -1; \
+    }
+
+// target and, for a backward jump, the commands it repeats
+#define READ_TARGET() \
+    target = read_entry(&pc, wide); \
+    count = (op & DENSE_BACKWARD) ? read_entry(&pc, wide) : -1
+
+// goes on at entry target, a backward jump out of the limits of the watchdog stays at the jump
+#define JUMP() \
+    { \
+        const Dense_entry_t* to = &entries[target]; \
+        if ((count >= 0) && This->watchdog) \
+        { \
+            if (count == 0) \
+                count = Dense_index(dense, at - code) + 1 - to->index; \
+            if (CPU_checkpoint(This, to->index + count - 1, count) != 0) \
+                return CPU_EXPIRED; \
+        } \
+        This->position = to->index; \
+        pc = code + to->offset; \
+    }
+
+#define STACK_JUMP(command, relation) \
+    case command: \
+    case command | DENSE_BACKWARD: \
+        NEED(2); \
+        a = POP_RAW(stack); \
+        b = POP_RAW(stack); \
+        READ_TARGET(); \
+        if (a relation b) \
+            JUMP(); \
+        break;
+
+#define REG_JUMP(command, relation) \
+    case command: \
+    case command | DENSE_BACKWARD: \
+        regs = *pc++; \
+        READ_TARGET(); \
+        if (REG(This, regs & 3) relation REG(This, regs >> 2)) \
+            JUMP(); \
+        break;
+
+// the EXT slot after the value is skipped when the jump is not taken
+#define IMM_JUMP(command, relation) \
+    case command: \
+    case command | DENSE_BACKWARD: \
+        regs = *pc++; \
+        READ_TARGET(); \
+        b = read_value(&pc, pool, wide); \
+        if (REG(This, regs & 3) relation b) \
+            JUMP() \
+        else \
+            ++pc; \
+        break;
+
+#define REG_OP(command, operation) \
+    case command: \
+        regs = *pc++; \
+        REG(This, regs & 3) = operation(REG(This, regs & 3), REG(This, regs >> 2)); \
+        break;
+
+#define IMM_OP(command, operation) \
+    case command: \
+        regs = *pc++; \
+        REG(This, regs & 3) = operation(REG(This, regs & 3), read_value(&pc, pool, wide)); \
+        break;
+
+#define STACK_OP(command, operation) \
+    case command: \
+        NEED(2); \
+        a = POP_RAW(stack); \
+        stack->data[stack->count - 1] = operation(a, stack->data[stack->count - 1]); \
+        break;
+
+int CPU_run_dense(CPU_t* This, Dense_t* dense)
+{
+    ASSERT_OK(CPU, This);
+    ASSERT_OK(Dense, dense);
+
+    Stack_t* stack = This->cstack;
+    Stack_t* calls = This->call_stack;
+    const unsigned char* code = dense->code;
+    const Dense_entry_t* entries = dense->entries;
+    const CPU_word_t* pool = dense->pool;
+    int wide = dense->wide;
+
+    const unsigned char* pc = code + Dense_offset(dense, This->start);
+    This->position = This->start;
+    for (;;)
+    {
+        const unsigned char* at = pc;
+        CPU_word_t a = 0;
+        CPU_word_t b = 0;
+        int regs = 0;
+        int target = 0;
+        int count = -1;
+        int op = *pc++;
+        switch (op)
+        {
+        case END:
+            return 0;
+        case NOP:
+            break;
+        case PUSH:
+            ROOM(1);
+            PUSH_RAW(stack, read_value(&pc, pool, wide));
+            break;
+        case DENSE_PUSH_REG + RAX:
+        case DENSE_PUSH_REG + RBX:
+        case DENSE_PUSH_REG + RCX:
+        case DENSE_PUSH_REG + RDX:
+            ROOM(1);
+            PUSH_RAW(stack, REG(This, op - DENSE_PUSH_REG));
+            break;
+        case DENSE_POP_REG + RAX:
+        case DENSE_POP_REG + RBX:
+        case DENSE_POP_REG + RCX:
+        case DENSE_POP_REG + RDX:
+            NEED(1);
+            REG(This, op - DENSE_POP_REG) = POP_RAW(stack);
+            break;
+        STACK_OP(ADD, word_add)
+        STACK_OP(SUB, word_sub)
+        STACK_OP(MUL, word_mul)
+        STACK_OP(DIV, word_div)
+        STACK_OP(POW, word_pow)
+        case DUP:
+            NEED(1);
+            ROOM(1);
+            a = stack->data[stack->count - 1];
+            PUSH_RAW(stack, a);
+            break;
+        case IN:
+            ROOM(1);
+            a = CPU_input(This);
+            PUSH_RAW(stack, a);
+            break;
+        case OUT:
+            NEED(1);
+            CPU_output(This, POP_RAW(stack));
+            break;
+        case MOV_RR:
+            regs = *pc++;
+            REG(This, regs & 3) = REG(This, regs >> 2);
+            break;
+        case MOV_RI:
+            regs = *pc++;
+            REG(This, regs & 3) = read_value(&pc, pool, wide);
+            break;
+        REG_OP(ADD_RR, word_add)
+        IMM_OP(ADD_RI, word_add)
+        REG_OP(SUB_RR, word_sub)
+        IMM_OP(SUB_RI, word_sub)
+        REG_OP(MUL_RR, word_mul)
+        IMM_OP(MUL_RI, word_mul)
+        REG_OP(DIV_RR, word_div)
+        IMM_OP(DIV_RI, word_div)
+        case INC:
+            regs = *pc++;
+            REG(This, regs & 3) = word_add(REG(This, regs & 3), 1);
+            break;
+        case DEC:
+            regs = *pc++;
+            REG(This, regs & 3) = word_sub(REG(This, regs & 3), 1);
+            break;
+        STACK_JUMP(JA, >)
+        STACK_JUMP(JAE, >=)
+        STACK_JUMP(JB, <)
+        STACK_JUMP(JBE, <=)
+        STACK_JUMP(JE, ==)
+        STACK_JUMP(JNE, !=)
+        REG_JUMP(JA_RR, >)
+        REG_JUMP(JAE_RR, >=)
+        REG_JUMP(JB_RR, <)
+        REG_JUMP(JBE_RR, <=)
+        REG_JUMP(JE_RR, ==)
+        REG_JUMP(JNE_RR, !=)
+        IMM_JUMP(JA_RI, >)
+        IMM_JUMP(JAE_RI, >=)
+        IMM_JUMP(JB_RI, <)
+        IMM_JUMP(JBE_RI, <=)
+        IMM_JUMP(JE_RI, ==)
+        IMM_JUMP(JNE_RI, !=)
+        case LOOP:
+        case LOOP | DENSE_BACKWARD:
+            regs = *pc++;
+            READ_TARGET();
+            REG(This, regs & 3) = word_sub(REG(This, regs & 3), 1);
+            if (REG(This, regs & 3) != 0)
+                JUMP();
+            break;
+        case JMP:
+        case JMP | DENSE_BACKWARD:
+            READ_TARGET();
+            JUMP();
+            break;
+        case CALL:
+        {
+            target = read_entry(&pc, wide);
+            int address = entries[read_entry(&pc, wide)].index;
+            if (calls->count >= calls->size)
+            {
+                printf("Call stack overflow at %s\n", Symbols_where(address - 1));
+                return -1;
+            }
+            if (This->watchdog && (CPU_checkpoint(This, address - 1, 1) != 0))
+                return CPU_EXPIRED;
+            PUSH_RAW(calls, address);
+            CPU_frame_push(This);
+            This->position = entries[target].index;
+            pc = code + entries[target].offset;
+            break;
+        }
+        case RET:
+        {
+            // returns have entries, so finding their index only searches the entries
+            if (calls->count <= 0)
+            {
+                printf("Call stack underflow at %s\n", Symbols_where(Dense_index(dense, at - code)));
+                return -1;
+            }
+            if (This->watchdog && (CPU_checkpoint(This, Dense_index(dense, at - code), 1) != 0))
+                return CPU_EXPIRED;
+            int address = POP_RAW(calls);
+            CPU_frame_pop(This);
+            if ((address < 0) || (address >= dense->commands_cnt))
+            {
+                printf("Bad jump from command %s\n", Symbols_where(Dense_index(dense, at - code)));
+                return -1;
+            }
+            This->position = address;
+            pc = code + Dense_offset(dense, address);
+            break;
+        }
+        case ENTER:
+            if (CPU_enter(This, read_value(&pc, pool, wide)) != 0)
+                return -1;
+            break;
+        case LOAD_LOCAL:
+        {
+            a = read_value(&pc, pool, wide);
+            ROOM(1);
+            if (!((a >= 0) && (a < This->frames->count - This->frame)))
+            {
+                printf("Local slot " WORD_PRINT " is out of the frame\n", a);
+                return -1;
+            }
+            int index = This->frame + (int) a;
+            PUSH_RAW(stack, This->frames->data[index]);
+            break;
+        }
+        case STORE_LOCAL:
+        {
+            a = read_value(&pc, pool, wide);
+            NEED(1);
+            if (!((a >= 0) && (a < This->frames->count - This->frame)))
+            {
+                printf("Local slot " WORD_PRINT " is out of the frame\n", a);
+                return -1;
+            }
+            int index = This->frame + (int) a;
+            This->frames->data[index] = POP_RAW(stack);
+            break;
+        }
+        case LOAD_R:
+        case LOAD_I:
+            a = (op == LOAD_R) ? REG(This, *pc++ & 3) : read_value(&pc, pool, wide);
+            ROOM(1);
+            if (CPU_memory_check(This, a, 1) != 0)
+                return -1;
+            PUSH_RAW(stack, This->memory[(int) a]);
+            break;
+        case STORE_R:
+        case STORE_I:
+            a = (op == STORE_R) ? REG(This, *pc++ & 3) : read_value(&pc, pool, wide);
+            NEED(1);
+            if (CPU_memory_check(This, a, 1) != 0)
+                return -1;
+            This->memory[(int) a] = POP_RAW(stack);
+            break;
+        case DENSE_STEP:
+        {
+            int from = entries[read_entry(&pc, wide)].index;
+            int index = from;
+            int result = CPU_step(This, dense->commands, &index);
+            if (result != 0)
+                return result;
+            if ((index < 0) || (index >= dense->commands_cnt))
+            {
+                printf("Bad jump from command %s\n", Symbols_where(from));
+                return -1;
+            }
+            // the NOPs of the operand slots and the next command follow, anything else is looked up
+            if ((index > from) && (index <= from + CPU_command_length(&dense->commands[from])))
+                pc += index - from - 1;
+            else
+                pc = code + Dense_offset(dense, index);
+            This->position = index;
+            break;
+        }
+        default:
+            printf("Bad dense code %d at %s\n", op, Symbols_where(Dense_index(dense, at - code)));
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef DENSE_H_INCLUDED
+#define DENSE_H_INCLUDED
+
+#include "commands.h"
+#include "processor.h"
+
+/*
+ * Byte code of a program for the dense engine. Every command becomes its
+ * number in one byte followed only by the operands it has:
+ *   registers   one byte, reg | reg2 << 2; PUSH_VAR and POP carry the
+ *               register in the opcode instead (DENSE_PUSH_REG + reg)
+ *   target      number of the entry of the target, 2 bytes, 4 in wide
+ *               programs
+ *   value       one byte for integers -64..63, otherwise 0x80 | the index
+ *               of the value in the constant pool, 2 bytes, 4 in wide ones
+ * Jumps to their own or an earlier command have DENSE_BACKWARD in the
+ * opcode and carry the number of commands from the target to themselves
+ * after the target, for the watchdog, 0 when it does not fit. CALL
+ * carries the entry it returns to after its target, the compare jumps with
+ * an immediate carry it after their targets. The commands the engine does
+ * not run itself become DENSE_STEP with their entry and are run by
+ * CPU_step(). Operand slots of a command become a NOP each, so the code
+ * has one instruction for every command index.
+ *
+ * Entries give the code of the command indices the engine has to find by
+ * index: targets, return points, commands run by CPU_step() and where
+ * they jump, returns, and every DENSE_ENTRY_SPACING-th
+ * index. Any other index is found by decoding from the entry before it.
+ */
+#define DENSE_PUSH_REG (COMMANDS_CNT + 1)
+#define DENSE_POP_REG (DENSE_PUSH_REG + 4)
+#define DENSE_STEP (DENSE_POP_REG + 4)
+#define DENSE_BACKWARD 0x80
+
+#define DENSE_SMALL_MIN -64
+#define DENSE_SMALL_MAX 63
+#define DENSE_NARROW_POOL 32768     // pool indices that fit the 2-byte form
+#define DENSE_NARROW_ENTRIES 65536  // entries and counts that fit the 2-byte form
+#define DENSE_ENTRY_SPACING 64
+
+typedef struct
+{
+    int index;
+    int offset;
+} Dense_entry_t;
+
+typedef struct
+{
+    const CPU_command_t* commands;
+    int commands_cnt;
+    unsigned char* code;
+    int code_size;
+    Dense_entry_t* entries; // by increasing index and offset, the first one is command 0
+    int entries_cnt;
+    CPU_word_t* pool;       // distinct values without the short form
+    int pool_cnt;
+    int wide;               // targets, pool indices and counts take 4 bytes
+} Dense_t;
+
+int Dense_ctor(Dense_t* This, const CPU_command_t* commands, int commands_cnt);
+int Dense_dtor(Dense_t* This);
+int Dense_ok(Dense_t* This);
+int Dense_dump(Dense_t* This, char* name);
+int Dense_index(const Dense_t* This, int offset);
+int Dense_offset(const Dense_t* This, int index);
+int Dense_print_stats(Dense_t* This);
+int CPU_run_dense(CPU_t* This, Dense_t* dense);
+
+#endif // DENSE_H_INCLUDED
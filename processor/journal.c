@@ -0,0 +1,272 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "journal.h"
+#include "myassert.h"
+
+#define JOURNAL_FLAG_OUTPUTS 1
+#define JOURNAL_WORD_SHIFT 1    // WORD_KIND of the values is kept in the flags above the outputs bit
+
+static long long now()
+{
+    struct timespec time = {};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000LL + time.tv_nsec / 1000;
+}
+
+// opens the log for writing or reading, returns -1 if it cannot be opened or is not a journal
+int Journal_ctor(Journal_t* This, const char* filename, int mode, int outputs)
+{
+    assert(This);
+    assert(filename);
+    assert((mode == JOURNAL_RECORD) || (mode == JOURNAL_REPLAY));
+
+    *This = (Journal_t) {};
+    This->mode = mode;
+    This->stream = fopen(filename, (mode == JOURNAL_RECORD) ? "wb" : "rb");
+    if (!This->stream)
+    {
+        printf("Error opening journal ");
+        perror(filename);
+        return -1;
+    }
+
+    if (mode == JOURNAL_RECORD)
+    {
+        This->outputs = outputs;
+        fwrite(JOURNAL_MAGIC, 1, JOURNAL_MAGIC_LENGTH, This->stream);
+        fputc((outputs ? JOURNAL_FLAG_OUTPUTS : 0) | (WORD_KIND << JOURNAL_WORD_SHIFT), This->stream);
+    } else
+    {
+        char magic[JOURNAL_MAGIC_LENGTH] = {};
+        int flags = 0;
+        if ((fread(magic, 1, JOURNAL_MAGIC_LENGTH, This->stream) != JOURNAL_MAGIC_LENGTH) ||
+            memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) || ((flags = fgetc(This->stream)) == EOF))
+        {
+            printf("%s is not an input journal\n", filename);
+            fclose(This->stream);
+            This->stream = 0;
+            return -1;
+        }
+        if ((flags >> JOURNAL_WORD_SHIFT) != WORD_KIND)
+        {
+            printf("%s is a journal of another machine word, this processor runs " WORD_NAME "\n", filename);
+            fclose(This->stream);
+            This->stream = 0;
+            return -1;
+        }
+        This->outputs = (flags & JOURNAL_FLAG_OUTPUTS) != 0;
+    }
+    This->start_time = now();
+    This->last_time = This->start_time;
+
+    ASSERT_OK(Journal, This);
+
+    return 0;
+}
+
+int Journal_dtor(Journal_t* This)
+{
+    assert(This);
+
+    if (This->stream)
+        fclose(This->stream);
+    This->stream = 0;
+    This->mode = 0;
+
+    return 0;
+}
+
+int Journal_ok(Journal_t* This)
+{
+    return This && This->stream && ((This->mode == JOURNAL_RECORD) || (This->mode == JOURNAL_REPLAY)) &&
+           (This->inputs_cnt >= 0) && (This->outputs_cnt >= 0) && (This->mismatches >= 0);
+}
+
+int Journal_dump(Journal_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Journal_t(%s)\n"
+           "{\n"
+           "    stream = %p\n"
+           "    mode = %d\n"
+           "    outputs = %d\n"
+           "    inputs_cnt = %lld\n"
+           "    outputs_cnt = %lld\n"
+           "    mismatches = %lld\n"
+           "    exhausted = %d\n"
+           "}\n",
+           name, Journal_ok(This) ? "ok" : "NOT OK!!!", This->stream, This->mode, This->outputs,
+           This->inputs_cnt, This->outputs_cnt, This->mismatches, This->exhausted);
+
+    return 0;
+}
+
+int Journal_record(Journal_t* This, int kind, CPU_word_t value)
+{
+    ASSERT_OK(Journal, This);
+    assert(This->mode == JOURNAL_RECORD);
+
+    long long time = now();
+    unsigned long long delta = time - This->last_time;
+    This->last_time = time;
+
+    fputc(kind, This->stream);
+    fwrite(&value, sizeof(value), 1, This->stream);
+    do
+    {
+        int byte = delta & 0x7f;
+        delta >>= 7;
+        fputc(delta ? (byte | 0x80) : byte, This->stream);
+    } while (delta);
+
+    if (kind == JOURNAL_INPUT)
+        ++This->inputs_cnt;
+    else
+        ++This->outputs_cnt;
+
+    return 0;
+}
+
+// reads the next entry, returns its kind or EOF
+static int read_entry(Journal_t* This, CPU_word_t* value)
+{
+    int kind = fgetc(This->stream);
+    if (kind == EOF)
+        return EOF;
+    if (fread(value, sizeof(*value), 1, This->stream) != 1)
+        return EOF;
+    unsigned long long delta = 0;
+    int byte = 0;
+    for (int shift = 0; ((byte = fgetc(This->stream)) != EOF) && (shift < 64); shift += 7)
+    {
+        delta |= (unsigned long long) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    if (byte == EOF)
+        return EOF;
+    This->recorded_time += delta;
+
+    return kind;
+}
+
+// takes the next recorded input, returns -1 if the run has left the recorded one
+int Journal_input(Journal_t* This, CPU_word_t* value)
+{
+    ASSERT_OK(Journal, This);
+    assert(This->mode == JOURNAL_REPLAY);
+    assert(value);
+
+    *value = 0;
+    if (This->exhausted)
+        return -1;
+    CPU_word_t recorded = 0;
+    int kind = read_entry(This, &recorded);
+    if (kind != JOURNAL_INPUT)
+    {
+        if (kind == EOF)
+            printf("Input %lld is past the end of the journal\n", This->inputs_cnt + 1);
+        else
+            printf("Input %lld is taken where output %lld was recorded\n", This->inputs_cnt + 1,
+                   This->outputs_cnt + 1);
+        This->exhausted = 1;
+        ++This->mismatches;
+        return -1;
+    }
+    *value = recorded;
+    ++This->inputs_cnt;
+
+    return 0;
+}
+
+// records the output or checks it against the recorded one
+int Journal_output(Journal_t* This, CPU_word_t value)
+{
+    ASSERT_OK(Journal, This);
+
+    if (!This->outputs)
+        return 0;
+    if (This->mode == JOURNAL_RECORD)
+        return Journal_record(This, JOURNAL_OUTPUT, value);
+    if (This->exhausted)
+        return -1;
+
+    CPU_word_t recorded = 0;
+    int kind = read_entry(This, &recorded);
+    ++This->outputs_cnt;
+    if (kind != JOURNAL_OUTPUT)
+    {
+        if (kind == EOF)
+            printf("Output %lld is past the end of the journal\n", This->outputs_cnt);
+        else
+            printf("Output %lld is printed where input %lld was recorded\n", This->outputs_cnt,
+                   This->inputs_cnt + 1);
+        This->exhausted = 1;
+        ++This->mismatches;
+        return -1;
+    }
+    // NaN outputs match each other
+    if ((value != recorded) && !(word_is_nan(value) && word_is_nan(recorded)))
+    {
+        if (This->mismatches == 0)
+            printf("Output %lld is " WORD_PRINT ", " WORD_PRINT " was recorded\n", This->outputs_cnt, value,
+                   recorded);
+        ++This->mismatches;
+        return -1;
+    }
+
+    return 0;
+}
+
+// passes over the first inputs and outputs, which a run resumed from a snapshot has already seen
+int Journal_skip(Journal_t* This, long long inputs, long long outputs)
+{
+    ASSERT_OK(Journal, This);
+    assert(This->mode == JOURNAL_REPLAY);
+
+    while ((This->inputs_cnt < inputs) || (This->outputs && (This->outputs_cnt < outputs)))
+    {
+        CPU_word_t value = 0;
+        int kind = read_entry(This, &value);
+        if (kind == EOF)
+        {
+            printf("Journal ends before the position of the snapshot\n");
+            This->exhausted = 1;
+            ++This->mismatches;
+            return -1;
+        }
+        if (kind == JOURNAL_INPUT)
+            ++This->inputs_cnt;
+        else
+            ++This->outputs_cnt;
+    }
+
+    return 0;
+}
+
+// reports the replay, returns 0 if the run took and printed exactly what was recorded
+int Journal_finish(Journal_t* This)
+{
+    ASSERT_OK(Journal, This);
+
+    if (This->mode == JOURNAL_RECORD)
+    {
+        fflush(This->stream);
+        return 0;
+    }
+
+    CPU_word_t value = 0;
+    if (!This->exhausted && (read_entry(This, &value) != EOF))
+    {
+        printf("The run ended before the end of the journal\n");
+        ++This->mismatches;
+    }
+    printf("Replayed %lld inputs and %lld outputs in %.3f s, recorded run took %.3f s, %lld mismatches\n",
+           This->inputs_cnt, This->outputs_cnt, (now() - This->start_time) / 1e6, This->recorded_time / 1e6,
+           This->mismatches);
+
+    return This->mismatches ? -1 : 0;
+}
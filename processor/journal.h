@@ -0,0 +1,51 @@
+#ifndef JOURNAL_H_INCLUDED
+#define JOURNAL_H_INCLUDED
+
+#include <stdio.h>
+#include "word.h"
+
+#define JOURNAL_MAGIC "CPUIOLOG"
+#define JOURNAL_MAGIC_LENGTH 8
+
+// journal entry kinds
+#define JOURNAL_INPUT 'I'
+#define JOURNAL_OUTPUT 'O'
+
+enum JOURNAL_MODE {
+    JOURNAL_RECORD = 1,
+    JOURNAL_REPLAY
+};
+
+/*
+ * Binary log of the values a run takes by IN and, optionally, prints by OUT.
+ * After the magic and a flags byte, every entry is its kind, the value as a
+ * machine word and the time since the previous entry in microseconds, written
+ * 7 bits per byte with the high bit set on all bytes but the last.
+ * Replaying feeds the inputs back without prompts or waiting and compares
+ * the outputs with the recorded ones.
+ */
+typedef struct
+{
+    FILE* stream;
+    int mode;
+    int outputs;                // OUT values are in the log
+    long long last_time;        // of the previous entry, in microseconds
+    long long recorded_time;    // sum of the entry times read so far
+    long long start_time;
+    long long inputs_cnt;
+    long long outputs_cnt;
+    long long mismatches;
+    int exhausted;              // replay ran past the end of the log
+} Journal_t;
+
+int Journal_ctor(Journal_t* This, const char* filename, int mode, int outputs);
+int Journal_dtor(Journal_t* This);
+int Journal_ok(Journal_t* This);
+int Journal_dump(Journal_t* This, char* name);
+int Journal_record(Journal_t* This, int kind, CPU_word_t value);
+int Journal_input(Journal_t* This, CPU_word_t* value);
+int Journal_output(Journal_t* This, CPU_word_t value);
+int Journal_skip(Journal_t* This, long long inputs, long long outputs);
+int Journal_finish(Journal_t* This);
+
+#endif // JOURNAL_H_INCLUDED
@@ -0,0 +1,337 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lazy.h"
+#include "commands.h"
+#include "processor.h"
+#include "natives.h"
+#include "myassert.h"
+
+#define MAX_TOKEN MAX_NATIVE_NAME
+#define INITIAL_CAPACITY 1024
+
+// copies the next whitespace separated token into buffer, returns 0 at the end of the file
+static int next_token(Lazy_program_t* This, char* buffer)
+{
+    while ((This->position < This->size) && isspace((unsigned char) This->data[This->position]))
+        ++This->position;
+
+    int length = 0;
+    while ((This->position < This->size) && !isspace((unsigned char) This->data[This->position]))
+    {
+        if (length < MAX_TOKEN - 1)
+            buffer[length++] = This->data[This->position];
+        ++This->position;
+    }
+    buffer[length] = '\0';
+
+    return length;
+}
+
+static int read_int(Lazy_program_t* This, int* value)
+{
+    char token[MAX_TOKEN] = {};
+    char* end = 0;
+    if (!next_token(This, token))
+        return 0;
+    *value = strtol(token, &end, 10);
+    return *end == '\0';
+}
+
+static int read_word(Lazy_program_t* This, CPU_word_t* value)
+{
+    char token[MAX_TOKEN] = {};
+    char* end = 0;
+    if (!next_token(This, token))
+        return 0;
+    *value = word_parse(token, &end);
+    return (end != token) && (*end == '\0');
+}
+
+// checks the word tag like CPU_word_read() does, returns 0 or the ctor error code
+static int read_word_tag(Lazy_program_t* This)
+{
+    size_t position = This->position;
+    char token[MAX_TOKEN] = {};
+    if (!next_token(This, token) || strcmp(token, WORD_MAGIC))
+    {
+        This->position = position;
+        strcpy(token, "float");
+    } else if (!next_token(This, token))
+    {
+        printf("Program file corrupt\n");
+        return 2;
+    }
+    if (strcmp(token, WORD_NAME))
+    {
+        printf("Program is written for %s words, this build runs " WORD_NAME " ones\n", token);
+        return 2;
+    }
+
+    return 0;
+}
+
+// reads and resolves the natives table if the program starts with one, returns 0 or the ctor error code
+static int read_natives(Lazy_program_t* This)
+{
+    size_t position = This->position;
+    char token[MAX_TOKEN] = {};
+    if (!next_token(This, token) || strcmp(token, NATIVES_MAGIC))
+    {
+        This->position = position;
+        return 0;
+    }
+
+    int count = 0;
+    if (!read_int(This, &count) || (count < 0) || (count > COMMANDS_MAX_NATIVES))
+    {
+        printf("Program file corrupt\n");
+        return 2;
+    }
+    char** names = (char**) calloc(count + 1, sizeof(*names));
+    int result = 0;
+    for (int i = 0; (i < count) && (result == 0); ++i)
+    {
+        if (!next_token(This, token))
+        {
+            printf("Program file corrupt\n");
+            result = 2;
+        } else
+            names[i] = strdup(token);
+    }
+    This->natives = (int*) calloc(count + 1, sizeof(*This->natives));
+    This->natives_cnt = count;
+    if ((result == 0) && (Natives_resolve(names, count, This->natives) != 0))
+        result = 2;
+    CPU_natives_free(names, count);
+
+    return result;
+}
+
+int Lazy_program_ctor(Lazy_program_t* This, const char* filename)
+{
+    assert(This);
+    assert(filename);
+
+    This->fd = -1;
+    This->data = 0;
+    This->commands = 0;
+    This->natives = 0;
+    This->natives_cnt = 0;
+
+    This->fd = open(filename, O_RDONLY);
+    if (This->fd < 0)
+    {
+        printf("Error opening file ");
+        perror(filename);
+        return 1;
+    }
+
+    struct stat info = {};
+    if ((fstat(This->fd, &info) != 0) || (info.st_size == 0))
+    {
+        printf("Program file corrupt\n");
+        return 2;
+    }
+    This->size = info.st_size;
+
+    void* data = mmap(0, This->size, PROT_READ, MAP_PRIVATE, This->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        printf("Error mapping file ");
+        perror(filename);
+        return 1;
+    }
+    madvise(data, This->size, MADV_SEQUENTIAL);
+    This->data = (const char*) data;
+    This->position = 0;
+
+    int header_result = read_word_tag(This);
+    if (header_result == 0)
+        header_result = read_natives(This);
+    if (header_result != 0)
+        return header_result;
+    if (!read_int(This, &This->commands_cnt) || !read_int(This, &This->params_cnt) || (This->commands_cnt <= 0))
+    {
+        printf("Program file corrupt\n");
+        return 2;
+    }
+
+    This->decoded_cnt = 0;
+    This->decoded_params_cnt = 0;
+    This->capacity = (This->commands_cnt < INITIAL_CAPACITY) ? This->commands_cnt : INITIAL_CAPACITY;
+    This->commands = (CPU_command_t*) calloc(This->capacity, sizeof(*This->commands));
+
+    ASSERT_OK(Lazy_program, This);
+
+    return 0;
+}
+
+int Lazy_program_dtor(Lazy_program_t* This)
+{
+    assert(This);
+
+    if (This->data)
+        munmap((void*) This->data, This->size);
+    if (This->fd >= 0)
+        close(This->fd);
+    free(This->commands);
+    free(This->natives);
+    This->natives = 0;
+    This->natives_cnt = 0;
+    This->data = 0;
+    This->fd = -1;
+    This->commands = 0;
+    This->size = 0;
+    This->capacity = 0;
+    This->decoded_cnt = -1;
+
+    return 0;
+}
+
+int Lazy_program_ok(Lazy_program_t* This)
+{
+    if (!This)
+        return 0;
+    if (!This->data || !This->commands)
+        return 0;
+    if ((This->decoded_cnt < 0) || (This->decoded_cnt > This->capacity) || (This->capacity > This->commands_cnt))
+        return 0;
+    if (This->position > This->size)
+        return 0;
+    return 1;
+}
+
+int Lazy_program_dump(Lazy_program_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Lazy_program_t(%s)\n"
+           "{\n"
+           "    size = %zu\n"
+           "    position = %zu\n"
+           "    commands_cnt = %d\n"
+           "    params_cnt = %d\n"
+           "    decoded_cnt = %d\n"
+           "    decoded_params_cnt = %d\n"
+           "    capacity = %d\n"
+           "}\n",
+           name, Lazy_program_ok(This) ? "ok" : "NOT OK!!!", This->size, This->position, This->commands_cnt,
+           This->params_cnt, This->decoded_cnt, This->decoded_params_cnt, This->capacity);
+
+    return 0;
+}
+
+// decodes commands up to index and EXT operands or table of the one there, returns -1 for index out of the program and -2 for corrupt file
+int Lazy_program_decode(Lazy_program_t* This, int index)
+{
+    ASSERT_OK(Lazy_program, This);
+
+    if ((index < 0) || (index >= This->commands_cnt))
+        return -1;
+    if (index < This->decoded_cnt)
+        return 0;
+
+    int ext_cnt = 0;     // EXT and CASE commands the last decoded command still expects
+    while ((This->decoded_cnt <= index) || (ext_cnt > 0))
+    {
+        if (This->decoded_cnt == This->commands_cnt)
+            return -2;
+        if (This->decoded_cnt == This->capacity)
+        {
+            int capacity = This->capacity;
+            while (capacity <= index)
+                capacity *= 2;
+            if (capacity == This->capacity)
+                capacity *= 2;
+            if (capacity > This->commands_cnt)
+                capacity = This->commands_cnt;
+            This->commands = (CPU_command_t*) realloc(This->commands, capacity * sizeof(*This->commands));
+            This->capacity = capacity;
+        }
+
+        int cmd = 0;
+        int reg = 0;
+        int reg2 = 0;
+        CPU_word_t param = 0;
+        if (!read_int(This, &cmd) || (cmd < END) || (cmd >= COMMANDS_CNT) || (((cmd == EXT) || (cmd == CASE)) != (ext_cnt > 0)))
+            return -2;
+        int operands = CPU_command_operands(cmd);
+        if (((operands & OPERAND_REG) && !read_int(This, &reg)) ||
+            ((operands & OPERAND_REG2) && !read_int(This, &reg2)) ||
+            ((operands & OPERAND_PARAM) && !read_word(This, &param)))
+            return -2;
+        This->decoded_params_cnt += CPU_command_operands_cnt(cmd);
+
+        // filled as CPU_command_read() does, the constructor would assert on a corrupt command
+        CPU_command_t* command = &This->commands[This->decoded_cnt];
+        command->command = cmd;
+        command->reg = reg;
+        command->reg2 = reg2;
+        command->parameter = param;
+        if (!CPU_command_ok(command))
+            return -2;
+        if (cmd == NATIVE)
+        {
+            if (param >= This->natives_cnt)
+                return -2;
+            command->parameter = This->natives[(int) param];
+        }
+        ++This->decoded_cnt;
+        ext_cnt = ((cmd == EXT) || (cmd == CASE)) ? ext_cnt - 1 : CPU_command_length(command) - 1;
+    }
+
+    if (This->decoded_cnt == This->commands_cnt)
+    {
+        // only the debug section may follow
+        char token[MAX_TOKEN] = {};
+        if ((next_token(This, token) && strcmp(token, DEBUG_MAGIC)) || (This->decoded_params_cnt != This->params_cnt))
+            return -2;
+    }
+
+    ASSERT_OK(Lazy_program, This);
+    return 0;
+}
+
+int CPU_run_lazy(CPU_t* This, Lazy_program_t* program)
+{
+    ASSERT_OK(CPU, This);
+    ASSERT_OK(Lazy_program, program);
+
+    int command_index = This->start;
+    for (;;)
+    {
+        if ((command_index < 0) || (command_index >= program->decoded_cnt))
+        {
+            int decode_result = Lazy_program_decode(program, command_index);
+            if (decode_result == -2)
+            {
+                printf("Program file corrupt\n");
+                return -2;
+            } else if (decode_result != 0)
+            {
+                printf("Jump to %d is out of the program\n", command_index);
+                return -1;
+            }
+        }
+        int command = program->commands[command_index].command;
+        if (command == END)
+            break;
+        if ((command >= SPAWN) && (command <= RECV))
+        {
+            printf("Programs using concurrency commands cannot be run lazily\n");
+            return -1;
+        }
+        int result = CPU_step(This, program->commands, &command_index);
+        if (result != 0)
+            return result;
+    }
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef LAZY_H_INCLUDED
+#define LAZY_H_INCLUDED
+
+#include <stddef.h>
+#include "commands.h"
+#include "processor.h"
+
+/*
+ * Program file mapped into memory and decoded on demand. Commands are text
+ * of variable width, so decoding moves a frontier forward: reaching command
+ * N decodes everything before it once, and the decoded form is kept.
+ */
+typedef struct
+{
+    int fd;
+    const char* data;
+    size_t size;
+    size_t position;    // offset of the first command not decoded yet
+    int commands_cnt;   // counts from the header
+    int params_cnt;
+    int decoded_cnt;
+    int decoded_params_cnt;
+    int capacity;
+    CPU_command_t* commands;
+    int natives_cnt;    // registered functions of the natives table
+    int* natives;
+} Lazy_program_t;
+
+int Lazy_program_ctor(Lazy_program_t* This, const char* filename);
+int Lazy_program_dtor(Lazy_program_t* This);
+int Lazy_program_ok(Lazy_program_t* This);
+int Lazy_program_dump(Lazy_program_t* This, char* name);
+int Lazy_program_decode(Lazy_program_t* This, int index);
+int CPU_run_lazy(CPU_t* This, Lazy_program_t* program);
+
+#endif // LAZY_H_INCLUDED
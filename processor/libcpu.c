@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "libcpu.h"
+#include "commands.h"
+#include "processor.h"
+#include "loader.h"
+#include "scheduler.h"
+
+struct CPU_program
+{
+    CPU_command_t* commands;
+    int commands_cnt;
+};
+
+// the processor arena follows the context in the block of the host
+struct CPU_context
+{
+    CPU_t cpu;
+    const CPU_program_t* program;
+    int finished;
+    Watchdog_t watchdog;    // set to the processor by CPU_context_limit()
+};
+
+/*
+ * Loads the program file, returns 0 or the code of the processor: 1 if the
+ * file cannot be opened, 2 if it is corrupt or uses concurrency commands,
+ * which only the scheduler of the processor runs.
+ */
+int CPU_program_load(const char* filename, CPU_program_t** program)
+{
+    assert(filename);
+    assert(program);
+
+    *program = 0;
+    CPU_command_t* commands = 0;
+    int commands_cnt = 0;
+    int result = CPU_load_program(filename, &commands, &commands_cnt);
+    if (result != 0)
+        return result;
+    if (Scheduler_needed(commands, commands_cnt))
+    {
+        printf("Programs using concurrency commands cannot be embedded\n");
+        free(commands);
+        return 2;
+    }
+
+    *program = (CPU_program_t*) calloc(1, sizeof(**program));
+    (*program)->commands = commands;
+    (*program)->commands_cnt = commands_cnt;
+
+    return 0;
+}
+
+// the program may be freed once no context runs it
+int CPU_program_free(CPU_program_t* program)
+{
+    if (!program)
+        return 0;
+    free(program->commands);
+    free(program);
+
+    return 0;
+}
+
+int CPU_program_commands_cnt(const CPU_program_t* program)
+{
+    assert(program);
+
+    return program->commands_cnt;
+}
+
+// bytes of the block a context takes, memory_size is in cells, 0 for MEMORY_SIZE
+size_t CPU_context_size(int memory_size)
+{
+    assert(memory_size >= 0);
+
+    return sizeof(CPU_context_t) + CPU_arena_size(memory_size ? memory_size : MEMORY_SIZE);
+}
+
+/*
+ * Lays a context of the program out in arena, which has to be aligned for
+ * a pointer, as malloc() gives it. io may be 0 for the console. Returns 0
+ * if arena is smaller than CPU_context_size().
+ */
+CPU_context_t* CPU_context_init(void* arena, size_t arena_size, const CPU_program_t* program, int memory_size,
+                                const CPU_io_t* io)
+{
+    assert(arena);
+    assert(program);
+    assert(memory_size >= 0);
+
+    if (arena_size < CPU_context_size(memory_size))
+        return 0;
+
+    CPU_context_t* context = (CPU_context_t*) arena;
+    CPU_ctor_arena(&context->cpu, context + 1, memory_size ? memory_size : MEMORY_SIZE);
+    if (io)
+        context->cpu.io = *io;
+    context->program = program;
+    context->finished = 0;
+
+    return context;
+}
+
+// makes the context ready to run the program again from its start
+int CPU_context_reset(CPU_context_t* context)
+{
+    assert(context);
+
+    CPU_reset(&context->cpu);
+    context->finished = 0;
+
+    return 0;
+}
+
+// limits of the runs of the context, 0 for none; the time of a run is counted from its start
+int CPU_context_limit(CPU_context_t* context, long long max_instructions, long long timeout)
+{
+    assert(context);
+    assert((max_instructions >= 0) && (timeout >= 0));
+
+    Watchdog_ctor(&context->watchdog, max_instructions, timeout);
+    context->cpu.watchdog = (max_instructions || timeout) ? &context->watchdog : 0;
+
+    return 0;
+}
+
+/*
+ * Runs the program to its end, returns -1 if it has already been run since
+ * the last reset or a command failed and CPU_EXPIRED if a limit of the
+ * context stopped it.
+ */
+int CPU_context_run(CPU_context_t* context)
+{
+    assert(context);
+
+    if (context->finished)
+    {
+        printf("Context has finished, reset it to run again\n");
+        return -1;
+    }
+    if (context->cpu.watchdog)
+        Watchdog_start(context->cpu.watchdog);
+    int result = CPU_run_program(&context->cpu, context->program->commands);
+    context->finished = 1;
+
+    return result;
+}
+
+CPU_word_t CPU_context_register(const CPU_context_t* context, int reg)
+{
+    assert(context);
+    assert((reg >= RAX) && (reg <= RDX));
+
+    return *CPU_register((CPU_t*) &context->cpu, reg);
+}
+
+// values is given the bottom of the stack, returns the number of values on it
+int CPU_context_stack(const CPU_context_t* context, const CPU_word_t** values)
+{
+    assert(context);
+    assert(values);
+
+    *values = context->cpu.cstack->data;
+    return context->cpu.cstack->count;
+}
+
+CPU_word_t* CPU_context_memory(CPU_context_t* context, int* memory_size)
+{
+    assert(context);
+    assert(memory_size);
+
+    *memory_size = context->cpu.memory_size;
+    return context->cpu.memory;
+}
@@ -0,0 +1,44 @@
+#ifndef LIBCPU_H_INCLUDED
+#define LIBCPU_H_INCLUDED
+
+#include <stddef.h>
+#include "word.h"
+#include "processor.h"
+
+/*
+ * Interface for running programs inside another application. A program is
+ * loaded once and never changed, so any number of contexts on any threads
+ * may run it. A context is the state of one run: registers, stacks and
+ * memory, all laid out in a single block the host gives it. Creating,
+ * running and resetting a context allocate nothing.
+ *
+ *     CPU_program_t* program = 0;
+ *     CPU_program_load("code.out", &program);
+ *     void* arena = malloc(CPU_context_size(0));
+ *     CPU_context_t* context = CPU_context_init(arena, CPU_context_size(0), program, 0, &io);
+ *     CPU_context_run(context);
+ *     CPU_context_reset(context);  // and run again
+ *     free(arena);
+ *     CPU_program_free(program);
+ *
+ * Native functions are registered before programs using them are loaded.
+ * CPU_context_limit() bounds every later run of the context in commands and
+ * milliseconds, a run stopped by a limit returns CPU_EXPIRED.
+ */
+typedef struct CPU_program CPU_program_t;
+typedef struct CPU_context CPU_context_t;
+
+int CPU_program_load(const char* filename, CPU_program_t** program);
+int CPU_program_free(CPU_program_t* program);
+int CPU_program_commands_cnt(const CPU_program_t* program);
+size_t CPU_context_size(int memory_size);
+CPU_context_t* CPU_context_init(void* arena, size_t arena_size, const CPU_program_t* program, int memory_size,
+                                const CPU_io_t* io);
+int CPU_context_reset(CPU_context_t* context);
+int CPU_context_limit(CPU_context_t* context, long long max_instructions, long long timeout);
+int CPU_context_run(CPU_context_t* context);
+CPU_word_t CPU_context_register(const CPU_context_t* context, int reg);
+int CPU_context_stack(const CPU_context_t* context, const CPU_word_t** values);
+CPU_word_t* CPU_context_memory(CPU_context_t* context, int* memory_size);
+
+#endif // LIBCPU_H_INCLUDED
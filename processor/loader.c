@@ -0,0 +1,118 @@
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "loader.h"
+#include "commands.h"
+#include "natives.h"
+
+/*
+ * Reads the program file into a new array of commands with their natives
+ * bound. Returns 0, 1 if the file cannot be opened or 2 if it is corrupt,
+ * the reason is printed.
+ */
+int CPU_load_program(const char* filename, CPU_command_t** commands, int* commands_cnt)
+{
+    assert(filename);
+    assert(commands);
+    assert(commands_cnt);
+
+    *commands = 0;
+    *commands_cnt = 0;
+    FILE* stream = fopen(filename, "rb");
+    if (!stream)
+    {
+        printf("Error opening file ");
+        perror(filename);
+        return 1;
+    }
+
+    int word = CPU_word_read(stream);
+    if (word != 0)
+    {
+        if (word < 0)
+            printf("Program file corrupt\n");
+        fclose(stream);
+        return 2;
+    }
+
+    char** natives = 0;
+    int natives_cnt = 0;
+    int params_cnt = 0;
+    if ((CPU_natives_read(stream, &natives, &natives_cnt) != 0) ||
+        (fscanf(stream, "%d %d", commands_cnt, &params_cnt) != 2) || (*commands_cnt <= 0))
+    {
+        printf("Program file corrupt\n");
+        CPU_natives_free(natives, natives_cnt);
+        fclose(stream);
+        return 2;
+    }
+
+    *commands = (CPU_command_t*) calloc(*commands_cnt, sizeof(**commands));
+
+    int fill_result = fill_commands(stream, *commands, *commands_cnt, params_cnt);
+    fclose(stream);
+    if (fill_result == 0)
+        fill_result = link_natives(*commands, *commands_cnt, natives, natives_cnt);
+    CPU_natives_free(natives, natives_cnt);
+
+    if (fill_result != 0)
+    {
+        if (fill_result == -2)
+            printf("Program file corrupt\n");
+        free(*commands);
+        *commands = 0;
+        *commands_cnt = 0;
+        return 2;
+    }
+
+    return 0;
+}
+
+int fill_commands(FILE* stream, CPU_command_t* commands, int commands_cnt, int params_cnt)
+{
+    assert(stream);
+    assert(commands);
+
+    int cmd_index = 0;
+    int _params_cnt = 0;
+    CPU_command_t command = {};
+    int result = 0;
+    while ((cmd_index < commands_cnt) && ((result = CPU_command_read(&command, stream)) == 0))
+    {
+        commands[cmd_index] = command;
+        _params_cnt += CPU_command_operands_cnt(command.command);
+        ++cmd_index;
+    }
+    if (result < 0)
+    {
+        printf("Incorrect argument\n");
+        return -1;
+    }
+    // only the debug section may follow, it is left for Symbols_where() to read when needed
+    int c = getc(stream);
+    while (isspace(c))
+        c = getc(stream);
+    if ((c != EOF) && (c != DEBUG_MAGIC[0]))
+        return -2;
+    if ((cmd_index == commands_cnt) && (_params_cnt == params_cnt) && (CPU_commands_check(commands, commands_cnt) == 0))
+        return 0;
+    else
+        return -2;
+}
+
+// binds NATIVE commands to the registered functions named in the natives table of the program
+int link_natives(CPU_command_t* commands, int commands_cnt, char** names, int names_cnt)
+{
+    assert(commands);
+
+    int* indices = (int*) calloc(names_cnt + 1, sizeof(*indices));
+    int result = 0;
+    if (Natives_resolve(names, names_cnt, indices) != 0)
+        result = -1;
+    else if (Natives_link(commands, commands_cnt, indices, names_cnt) != 0)
+        result = -2;
+    free(indices);
+
+    return result;
+}
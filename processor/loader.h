@@ -0,0 +1,10 @@
+#ifndef LOADER_H_INCLUDED
+#define LOADER_H_INCLUDED
+
+#include "commands.h"
+
+int CPU_load_program(const char* filename, CPU_command_t** commands, int* commands_cnt);
+int fill_commands(FILE* stream, CPU_command_t* commands, int commands_cnt, int params_cnt);
+int link_natives(CPU_command_t* commands, int commands_cnt, char** names, int names_cnt);
+
+#endif // LOADER_H_INCLUDED
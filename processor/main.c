@@ -1,44 +1,274 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "processor.h"
 #include "commands.h"
+#include "blocks.h"
+#include "lazy.h"
+#include "trace.h"
+#include "regvm.h"
+#include "dense.h"
+#include "vector.h"
+#include "natives.h"
+#include "scheduler.h"
+#include "debugger.h"
+#include "symbols.h"
+#include "loader.h"
+#include "snapshot.h"
+#include "sampler.h"
+#include "perfmap.h"
 
 #define DEFAULT_INPUT "../assembler/code.out"
 
+// execution engines
+#define ENGINE_INTERPRETER 0
+#define ENGINE_BLOCKS 1
+#define ENGINE_TRACE 2
+#define ENGINE_REGVM 3
+#define ENGINE_DENSE 4
+
 #define MY_NAME "GavYur"
 #define GREET(program, version) printf("#--- " program " v" version " (%s %s) by " MY_NAME "\n\n", __DATE__, __TIME__)
 
+typedef struct
+{
+    const char* input;
+    int engine;
+    int lazy;
+    int trace_stats;
+    int dense_stats;
+    int memory_size;
+    int native_stats;
+    int threads;
+    int debug;
+    const char* record;
+    int record_outputs;
+    const char* replay;
+    const char* profile;
+    long long max_instructions;
+    long long timeout;
+    const char* snapshot;
+    const char* snapshot_at;
+    const char* restore;
+    const char* sample;
+    int sample_rate;
+    int perf;               // PERFMAP_MAP and PERFMAP_JITDUMP
+} Options_t;
+
 int print_help();
 int print_version();
-int parse_file(const char* filename);
-int fill_commands(FILE* stream, CPU_command_t* commands, int commands_cnt, int params_cnt);
+int parse_options(Options_t* options, int argc, char* argv[]);
+int parse_file(const Options_t* options);
+int run_program(const Options_t* options, CPU_command_t* commands, int commands_cnt);
+int run_lazy(const Options_t* options);
+int processor_ctor(const Options_t* options, CPU_t* processor, Journal_t* journal, Watchdog_t* watchdog);
+int processor_dtor(CPU_t* processor, Journal_t* journal);
+int print_expired(CPU_t* processor);
+int find_command(const char* position, const CPU_command_t* commands, int commands_cnt);
+int restore_snapshot(const Options_t* options, CPU_t* processor, const CPU_command_t* commands, int commands_cnt);
+int run_profiled(const Options_t* options, CPU_t* processor, CPU_command_t* commands, int commands_cnt);
 
 int main(int argc, char* argv[])
 {
-    if (argc == 1)
-    {
-        return parse_file(DEFAULT_INPUT);
-    } else if (argc == 2)
+    Natives_register_builtins();
+
+    Options_t options = {};
+    int result = parse_options(&options, argc, argv);
+    if (result != 0)
+        return (result < 0) ? print_help() : print_version();
+
+    Symbols_attach(options.input);
+    result = parse_file(&options);
+    Symbols_release();
+
+    return result;
+}
+
+// returns 0 when the program has to be run, -1 for help and 1 for version
+int parse_options(Options_t* options, int argc, char* argv[])
+{
+    assert(options);
+
+    options->input = DEFAULT_INPUT;
+    options->engine = ENGINE_INTERPRETER;
+    options->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    options->sample_rate = SAMPLER_RATE;
+
+    for (int i = 1; i < argc; ++i)
     {
-        if (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))
-            return print_help();
-        else if (!strcmp(argv[1], "--version") || !strcmp(argv[1], "-v"))
-            return print_version();
+        if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h"))
+            return -1;
+        else if (!strcmp(argv[i], "--version") || !strcmp(argv[i], "-v"))
+            return 1;
+        else if (!strcmp(argv[i], "--engine=interpreter"))
+            options->engine = ENGINE_INTERPRETER;
+        else if (!strcmp(argv[i], "--engine=blocks"))
+            options->engine = ENGINE_BLOCKS;
+        else if (!strcmp(argv[i], "--engine=trace"))
+            options->engine = ENGINE_TRACE;
+        else if (!strcmp(argv[i], "--engine=regvm"))
+            options->engine = ENGINE_REGVM;
+        else if (!strcmp(argv[i], "--engine=dense"))
+            options->engine = ENGINE_DENSE;
+        else if (!strcmp(argv[i], "--trace-stats"))
+            options->trace_stats = 1;
+        else if (!strcmp(argv[i], "--dense-stats"))
+            options->dense_stats = 1;
+        else if (!strcmp(argv[i], "--lazy"))
+            options->lazy = 1;
+        else if (!strcmp(argv[i], "--debug"))
+            options->debug = 1;
+        else if (!strncmp(argv[i], "--record=", strlen("--record=")))
+            options->record = argv[i] + strlen("--record=");
+        else if (!strcmp(argv[i], "--record-outputs"))
+            options->record_outputs = 1;
+        else if (!strncmp(argv[i], "--replay=", strlen("--replay=")))
+            options->replay = argv[i] + strlen("--replay=");
+        else if (!strncmp(argv[i], "--profile=", strlen("--profile=")))
+            options->profile = argv[i] + strlen("--profile=");
+        else if (!strncmp(argv[i], "--snapshot=", strlen("--snapshot=")))
+            options->snapshot = argv[i] + strlen("--snapshot=");
+        else if (!strncmp(argv[i], "--snapshot-at=", strlen("--snapshot-at=")))
+            options->snapshot_at = argv[i] + strlen("--snapshot-at=");
+        else if (!strncmp(argv[i], "--restore=", strlen("--restore=")))
+            options->restore = argv[i] + strlen("--restore=");
+        else if (!strcmp(argv[i], "--perf-map"))
+            options->perf |= PERFMAP_MAP;
+        else if (!strcmp(argv[i], "--jitdump"))
+            options->perf |= PERFMAP_JITDUMP;
+        else if (!strncmp(argv[i], "--sample=", strlen("--sample=")))
+            options->sample = argv[i] + strlen("--sample=");
+        else if (!strncmp(argv[i], "--sample-rate=", strlen("--sample-rate=")))
+        {
+            char* end = 0;
+            options->sample_rate = strtol(argv[i] + strlen("--sample-rate="), &end, 10);
+            if ((*end != '\0') || (options->sample_rate <= 0) || (options->sample_rate > 1000000))
+                return -1;
+        }
+        else if (!strcmp(argv[i], "--native-stats"))
+            options->native_stats = 1;
+        else if (!strncmp(argv[i], "--threads=", strlen("--threads=")))
+        {
+            char* end = 0;
+            options->threads = strtol(argv[i] + strlen("--threads="), &end, 10);
+            if ((*end != '\0') || (options->threads <= 0))
+                return -1;
+        }
+        else if (!strncmp(argv[i], "--max-instructions=", strlen("--max-instructions=")))
+        {
+            char* end = 0;
+            options->max_instructions = strtoll(argv[i] + strlen("--max-instructions="), &end, 10);
+            if ((*end != '\0') || (options->max_instructions <= 0))
+                return -1;
+        }
+        else if (!strncmp(argv[i], "--timeout=", strlen("--timeout=")))
+        {
+            char* end = 0;
+            options->timeout = strtoll(argv[i] + strlen("--timeout="), &end, 10);
+            if ((*end != '\0') || (options->timeout <= 0))
+                return -1;
+        }
+        else if (!strncmp(argv[i], "--memory=", strlen("--memory=")))
+        {
+            char* end = 0;
+            options->memory_size = strtol(argv[i] + strlen("--memory="), &end, 10);
+            if ((*end != '\0') || (options->memory_size <= 0))
+                return -1;
+        } else if (!strncmp(argv[i], "--vector=", strlen("--vector=")))
+        {
+            if (Vector_select(argv[i] + strlen("--vector=")) != 0)
+            {
+                printf("Vector kernels %s are not supported here\n", argv[i] + strlen("--vector="));
+                return -1;
+            }
+        }
+        else if ((argv[i][0] != '-') && (i == argc - 1))
+            options->input = argv[i];
         else
-            return parse_file(argv[1]);
-    } else
-        return print_help();
+            return -1;
+    }
+    if (options->lazy && (options->engine != ENGINE_INTERPRETER))
+        return -1;
+    if (options->trace_stats && (options->engine != ENGINE_TRACE))
+        return -1;
+    if (options->dense_stats && (options->engine != ENGINE_DENSE))
+        return -1;
+    if (options->debug && (options->lazy || (options->engine != ENGINE_INTERPRETER)))
+        return -1;
+    if ((options->record && options->replay) || (options->record_outputs && !options->record))
+        return -1;
+    if (options->profile && (options->lazy || options->debug || (options->engine != ENGINE_INTERPRETER)))
+        return -1;
+    if ((options->max_instructions || options->timeout) && options->debug)
+        return -1;
+    if (!options->snapshot != !options->snapshot_at)
+        return -1;
+    if (options->snapshot &&
+        (options->lazy || options->debug || options->profile || (options->engine != ENGINE_INTERPRETER)))
+        return -1;
+    if (options->restore && (options->lazy || options->debug))
+        return -1;
+    if (options->sample && (options->lazy || options->debug || options->profile || options->snapshot))
+        return -1;
+    if (options->perf &&
+        (options->lazy || options->debug || options->profile || options->snapshot ||
+         (options->engine != ENGINE_INTERPRETER)))
+        return -1;
+
+    return 0;
 }
+
 int print_help()
 {
     GREET("Processor", "0.1");
     printf("\nusage: processor [options] [input_file]\n\n"
            "Options:\n"
            "  -h, --help\t\tprints this message\n"
-           "  -v, --version\t\tprints version of this program\n\n"
+           "  -v, --version\t\tprints version of this program\n"
+           "  --engine=NAME\t\texecution engine:\n"
+           "\t\t\t  interpreter - runs commands one by one (default)\n"
+           "\t\t\t  blocks - runs basic blocks checking stack bounds once per block\n"
+           "\t\t\t  trace - records hot loops into optimised traces\n"
+           "\t\t\t  regvm - translates blocks into register code without stack traffic\n"
+           "\t\t\t  dense - runs a compact byte code with one-byte opcodes and a constant pool\n"
+           "  --trace-stats\t\tprints statistics of the trace engine at exit\n"
+           "  --dense-stats\t\tprints the size of the code of the dense engine\n"
+           "  --lazy\t\tmaps input file and decodes commands only when they are reached\n"
+           "\t\t\t(interpreter engine only)\n"
+           "  --memory=N\t\tsize of the linear memory in cells (%d by default)\n"
+           "  --vector=NAME\t\tkernels of the bulk memory commands: auto (default), scalar, sse, avx2\n"
+           "  --native-stats\t\tprints the number of calls of every native function at exit\n"
+           "  --threads=N\t\tworkers running the contexts of spawn (number of cores by default)\n"
+           "  --debug\t\truns the program under the debugger reading its commands from stdin,\n"
+           "\t\t\ttype help there to list them (interpreter engine only)\n"
+           "  --record=FILE\t\twrites every value taken by in to a binary journal\n"
+           "  --record-outputs\twrites the values printed by out to the journal too\n"
+           "  --replay=FILE\t\ttakes the inputs from a journal without prompts and checks the outputs\n"
+           "\t\t\tagainst the recorded ones; a mismatch exits with code 4\n"
+           "  --profile=FILE\t\twrites how often every command ran and jumped for assembler --profile-use\n"
+           "\t\t\t(interpreter engine only)\n"
+           "  --max-instructions=N\tstops the program with code 5 after about N commands\n"
+           "  --timeout=MS\t\tstops the program with code 5 after MS milliseconds\n"
+           "\t\t\t(both are checked at backward jumps, calls and returns only, not with --debug)\n"
+           "  --snapshot=FILE\twrites the state of the run to FILE when it reaches --snapshot-at and goes on\n"
+           "  --snapshot-at=LABEL\tlabel (of a program assembled with -g) or index of the command to take\n"
+           "\t\t\tthe snapshot at (interpreter engine only)\n"
+           "  --restore=FILE\tresumes the program from a snapshot of it instead of starting it, a replayed\n"
+           "\t\t\tjournal goes on from the inputs and outputs the snapshot had seen\n"
+           "  --sample=FILE\t\tsamples the run by a SIGPROF timer and writes how often it was at every\n"
+           "\t\t\tcommand, label and call stack to FILE at exit and on SIGUSR1\n"
+           "  --sample-rate=HZ\tsamples a second of processor time (%d by default)\n"
+           "  --perf-map\t\truns every call through a native trampoline of its routine and names the\n"
+           "\t\t\ttrampolines after the labels in /tmp/perf-<pid>.map for perf report -g\n"
+           "  --jitdump\t\twrites the trampolines to /tmp/jit-<pid>.dump for perf record -k 1 and\n"
+           "\t\t\tperf inject --jit (both interpreter engine only)\n\n"
+           "Programs using spawn, join, send or recv run on the interpreter engine only.\n"
+           "Programs assembled with -g are reported by source lines and labels.\n"
+           "Machine words are " WORD_NAME ", other builds run programs assembled for their own words.\n"
            "If no input file specified, program will use \"%s\" as input file.\n",
-           DEFAULT_INPUT);
+           MEMORY_SIZE, SAMPLER_RATE, DEFAULT_INPUT);
 
     return 0;
 }
@@ -50,92 +280,345 @@ int print_version()
     return 0;
 }
 
-int parse_file(const char* filename)
+int parse_file(const Options_t* options)
 {
     GREET("Processor", "0.1");
 
-    FILE* stream = fopen(filename, "rb");
-    if (!stream)
-    {
-        printf("Error opening file ");
-        perror(filename);
-        return 1;
-    }
+    if (options->lazy)
+        return run_lazy(options);
 
+    CPU_command_t* commands = 0;
     int commands_cnt = 0;
-    int params_cnt = 0;
-    fscanf(stream, "%d %d", &commands_cnt, &params_cnt);
+    int load_result = CPU_load_program(options->input, &commands, &commands_cnt);
+    if (load_result != 0)
+        return load_result;
 
-    CPU_command_t* commands = (CPU_command_t*) calloc(commands_cnt, sizeof(*commands));
+    int result = run_program(options, commands, commands_cnt);
+    free(commands);
 
-    int fill_result = fill_commands(stream, commands, commands_cnt, params_cnt);
-    fclose(stream);
+    return result;
+}
+
+int run_program(const Options_t* options, CPU_command_t* commands, int commands_cnt)
+{
+    assert(options);
+    assert(commands);
 
-    if (fill_result != 0)
+    CPU_t processor = {};
+    Journal_t journal = {};
+    Watchdog_t watchdog = {};
+    if (processor_ctor(options, &processor, &journal, &watchdog) != 0)
     {
-        if (fill_result == -2)
-            printf("Program file corrupt\n");
-        return 2;
+        processor_dtor(&processor, &journal);
+        return 3;
     }
 
-    CPU_t processor = {};
-    CPU_ctor(&processor);
+    int run_result = 0;
+    int scheduled = Scheduler_needed(commands, commands_cnt);
+    if (scheduled && ((options->engine != ENGINE_INTERPRETER) || options->debug || processor.journal ||
+                      options->profile || processor.watchdog || options->snapshot || options->restore ||
+                      options->sample || options->perf))
+    {
+        printf("Programs using concurrency commands run on the interpreter engine only, "
+               "without the debugger, a journal, a profile, limits, snapshots, sampling or perf maps\n");
+        processor_dtor(&processor, &journal);
+        return 3;
+    }
+    if (options->restore && (restore_snapshot(options, &processor, commands, commands_cnt) != 0))
+    {
+        processor_dtor(&processor, &journal);
+        return 3;
+    }
+    Sampler_t sampler = {};
+    if (options->sample)
+    {
+        Sampler_ctor(&sampler, options->sample, options->sample_rate, &processor, commands, commands_cnt);
+        if (Sampler_start(&sampler) != 0)
+        {
+            Sampler_dtor(&sampler);
+            processor_dtor(&processor, &journal);
+            return 3;
+        }
+    }
+
+    if (scheduled)
+    {
+        Scheduler_t scheduler = {};
+        Scheduler_ctor(&scheduler, commands, commands_cnt, options->threads);
+        run_result = CPU_run_scheduled(&processor, &scheduler);
+        Scheduler_dtor(&scheduler);
+    } else if (options->debug)
+    {
+        Debugger_t debugger = {};
+        Debugger_ctor(&debugger, commands, commands_cnt);
+        run_result = CPU_run_debugger(&processor, &debugger, stdin);
+        Debugger_dtor(&debugger);
+    } else if (options->profile)
+        run_result = run_profiled(options, &processor, commands, commands_cnt);
+    else if (options->snapshot)
+    {
+        int at = find_command(options->snapshot_at, commands, commands_cnt);
+        if (at < 0)
+        {
+            printf("No command at %s to take the snapshot at, labels are known in programs assembled with -g\n",
+                   options->snapshot_at);
+            processor_dtor(&processor, &journal);
+            return 3;
+        }
+        run_result = CPU_run_snapshot(&processor, commands, commands_cnt, at, options->snapshot);
+    } else if (options->engine == ENGINE_BLOCKS)
+    {
+        Blocks_t blocks = {};
+        Blocks_ctor(&blocks, commands, commands_cnt);
+        run_result = CPU_run_blocks(&processor, &blocks);
+        Blocks_dtor(&blocks);
+    } else if (options->engine == ENGINE_TRACE)
+    {
+        Tracer_t tracer = {};
+        Tracer_ctor(&tracer, commands, commands_cnt);
+        run_result = CPU_run_traced(&processor, &tracer);
+        if (options->trace_stats)
+            Tracer_print_stats(&tracer);
+        Tracer_dtor(&tracer);
+    } else if (options->engine == ENGINE_REGVM)
+    {
+        Regvm_t regvm = {};
+        Regvm_ctor(&regvm, commands, commands_cnt);
+        run_result = CPU_run_regvm(&processor, &regvm);
+        Regvm_dtor(&regvm);
+    } else if (options->engine == ENGINE_DENSE)
+    {
+        Dense_t dense = {};
+        Dense_ctor(&dense, commands, commands_cnt);
+        if (options->dense_stats)
+            Dense_print_stats(&dense);
+        run_result = CPU_run_dense(&processor, &dense);
+        Dense_dtor(&dense);
+    } else if (options->perf)
+    {
+        Perfmap_t perfmap = {};
+        if (Perfmap_ctor(&perfmap, &processor, commands, commands_cnt, options->perf) == 0)
+            run_result = CPU_run_perfmap(&processor, &perfmap);
+        else
+            run_result = -1;
+        Perfmap_dtor(&perfmap);
+    } else if (options->sample)
+        run_result = CPU_run_sampled(&processor, commands);
+    else
+        run_result = CPU_run_program(&processor, commands);
+
+    if (options->sample)
+    {
+        if (Sampler_stop(&sampler) == 0)
+            printf("Samples written to %s\n", options->sample);
+        Sampler_dtor(&sampler);
+    }
+    if (run_result == CPU_EXPIRED)
+        print_expired(&processor);
+    int replay_result = processor_dtor(&processor, &journal);
+    if (options->native_stats)
+        Natives_print_stats();
 
-    if (CPU_run_program(&processor, commands) != 0)
+    if (run_result == CPU_EXPIRED)
+        return 5;
+    if (run_result != 0)
     {
         printf("Runtime error\n");
         return 3;
     }
 
-    free(commands);
+    return (replay_result != 0) ? 4 : 0;
+}
+
+int processor_ctor(const Options_t* options, CPU_t* processor, Journal_t* journal, Watchdog_t* watchdog)
+{
+    assert(options);
+    assert(processor);
+    assert(journal);
+    assert(watchdog);
+
+    CPU_ctor(processor);
+    if (options->memory_size && (CPU_memory_resize(processor, options->memory_size) != 0))
+    {
+        printf("Cannot allocate memory of %d cells\n", options->memory_size);
+        return -1;
+    }
+    if (options->record || options->replay)
+    {
+        if (options->record && (Journal_ctor(journal, options->record, JOURNAL_RECORD, options->record_outputs) != 0))
+            return -1;
+        if (options->replay && (Journal_ctor(journal, options->replay, JOURNAL_REPLAY, 0) != 0))
+            return -1;
+        processor->journal = journal;
+    }
+    if (options->max_instructions || options->timeout)
+    {
+        Watchdog_ctor(watchdog, options->max_instructions, options->timeout);
+        processor->watchdog = watchdog;
+    }
 
     return 0;
 }
 
-int fill_commands(FILE* stream, CPU_command_t* commands, int commands_cnt, int params_cnt)
+// index of the command at the label or number, -1 if no command starts there
+int find_command(const char* position, const CPU_command_t* commands, int commands_cnt)
 {
-    assert(stream);
+    assert(position);
     assert(commands);
 
-    int cmd_index = 0;
-    int _params_cnt = 0;
-    int cmd = 0;
-    while (fscanf(stream, "%d", &cmd) != EOF)
+    int index = Symbols_find(position);
+    if (index < 0)
     {
-        CPU_command_t command = {};
-        CPU_command_ctor(&command, cmd, 0);
-        float param = 0;
-        switch (cmd)
-        {
-        case PUSH:
-        case PUSH_VAR:
-        case POP:
-        case JA:
-        case JAE:
-        case JB:
-        case JBE:
-        case JE:
-        case JNE:
-        case JMP:
-        case CALL:
-            if (fscanf(stream, "%f", &param) == 1)
-            {
-                command.parameter = param;
-                ++_params_cnt;
-            } else
-            {
-                printf("Incorrect argument\n");
-                return -1;
-            }
-            break;
-        default:
-            break;
-        }
-        commands[cmd_index] = command;
-        ++cmd_index;
+        char* end = 0;
+        long number = strtol(position, &end, 10);
+        if ((end != position) && (*end == '\0'))
+            index = number;
     }
-    if ((cmd_index == commands_cnt) && (_params_cnt == params_cnt))
-        return 0;
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+        if (i == index)
+            return index;
+
+    return -1;
+}
+
+// puts the state of the snapshot into the processor and moves a replayed journal to its position
+int restore_snapshot(const Options_t* options, CPU_t* processor, const CPU_command_t* commands, int commands_cnt)
+{
+    assert(options);
+    assert(processor);
+    assert(commands);
+
+    if (CPU_snapshot_restore(processor, options->restore, commands, commands_cnt) != 0)
+        return -1;
+    printf("Resumed from %s at %s after %lld inputs\n", options->restore, Symbols_where(processor->start),
+           processor->inputs);
+    if (processor->journal && (processor->journal->mode == JOURNAL_REPLAY))
+        Journal_skip(processor->journal, processor->inputs, processor->outputs);
+
+    return 0;
+}
+
+// tells which limit stopped the program and where, with the registers at that point
+int print_expired(CPU_t* processor)
+{
+    assert(processor);
+    assert(processor->watchdog);
+
+    const Watchdog_t* watchdog = processor->watchdog;
+    if (watchdog->expired == WATCHDOG_BUDGET)
+        printf("Program stopped after %lld commands at %s\n", watchdog->max_instructions,
+               Symbols_where(watchdog->command));
     else
-        return -2;
+        printf("Program stopped after %lld ms at %s\n", watchdog->timeout, Symbols_where(watchdog->command));
+    printf("rax = " WORD_PRINT ", rbx = " WORD_PRINT ", rcx = " WORD_PRINT ", rdx = " WORD_PRINT
+           ", %d values on the stack, %d calls deep\n",
+           processor->rax, processor->rbx, processor->rcx, processor->rdx, processor->cstack->count,
+           processor->call_stack->count);
+
+    return 0;
+}
+
+#define PROFILE_HOTTEST 5
+
+// runs the program counting its commands, writes the profile and prints where most of the time went
+int run_profiled(const Options_t* options, CPU_t* processor, CPU_command_t* commands, int commands_cnt)
+{
+    assert(options);
+    assert(processor);
+    assert(commands);
+
+    CPU_profile_t profile = {};
+    profile.commands_cnt = commands_cnt;
+    profile.hash = CPU_commands_hash(commands, commands_cnt);
+    profile.counts = (long long*) calloc(commands_cnt, sizeof(*profile.counts));
+    profile.taken = (long long*) calloc(commands_cnt, sizeof(*profile.taken));
+
+    int result = CPU_run_profiled(processor, commands, &profile);
+
+    FILE* stream = fopen(options->profile, "wb");
+    if (!stream)
+    {
+        printf("Error opening profile ");
+        perror(options->profile);
+        CPU_profile_free(&profile);
+        return -1;
+    }
+    CPU_profile_write(stream, &profile);
+    fclose(stream);
+
+    printf("Profile written to %s, hottest commands:\n", options->profile);
+    char* shown = (char*) calloc(commands_cnt, sizeof(*shown));
+    for (int printed = 0; printed < PROFILE_HOTTEST; ++printed)
+    {
+        int hottest = -1;
+        for (int i = 0; i < commands_cnt; ++i)
+            if (!shown[i] && profile.counts[i] && ((hottest < 0) || (profile.counts[i] > profile.counts[hottest])))
+                hottest = i;
+        if (hottest < 0)
+            break;
+        shown[hottest] = 1;
+        printf("  %lld\t%s\n", profile.counts[hottest], Symbols_where(hottest));
+    }
+    free(shown);
+    CPU_profile_free(&profile);
+
+    return result;
+}
+
+// returns -1 if the replayed run did not match the journal
+int processor_dtor(CPU_t* processor, Journal_t* journal)
+{
+    assert(processor);
+    assert(journal);
+
+    int result = 0;
+    if (processor->journal)
+        result = Journal_finish(journal);
+    Journal_dtor(journal);
+    CPU_dtor(processor);
+
+    return result;
+}
+
+int run_lazy(const Options_t* options)
+{
+    assert(options);
+
+    Lazy_program_t program = {};
+    int load_result = Lazy_program_ctor(&program, options->input);
+    if (load_result != 0)
+    {
+        Lazy_program_dtor(&program);
+        return load_result;
+    }
+
+    CPU_t processor = {};
+    Journal_t journal = {};
+    Watchdog_t watchdog = {};
+    if (processor_ctor(options, &processor, &journal, &watchdog) != 0)
+    {
+        processor_dtor(&processor, &journal);
+        Lazy_program_dtor(&program);
+        return 3;
+    }
+
+    int run_result = CPU_run_lazy(&processor, &program);
+    if (run_result == CPU_EXPIRED)
+        print_expired(&processor);
+    int replay_result = processor_dtor(&processor, &journal);
+    if (options->native_stats)
+        Natives_print_stats();
+    Lazy_program_dtor(&program);
+
+    if (run_result == -2)
+        return 2;
+    if (run_result == CPU_EXPIRED)
+        return 5;
+    if (run_result != 0)
+    {
+        printf("Runtime error\n");
+        return 3;
+    }
+
+    return (replay_result != 0) ? 4 : 0;
 }
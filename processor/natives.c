@@ -0,0 +1,254 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "natives.h"
+#include "commands.h"
+#include "processor.h"
+#include "myassert.h"
+#include "stack.h"
+
+static Native_t natives[COMMANDS_MAX_NATIVES] = {};
+static int natives_cnt = 0;
+
+// registers a host function, returns its index or -1
+int Natives_register(const char* name, int arity, int results, Native_function_t function)
+{
+    assert(name);
+    assert(function);
+
+    if ((strlen(name) == 0) || (strlen(name) >= MAX_NATIVE_NAME) || (arity < 0) || (arity > NATIVE_MAX_ARITY) ||
+        (results < 0) || (results > 1) || (Natives_find(name) != -1) || (natives_cnt == COMMANDS_MAX_NATIVES))
+        return -1;
+
+    Native_t* native = &natives[natives_cnt];
+    native->name = name;
+    native->arity = arity;
+    native->results = results;
+    native->function = function;
+    atomic_init(&native->calls, 0);
+
+    return natives_cnt++;
+}
+
+int Natives_find(const char* name)
+{
+    assert(name);
+
+    for (int i = 0; i < natives_cnt; ++i)
+        if (!strcmp(natives[i].name, name))
+            return i;
+    return -1;
+}
+
+const Native_t* Natives_get(int index)
+{
+    if ((index < 0) || (index >= natives_cnt))
+        return 0;
+    return &natives[index];
+}
+
+// finds the registered functions for the natives table of a program, returns 0 if all of them are there
+int Natives_resolve(char* const* names, int names_cnt, int* indices)
+{
+    assert(names || (names_cnt == 0));
+    assert(indices || (names_cnt == 0));
+
+    int result = 0;
+    for (int i = 0; i < names_cnt; ++i)
+    {
+        indices[i] = Natives_find(names[i]);
+        if (indices[i] == -1)
+        {
+            printf("Unknown native function %s\n", names[i]);
+            result = -1;
+        }
+    }
+
+    return result;
+}
+
+// turns natives table indices of NATIVE commands into registry ones, returns -1 for an index out of the table
+int Natives_link(CPU_command_t* commands, int commands_cnt, const int* indices, int indices_cnt)
+{
+    assert(commands);
+
+    for (int i = 0; i < commands_cnt; ++i)
+    {
+        if (commands[i].command != NATIVE)
+            continue;
+        int index = commands[i].parameter;
+        if (index >= indices_cnt)
+            return -1;
+        commands[i].parameter = indices[index];
+    }
+
+    return 0;
+}
+
+int Natives_print_stats()
+{
+    printf("Native calls:\n");
+    for (int i = 0; i < natives_cnt; ++i)
+    {
+        long long calls = atomic_load(&natives[i].calls);
+        if (calls)
+            printf("  %-16s %lld\n", natives[i].name, calls);
+    }
+
+    return 0;
+}
+
+// calls the registered function with arguments already taken from the stack
+int Natives_call(CPU_t* This, int index, const CPU_word_t* args, CPU_word_t* result)
+{
+    assert((index >= 0) && (index < natives_cnt));
+
+    Native_t* native = &natives[index];
+    atomic_fetch_add_explicit(&native->calls, 1, memory_order_relaxed);
+    if (native->function(This, args, result) != 0)
+    {
+        printf("Native function %s failed\n", native->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+int CPU_native(CPU_t* This, int index)
+{
+    ASSERT_OK(CPU, This);
+
+    const Native_t* native = Natives_get(index);
+    assert(native);
+
+    if (This->cstack->count < native->arity)
+    {
+        printf("Not enough arguments for native function %s\n", native->name);
+        return -1;
+    }
+    CPU_word_t args[NATIVE_MAX_ARITY] = {};
+    for (int i = native->arity - 1; i >= 0; --i)
+        args[i] = Stack_pop(This->cstack);
+
+    CPU_word_t result = 0;
+    if (Natives_call(This, index, args, &result) != 0)
+        return -1;
+    if (native->results)
+        CPU_push(This, result);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+// float words take the float functions, integer ones the double results truncated
+#if WORD_KIND == WORD_FLOAT
+#define WORD_MATH(function) function##f
+#else
+#define WORD_MATH(function) function
+#endif
+
+static int native_sqrt(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+    *result = WORD_MATH(sqrt)(args[0]);
+    return 0;
+}
+
+static int native_sin(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+    *result = WORD_MATH(sin)(args[0]);
+    return 0;
+}
+
+static int native_cos(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+    *result = WORD_MATH(cos)(args[0]);
+    return 0;
+}
+
+static int native_exp(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+    *result = WORD_MATH(exp)(args[0]);
+    return 0;
+}
+
+static int native_log(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+    *result = WORD_MATH(log)(args[0]);
+    return 0;
+}
+
+static int native_abs(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+#if WORD_KIND == WORD_INT64
+    *result = (args[0] < 0) ? word_sub(0, args[0]) : args[0];
+#else
+    *result = WORD_MATH(fabs)(args[0]);
+#endif
+    return 0;
+}
+
+static int native_floor(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+#if WORD_KIND == WORD_INT64
+    *result = args[0];
+#else
+    *result = WORD_MATH(floor)(args[0]);
+#endif
+    return 0;
+}
+
+static int native_min(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+    *result = (args[0] < args[1]) ? args[0] : args[1];
+    return 0;
+}
+
+static int native_max(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) This;
+    *result = (args[0] > args[1]) ? args[0] : args[1];
+    return 0;
+}
+
+static int compare_words(const void* a, const void* b)
+{
+    CPU_word_t x = *(const CPU_word_t*) a;
+    CPU_word_t y = *(const CPU_word_t*) b;
+    return (x > y) - (x < y);
+}
+
+// sorts count memory cells from address: address, count
+static int native_sort(CPU_t* This, const CPU_word_t* args, CPU_word_t* result)
+{
+    (void) result;
+    if (CPU_memory_check(This, args[0], args[1]) != 0)
+        return -1;
+    qsort(This->memory + (int) args[0], (int) args[1], sizeof(*This->memory), compare_words);
+    return 0;
+}
+
+int Natives_register_builtins()
+{
+    Natives_register("sqrt", 1, 1, native_sqrt);
+    Natives_register("sin", 1, 1, native_sin);
+    Natives_register("cos", 1, 1, native_cos);
+    Natives_register("exp", 1, 1, native_exp);
+    Natives_register("log", 1, 1, native_log);
+    Natives_register("abs", 1, 1, native_abs);
+    Natives_register("floor", 1, 1, native_floor);
+    Natives_register("min", 2, 1, native_min);
+    Natives_register("max", 2, 1, native_max);
+    Natives_register("sort", 2, 0, native_sort);
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef NATIVES_H_INCLUDED
+#define NATIVES_H_INCLUDED
+
+#include <stdatomic.h>
+#include "processor.h"
+
+#define NATIVE_MAX_ARITY 8
+
+/*
+ * Host function called by the NATIVE command. args[0] is the value pushed
+ * first; the result is pushed back when the function declares one. The
+ * engines keep stack values in their own registers, so the function must
+ * not touch the stack. Returns 0 on success.
+ */
+typedef int (*Native_function_t)(CPU_t* This, const CPU_word_t* args, CPU_word_t* result);
+
+typedef struct
+{
+    const char* name;
+    int arity;          // stack values taken by the call
+    int results;        // stack values pushed back, 0 or 1
+    Native_function_t function;
+    atomic_llong calls;     // counted by the worker threads of the scheduler too
+} Native_t;
+
+int Natives_register(const char* name, int arity, int results, Native_function_t function);
+int Natives_register_builtins();
+int Natives_find(const char* name);
+const Native_t* Natives_get(int index);
+int Natives_resolve(char* const* names, int names_cnt, int* indices);
+int Natives_link(CPU_command_t* commands, int commands_cnt, const int* indices, int indices_cnt);
+int Natives_print_stats();
+int Natives_call(CPU_t* This, int index, const CPU_word_t* args, CPU_word_t* result);
+int CPU_native(CPU_t* This, int index);
+
+#endif // NATIVES_H_INCLUDED
@@ -0,0 +1,352 @@
+#include <assert.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "perfmap.h"
+#include "myassert.h"
+#include "symbols.h"
+
+#define MAX_REGION_NAME 96
+
+// the trampolines take the run, the depth and the routine to call with them, which they pass on
+#if defined(__x86_64__)
+#define PERFMAP_MACHINE EM_X86_64
+// push %rbp; mov %rsp, %rbp; call *%rdx; pop %rbp; ret
+static const unsigned char trampoline_code[] = {0x55, 0x48, 0x89, 0xe5, 0xff, 0xd2, 0x5d, 0xc3};
+#define TRAMPOLINE_FILL 0xcc    // int3
+#elif defined(__aarch64__)
+#define PERFMAP_MACHINE EM_AARCH64
+// stp x29, x30, [sp, #-16]!; mov x29, sp; blr x2; ldp x29, x30, [sp], #16; ret
+static const uint32_t trampoline_code[] = {0xa9bf7bfd, 0x910003fd, 0xd63f0040, 0xa8c17bfd, 0xd65f03c0};
+#define TRAMPOLINE_FILL 0x00    // udf
+#endif
+
+typedef int (*Perfmap_trampoline_t)(Perfmap_t* This, int depth, Perfmap_routine_t routine);
+
+/*
+ * Records of the jitdump format of perf, see jitdump-specification.txt in
+ * the sources of perf. A code load record is followed by the name of the
+ * region with its terminating zero and then by the code itself.
+ */
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_CODE_LOAD 0
+#define JITDUMP_CODE_CLOSE 3
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} Jitdump_header_t;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+} Jitdump_record_t;
+
+typedef struct
+{
+    Jitdump_record_t record;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+} Jitdump_load_t;
+
+// perf record -k 1 stamps its samples with the same clock
+static uint64_t timestamp()
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// label of the routine at start, otherwise the commands from it to its first RET
+static void region_name(Perfmap_t* This, int trampoline, int start, char* name)
+{
+    const char* label = Symbols_label(start);
+    if (label && (Symbols_find(label) == start))
+        snprintf(name, MAX_REGION_NAME, "cpu::%s", label);
+    else if (trampoline == 0)
+        snprintf(name, MAX_REGION_NAME, "cpu::program");
+    else
+    {
+        int end = start;
+        while ((end + 1 < This->commands_cnt) && (This->commands[end].command != RET))
+            end += CPU_command_length(&This->commands[end]);
+        snprintf(name, MAX_REGION_NAME, "cpu::%d-%d", start, end);
+    }
+}
+
+static int open_jitdump(Perfmap_t* This)
+{
+    char filename[64] = "";
+    snprintf(filename, sizeof(filename), "/tmp/jit-%d.dump", (int) getpid());
+    int fd = open(filename, O_CREAT | O_TRUNC | O_RDWR, 0666);
+    if (fd < 0)
+    {
+        printf("Error opening jitdump ");
+        perror(filename);
+        return -1;
+    }
+    This->marker = mmap(0, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    if (This->marker == MAP_FAILED)
+    {
+        This->marker = 0;
+        printf("Error mapping jitdump ");
+        perror(filename);
+        close(fd);
+        return -1;
+    }
+    This->jitdump = fdopen(fd, "wb");
+
+    Jitdump_header_t header = {JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(header), PERFMAP_MACHINE, 0,
+                               (uint32_t) getpid(), timestamp(), 0};
+    fwrite(&header, sizeof(header), 1, This->jitdump);
+
+    return 0;
+}
+
+static void write_jitdump(Perfmap_t* This, int trampoline, const char* name)
+{
+    uint64_t address = (uint64_t) (uintptr_t) (This->code + trampoline * PERFMAP_TRAMPOLINE_SIZE);
+    Jitdump_load_t load = {};
+    load.record.id = JITDUMP_CODE_LOAD;
+    load.record.total_size = sizeof(load) + strlen(name) + 1 + PERFMAP_TRAMPOLINE_SIZE;
+    load.record.timestamp = timestamp();
+    load.pid = getpid();
+    load.tid = syscall(SYS_gettid);
+    load.vma = address;
+    load.code_addr = address;
+    load.code_size = PERFMAP_TRAMPOLINE_SIZE;
+    load.code_index = trampoline;
+    fwrite(&load, sizeof(load), 1, This->jitdump);
+    fwrite(name, strlen(name) + 1, 1, This->jitdump);
+    fwrite(This->code + trampoline * PERFMAP_TRAMPOLINE_SIZE, PERFMAP_TRAMPOLINE_SIZE, 1, This->jitdump);
+}
+
+// names every trampoline in the outputs asked for
+static int write_regions(Perfmap_t* This)
+{
+    FILE* map = 0;
+    if (This->outputs & PERFMAP_MAP)
+    {
+        char filename[64] = "";
+        snprintf(filename, sizeof(filename), "/tmp/perf-%d.map", (int) getpid());
+        map = fopen(filename, "w");
+        if (!map)
+        {
+            printf("Error opening perf map ");
+            perror(filename);
+            return -1;
+        }
+    }
+    if ((This->outputs & PERFMAP_JITDUMP) && (open_jitdump(This) != 0))
+    {
+        if (map)
+            fclose(map);
+        return -1;
+    }
+
+    int* starts = (int*) calloc(This->trampolines_cnt, sizeof(*starts));
+    starts[0] = This->cpu->start;
+    for (int i = 0; i < This->commands_cnt; ++i)
+        if (This->trampoline_of[i] > 0)
+            starts[This->trampoline_of[i]] = i;
+    for (int t = 0; t < This->trampolines_cnt; ++t)
+    {
+        char name[MAX_REGION_NAME] = "";
+        region_name(This, t, starts[t], name);
+        if (map)
+            fprintf(map, "%lx %x %s\n", (unsigned long) (uintptr_t) (This->code + t * PERFMAP_TRAMPOLINE_SIZE),
+                    PERFMAP_TRAMPOLINE_SIZE, name);
+        if (This->jitdump)
+            write_jitdump(This, t, name);
+    }
+    free(starts);
+    if (map)
+        fclose(map);
+    if (This->jitdump)
+        fflush(This->jitdump);
+
+    return 0;
+}
+
+int Perfmap_ctor(Perfmap_t* This, CPU_t* cpu, const CPU_command_t* commands, int commands_cnt, int outputs)
+{
+    assert(This);
+    assert(cpu);
+    assert(commands);
+    assert(commands_cnt > 0);
+
+    This->commands = commands;
+    This->commands_cnt = commands_cnt;
+    This->cpu = cpu;
+    This->outputs = outputs;
+    This->trampoline_of = (int*) malloc(commands_cnt * sizeof(*This->trampoline_of));
+    for (int i = 0; i < commands_cnt; ++i)
+        This->trampoline_of[i] = -1;
+    This->trampolines_cnt = 1;
+    for (int i = 0; i < commands_cnt; i += CPU_command_length(&commands[i]))
+    {
+        int target = commands[i].parameter;
+        if ((commands[i].command == CALL) && (target >= 0) && (target < commands_cnt) &&
+            (This->trampoline_of[target] < 0))
+            This->trampoline_of[target] = This->trampolines_cnt++;
+    }
+
+#if defined(PERFMAP_MACHINE)
+    size_t page = sysconf(_SC_PAGESIZE);
+    This->code_size = (This->trampolines_cnt * PERFMAP_TRAMPOLINE_SIZE + page - 1) / page * page;
+    This->code = (unsigned char*) mmap(0, This->code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (This->code == MAP_FAILED)
+    {
+        This->code = 0;
+        perror("Error allocating trampolines");
+        return -1;
+    }
+    memset(This->code, TRAMPOLINE_FILL, This->code_size);
+    for (int t = 0; t < This->trampolines_cnt; ++t)
+        memcpy(This->code + t * PERFMAP_TRAMPOLINE_SIZE, trampoline_code, sizeof(trampoline_code));
+    if (mprotect(This->code, This->code_size, PROT_READ | PROT_EXEC) != 0)
+    {
+        perror("Error protecting trampolines");
+        return -1;
+    }
+    __builtin___clear_cache((char*) This->code, (char*) This->code + This->code_size);
+#else
+    printf("Perf maps are made on x86-64 and AArch64 only\n");
+    return -1;
+#endif
+
+    if (write_regions(This) != 0)
+        return -1;
+
+    ASSERT_OK(Perfmap, This);
+
+    return 0;
+}
+
+int Perfmap_dtor(Perfmap_t* This)
+{
+    assert(This);
+
+    if (This->jitdump)
+    {
+        Jitdump_record_t close = {JITDUMP_CODE_CLOSE, sizeof(close), timestamp()};
+        fwrite(&close, sizeof(close), 1, This->jitdump);
+        fclose(This->jitdump);
+    }
+    if (This->marker)
+        munmap(This->marker, sysconf(_SC_PAGESIZE));
+    if (This->code)
+        munmap(This->code, This->code_size);
+    free(This->trampoline_of);
+    This->jitdump = 0;
+    This->marker = 0;
+    This->code = 0;
+    This->trampoline_of = 0;
+    This->trampolines_cnt = -1;
+    This->commands_cnt = -1;
+    This->commands = 0;
+
+    return 0;
+}
+
+int Perfmap_ok(Perfmap_t* This)
+{
+    return This && This->commands && This->cpu && This->code && This->trampoline_of &&
+           (This->commands_cnt > 0) && (This->trampolines_cnt > 0) &&
+           ((size_t) This->trampolines_cnt * PERFMAP_TRAMPOLINE_SIZE <= This->code_size) &&
+           (!(This->outputs & PERFMAP_JITDUMP) || This->jitdump);
+}
+
+int Perfmap_dump(Perfmap_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Perfmap_t(%s)\n"
+           "{\n"
+           "    commands_cnt = %d\n"
+           "    outputs = %d\n"
+           "    code = %p\n"
+           "    trampolines_cnt = %d\n"
+           "    index = %d\n"
+           "}\n",
+           name, Perfmap_ok(This) ? "ok" : "NOT OK!!!", This->commands_cnt, This->outputs, (void*) This->code,
+           This->trampolines_cnt, This->index);
+
+    return 0;
+}
+
+static int run_routine(Perfmap_t* This, int depth);
+
+// runs the routine at index in a frame of its trampoline
+static int enter(Perfmap_t* This, int index, int depth)
+{
+    if ((index < 0) || (index >= This->commands_cnt) || (This->trampoline_of[index] < 0))
+    {
+        printf("Bad call of command %d\n", index);
+        return -1;
+    }
+    Perfmap_trampoline_t trampoline =
+        (Perfmap_trampoline_t) (void*) (This->code + This->trampoline_of[index] * PERFMAP_TRAMPOLINE_SIZE);
+    return trampoline(This, depth, run_routine);
+}
+
+// runs commands from This->index until the call the run began with returns or the program ends
+static int run_routine(Perfmap_t* This, int depth)
+{
+    CPU_t* cpu = This->cpu;
+    while (This->commands[This->index].command != END)
+    {
+        int command = This->commands[This->index].command;
+        cpu->position = This->index;
+        int result = CPU_step(cpu, This->commands, &This->index);
+        if (result != 0)
+            return result;
+        if ((command == CALL) && (cpu->call_stack->count > depth))
+        {
+            result = enter(This, This->index, cpu->call_stack->count);
+            if ((result != 0) || This->finished)
+                return result;
+        } else if (cpu->call_stack->count < depth)
+            return 0;
+    }
+    This->finished = 1;
+
+    return 0;
+}
+
+int CPU_run_perfmap(CPU_t* This, Perfmap_t* perfmap)
+{
+    ASSERT_OK(CPU, This);
+    ASSERT_OK(Perfmap, perfmap);
+
+    Perfmap_trampoline_t program = (Perfmap_trampoline_t) (void*) perfmap->code;
+    perfmap->index = This->start;
+    perfmap->finished = 0;
+    int result = 0;
+    // calls restored from a snapshot return into the program
+    while ((result == 0) && !perfmap->finished)
+        result = program(perfmap, This->call_stack->count, run_routine);
+
+    return result;
+}
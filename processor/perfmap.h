@@ -0,0 +1,48 @@
+#ifndef PERFMAP_H_INCLUDED
+#define PERFMAP_H_INCLUDED
+
+#include <stdio.h>
+#include "commands.h"
+#include "processor.h"
+
+#define PERFMAP_MAP 1               // writes /tmp/perf-<pid>.map
+#define PERFMAP_JITDUMP 2           // writes /tmp/jit-<pid>.dump for perf inject --jit
+#define PERFMAP_TRAMPOLINE_SIZE 16
+
+/*
+ * Native code regions for perf. The program and every routine it calls get
+ * a trampoline of their own, a few instructions that set up a frame and
+ * call the interpreter back, and every call of the program is run through
+ * the trampoline of its routine. The native call stack then holds a frame
+ * in the trampoline of every routine active, and the trampolines are named
+ * in the perf map and the jitdump after the labels of the program, or the
+ * commands of the routine if it has no debug section, so that perf report
+ * and flame graphs of a run attribute the time of the interpreter to the
+ * routines of the program.
+ */
+typedef struct Perfmap_t Perfmap_t;
+typedef int (*Perfmap_routine_t)(Perfmap_t* This, int depth);
+
+struct Perfmap_t
+{
+    const CPU_command_t* commands;
+    int commands_cnt;
+    CPU_t* cpu;
+    int outputs;                    // PERFMAP_MAP and PERFMAP_JITDUMP
+    unsigned char* code;            // trampolines, the one of the program first
+    size_t code_size;
+    int* trampoline_of;             // trampoline of every command that is called, -1 for the others
+    int trampolines_cnt;
+    int index;                      // command being run, shared by the nested runs
+    int finished;
+    FILE* jitdump;
+    void* marker;                   // executable mapping of the jitdump, perf finds the file by it
+};
+
+int Perfmap_ctor(Perfmap_t* This, CPU_t* cpu, const CPU_command_t* commands, int commands_cnt, int outputs);
+int Perfmap_dtor(Perfmap_t* This);
+int Perfmap_ok(Perfmap_t* This);
+int Perfmap_dump(Perfmap_t* This, char* name);
+int CPU_run_perfmap(CPU_t* This, Perfmap_t* perfmap);
+
+#endif // PERFMAP_H_INCLUDED
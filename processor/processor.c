@@ -1,10 +1,15 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <stddef.h>
 #include "commands.h"
 #include "processor.h"
 #include "myassert.h"
 #include "stack.h"
+#include "vector.h"
+#include "natives.h"
+#include "symbols.h"
 
 int CPU_ctor(CPU_t* This)
 {
@@ -16,16 +21,110 @@ int CPU_ctor(CPU_t* This)
     This->rdx = 0;
     This->cstack = (Stack_t*) calloc(1, sizeof(*This->cstack));
     Stack_ctor(This->cstack, STACK_SIZE);
+    This->call_stack = (Stack_t*) calloc(1, sizeof(*This->call_stack));
+    Stack_ctor(This->call_stack, CALL_STACK_SIZE);
+    This->frames = (Stack_t*) calloc(1, sizeof(*This->frames));
+    Stack_ctor(This->frames, FRAMES_SIZE);
+    This->frame_links = (Stack_t*) calloc(1, sizeof(*This->frame_links));
+    Stack_ctor(This->frame_links, 2 * CALL_STACK_SIZE);
+    This->frame = 0;
+    This->memory = (CPU_word_t*) calloc(MEMORY_SIZE, sizeof(*This->memory));
+    This->memory_size = MEMORY_SIZE;
+    This->journal = 0;
+    This->watchdog = 0;
+    This->start = 0;
+    This->inputs = 0;
+    This->outputs = 0;
+    This->position = 0;
+    This->io = (CPU_io_t) {};
+    This->in_arena = 0;
 
     ASSERT_OK(CPU, This);
 
     return 0;
 }
 
+// bytes CPU_ctor_arena() takes for a processor with memory_size memory cells
+size_t CPU_arena_size(int memory_size)
+{
+    assert(memory_size > 0);
+
+    return 4 * sizeof(Stack_t) +
+           (STACK_SIZE + CALL_STACK_SIZE + FRAMES_SIZE + 2 * CALL_STACK_SIZE + (size_t) memory_size) *
+           sizeof(CPU_word_t);
+}
+
+/*
+ * Processor with its stacks and memory laid out in arena, which has to be
+ * CPU_arena_size() bytes aligned for a pointer. Nothing is allocated; the
+ * processor is not destroyed, the caller frees the arena when done with it.
+ */
+int CPU_ctor_arena(CPU_t* This, void* arena, int memory_size)
+{
+    assert(This);
+    assert(arena);
+    assert(((size_t) arena % _Alignof(Stack_t)) == 0);
+    assert(memory_size > 0);
+
+    Stack_t* stacks = (Stack_t*) arena;
+    CPU_word_t* words = (CPU_word_t*) (stacks + 4);
+    This->cstack = &stacks[0];
+    Stack_ctor_at(This->cstack, words, STACK_SIZE);
+    words += STACK_SIZE;
+    This->call_stack = &stacks[1];
+    Stack_ctor_at(This->call_stack, words, CALL_STACK_SIZE);
+    words += CALL_STACK_SIZE;
+    This->frames = &stacks[2];
+    Stack_ctor_at(This->frames, words, FRAMES_SIZE);
+    words += FRAMES_SIZE;
+    This->frame_links = &stacks[3];
+    Stack_ctor_at(This->frame_links, words, 2 * CALL_STACK_SIZE);
+    words += 2 * CALL_STACK_SIZE;
+    This->memory = words;
+    This->memory_size = memory_size;
+    This->journal = 0;
+    This->watchdog = 0;
+    This->io = (CPU_io_t) {};
+    This->in_arena = 1;
+    CPU_reset(This);
+
+    return 0;
+}
+
+// empties the stacks and clears registers and memory, as a fresh processor has them
+int CPU_reset(CPU_t* This)
+{
+    assert(This);
+
+    This->rax = 0;
+    This->rbx = 0;
+    This->rcx = 0;
+    This->rdx = 0;
+    This->cstack->count = 0;
+    This->call_stack->count = 0;
+    This->frames->count = 0;
+    This->frame_links->count = 0;
+    This->frame = 0;
+    This->start = 0;
+    This->inputs = 0;
+    This->outputs = 0;
+    This->position = 0;
+    memset(This->memory, 0, This->memory_size * sizeof(*This->memory));
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
 int CPU_dtor(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
+    if (This->in_arena)
+    {
+        *This = (CPU_t) {};
+        return 0;
+    }
+
     This->rax = 0;
     This->rbx = 0;
     This->rcx = 0;
@@ -33,6 +132,22 @@ int CPU_dtor(CPU_t* This)
     Stack_dtor(This->cstack);
     free(This->cstack);
     This->cstack = 0;
+    Stack_dtor(This->call_stack);
+    free(This->call_stack);
+    This->call_stack = 0;
+    Stack_dtor(This->frames);
+    free(This->frames);
+    This->frames = 0;
+    Stack_dtor(This->frame_links);
+    free(This->frame_links);
+    This->frame_links = 0;
+    This->frame = 0;
+    free(This->memory);
+    This->memory = 0;
+    This->memory_size = 0;
+    This->journal = 0;
+    This->watchdog = 0;
+    This->start = 0;
 
     return 0;
 }
@@ -43,6 +158,14 @@ int CPU_ok(CPU_t* This)
         return 0;
     if (!Stack_ok(This->cstack))
         return 0;
+    if (!Stack_ok(This->call_stack))
+        return 0;
+    if (!Stack_ok(This->frames) || !Stack_ok(This->frame_links))
+        return 0;
+    if ((This->frame < 0) || (This->frame > This->frames->count))
+        return 0;
+    if (!This->memory || (This->memory_size <= 0))
+        return 0;
     return 1;
 }
 
@@ -52,21 +175,36 @@ int CPU_dump(CPU_t* This, char* name)
 
     printf("%s = CPU_t(%s)\n"
            "{\n"
-           "    rax = %g\n"
-           "    rbx = %g\n"
-           "    rcx = %g\n"
-           "    rdx = %g\n",
-           name, CPU_ok(This) ? "ok" : "NOT OK!!!", This->rax, This->rbx, This->rcx, This->rdx);
+           "    rax = " WORD_PRINT "\n"
+           "    rbx = " WORD_PRINT "\n"
+           "    rcx = " WORD_PRINT "\n"
+           "    rdx = " WORD_PRINT "\n"
+           "    frame = %d\n"
+           "    memory_size = %d\n",
+           name, CPU_ok(This) ? "ok" : "NOT OK!!!", This->rax, This->rbx, This->rcx, This->rdx, This->frame,
+           This->memory_size);
     if (This->cstack)
         Stack_dump(This->cstack, "cstack");
     else
         printf("    cstack = 0!!!\n");
+    if (This->call_stack)
+        Stack_dump(This->call_stack, "call_stack");
+    else
+        printf("    call_stack = 0!!!\n");
+    if (This->frames)
+        Stack_dump(This->frames, "frames");
+    else
+        printf("    frames = 0!!!\n");
+    if (This->frame_links)
+        Stack_dump(This->frame_links, "frame_links");
+    else
+        printf("    frame_links = 0!!!\n");
     printf("}\n");
 
     return 0;
 }
 
-int CPU_push(CPU_t* This, float value)
+int CPU_push(CPU_t* This, CPU_word_t value)
 {
     ASSERT_OK(CPU, This);
 
@@ -76,7 +214,7 @@ int CPU_push(CPU_t* This, float value)
     return 0;
 }
 
-int CPU_push_var(CPU_t* This, float var)
+int CPU_push_var(CPU_t* This, CPU_word_t var)
 {
     if (var == RAX)
         CPU_push(This, This->rax);
@@ -92,7 +230,7 @@ int CPU_push_var(CPU_t* This, float var)
     return 0;
 }
 
-int CPU_pop(CPU_t* This, float var)
+int CPU_pop(CPU_t* This, CPU_word_t var)
 {
     ASSERT_OK(CPU, This);
 
@@ -111,110 +249,278 @@ int CPU_pop(CPU_t* This, float var)
     return 0;
 }
 
-int CPU_ja(CPU_t* This, float param, int* current_command)
+int CPU_ja(CPU_t* This, CPU_word_t param, int* current_command)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    int result = 0;
     if (a > b)
-        CPU_jmp(This, param, current_command);
+        result = CPU_jmp(This, param, current_command);
 
     ASSERT_OK(CPU, This);
-    return 0;
+    return result;
 }
 
-int CPU_jae(CPU_t* This, float param, int* current_command)
+int CPU_jae(CPU_t* This, CPU_word_t param, int* current_command)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    int result = 0;
     if (a >= b)
-        CPU_jmp(This, param, current_command);
+        result = CPU_jmp(This, param, current_command);
 
     ASSERT_OK(CPU, This);
-    return 0;
+    return result;
 }
 
-int CPU_jb(CPU_t* This, float param, int* current_command)
+int CPU_jb(CPU_t* This, CPU_word_t param, int* current_command)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    int result = 0;
     if (a < b)
-        CPU_jmp(This, param, current_command);
+        result = CPU_jmp(This, param, current_command);
 
     ASSERT_OK(CPU, This);
-    return 0;
+    return result;
 }
 
-int CPU_jbe(CPU_t* This, float param, int* current_command)
+int CPU_jbe(CPU_t* This, CPU_word_t param, int* current_command)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    int result = 0;
     if (a <= b)
-        CPU_jmp(This, param, current_command);
+        result = CPU_jmp(This, param, current_command);
 
     ASSERT_OK(CPU, This);
-    return 0;
+    return result;
 }
 
-int CPU_je(CPU_t* This, float param, int* current_command)
+int CPU_je(CPU_t* This, CPU_word_t param, int* current_command)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    int result = 0;
     if (a == b)
-        CPU_jmp(This, param, current_command);
+        result = CPU_jmp(This, param, current_command);
 
     ASSERT_OK(CPU, This);
-    return 0;
+    return result;
 }
 
-int CPU_jne(CPU_t* This, float param, int* current_command)
+int CPU_jne(CPU_t* This, CPU_word_t param, int* current_command)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    int result = 0;
     if (a != b)
-        CPU_jmp(This, param, current_command);
+        result = CPU_jmp(This, param, current_command);
+
+    ASSERT_OK(CPU, This);
+    return result;
+}
+
+/*
+ * Takes cost commands off the budget of the watchdog at a checkpoint of
+ * command index, returns 0 or CPU_EXPIRED once a limit has run out. Every
+ * engine calls it only at backward jumps, with the commands the jump spans,
+ * and at CALL and RET, with one, so runs without a watchdog never get here.
+ */
+int CPU_checkpoint(CPU_t* This, int index, long long cost)
+{
+    if (!This->watchdog || (Watchdog_charge(This->watchdog, cost) == 0))
+        return 0;
+    This->watchdog->command = index;
+
+    return CPU_EXPIRED;
+}
+
+// a backward jump out of the limits of the watchdog stays at the jump command
+int CPU_jmp(CPU_t* This, CPU_word_t param, int* current_command)
+{
+    ASSERT_OK(CPU, This);
+
+    if (This->watchdog && (param <= *current_command) &&
+        (CPU_checkpoint(This, *current_command, *current_command + 1 - (int) param) != 0))
+        return CPU_EXPIRED;
+    *current_command = param - 1;
 
     ASSERT_OK(CPU, This);
     return 0;
 }
 
-int CPU_jmp(CPU_t* This, float param, int* current_command)
+int CPU_call(CPU_t* This, CPU_word_t param, int* current_command)
 {
     ASSERT_OK(CPU, This);
 
+    if (This->watchdog && (CPU_checkpoint(This, *current_command, 1) != 0))
+        return CPU_EXPIRED;
+    Stack_push(This->call_stack, *current_command + 1);
+    CPU_frame_push(This);
     *current_command = param - 1;
 
     ASSERT_OK(CPU, This);
     return 0;
 }
 
-int CPU_call(CPU_t* This, float param, int* current_command, Stack_t* call_stack)
+int CPU_ret(CPU_t* This, int* current_command)
+{
+    ASSERT_OK(CPU, This);
+
+    if (This->watchdog && (CPU_checkpoint(This, *current_command, 1) != 0))
+        return CPU_EXPIRED;
+    *current_command = Stack_pop(This->call_stack) - 1;
+    CPU_frame_pop(This);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+/*
+ * A call starts an empty frame right above the caller's one; ENTER at the
+ * routine's label gives it its local slots. Returning drops the frame, so
+ * frames live on one contiguous stack and need no allocation.
+ */
+int CPU_frame_push(CPU_t* This)
+{
+    Stack_t* links = This->frame_links;
+    if (links->count + 2 > links->size)
+        return -1;
+    links->data[links->count++] = This->frame;
+    links->data[links->count++] = This->frames->count;
+    This->frame = This->frames->count;
+
+    return 0;
+}
+
+int CPU_frame_pop(CPU_t* This)
+{
+    Stack_t* links = This->frame_links;
+    if (links->count < 2)
+        return -1;
+    This->frames->count = links->data[--links->count];
+    This->frame = links->data[--links->count];
+
+    return 0;
+}
+
+int CPU_enter(CPU_t* This, CPU_word_t slots)
+{
+    ASSERT_OK(CPU, This);
+
+    if (!((slots >= 0) && (slots <= This->frames->size - This->frame)))
+    {
+        printf("Frame of " WORD_PRINT " local slots does not fit\n", slots);
+        return -1;
+    }
+    int count = slots;
+    for (int i = This->frame; i < This->frame + count; ++i)
+        This->frames->data[i] = 0;
+    This->frames->count = This->frame + count;
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+int CPU_load_local(CPU_t* This, CPU_word_t slot)
+{
+    ASSERT_OK(CPU, This);
+
+    // NaN fails the check too, only slots in the frame are cast to int
+    if (!((slot >= 0) && (slot < This->frames->count - This->frame)))
+    {
+        printf("Local slot " WORD_PRINT " is out of the frame\n", slot);
+        return -1;
+    }
+    int index = This->frame + (int) slot;
+    CPU_push(This, This->frames->data[index]);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+int CPU_store_local(CPU_t* This, CPU_word_t slot)
 {
     ASSERT_OK(CPU, This);
 
-    Stack_push(call_stack, *current_command + 1);
-    CPU_jmp(This, param, current_command);
+    if (!((slot >= 0) && (slot < This->frames->count - This->frame)))
+    {
+        printf("Local slot " WORD_PRINT " is out of the frame\n", slot);
+        return -1;
+    }
+    int index = This->frame + (int) slot;
+    This->frames->data[index] = Stack_pop(This->cstack);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+int CPU_memory_resize(CPU_t* This, int size)
+{
+    ASSERT_OK(CPU, This);
+
+    if ((size <= 0) || This->in_arena)
+        return -1;
+    CPU_word_t* memory = (CPU_word_t*) realloc(This->memory, size * sizeof(*memory));
+    if (!memory)
+        return -1;
+    for (int i = This->memory_size; i < size; ++i)
+        memory[i] = 0;
+    This->memory = memory;
+    This->memory_size = size;
 
     ASSERT_OK(CPU, This);
     return 0;
 }
 
-int CPU_ret(CPU_t* This, int* current_command, Stack_t* call_stack)
+/*
+ * Returns 0 if count cells from address are all in the memory. The range is
+ * checked first, so NaN and huge words never reach the casts to int.
+ */
+int CPU_memory_check(CPU_t* This, CPU_word_t address, CPU_word_t count)
+{
+    if (!((address >= 0) && (address <= This->memory_size) && (count >= 0) &&
+          (count <= This->memory_size - address)) ||
+        (address != (int) address) || (count != (int) count))
+    {
+        printf("Memory range " WORD_PRINT ".." WORD_PRINT " is out of the memory\n", address, address + count - 1);
+        return -1;
+    }
+    return 0;
+}
+
+int CPU_load(CPU_t* This, CPU_word_t address)
 {
     ASSERT_OK(CPU, This);
 
-    CPU_jmp(This, Stack_pop(call_stack), current_command);
+    if (CPU_memory_check(This, address, 1) != 0)
+        return -1;
+    CPU_push(This, This->memory[(int) address]);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+int CPU_store(CPU_t* This, CPU_word_t address)
+{
+    ASSERT_OK(CPU, This);
+
+    if (CPU_memory_check(This, address, 1) != 0)
+        return -1;
+    This->memory[(int) address] = Stack_pop(This->cstack);
 
     ASSERT_OK(CPU, This);
     return 0;
@@ -224,9 +530,9 @@ int CPU_add(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
-    CPU_push(This, a + b);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    CPU_push(This, word_add(a, b));
 
     ASSERT_OK(CPU, This);
     return 0;
@@ -236,9 +542,9 @@ int CPU_sub(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
-    CPU_push(This, a - b);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    CPU_push(This, word_sub(a, b));
 
     ASSERT_OK(CPU, This);
     return 0;
@@ -248,9 +554,9 @@ int CPU_mul(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
-    CPU_push(This, a * b);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    CPU_push(This, word_mul(a, b));
 
     ASSERT_OK(CPU, This);
     return 0;
@@ -260,9 +566,9 @@ int CPU_div(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
-    CPU_push(This, a / b);
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    CPU_push(This, word_div(a, b));
 
     ASSERT_OK(CPU, This);
     return 0;
@@ -272,9 +578,9 @@ int CPU_pow(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
-    float b = Stack_pop(This->cstack);
-    CPU_push(This, pow(a, b));
+    CPU_word_t a = Stack_pop(This->cstack);
+    CPU_word_t b = Stack_pop(This->cstack);
+    CPU_push(This, word_pow(a, b));
 
     ASSERT_OK(CPU, This);
     return 0;
@@ -284,7 +590,7 @@ int CPU_dup(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
-    float a = Stack_pop(This->cstack);
+    CPU_word_t a = Stack_pop(This->cstack);
     CPU_push(This, a);
     CPU_push(This, a);
 
@@ -292,14 +598,206 @@ int CPU_dup(CPU_t* This)
     return 0;
 }
 
+_Static_assert(offsetof(CPU_t, rdx) == offsetof(CPU_t, registers) + RDX * sizeof(CPU_word_t),
+               "registers of CPU_t must overlay the named ones");
+
+CPU_word_t* CPU_register(CPU_t* This, int reg)
+{
+    switch (reg)
+    {
+    case RAX:
+        return &This->rax;
+    case RBX:
+        return &This->rbx;
+    case RCX:
+        return &This->rcx;
+    case RDX:
+        return &This->rdx;
+    default:
+        return 0;
+    }
+}
+
+int CPU_mov(CPU_t* This, int reg, CPU_word_t value)
+{
+    ASSERT_OK(CPU, This);
+
+    *CPU_register(This, reg) = value;
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+int CPU_add_reg(CPU_t* This, int reg, CPU_word_t value)
+{
+    ASSERT_OK(CPU, This);
+
+    CPU_word_t* target = CPU_register(This, reg);
+    *target = word_add(*target, value);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+int CPU_sub_reg(CPU_t* This, int reg, CPU_word_t value)
+{
+    ASSERT_OK(CPU, This);
+
+    CPU_word_t* target = CPU_register(This, reg);
+    *target = word_sub(*target, value);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+int CPU_mul_reg(CPU_t* This, int reg, CPU_word_t value)
+{
+    ASSERT_OK(CPU, This);
+
+    CPU_word_t* target = CPU_register(This, reg);
+    *target = word_mul(*target, value);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+int CPU_div_reg(CPU_t* This, int reg, CPU_word_t value)
+{
+    ASSERT_OK(CPU, This);
+
+    CPU_word_t* target = CPU_register(This, reg);
+    *target = word_div(*target, value);
+
+    ASSERT_OK(CPU, This);
+    return 0;
+}
+
+// condition of jump command JA..JNE on a compared to b
+static int CPU_condition(int jump, CPU_word_t a, CPU_word_t b)
+{
+    switch (jump)
+    {
+    case JA:
+        return a > b;
+    case JAE:
+        return a >= b;
+    case JB:
+        return a < b;
+    case JBE:
+        return a <= b;
+    case JE:
+        return a == b;
+    case JNE:
+        return a != b;
+    default:
+        return 0;
+    }
+}
+
+// JA_RR..JNE_RR: jumps to param if register reg compares to register reg2
+int CPU_jump_reg(CPU_t* This, int command, int reg, int reg2, CPU_word_t param, int* current_command)
+{
+    ASSERT_OK(CPU, This);
+
+    int result = 0;
+    if (CPU_condition(JA + (command - JA_RR), *CPU_register(This, reg), *CPU_register(This, reg2)))
+        result = CPU_jmp(This, param, current_command);
+
+    ASSERT_OK(CPU, This);
+    return result;
+}
+
+// JA_RI..JNE_RI: jumps to param if register reg compares to value, otherwise skips the EXT command of value
+int CPU_jump_imm(CPU_t* This, int command, int reg, CPU_word_t value, CPU_word_t param, int* current_command)
+{
+    ASSERT_OK(CPU, This);
+
+    int result = 0;
+    if (CPU_condition(JA + (command - JA_RI), *CPU_register(This, reg), value))
+        result = CPU_jmp(This, param, current_command);
+    else
+        ++*current_command;
+
+    ASSERT_OK(CPU, This);
+    return result;
+}
+
+// index of the command the SWITCH command jumps to, its table follows it in the program
+int CPU_switch_target(CPU_t* This, const CPU_command_t* command)
+{
+    CPU_word_t value = word_sub(*CPU_register(This, command->reg), command[1].parameter);
+    int cases_cnt = command->parameter;
+    int entry = 0;
+    if ((value >= 0) && (value < cases_cnt) && (value == (int) value))
+        entry = 1 + (int) value;
+
+    return command[2 + entry].parameter;
+}
+
+int CPU_switch(CPU_t* This, const CPU_command_t* command, int* current_command)
+{
+    ASSERT_OK(CPU, This);
+
+    int result = CPU_jmp(This, CPU_switch_target(This, command), current_command);
+
+    ASSERT_OK(CPU, This);
+    return result;
+}
+
+int CPU_loop(CPU_t* This, int reg, CPU_word_t param, int* current_command)
+{
+    ASSERT_OK(CPU, This);
+
+    CPU_word_t* counter = CPU_register(This, reg);
+    *counter = word_sub(*counter, 1);
+    int result = 0;
+    if (*counter != 0)
+        result = CPU_jmp(This, param, current_command);
+
+    ASSERT_OK(CPU, This);
+    return result;
+}
+
+CPU_word_t CPU_input(CPU_t* This)
+{
+    CPU_word_t value = 0;
+    ++This->inputs;
+    if (This->journal && (This->journal->mode == JOURNAL_REPLAY))
+    {
+        Journal_input(This->journal, &value);
+        return value;
+    }
+    if (This->io.input)
+        This->io.input(This->io.user, &value);
+    else
+    {
+        printf("Input parameter> ");
+        scanf(WORD_SCAN, &value);
+    }
+    if (This->journal)
+        Journal_record(This->journal, JOURNAL_INPUT, value);
+
+    return value;
+}
+
+int CPU_output(CPU_t* This, CPU_word_t value)
+{
+    ++This->outputs;
+    if (This->io.output)
+        This->io.output(This->io.user, value);
+    else
+        printf(WORD_PRINT "\n", value);
+    if (This->journal)
+        Journal_output(This->journal, value);
+
+    return 0;
+}
+
 int CPU_in(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
-    float value = 0;
-    printf("Input parameter> ");
-    scanf("%f", &value);
-    CPU_push(This, value);
+    CPU_push(This, CPU_input(This));
 
     ASSERT_OK(CPU, This);
     return 0;
@@ -309,90 +807,224 @@ int CPU_out(CPU_t* This)
 {
     ASSERT_OK(CPU, This);
 
-    printf("%g\n", Stack_pop(This->cstack));
+    CPU_output(This, Stack_pop(This->cstack));
 
     ASSERT_OK(CPU, This);
     return 0;
 }
 
-int CPU_run_program(CPU_t* This, CPU_command_t* commands)
+int CPU_step(CPU_t* This, const CPU_command_t* commands, int* current_command)
+{
+    CPU_command_t command = commands[*current_command];
+    int result = 0;     // CPU_EXPIRED from the watchdog or -1 from a failed command
+    switch (command.command)
+    {
+    case PUSH:
+        CPU_push(This, command.parameter);
+        break;
+    case PUSH_VAR:
+        CPU_push_var(This, command.parameter);
+        break;
+    case POP:
+        CPU_pop(This, command.parameter);
+        break;
+    case JA:
+        result = CPU_ja(This, command.parameter, current_command);
+        break;
+    case JAE:
+        result = CPU_jae(This, command.parameter, current_command);
+        break;
+    case JB:
+        result = CPU_jb(This, command.parameter, current_command);
+        break;
+    case JBE:
+        result = CPU_jbe(This, command.parameter, current_command);
+        break;
+    case JE:
+        result = CPU_je(This, command.parameter, current_command);
+        break;
+    case JNE:
+        result = CPU_jne(This, command.parameter, current_command);
+        break;
+    case JMP:
+        result = CPU_jmp(This, command.parameter, current_command);
+        break;
+    case CALL:
+        result = CPU_call(This, command.parameter, current_command);
+        break;
+    case RET:
+        result = CPU_ret(This, current_command);
+        break;
+    case ADD:
+        CPU_add(This);
+        break;
+    case SUB:
+        CPU_sub(This);
+        break;
+    case MUL:
+        CPU_mul(This);
+        break;
+    case DIV:
+        CPU_div(This);
+        break;
+    case POW:
+        CPU_pow(This);
+        break;
+    case DUP:
+        CPU_dup(This);
+        break;
+    case IN:
+        CPU_in(This);
+        break;
+    case OUT:
+        CPU_out(This);
+        break;
+    case MOV_RR:
+        CPU_mov(This, command.reg, *CPU_register(This, command.reg2));
+        break;
+    case MOV_RI:
+        CPU_mov(This, command.reg, command.parameter);
+        break;
+    case ADD_RR:
+        CPU_add_reg(This, command.reg, *CPU_register(This, command.reg2));
+        break;
+    case ADD_RI:
+        CPU_add_reg(This, command.reg, command.parameter);
+        break;
+    case SUB_RR:
+        CPU_sub_reg(This, command.reg, *CPU_register(This, command.reg2));
+        break;
+    case SUB_RI:
+        CPU_sub_reg(This, command.reg, command.parameter);
+        break;
+    case MUL_RR:
+        CPU_mul_reg(This, command.reg, *CPU_register(This, command.reg2));
+        break;
+    case MUL_RI:
+        CPU_mul_reg(This, command.reg, command.parameter);
+        break;
+    case DIV_RR:
+        CPU_div_reg(This, command.reg, *CPU_register(This, command.reg2));
+        break;
+    case DIV_RI:
+        CPU_div_reg(This, command.reg, command.parameter);
+        break;
+    case INC:
+        CPU_add_reg(This, command.reg, 1);
+        break;
+    case DEC:
+        CPU_sub_reg(This, command.reg, 1);
+        break;
+    case JA_RR:
+    case JAE_RR:
+    case JB_RR:
+    case JBE_RR:
+    case JE_RR:
+    case JNE_RR:
+        result = CPU_jump_reg(This, command.command, command.reg, command.reg2, command.parameter, current_command);
+        break;
+    case LOOP:
+        result = CPU_loop(This, command.reg, command.parameter, current_command);
+        break;
+    case JA_RI:
+    case JAE_RI:
+    case JB_RI:
+    case JBE_RI:
+    case JE_RI:
+    case JNE_RI:
+        // the immediate is in the EXT command after the jump
+        result = CPU_jump_imm(This, command.command, command.reg, commands[*current_command + 1].parameter,
+                              command.parameter, current_command);
+        break;
+    case SWITCH:
+        result = CPU_switch(This, &commands[*current_command], current_command);
+        break;
+    case ENTER:
+        result = CPU_enter(This, command.parameter);
+        break;
+    case LOAD_LOCAL:
+        result = CPU_load_local(This, command.parameter);
+        break;
+    case STORE_LOCAL:
+        result = CPU_store_local(This, command.parameter);
+        break;
+    case LOAD_R:
+        result = CPU_load(This, *CPU_register(This, command.reg));
+        break;
+    case LOAD_I:
+        result = CPU_load(This, command.parameter);
+        break;
+    case STORE_R:
+        result = CPU_store(This, *CPU_register(This, command.reg));
+        break;
+    case STORE_I:
+        result = CPU_store(This, command.parameter);
+        break;
+    case VADD:
+    case VMUL:
+    case VFMA:
+    case VSUM:
+    case VMIN:
+    case VMAX:
+    case VDOT:
+    case VIN:
+    case VOUT:
+        result = CPU_vector(This, command.command);
+        break;
+    case NATIVE:
+        result = CPU_native(This, command.parameter);
+        break;
+    case SPAWN:
+    case JOIN:
+    case SEND:
+    case RECV:
+        printf("Concurrency command at %s is run only by the scheduler\n", Symbols_where(*current_command));
+        break;
+    case BREAK:
+        // stays at the breakpoint, the debugger runs the saved command
+        return 1;
+    default:
+        break;
+    }
+    // a stopped command stays current
+    if (result != 0)
+        return result;
+    ++*current_command;
+
+    return 0;
+}
+
+int CPU_run_program(CPU_t* This, const CPU_command_t* commands)
 {
     ASSERT_OK(CPU, This);
 
-    Stack_t call_stack = {};
-    Stack_ctor(&call_stack, CALL_STACK_SIZE);
+    int command_index = This->start;
+    while (commands[command_index].command != END)
+    {
+        int result = CPU_step(This, commands, &command_index);
+        if (result != 0)
+            return result;
+    }
+
+    return 0;
+}
+
+// CPU_run_program() counting runs of every command and jumps away from the next one
+int CPU_run_profiled(CPU_t* This, CPU_command_t* commands, CPU_profile_t* profile)
+{
+    ASSERT_OK(CPU, This);
+    assert(profile);
 
-    int command_index = 0;
-    CPU_command_t command = commands[command_index];
-    while (command.command != END)
+    int command_index = This->start;
+    while (commands[command_index].command != END)
     {
-        switch (command.command)
-        {
-        case PUSH:
-            CPU_push(This, command.parameter);
-            break;
-        case PUSH_VAR:
-            CPU_push_var(This, command.parameter);
-            break;
-        case POP:
-            CPU_pop(This, command.parameter);
-            break;
-        case JA:
-            CPU_ja(This, command.parameter, &command_index);
-            break;
-        case JAE:
-            CPU_jae(This, command.parameter, &command_index);
-            break;
-        case JB:
-            CPU_jb(This, command.parameter, &command_index);
-            break;
-        case JBE:
-            CPU_jbe(This, command.parameter, &command_index);
-            break;
-        case JE:
-            CPU_je(This, command.parameter, &command_index);
-            break;
-        case JNE:
-            CPU_jne(This, command.parameter, &command_index);
-            break;
-        case JMP:
-            CPU_jmp(This, command.parameter, &command_index);
-            break;
-        case CALL:
-            CPU_call(This, command.parameter, &command_index, &call_stack);
-            break;
-        case RET:
-            CPU_ret(This, &command_index, &call_stack);
-            break;
-        case ADD:
-            CPU_add(This);
-            break;
-        case SUB:
-            CPU_sub(This);
-            break;
-        case MUL:
-            CPU_mul(This);
-            break;
-        case DIV:
-            CPU_div(This);
-            break;
-        case POW:
-            CPU_pow(This);
-            break;
-        case DUP:
-            CPU_dup(This);
-            break;
-        case IN:
-            CPU_in(This);
-            break;
-        case OUT:
-            CPU_out(This);
-            break;
-        default:
-            break;
-        }
-        ++command_index;
-        command = commands[command_index];
+        int index = command_index;
+        int result = CPU_step(This, commands, &command_index);
+        if (result != 0)
+            return result;
+        ++profile->counts[index];
+        if (command_index != index + CPU_command_length(&commands[index]))
+            ++profile->taken[index];
     }
 
     return 0;
@@ -1,45 +1,111 @@
 #ifndef ASM_INTERPRETER_H_INCLUDED
 #define ASM_INTERPRETER_H_INCLUDED
 
+#include <signal.h>
+#include <stddef.h>
 #include "commands.h"
 #include "stack.h"
+#include "journal.h"
+#include "watchdog.h"
 
 #define STACK_SIZE 100
 #define CALL_STACK_SIZE 100
+#define FRAMES_SIZE 1024
+#define MEMORY_SIZE 65536
+
+// returned by CPU_step() and the engines when the watchdog has stopped the program
+#define CPU_EXPIRED 2
+
+// host handlers of IN and OUT, the console is used when they are not set; they return 0 on success
+typedef struct
+{
+    int (*input)(void* user, CPU_word_t* value);
+    int (*output)(void* user, CPU_word_t value);
+    void* user;
+} CPU_io_t;
 
 typedef struct
 {
-    float rax;
-    float rbx;
-    float rcx;
-    float rdx;
+    union
+    {
+        struct
+        {
+            CPU_word_t rax;
+            CPU_word_t rbx;
+            CPU_word_t rcx;
+            CPU_word_t rdx;
+        };
+        CPU_word_t registers[4];    // the same words indexed by RAX..RDX for the engines
+    };
     Stack_t* cstack;
+    Stack_t* call_stack;
+    Stack_t* frames;        // local slots of all active frames, the current one is on top
+    Stack_t* frame_links;   // frame and frames count of every caller
+    int frame;              // first local slot of the current frame
+    CPU_word_t* memory;
+    int memory_size;
+    Journal_t* journal;     // records or replays IN and OUT values when set
+    Watchdog_t* watchdog;   // limits the run when set, see CPU_checkpoint()
+    int start;              // command the engines begin at, 0 unless a snapshot has been restored
+    long long inputs;       // values taken by IN and printed by OUT so far
+    long long outputs;
+    volatile sig_atomic_t position; // command being run, kept by the engines for the sampler
+    CPU_io_t io;
+    int in_arena;           // stacks and memory are in a block of the caller, see CPU_ctor_arena()
 } CPU_t;
 
 int CPU_ctor(CPU_t* This);
+size_t CPU_arena_size(int memory_size);
+int CPU_ctor_arena(CPU_t* This, void* arena, int memory_size);
+int CPU_reset(CPU_t* This);
 int CPU_dtor(CPU_t* This);
 int CPU_ok(CPU_t* This);
 int CPU_dump(CPU_t* This, char* name);
-int CPU_push(CPU_t* This, float value);
-int CPU_push_var(CPU_t* This, float var);
-int CPU_pop(CPU_t* This, float var);
-int CPU_ja(CPU_t* This, float param, int* current_command);
-int CPU_jae(CPU_t* This, float param, int* current_command);
-int CPU_jb(CPU_t* This, float param, int* current_command);
-int CPU_jbe(CPU_t* This, float param, int* current_command);
-int CPU_je(CPU_t* This, float param, int* current_command);
-int CPU_jne(CPU_t* This, float param, int* current_command);
-int CPU_jmp(CPU_t* This, float param, int* current_command);
-int CPU_call(CPU_t* This, float param, int* current_command, Stack_t* call_stack);
-int CPU_ret(CPU_t* This, int* current_command, Stack_t* call_stack);
+int CPU_push(CPU_t* This, CPU_word_t value);
+int CPU_push_var(CPU_t* This, CPU_word_t var);
+int CPU_pop(CPU_t* This, CPU_word_t var);
+int CPU_ja(CPU_t* This, CPU_word_t param, int* current_command);
+int CPU_jae(CPU_t* This, CPU_word_t param, int* current_command);
+int CPU_jb(CPU_t* This, CPU_word_t param, int* current_command);
+int CPU_jbe(CPU_t* This, CPU_word_t param, int* current_command);
+int CPU_je(CPU_t* This, CPU_word_t param, int* current_command);
+int CPU_jne(CPU_t* This, CPU_word_t param, int* current_command);
+int CPU_jmp(CPU_t* This, CPU_word_t param, int* current_command);
+int CPU_call(CPU_t* This, CPU_word_t param, int* current_command);
+int CPU_ret(CPU_t* This, int* current_command);
 int CPU_add(CPU_t* This);
 int CPU_sub(CPU_t* This);
 int CPU_mul(CPU_t* This);
 int CPU_div(CPU_t* This);
 int CPU_pow(CPU_t* This);
 int CPU_dup(CPU_t* This);
+CPU_word_t* CPU_register(CPU_t* This, int reg);
+int CPU_mov(CPU_t* This, int reg, CPU_word_t value);
+int CPU_add_reg(CPU_t* This, int reg, CPU_word_t value);
+int CPU_sub_reg(CPU_t* This, int reg, CPU_word_t value);
+int CPU_mul_reg(CPU_t* This, int reg, CPU_word_t value);
+int CPU_div_reg(CPU_t* This, int reg, CPU_word_t value);
+int CPU_jump_reg(CPU_t* This, int command, int reg, int reg2, CPU_word_t param, int* current_command);
+int CPU_jump_imm(CPU_t* This, int command, int reg, CPU_word_t value, CPU_word_t param, int* current_command);
+int CPU_loop(CPU_t* This, int reg, CPU_word_t param, int* current_command);
+int CPU_frame_push(CPU_t* This);
+int CPU_frame_pop(CPU_t* This);
+int CPU_enter(CPU_t* This, CPU_word_t slots);
+int CPU_load_local(CPU_t* This, CPU_word_t slot);
+int CPU_store_local(CPU_t* This, CPU_word_t slot);
+int CPU_memory_resize(CPU_t* This, int size);
+int CPU_memory_check(CPU_t* This, CPU_word_t address, CPU_word_t count);
+int CPU_load(CPU_t* This, CPU_word_t address);
+int CPU_store(CPU_t* This, CPU_word_t address);
+int CPU_switch_target(CPU_t* This, const CPU_command_t* command);
+int CPU_switch(CPU_t* This, const CPU_command_t* command, int* current_command);
+CPU_word_t CPU_input(CPU_t* This);
+int CPU_output(CPU_t* This, CPU_word_t value);
 int CPU_in(CPU_t* This);
 int CPU_out(CPU_t* This);
-int CPU_run_program(CPU_t* This, CPU_command_t* commands);
+int CPU_checkpoint(CPU_t* This, int index, long long cost);
+int CPU_step(CPU_t* This, const CPU_command_t* commands, int* current_command);
+int CPU_run_program(CPU_t* This, const CPU_command_t* commands);
+int CPU_run_profiled(CPU_t* This, CPU_command_t* commands, CPU_profile_t* profile);
 
 #endif // ASM_INTERPRETER_H_INCLUDED
@@ -0,0 +1,736 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "regvm.h"
+#include "blocks.h"
+#include "commands.h"
+#include "processor.h"
+#include "myassert.h"
+#include "stack.h"
+#include "natives.h"
+#include "symbols.h"
+
+typedef struct
+{
+    Regvm_op_t* ops;
+    int ops_cnt;
+    int* stack;         // virtual registers standing for the stack above the entry depth
+    int depth;
+    int vregs_cnt;
+    int pops;
+} Translation_t;
+
+static Regvm_op_t* emit(Translation_t* This, int op)
+{
+    Regvm_op_t* result = &This->ops[This->ops_cnt++];
+    result->op = op;
+    result->dst = -1;
+    result->src1 = -1;
+    result->src2 = -1;
+    result->reg = 0;
+    result->value = 0;
+    return result;
+}
+
+static int new_vreg(Translation_t* This)
+{
+    return This->vregs_cnt++;
+}
+
+static void sim_push(Translation_t* This, int vreg)
+{
+    This->stack[This->depth++] = vreg;
+}
+
+static int sim_pop(Translation_t* This)
+{
+    if (This->depth > 0)
+        return This->stack[--This->depth];
+
+    int vreg = new_vreg(This);
+    emit(This, R_POP)->dst = vreg;
+    ++This->pops;
+    return vreg;
+}
+
+// leaves the values of the block on the real stack
+static int spill(Translation_t* This)
+{
+    int pushes = This->depth;
+    for (int i = 0; i < This->depth; ++i)
+        emit(This, R_PUSH)->src1 = This->stack[i];
+    This->depth = 0;
+    return pushes;
+}
+
+static int valid_register(const CPU_command_t* command)
+{
+    int reg = command->parameter;
+    return (reg >= RAX) && (reg <= RDX) && (reg == command->parameter);
+}
+
+static int arithmetic_op(int command)
+{
+    switch (command)
+    {
+    case ADD:
+        return R_ADD;
+    case SUB:
+        return R_SUB;
+    case MUL:
+        return R_MUL;
+    case DIV:
+        return R_DIV;
+    case POW:
+        return R_POW;
+    default:
+        return -1;
+    }
+}
+
+static int load(Translation_t* This, int reg)
+{
+    int vreg = new_vreg(This);
+    Regvm_op_t* op = emit(This, R_LOAD);
+    op->dst = vreg;
+    op->reg = reg;
+    return vreg;
+}
+
+static int constant(Translation_t* This, CPU_word_t value)
+{
+    int vreg = new_vreg(This);
+    Regvm_op_t* op = emit(This, R_CONST);
+    op->dst = vreg;
+    op->value = value;
+    return vreg;
+}
+
+// reg = reg op reg2 / parameter, the stack is not touched
+static void translate_register_command(Translation_t* This, const CPU_command_t* command)
+{
+    static const int ops[] = {R_ADD, R_SUB, R_MUL, R_DIV};
+    int cmd = command->command;
+    int operands = CPU_command_operands(cmd);
+    int value = -1;
+    if (operands & OPERAND_REG2)
+        value = load(This, command->reg2);
+    else
+        value = constant(This, (operands & OPERAND_PARAM) ? command->parameter : 1);
+
+    int result = value;
+    if ((cmd != MOV_RR) && (cmd != MOV_RI))
+    {
+        int kind = (cmd == INC) ? R_ADD : (cmd == DEC) ? R_SUB : ops[(cmd - ADD_RR) / 2];
+        int current = load(This, command->reg);
+        result = new_vreg(This);
+        Regvm_op_t* op = emit(This, kind);
+        op->dst = result;
+        op->src1 = current;
+        op->src2 = value;
+    }
+    Regvm_op_t* op = emit(This, R_STORE);
+    op->src1 = result;
+    op->reg = command->reg;
+}
+
+static int exit_op(int command)
+{
+    switch (command)
+    {
+    case JA:
+    case JAE:
+    case JB:
+    case JBE:
+    case JE:
+    case JNE:
+    case JA_RR:
+    case JAE_RR:
+    case JB_RR:
+    case JBE_RR:
+    case JE_RR:
+    case JNE_RR:
+    case LOOP:
+    case JA_RI:
+    case JAE_RI:
+    case JB_RI:
+    case JBE_RI:
+    case JE_RI:
+    case JNE_RI:
+        return R_BRANCH;
+    case JMP:
+        return R_JMP;
+    case CALL:
+        return R_CALL;
+    case RET:
+        return R_RET;
+    case END:
+        return R_END;
+    default:
+        return R_STEP;
+    }
+}
+
+// translates commands start..end-1 of the block, only the last one may leave it
+static void translate_block(Regvm_block_t* block, const CPU_command_t* commands, Translation_t* tr)
+{
+    tr->ops_cnt = 0;
+    tr->depth = 0;
+    tr->vregs_cnt = 0;
+    tr->pops = 0;
+    block->exit = -1;
+
+    for (int i = block->start; i < block->end; ++i)
+    {
+        const CPU_command_t* command = &commands[i];
+        int vreg = -1;
+        Regvm_op_t* op = 0;
+        switch (command->command)
+        {
+        case NOP:
+            break;
+        case PUSH:
+            vreg = new_vreg(tr);
+            op = emit(tr, R_CONST);
+            op->dst = vreg;
+            op->value = command->parameter;
+            sim_push(tr, vreg);
+            break;
+        case PUSH_VAR:
+        case POP:
+            if (!valid_register(command))
+            {
+                block->exit = i;
+                break;
+            }
+            if (command->command == PUSH_VAR)
+            {
+                vreg = new_vreg(tr);
+                op = emit(tr, R_LOAD);
+                op->dst = vreg;
+                op->reg = command->parameter;
+                sim_push(tr, vreg);
+            } else
+            {
+                vreg = sim_pop(tr);
+                op = emit(tr, R_STORE);
+                op->src1 = vreg;
+                op->reg = command->parameter;
+            }
+            break;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case POW:
+        {
+            int a = sim_pop(tr);
+            int b = sim_pop(tr);
+            vreg = new_vreg(tr);
+            op = emit(tr, arithmetic_op(command->command));
+            op->dst = vreg;
+            op->src1 = a;
+            op->src2 = b;
+            sim_push(tr, vreg);
+            break;
+        }
+        case DUP:
+            vreg = sim_pop(tr);
+            sim_push(tr, vreg);
+            sim_push(tr, vreg);
+            break;
+        case IN:
+            vreg = new_vreg(tr);
+            emit(tr, R_IN)->dst = vreg;
+            sim_push(tr, vreg);
+            break;
+        case OUT:
+            vreg = sim_pop(tr);
+            emit(tr, R_OUT)->src1 = vreg;
+            break;
+        case LOAD_LOCAL:
+            vreg = new_vreg(tr);
+            op = emit(tr, R_LOAD_LOCAL);
+            op->dst = vreg;
+            op->value = command->parameter;
+            sim_push(tr, vreg);
+            break;
+        case STORE_LOCAL:
+            vreg = sim_pop(tr);
+            op = emit(tr, R_STORE_LOCAL);
+            op->src1 = vreg;
+            op->value = command->parameter;
+            break;
+        case LOAD_R:
+        case LOAD_I:
+        {
+            int address = (command->command == LOAD_R) ? load(tr, command->reg) : constant(tr, command->parameter);
+            vreg = new_vreg(tr);
+            op = emit(tr, R_LOAD_MEM);
+            op->dst = vreg;
+            op->src1 = address;
+            sim_push(tr, vreg);
+            break;
+        }
+        case STORE_R:
+        case STORE_I:
+        {
+            vreg = sim_pop(tr);
+            int address = (command->command == STORE_R) ? load(tr, command->reg) : constant(tr, command->parameter);
+            op = emit(tr, R_STORE_MEM);
+            op->src1 = address;
+            op->src2 = vreg;
+            break;
+        }
+        case NATIVE:
+        {
+            // arguments are copied to consecutive registers, so the function reads them in place
+            const Native_t* native = Natives_get(command->parameter);
+            int args[NATIVE_MAX_ARITY] = {};
+            for (int j = native->arity - 1; j >= 0; --j)
+                args[j] = sim_pop(tr);
+            int first = tr->vregs_cnt;
+            for (int j = 0; j < native->arity; ++j)
+            {
+                op = emit(tr, R_MOVE);
+                op->dst = new_vreg(tr);
+                op->src1 = args[j];
+            }
+            vreg = new_vreg(tr);
+            op = emit(tr, R_NATIVE);
+            op->dst = vreg;
+            op->src1 = first;
+            op->reg = command->parameter;
+            if (native->results)
+                sim_push(tr, vreg);
+            break;
+        }
+        case MOV_RR:
+        case MOV_RI:
+        case ADD_RR:
+        case ADD_RI:
+        case SUB_RR:
+        case SUB_RI:
+        case MUL_RR:
+        case MUL_RI:
+        case DIV_RR:
+        case DIV_RI:
+        case INC:
+        case DEC:
+            translate_register_command(tr, command);
+            break;
+        default:
+            block->exit = i;
+            break;
+        }
+        if (block->exit >= 0)
+            break;
+    }
+
+    if (block->exit < 0)
+    {
+        block->pushes = spill(tr);
+        emit(tr, R_FALL);
+    } else
+    {
+        const CPU_command_t* command = &commands[block->exit];
+        int op_kind = exit_op(command->command);
+        int a = -1;
+        int b = -1;
+        int branch = command->command;
+        if ((command->command >= JA_RR) && (command->command <= JNE_RR))
+        {
+            a = load(tr, command->reg);
+            b = load(tr, command->reg2);
+            branch = JA + (command->command - JA_RR);
+        } else if ((command->command >= JA_RI) && (command->command <= JNE_RI))
+        {
+            a = load(tr, command->reg);
+            b = constant(tr, command[1].parameter);
+            branch = JA + (command->command - JA_RI);
+        } else if (command->command == LOOP)
+        {
+            int counter = load(tr, command->reg);
+            int one = constant(tr, 1);
+            a = new_vreg(tr);
+            Regvm_op_t* op = emit(tr, R_SUB);
+            op->dst = a;
+            op->src1 = counter;
+            op->src2 = one;
+            op = emit(tr, R_STORE);
+            op->src1 = a;
+            op->reg = command->reg;
+            b = constant(tr, 0);
+            branch = JNE;
+        } else if (op_kind == R_BRANCH)
+        {
+            a = sim_pop(tr);
+            b = sim_pop(tr);
+        }
+        block->pushes = spill(tr);
+        Regvm_op_t* op = emit(tr, op_kind);
+        op->src1 = a;
+        op->src2 = b;
+        op->reg = branch;
+        op->value = command->parameter;
+    }
+    block->pops = tr->pops;
+}
+
+int Regvm_ctor(Regvm_t* This, const CPU_command_t* commands, int commands_cnt)
+{
+    assert(This);
+    assert(commands);
+    assert(commands_cnt > 0);
+
+    This->commands = commands;
+    This->commands_cnt = commands_cnt;
+    This->by_index = (Regvm_block_t**) calloc(commands_cnt, sizeof(*This->by_index));
+
+    char* leaders = (char*) calloc(commands_cnt, sizeof(*leaders));
+    Blocks_find_leaders(commands, commands_cnt, leaders);
+    This->blocks_cnt = 0;
+    for (int i = 0; i < commands_cnt; ++i)
+        This->blocks_cnt += leaders[i];
+    This->blocks = (Regvm_block_t*) calloc(This->blocks_cnt, sizeof(*This->blocks));
+
+    // a native call may copy and pop all its arguments
+    int ops_size = 5 * commands_cnt + 1;
+    for (int i = 0; i < commands_cnt; ++i)
+        if (commands[i].command == NATIVE)
+            ops_size += 2 * NATIVE_MAX_ARITY;
+    Translation_t tr = {};
+    tr.ops = (Regvm_op_t*) calloc(ops_size, sizeof(*tr.ops));
+    tr.stack = (int*) calloc(2 * commands_cnt + 1, sizeof(*tr.stack));
+    This->vregs_cnt = 1;
+
+    int block_index = 0;
+    for (int i = 0; i < commands_cnt; ++block_index)
+    {
+        Regvm_block_t* block = &This->blocks[block_index];
+        block->start = i;
+        do
+            ++i;
+        while ((i < commands_cnt) && !leaders[i]);
+        block->end = i;
+        This->by_index[block->start] = block;
+
+        translate_block(block, commands, &tr);
+        assert((block->exit < 0) || (block->exit + CPU_command_length(&commands[block->exit]) == block->end));
+        block->ops_cnt = tr.ops_cnt;
+        block->ops = (Regvm_op_t*) calloc(tr.ops_cnt, sizeof(*block->ops));
+        for (int j = 0; j < tr.ops_cnt; ++j)
+            block->ops[j] = tr.ops[j];
+        if (tr.vregs_cnt > This->vregs_cnt)
+            This->vregs_cnt = tr.vregs_cnt;
+    }
+    free(tr.ops);
+    free(tr.stack);
+    free(leaders);
+
+    for (int i = 0; i < This->blocks_cnt; ++i)
+    {
+        Regvm_block_t* block = &This->blocks[i];
+        block->next = (block->end < commands_cnt) ? This->by_index[block->end] : 0;
+        block->taken = 0;
+        if (block->exit >= 0)
+        {
+            const CPU_command_t* command = &commands[block->exit];
+            int target = command->parameter;
+            if ((CPU_command_operands(command->command) & OPERAND_TARGET) && (target >= 0) && (target < commands_cnt))
+                block->taken = This->by_index[target];
+        }
+    }
+    This->vregs = (CPU_word_t*) calloc(This->vregs_cnt, sizeof(*This->vregs));
+
+    ASSERT_OK(Regvm, This);
+
+    return 0;
+}
+
+int Regvm_dtor(Regvm_t* This)
+{
+    assert(This);
+
+    for (int i = 0; This->blocks && (i < This->blocks_cnt); ++i)
+        free(This->blocks[i].ops);
+    free(This->blocks);
+    free(This->by_index);
+    free(This->vregs);
+    This->blocks = 0;
+    This->by_index = 0;
+    This->vregs = 0;
+    This->blocks_cnt = -1;
+    This->commands_cnt = -1;
+    This->commands = 0;
+
+    return 0;
+}
+
+int Regvm_ok(Regvm_t* This)
+{
+    if (!This)
+        return 0;
+    if (!This->commands || !This->blocks || !This->by_index || !This->vregs)
+        return 0;
+    if ((This->commands_cnt <= 0) || (This->blocks_cnt <= 0) || (This->vregs_cnt <= 0))
+        return 0;
+    if (This->by_index[0] != &This->blocks[0])
+        return 0;
+    return 1;
+}
+
+int Regvm_dump(Regvm_t* This, char* name)
+{
+    assert(This);
+
+    static const char* names[] = {"const", "load", "store", "pop", "push", "add", "sub", "mul", "div", "pow",
+                                  "in", "out", "load_local", "store_local", "load_mem", "store_mem",
+                                  "move", "native",
+                                  "fall", "branch", "jmp", "call", "ret", "end", "step"};
+
+    printf("%s = Regvm_t(%s)\n"
+           "{\n"
+           "    commands_cnt = %d\n"
+           "    blocks_cnt = %d\n"
+           "    vregs_cnt = %d\n"
+           "    blocks = \n"
+           "    {\n",
+           name, Regvm_ok(This) ? "ok" : "NOT OK!!!", This->commands_cnt, This->blocks_cnt, This->vregs_cnt);
+    for (int i = 0; This->blocks && (i < This->blocks_cnt); ++i)
+    {
+        Regvm_block_t* block = &This->blocks[i];
+        printf("        [%d] commands %d..%d, pops %d, pushes %d\n",
+               i, block->start, block->end - 1, block->pops, block->pushes);
+        for (int j = 0; j < block->ops_cnt; ++j)
+        {
+            Regvm_op_t* op = &block->ops[j];
+            printf("            %s dst v%d, src v%d v%d, reg %d, value " WORD_PRINT "\n",
+                   names[op->op], op->dst, op->src1, op->src2, op->reg, op->value);
+        }
+    }
+    printf("    }\n"
+           "}\n");
+
+    return 0;
+}
+
+static int branch_taken(int command, CPU_word_t a, CPU_word_t b)
+{
+    switch (command)
+    {
+    case JA:
+        return a > b;
+    case JAE:
+        return a >= b;
+    case JB:
+        return a < b;
+    case JBE:
+        return a <= b;
+    case JE:
+        return a == b;
+    case JNE:
+        return a != b;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Block to continue with at command index, commands that start no block are
+ * interpreted. *result gets a nonzero result of CPU_step().
+ */
+static Regvm_block_t* Regvm_enter(CPU_t* This, Regvm_t* regvm, int index, int* finished, int* result)
+{
+    while ((index >= 0) && (index < regvm->commands_cnt) && !regvm->by_index[index])
+    {
+        if (regvm->commands[index].command == END)
+        {
+            *finished = 1;
+            return 0;
+        }
+        if ((*result = CPU_step(This, regvm->commands, &index)) != 0)
+            return 0;
+    }
+    if ((index < 0) || (index >= regvm->commands_cnt))
+        return 0;
+    return regvm->by_index[index];
+}
+
+int CPU_run_regvm(CPU_t* This, Regvm_t* regvm)
+{
+    ASSERT_OK(CPU, This);
+    ASSERT_OK(Regvm, regvm);
+
+    CPU_word_t* regs[4] = {&This->rax, &This->rbx, &This->rcx, &This->rdx};
+    CPU_word_t* v = regvm->vregs;
+    Stack_t* stack = This->cstack;
+    Stack_t* call_stack = This->call_stack;
+    int finished = 0;
+    int result = 0;
+    Regvm_block_t* block = Regvm_enter(This, regvm, This->start, &finished, &result);
+
+    while (block)
+    {
+        This->position = block->start;
+        if (stack->count < block->pops)
+        {
+            printf("Stack underflow in block at %s\n", Symbols_where(block->start));
+            return -1;
+        }
+        if (stack->count - block->pops + block->pushes > stack->size)
+        {
+            printf("Stack overflow in block at %s\n", Symbols_where(block->start));
+            return -1;
+        }
+
+        Regvm_block_t* following = 0;
+        for (const Regvm_op_t* op = block->ops; ; ++op)
+        {
+            switch (op->op)
+            {
+            case R_CONST:
+                v[op->dst] = op->value;
+                continue;
+            case R_LOAD:
+                v[op->dst] = *regs[op->reg];
+                continue;
+            case R_STORE:
+                *regs[op->reg] = v[op->src1];
+                continue;
+            case R_POP:
+                v[op->dst] = stack->data[--stack->count];
+                continue;
+            case R_PUSH:
+                stack->data[stack->count++] = v[op->src1];
+                continue;
+            case R_ADD:
+                v[op->dst] = word_add(v[op->src1], v[op->src2]);
+                continue;
+            case R_SUB:
+                v[op->dst] = word_sub(v[op->src1], v[op->src2]);
+                continue;
+            case R_MUL:
+                v[op->dst] = word_mul(v[op->src1], v[op->src2]);
+                continue;
+            case R_DIV:
+                v[op->dst] = word_div(v[op->src1], v[op->src2]);
+                continue;
+            case R_POW:
+                v[op->dst] = word_pow(v[op->src1], v[op->src2]);
+                continue;
+            case R_IN:
+                v[op->dst] = CPU_input(This);
+                continue;
+            case R_OUT:
+                CPU_output(This, v[op->src1]);
+                continue;
+            case R_LOAD_LOCAL:
+            {
+                if (!((op->value >= 0) && (op->value < This->frames->count - This->frame)))
+                {
+                    printf("Local slot " WORD_PRINT " is out of the frame\n", op->value);
+                    return -1;
+                }
+                int index = This->frame + (int) op->value;
+                v[op->dst] = This->frames->data[index];
+                continue;
+            }
+            case R_STORE_LOCAL:
+            {
+                if (!((op->value >= 0) && (op->value < This->frames->count - This->frame)))
+                {
+                    printf("Local slot " WORD_PRINT " is out of the frame\n", op->value);
+                    return -1;
+                }
+                int index = This->frame + (int) op->value;
+                This->frames->data[index] = v[op->src1];
+                continue;
+            }
+            case R_LOAD_MEM:
+                if (CPU_memory_check(This, v[op->src1], 1) != 0)
+                    return -1;
+                v[op->dst] = This->memory[(int) v[op->src1]];
+                continue;
+            case R_STORE_MEM:
+                if (CPU_memory_check(This, v[op->src1], 1) != 0)
+                    return -1;
+                This->memory[(int) v[op->src1]] = v[op->src2];
+                continue;
+            case R_MOVE:
+                v[op->dst] = v[op->src1];
+                continue;
+            case R_NATIVE:
+                if (Natives_call(This, op->reg, &v[op->src1], &v[op->dst]) != 0)
+                    return -1;
+                continue;
+            case R_FALL:
+                following = block->next;
+                break;
+            case R_BRANCH:
+                following = branch_taken(op->reg, v[op->src1], v[op->src2]) ? block->taken : block->next;
+                break;
+            case R_JMP:
+                following = block->taken;
+                break;
+            case R_CALL:
+                if (call_stack->count >= call_stack->size)
+                {
+                    printf("Call stack overflow at %s\n", Symbols_where(block->exit));
+                    return -1;
+                }
+                call_stack->data[call_stack->count++] = block->end;
+                CPU_frame_push(This);
+                following = block->taken;
+                break;
+            case R_RET:
+            {
+                if (call_stack->count <= 0)
+                {
+                    printf("Call stack underflow at %s\n", Symbols_where(block->exit));
+                    return -1;
+                }
+                int address = call_stack->data[--call_stack->count];
+                CPU_frame_pop(This);
+                following = Regvm_enter(This, regvm, address, &finished, &result);
+                break;
+            }
+            case R_END:
+                return 0;
+            case R_STEP:
+            default:
+            {
+                int index = block->exit;
+                if ((result = CPU_step(This, regvm->commands, &index)) != 0)
+                    return result;
+                following = Regvm_enter(This, regvm, index, &finished, &result);
+                break;
+            }
+            }
+            break;
+        }
+
+        if (!following && !finished)
+        {
+            if (result != 0)
+                return result;
+            printf("Bad jump from command %s\n", Symbols_where((block->exit >= 0) ? block->exit : block->end - 1));
+            return -1;
+        }
+        // the watchdog is charged at backward jumps, calls and returns between blocks
+        if (This->watchdog && following && (block->exit >= 0))
+        {
+            int exit = regvm->commands[block->exit].command;
+            int backward = following->start <= block->exit;
+            if ((backward || (exit == CALL) || (exit == RET)) &&
+                (CPU_checkpoint(This, block->exit, backward ? block->exit + 1 - following->start : 1) != 0))
+                return CPU_EXPIRED;
+        }
+        block = following;
+    }
+    if (result != 0)
+        return result;
+
+    return finished ? 0 : -1;
+}
@@ -0,0 +1,84 @@
+#ifndef REGVM_H_INCLUDED
+#define REGVM_H_INCLUDED
+
+#include "commands.h"
+#include "processor.h"
+
+/*
+ * Three-address form of a basic block. Stack values live in virtual
+ * registers v[]; the real stack is only touched by R_POP for values the
+ * block takes from below its entry depth and by R_PUSH for values it
+ * leaves there at exit.
+ */
+enum REGVM_OP {
+    R_CONST = 0,    // v[dst] = value
+    R_LOAD,         // v[dst] = register reg
+    R_STORE,        // register reg = v[src1]
+    R_POP,          // v[dst] = value popped from the stack
+    R_PUSH,         // push v[src1] to the stack
+    R_ADD,          // v[dst] = v[src1] op v[src2]
+    R_SUB,
+    R_MUL,
+    R_DIV,
+    R_POW,
+    R_IN,           // v[dst] = input value
+    R_OUT,          // output v[src1]
+    R_LOAD_LOCAL,   // v[dst] = local slot value of the current frame
+    R_STORE_LOCAL,  // local slot value = v[src1]
+    R_LOAD_MEM,     // v[dst] = memory[v[src1]]
+    R_STORE_MEM,    // memory[v[src1]] = v[src2]
+    R_MOVE,         // v[dst] = v[src1]
+    R_NATIVE,       // v[dst] = native function reg called with v[src1], v[src1 + 1], ...
+    // block exits, always the last op of a block
+    R_FALL,
+    R_BRANCH,       // conditional jump command on v[src1], v[src2]
+    R_JMP,
+    R_CALL,
+    R_RET,
+    R_END,
+    R_STEP          // command the translator does not know, run by CPU_step()
+};
+
+typedef struct
+{
+    int op;
+    int dst;
+    int src1;
+    int src2;
+    int reg;        // register for R_LOAD and R_STORE, jump command for R_BRANCH
+    CPU_word_t value;
+} Regvm_op_t;
+
+typedef struct Regvm_block_t Regvm_block_t;
+
+struct Regvm_block_t
+{
+    int start;
+    int end;
+    int exit;           // command index of the exit, -1 for fall-through
+    int ops_cnt;
+    Regvm_op_t* ops;
+    int pops;           // stack values taken by R_POP
+    int pushes;         // stack values left by R_PUSH
+    Regvm_block_t* taken;
+    Regvm_block_t* next;
+};
+
+typedef struct
+{
+    const CPU_command_t* commands;
+    int commands_cnt;
+    int blocks_cnt;
+    Regvm_block_t* blocks;
+    Regvm_block_t** by_index;
+    int vregs_cnt;      // size of the virtual register file, maximum over blocks
+    CPU_word_t* vregs;
+} Regvm_t;
+
+int Regvm_ctor(Regvm_t* This, const CPU_command_t* commands, int commands_cnt);
+int Regvm_dtor(Regvm_t* This);
+int Regvm_ok(Regvm_t* This);
+int Regvm_dump(Regvm_t* This, char* name);
+int CPU_run_regvm(CPU_t* This, Regvm_t* regvm);
+
+#endif // REGVM_H_INCLUDED
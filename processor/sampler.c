@@ -0,0 +1,340 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "sampler.h"
+#include "myassert.h"
+#include "symbols.h"
+
+#define MAX_FRAME_NAME 64
+
+// sampler the SIGPROF handler fills, one run is sampled at a time
+static Sampler_t* active = 0;
+
+int Sampler_ctor(Sampler_t* This, const char* filename, int rate, CPU_t* cpu, const CPU_command_t* commands,
+                 int commands_cnt)
+{
+    assert(This);
+    assert(filename);
+    assert(rate > 0);
+    assert(cpu);
+    assert(commands);
+
+    This->filename = filename;
+    This->commands = commands;
+    This->commands_cnt = commands_cnt;
+    This->cpu = cpu;
+    This->rate = rate;
+    This->counts = (long long*) calloc(commands_cnt, sizeof(*This->counts));
+    This->samples = (Sample_t*) calloc(SAMPLER_CAPACITY, sizeof(*This->samples));
+    atomic_init(&This->samples_cnt, 0);
+    atomic_init(&This->dropped, 0);
+    atomic_init(&This->stopping, 0);
+    pthread_mutex_init(&This->writing, 0);
+
+    ASSERT_OK(Sampler, This);
+
+    return 0;
+}
+
+int Sampler_dtor(Sampler_t* This)
+{
+    assert(This);
+
+    free(This->counts);
+    This->counts = 0;
+    free(This->samples);
+    This->samples = 0;
+    pthread_mutex_destroy(&This->writing);
+
+    return 0;
+}
+
+int Sampler_ok(Sampler_t* This)
+{
+    return This && This->filename && This->commands && This->cpu && (This->rate > 0) && This->counts &&
+           This->samples && (atomic_load(&This->samples_cnt) >= 0) &&
+           (atomic_load(&This->samples_cnt) <= SAMPLER_CAPACITY);
+}
+
+int Sampler_dump(Sampler_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Sampler_t(%s)\n"
+           "{\n"
+           "    filename = %s\n"
+           "    commands_cnt = %d\n"
+           "    rate = %d\n"
+           "    samples_cnt = %d\n"
+           "    dropped = %d\n"
+           "}\n",
+           name, Sampler_ok(This) ? "ok" : "NOT OK!!!", This->filename, This->commands_cnt, This->rate,
+           atomic_load(&This->samples_cnt), atomic_load(&This->dropped));
+
+    return 0;
+}
+
+// SIGPROF handler: counts the command being run and keeps the call stack while there is room
+static void take_sample(int signal_number)
+{
+    (void) signal_number;
+    Sampler_t* This = active;
+    if (!This)
+        return;
+
+    const CPU_t* cpu = This->cpu;
+    int command = cpu->position;
+    if ((command >= 0) && (command < This->commands_cnt))
+        ++This->counts[command];
+
+    int index = atomic_load_explicit(&This->samples_cnt, memory_order_relaxed);
+    if (index >= SAMPLER_CAPACITY)
+    {
+        atomic_fetch_add_explicit(&This->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    Sample_t* sample = &This->samples[index];
+    const Stack_t* calls = cpu->call_stack;
+    int depth = calls->count;
+    int kept = (depth < SAMPLER_MAX_DEPTH) ? depth : SAMPLER_MAX_DEPTH;
+    sample->command = command;
+    sample->depth = depth;
+    for (int i = 0; i < kept; ++i)
+        sample->returns[i] = calls->data[depth - kept + i];
+    atomic_store_explicit(&This->samples_cnt, index + 1, memory_order_release);
+}
+
+static void* write_on_request(void* argument)
+{
+    Sampler_t* This = (Sampler_t*) argument;
+
+    sigset_t request;
+    sigemptyset(&request);
+    sigaddset(&request, SIGUSR1);
+    int signal = 0;
+    while ((sigwait(&request, &signal) == 0) && !atomic_load(&This->stopping))
+        Sampler_write(This);
+
+    return 0;
+}
+
+/*
+ * Arms the timer. SIGUSR1 is blocked in the calling thread and the threads
+ * it creates later, the writer thread alone waits for it; SIGPROF is kept
+ * away from the writer thread.
+ */
+int Sampler_start(Sampler_t* This)
+{
+    ASSERT_OK(Sampler, This);
+
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGUSR1);
+    sigaddset(&blocked, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &blocked, 0);
+    if (pthread_create(&This->writer, 0, write_on_request, This) != 0)
+    {
+        printf("Cannot start the sampler\n");
+        return -1;
+    }
+    sigset_t profiling;
+    sigemptyset(&profiling);
+    sigaddset(&profiling, SIGPROF);
+    pthread_sigmask(SIG_UNBLOCK, &profiling, 0);
+
+    active = This;
+    struct sigaction action = {};
+    action.sa_handler = take_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, 0);
+
+    long period = 1000000 / This->rate;
+    struct itimerval timer = {};
+    timer.it_interval.tv_sec = period / 1000000;
+    timer.it_interval.tv_usec = (period > 0) ? period % 1000000 : 1;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, 0);
+
+    return 0;
+}
+
+// disarms the timer, stops the writer thread and writes the final report
+int Sampler_stop(Sampler_t* This)
+{
+    ASSERT_OK(Sampler, This);
+
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, 0);
+    signal(SIGPROF, SIG_IGN);
+    active = 0;
+
+    atomic_store(&This->stopping, 1);
+    pthread_kill(This->writer, SIGUSR1);
+    pthread_join(This->writer, 0);
+
+    return Sampler_write(This);
+}
+
+typedef struct
+{
+    const char* name;
+    int index;          // of the command when counting by command
+    long long count;
+} Tally_t;
+
+static int compare_tallies(const void* a, const void* b)
+{
+    long long difference = ((const Tally_t*) b)->count - ((const Tally_t*) a)->count;
+    return (difference > 0) - (difference < 0);
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+// routine entered at command entry, by its label when the program has them
+static void frame_name(char* name, int entry)
+{
+    const char* label = Symbols_label(entry);
+    if (label)
+        snprintf(name, MAX_FRAME_NAME, "%s", label);
+    else
+        snprintf(name, MAX_FRAME_NAME, "%d", entry);
+}
+
+// folded call stack of a sample: outermost;...;innermost routine
+static char* stack_text(const Sampler_t* This, const Sample_t* sample)
+{
+    char* text = (char*) calloc((SAMPLER_MAX_DEPTH + 2) * (MAX_FRAME_NAME + 1), sizeof(*text));
+    int kept = (sample->depth < SAMPLER_MAX_DEPTH) ? sample->depth : SAMPLER_MAX_DEPTH;
+    char name[MAX_FRAME_NAME] = "";
+    if (kept < sample->depth)
+        strcpy(text, "...");
+    else if (Symbols_label(0))
+        frame_name(text, 0);
+    else
+        strcpy(text, "(program)");
+    for (int i = 0; i < kept; ++i)
+    {
+        // every return address follows the call of the routine
+        int call = sample->returns[i] - 1;
+        int entry = ((call >= 0) && (call < This->commands_cnt) && (This->commands[call].command == CALL)) ?
+                    (int) This->commands[call].parameter : call;
+        frame_name(name, entry);
+        strcat(text, ";");
+        strcat(text, name);
+    }
+
+    return text;
+}
+
+static void write_stacks(const Sampler_t* This, FILE* stream, int samples_cnt)
+{
+    char** stacks = (char**) calloc(samples_cnt + 1, sizeof(*stacks));
+    Tally_t* tallies = (Tally_t*) calloc(samples_cnt + 1, sizeof(*tallies));
+    for (int i = 0; i < samples_cnt; ++i)
+        stacks[i] = stack_text(This, &This->samples[i]);
+    qsort(stacks, samples_cnt, sizeof(*stacks), compare_names);
+    int tallies_cnt = 0;
+    for (int i = 0; i < samples_cnt; ++i)
+    {
+        if (!tallies_cnt || strcmp(tallies[tallies_cnt - 1].name, stacks[i]))
+            tallies[tallies_cnt++].name = stacks[i];
+        ++tallies[tallies_cnt - 1].count;
+    }
+    qsort(tallies, tallies_cnt, sizeof(*tallies), compare_tallies);
+    for (int i = 0; i < tallies_cnt; ++i)
+        fprintf(stream, "%s %lld\n", tallies[i].name, tallies[i].count);
+
+    for (int i = 0; i < samples_cnt; ++i)
+        free(stacks[i]);
+    free(stacks);
+    free(tallies);
+}
+
+/*
+ * Writes the samples so far by command, by the label the command follows
+ * and by call stack, the last in the folded format of flame graph tools.
+ * Labels come from the debug section, routines without one are named by
+ * the index of their first command. Returns 0 or -1 if the file cannot be
+ * written.
+ */
+int Sampler_write(Sampler_t* This)
+{
+    ASSERT_OK(Sampler, This);
+
+    pthread_mutex_lock(&This->writing);
+    FILE* stream = fopen(This->filename, "w");
+    if (!stream)
+    {
+        printf("Error opening samples file ");
+        perror(This->filename);
+        pthread_mutex_unlock(&This->writing);
+        return -1;
+    }
+
+    int samples_cnt = atomic_load_explicit(&This->samples_cnt, memory_order_acquire);
+    long long total = 0;
+    Tally_t* commands = (Tally_t*) calloc(This->commands_cnt, sizeof(*commands));
+    Tally_t* labels = (Tally_t*) calloc(This->commands_cnt, sizeof(*labels));
+    int commands_cnt = 0;
+    int labels_cnt = 0;
+    for (int i = 0; i < This->commands_cnt; ++i)
+    {
+        long long count = This->counts[i];
+        if (!count)
+            continue;
+        total += count;
+        commands[commands_cnt].index = i;
+        commands[commands_cnt++].count = count;
+        // labels are sorted by index, so samples of one label are counted in a row
+        const char* label = Symbols_label(i);
+        if (!label)
+            continue;
+        if (!labels_cnt || (labels[labels_cnt - 1].name != label))
+            labels[labels_cnt++].name = label;
+        labels[labels_cnt - 1].count += count;
+    }
+
+    fprintf(stream, "# %lld samples at %d Hz, %d of them without a call stack\n", total, This->rate,
+            atomic_load(&This->dropped));
+    fprintf(stream, "# samples by command\n");
+    qsort(commands, commands_cnt, sizeof(*commands), compare_tallies);
+    for (int i = 0; i < commands_cnt; ++i)
+        fprintf(stream, "%lld\t%5.1f%%\t%s\n", commands[i].count, 100.0 * commands[i].count / total,
+                Symbols_where(commands[i].index));
+    fprintf(stream, "# samples by label\n");
+    qsort(labels, labels_cnt, sizeof(*labels), compare_tallies);
+    for (int i = 0; i < labels_cnt; ++i)
+        fprintf(stream, "%lld\t%5.1f%%\t%s:\n", labels[i].count, 100.0 * labels[i].count / total, labels[i].name);
+    fprintf(stream, "# samples by call stack\n");
+    write_stacks(This, stream, samples_cnt);
+
+    free(commands);
+    free(labels);
+    int result = (fclose(stream) == 0) ? 0 : -1;
+    pthread_mutex_unlock(&This->writing);
+
+    return result;
+}
+
+// CPU_run_program() keeping CPU_t.position up to date for the sampler
+int CPU_run_sampled(CPU_t* This, const CPU_command_t* commands)
+{
+    ASSERT_OK(CPU, This);
+
+    int command_index = This->start;
+    while (commands[command_index].command != END)
+    {
+        This->position = command_index;
+        int result = CPU_step(This, commands, &command_index);
+        if (result != 0)
+            return result;
+    }
+
+    return 0;
+}
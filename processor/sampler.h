@@ -0,0 +1,54 @@
+#ifndef SAMPLER_H_INCLUDED
+#define SAMPLER_H_INCLUDED
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "commands.h"
+#include "processor.h"
+
+#define SAMPLER_RATE 1000           // samples a second of processor time by default
+#define SAMPLER_CAPACITY 262144     // call stacks kept, about four minutes at the default rate
+#define SAMPLER_MAX_DEPTH 16        // innermost return addresses kept with a sample
+
+typedef struct
+{
+    int command;
+    int depth;                      // calls active, may be more than the addresses kept
+    int returns[SAMPLER_MAX_DEPTH]; // innermost return addresses, the last one is of the innermost call
+} Sample_t;
+
+/*
+ * Statistical profiler for runs that cannot afford counting every command.
+ * A SIGPROF timer interrupts the run rate times a second of processor time
+ * and the handler takes CPU_t.position, which the engines keep up to date,
+ * and the call stack. Counts by command never run out; call stacks are kept
+ * for the first SAMPLER_CAPACITY samples. The report is written at the end
+ * of the run and, by a thread of its own, every time SIGUSR1 comes.
+ */
+typedef struct
+{
+    const char* filename;
+    const CPU_command_t* commands;
+    int commands_cnt;
+    CPU_t* cpu;
+    int rate;
+    long long* counts;              // samples by command
+    Sample_t* samples;
+    atomic_int samples_cnt;
+    atomic_int dropped;             // samples that came with the buffer full, counted by command only
+    atomic_int stopping;            // tells the writer thread to finish
+    pthread_t writer;
+    pthread_mutex_t writing;
+} Sampler_t;
+
+int Sampler_ctor(Sampler_t* This, const char* filename, int rate, CPU_t* cpu, const CPU_command_t* commands,
+                 int commands_cnt);
+int Sampler_dtor(Sampler_t* This);
+int Sampler_ok(Sampler_t* This);
+int Sampler_dump(Sampler_t* This, char* name);
+int Sampler_start(Sampler_t* This);
+int Sampler_stop(Sampler_t* This);
+int Sampler_write(Sampler_t* This);
+int CPU_run_sampled(CPU_t* This, const CPU_command_t* commands);
+
+#endif // SAMPLER_H_INCLUDED
@@ -0,0 +1,423 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "scheduler.h"
+#include "channel.h"
+#include "commands.h"
+#include "processor.h"
+#include "myassert.h"
+#include "stack.h"
+#include "symbols.h"
+
+int Scheduler_ctor(Scheduler_t* This, const CPU_command_t* commands, int commands_cnt, int threads_cnt)
+{
+    assert(This);
+    assert(commands);
+    assert(commands_cnt > 0);
+
+    This->commands = commands;
+    This->commands_cnt = commands_cnt;
+    This->threads_cnt = (threads_cnt > 0) ? threads_cnt : 1;
+    for (int i = 0; i < CHANNELS_CNT; ++i)
+        Channel_ctor(&This->channels[i]);
+    pthread_mutex_init(&This->lock, 0);
+    pthread_cond_init(&This->ready, 0);
+    This->contexts_cnt = 0;
+    This->live_cnt = 0;
+    This->queue_head = 0;
+    This->queue_cnt = 0;
+    This->progress = 0;
+    This->stalled_cnt = 0;
+    This->finished = 0;
+    This->deadlock = 0;
+    This->failed = 0;
+
+    ASSERT_OK(Scheduler, This);
+
+    return 0;
+}
+
+int Scheduler_dtor(Scheduler_t* This)
+{
+    assert(This);
+
+    for (int i = 0; i < This->contexts_cnt; ++i)
+    {
+        Context_t* context = This->contexts[i];
+        // the main context runs the processor of the caller
+        if ((context->id != 0) && context->cpu)
+        {
+            CPU_dtor(context->cpu);
+            free(context->cpu);
+        }
+        free(context);
+        This->contexts[i] = 0;
+    }
+    for (int i = 0; i < CHANNELS_CNT; ++i)
+        Channel_dtor(&This->channels[i]);
+    pthread_mutex_destroy(&This->lock);
+    pthread_cond_destroy(&This->ready);
+    This->contexts_cnt = -1;
+    This->commands = 0;
+
+    return 0;
+}
+
+int Scheduler_ok(Scheduler_t* This)
+{
+    if (!This)
+        return 0;
+    if (!This->commands || (This->commands_cnt <= 0) || (This->threads_cnt <= 0))
+        return 0;
+    if ((This->contexts_cnt < 0) || (This->contexts_cnt > MAX_CONTEXTS))
+        return 0;
+    if ((This->live_cnt < 0) || (This->live_cnt > This->contexts_cnt))
+        return 0;
+    if ((This->queue_cnt < 0) || (This->queue_cnt > This->live_cnt))
+        return 0;
+    return 1;
+}
+
+int Scheduler_dump(Scheduler_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Scheduler_t(%s)\n"
+           "{\n"
+           "    commands_cnt = %d\n"
+           "    threads_cnt = %d\n"
+           "    contexts_cnt = %d\n"
+           "    live_cnt = %d\n"
+           "    queue_cnt = %d\n"
+           "    progress = %lld\n"
+           "    stalled_cnt = %d\n"
+           "}\n",
+           name, Scheduler_ok(This) ? "ok" : "NOT OK!!!", This->commands_cnt, This->threads_cnt,
+           This->contexts_cnt, This->live_cnt, This->queue_cnt, This->progress, This->stalled_cnt);
+
+    return 0;
+}
+
+// returns 1 if the program uses commands only the scheduler runs
+int Scheduler_needed(const CPU_command_t* commands, int commands_cnt)
+{
+    assert(commands);
+
+    for (int i = 0; i < commands_cnt; ++i)
+        if ((commands[i].command >= SPAWN) && (commands[i].command <= RECV))
+            return 1;
+    return 0;
+}
+
+// both called with the lock held
+static void enqueue(Scheduler_t* This, Context_t* context)
+{
+    This->queue[(This->queue_head + This->queue_cnt) % MAX_CONTEXTS] = context;
+    ++This->queue_cnt;
+    pthread_cond_signal(&This->ready);
+}
+
+static Context_t* dequeue(Scheduler_t* This)
+{
+    Context_t* context = This->queue[This->queue_head];
+    This->queue_head = (This->queue_head + 1) % MAX_CONTEXTS;
+    --This->queue_cnt;
+    return context;
+}
+
+// registers a new context at command index start, returns its id or -1
+static int add_context(Scheduler_t* This, CPU_t* cpu, int start)
+{
+    pthread_mutex_lock(&This->lock);
+    int id = -1;
+    if (This->contexts_cnt < MAX_CONTEXTS)
+    {
+        Context_t* context = (Context_t*) calloc(1, sizeof(*context));
+        context->cpu = cpu;
+        context->id = This->contexts_cnt;
+        context->current_command = start;
+        context->state = CONTEXT_READY;
+        context->blocked_at = -1;
+        context->stall_epoch = -1;
+        This->contexts[This->contexts_cnt++] = context;
+        ++This->live_cnt;
+        enqueue(This, context);
+        id = context->id;
+    }
+    pthread_mutex_unlock(&This->lock);
+
+    return id;
+}
+
+static int spawn(Scheduler_t* This, Context_t* parent, int start)
+{
+    CPU_t* cpu = (CPU_t*) calloc(1, sizeof(*cpu));
+    CPU_ctor(cpu);
+    if ((parent->cpu->memory_size != cpu->memory_size) && (CPU_memory_resize(cpu, parent->cpu->memory_size) != 0))
+    {
+        CPU_dtor(cpu);
+        free(cpu);
+        printf("Cannot allocate memory for a new context\n");
+        return -1;
+    }
+    for (int reg = RAX; reg <= RDX; ++reg)
+        *CPU_register(cpu, reg) = *CPU_register(parent->cpu, reg);
+    cpu->io = parent->cpu->io;
+
+    int id = add_context(This, cpu, start);
+    if (id < 0)
+    {
+        CPU_dtor(cpu);
+        free(cpu);
+        printf("Too many contexts, at most %d can be spawned\n", MAX_CONTEXTS);
+        return -1;
+    }
+    CPU_push(parent->cpu, id);
+
+    return 0;
+}
+
+// returns 0 when the result of the joined context is pushed, 1 if it is still running and -1 for a bad id
+static int join(Scheduler_t* This, Context_t* context)
+{
+    Stack_t* stack = context->cpu->cstack;
+    if (stack->count == 0)
+    {
+        printf("Join without a context id at %s\n", Symbols_where(context->current_command));
+        return -1;
+    }
+    CPU_word_t id = stack->data[stack->count - 1];
+
+    pthread_mutex_lock(&This->lock);
+    int result = 0;
+    CPU_word_t value = 0;
+    if ((id != (int) id) || (id < 0) || (id >= This->contexts_cnt) || (id == context->id))
+        result = -1;
+    else if (!This->contexts[(int) id]->done)
+        result = 1;
+    else
+        value = This->contexts[(int) id]->result;
+    pthread_mutex_unlock(&This->lock);
+
+    if (result < 0)
+        printf("Join of unknown context " WORD_PRINT " at %s\n", id, Symbols_where(context->current_command));
+    if (result != 0)
+        return result;
+    Stack_pop(stack);
+    CPU_push(context->cpu, value);
+
+    return 0;
+}
+
+// runs the context till it blocks, ends or uses up its quantum, returns the number of commands run
+static int run_slice(Scheduler_t* This, Context_t* context)
+{
+    CPU_t* cpu = context->cpu;
+    int* index = &context->current_command;
+    context->state = CONTEXT_READY;
+    context->blocked_at = -1;
+
+    int steps = 0;
+    for (; steps < SCHEDULER_QUANTUM; ++steps)
+    {
+        if ((*index < 0) || (*index >= This->commands_cnt))
+        {
+            printf("Context %d jumped to %d out of the program\n", context->id, *index);
+            context->state = CONTEXT_FAILED;
+            return steps;
+        }
+        const CPU_command_t* command = &This->commands[*index];
+        int blocked = 0;
+        switch (command->command)
+        {
+        case END:
+            context->state = CONTEXT_FINISHED;
+            break;
+        case RET:
+            // the spawned routine returns
+            if (cpu->call_stack->count == 0)
+                context->state = CONTEXT_FINISHED;
+            else if (CPU_step(cpu, This->commands, index) != 0)
+                context->state = CONTEXT_FAILED;
+            break;
+        case SPAWN:
+            if (spawn(This, context, command->parameter) != 0)
+                context->state = CONTEXT_FAILED;
+            ++*index;
+            break;
+        case JOIN:
+            blocked = join(This, context);
+            if (blocked < 0)
+                context->state = CONTEXT_FAILED;
+            else if (!blocked)
+                ++*index;
+            break;
+        case SEND:
+            if (cpu->cstack->count == 0)
+            {
+                printf("Nothing to send at %s\n", Symbols_where(*index));
+                context->state = CONTEXT_FAILED;
+            } else if (Channel_send(&This->channels[(int) command->parameter],
+                                    cpu->cstack->data[cpu->cstack->count - 1]) == 0)
+            {
+                Stack_pop(cpu->cstack);
+                ++*index;
+            } else
+                blocked = 1;
+            break;
+        case RECV:
+        {
+            CPU_word_t value = 0;
+            if (Channel_recv(&This->channels[(int) command->parameter], &value) == 0)
+            {
+                CPU_push(cpu, value);
+                ++*index;
+            } else
+                blocked = 1;
+            break;
+        }
+        default:
+            if (CPU_step(cpu, This->commands, index) != 0)
+                context->state = CONTEXT_FAILED;
+            break;
+        }
+
+        if (blocked > 0)
+        {
+            context->state = CONTEXT_BLOCKED;
+            context->blocked_at = *index;
+        }
+        if (context->state != CONTEXT_READY)
+            break;
+    }
+
+    if (context->state == CONTEXT_FINISHED)
+        context->result = (cpu->cstack->count > 0) ? cpu->cstack->data[cpu->cstack->count - 1] : 0;
+    return steps;
+}
+
+// puts the context back after its slice started at progress count epoch, called with the lock held
+static void settle(Scheduler_t* This, Context_t* context, int steps, long long epoch)
+{
+    if ((steps > 0) || (context->state == CONTEXT_FINISHED))
+    {
+        ++This->progress;
+        This->stalled_cnt = 0;
+    }
+
+    switch (context->state)
+    {
+    case CONTEXT_FINISHED:
+        context->done = 1;
+        --This->live_cnt;
+        if (context->id == 0)
+            This->finished = 1;
+        break;
+    case CONTEXT_FAILED:
+        This->failed = 1;
+        This->finished = 1;
+        break;
+    default:
+        // others may have unblocked it after it looked, then it has to look again
+        if ((steps == 0) && (epoch == This->progress) && (context->stall_epoch != This->progress))
+        {
+            context->stall_epoch = This->progress;
+            ++This->stalled_cnt;
+        }
+        if (This->stalled_cnt == This->live_cnt)
+        {
+            This->deadlock = 1;
+            This->finished = 1;
+        } else
+            enqueue(This, context);
+        break;
+    }
+
+    if (This->finished)
+        pthread_cond_broadcast(&This->ready);
+}
+
+static void* worker(void* argument)
+{
+    Scheduler_t* This = (Scheduler_t*) argument;
+
+    pthread_mutex_lock(&This->lock);
+    for (;;)
+    {
+        while (!This->finished && (This->queue_cnt == 0))
+            pthread_cond_wait(&This->ready, &This->lock);
+        if (This->finished)
+            break;
+        Context_t* context = dequeue(This);
+        long long epoch = This->progress;
+        pthread_mutex_unlock(&This->lock);
+
+        int steps = run_slice(This, context);
+        if ((steps == 0) && (context->state == CONTEXT_BLOCKED))
+            sched_yield();
+        if ((context->state == CONTEXT_FINISHED) && (context->id != 0))
+        {
+            // only the result of a finished context is needed
+            CPU_dtor(context->cpu);
+            free(context->cpu);
+            context->cpu = 0;
+        }
+
+        pthread_mutex_lock(&This->lock);
+        settle(This, context, steps, epoch);
+    }
+    pthread_mutex_unlock(&This->lock);
+
+    return 0;
+}
+
+static const char* blocking_command_name(int command)
+{
+    switch (command)
+    {
+    case JOIN:
+        return "join";
+    case SEND:
+        return "send";
+    case RECV:
+        return "recv";
+    default:
+        return "?";
+    }
+}
+
+// runs the program in the main context This and the ones it spawns, returns 0 if the main one ended fine
+int CPU_run_scheduled(CPU_t* This, Scheduler_t* scheduler)
+{
+    ASSERT_OK(CPU, This);
+    ASSERT_OK(Scheduler, scheduler);
+
+    add_context(scheduler, This, 0);
+
+    pthread_t* threads = (pthread_t*) calloc(scheduler->threads_cnt, sizeof(*threads));
+    int started = 0;
+    for (; started < scheduler->threads_cnt; ++started)
+        if (pthread_create(&threads[started], 0, worker, scheduler) != 0)
+            break;
+    if (started == 0)
+        worker(scheduler);
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], 0);
+    free(threads);
+
+    if (scheduler->deadlock)
+        printf("Deadlock: every context is blocked\n");
+    for (int i = 0; i < scheduler->contexts_cnt; ++i)
+    {
+        Context_t* context = scheduler->contexts[i];
+        if (context->state == CONTEXT_BLOCKED)
+            printf("Context %d is blocked in %s at %s\n", context->id,
+                   blocking_command_name(scheduler->commands[context->blocked_at].command),
+                   Symbols_where(context->blocked_at));
+        else if ((context->state != CONTEXT_FINISHED) && (context->state != CONTEXT_FAILED))
+            printf("Context %d is left running at %s\n", context->id, Symbols_where(context->current_command));
+    }
+
+    return (scheduler->deadlock || scheduler->failed) ? -1 : 0;
+}
@@ -0,0 +1,70 @@
+#ifndef SCHEDULER_H_INCLUDED
+#define SCHEDULER_H_INCLUDED
+
+#include <pthread.h>
+#include "commands.h"
+#include "processor.h"
+#include "channel.h"
+
+#define MAX_CONTEXTS 1024
+#define SCHEDULER_QUANTUM 1024  // commands a context runs before the worker takes the next one
+
+enum CONTEXT_STATE {
+    CONTEXT_READY = 0,
+    CONTEXT_BLOCKED,        // could not pass the command at blocked_at
+    CONTEXT_FINISHED,
+    CONTEXT_FAILED
+};
+
+/*
+ * VM context: the program code is shared, stack, registers and memory are
+ * its own. The main context runs the processor given to CPU_run_scheduled(),
+ * the spawned ones get a fresh copy with the registers of the spawner.
+ */
+typedef struct
+{
+    CPU_t* cpu;
+    int id;
+    int current_command;
+    int state;
+    int blocked_at;
+    long long stall_epoch;  // progress count when the context last found nothing to do
+    int done;               // set under the scheduler lock once result is final
+    CPU_word_t result;           // top of its stack at the end, taken by JOIN
+} Context_t;
+
+/*
+ * Contexts are run by a pool of workers in slices. A context that cannot
+ * pass JOIN, SEND or RECV ends its slice and is queued again. When every
+ * live context has failed to run since the last progress anywhere, none of
+ * them ever will: that is reported as a deadlock.
+ */
+typedef struct
+{
+    const CPU_command_t* commands;
+    int commands_cnt;
+    int threads_cnt;
+    Channel_t channels[CHANNELS_CNT];
+    pthread_mutex_t lock;   // guards everything below
+    pthread_cond_t ready;
+    Context_t* contexts[MAX_CONTEXTS];
+    int contexts_cnt;
+    int live_cnt;
+    Context_t* queue[MAX_CONTEXTS];
+    int queue_head;
+    int queue_cnt;
+    long long progress;
+    int stalled_cnt;        // live contexts stalled since the last progress
+    int finished;
+    int deadlock;
+    int failed;
+} Scheduler_t;
+
+int Scheduler_ctor(Scheduler_t* This, const CPU_command_t* commands, int commands_cnt, int threads_cnt);
+int Scheduler_dtor(Scheduler_t* This);
+int Scheduler_ok(Scheduler_t* This);
+int Scheduler_dump(Scheduler_t* This, char* name);
+int Scheduler_needed(const CPU_command_t* commands, int commands_cnt);
+int CPU_run_scheduled(CPU_t* This, Scheduler_t* scheduler);
+
+#endif // SCHEDULER_H_INCLUDED
@@ -0,0 +1,204 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.h"
+#include "myassert.h"
+#include "symbols.h"
+
+// writes the state of the processor about to run command of the program, returns 0 or -1
+int CPU_snapshot_write(CPU_t* This, const char* filename, const CPU_command_t* commands, int commands_cnt,
+                       int command)
+{
+    ASSERT_OK(CPU, This);
+    assert(filename);
+    assert(commands);
+
+    int memory_used = This->memory_size;
+    while ((memory_used > 0) && (This->memory[memory_used - 1] == 0))
+        --memory_used;
+
+    Snapshot_header_t header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH);
+    header.word_kind = WORD_KIND;
+    header.commands_cnt = commands_cnt;
+    header.hash = CPU_commands_hash(commands, commands_cnt);
+    header.command = command;
+    header.frame = This->frame;
+    header.inputs = This->inputs;
+    header.outputs = This->outputs;
+    header.stack_cnt = This->cstack->count;
+    header.call_stack_cnt = This->call_stack->count;
+    header.frames_cnt = This->frames->count;
+    header.frame_links_cnt = This->frame_links->count;
+    header.memory_size = This->memory_size;
+    header.memory_used = memory_used;
+    header.registers[RAX] = This->rax;
+    header.registers[RBX] = This->rbx;
+    header.registers[RCX] = This->rcx;
+    header.registers[RDX] = This->rdx;
+
+    FILE* stream = fopen(filename, "wb");
+    if (!stream)
+    {
+        printf("Error opening snapshot ");
+        perror(filename);
+        return -1;
+    }
+    // the counts are not negative, fwrite() gives a size_t
+    int written = (fwrite(&header, sizeof(header), 1, stream) == 1) &&
+                  (fwrite(This->cstack->data, sizeof(CPU_word_t), header.stack_cnt, stream) ==
+                   (size_t) header.stack_cnt) &&
+                  (fwrite(This->call_stack->data, sizeof(CPU_word_t), header.call_stack_cnt, stream) ==
+                   (size_t) header.call_stack_cnt) &&
+                  (fwrite(This->frames->data, sizeof(CPU_word_t), header.frames_cnt, stream) ==
+                   (size_t) header.frames_cnt) &&
+                  (fwrite(This->frame_links->data, sizeof(CPU_word_t), header.frame_links_cnt, stream) ==
+                   (size_t) header.frame_links_cnt) &&
+                  (fwrite(This->memory, sizeof(CPU_word_t), memory_used, stream) == (size_t) memory_used);
+    if (fclose(stream) != 0)
+        written = 0;
+    if (!written)
+    {
+        printf("Error writing snapshot %s\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+// copies count values of a snapshot to the stack, returns -1 if they do not fit
+static int restore_stack(Stack_t* stack, const CPU_word_t** values, int64_t count)
+{
+    if ((count < 0) || (count > stack->size))
+        return -1;
+    memcpy(stack->data, *values, count * sizeof(**values));
+    stack->count = count;
+    *values += count;
+
+    return 0;
+}
+
+/*
+ * Maps the snapshot and puts its state into the processor, which then runs
+ * the program on from the command the snapshot was taken at. Returns 0 or
+ * -1 if the snapshot is unreadable, corrupt or of another program.
+ */
+int CPU_snapshot_restore(CPU_t* This, const char* filename, const CPU_command_t* commands, int commands_cnt)
+{
+    ASSERT_OK(CPU, This);
+    assert(filename);
+    assert(commands);
+
+    int file = open(filename, O_RDONLY);
+    struct stat file_stat = {};
+    if ((file < 0) || (fstat(file, &file_stat) != 0))
+    {
+        printf("Error opening snapshot ");
+        perror(filename);
+        if (file >= 0)
+            close(file);
+        return -1;
+    }
+    size_t size = file_stat.st_size;
+    void* mapped = (size >= sizeof(Snapshot_header_t)) ? mmap(0, size, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+    close(file);
+    if (mapped == MAP_FAILED)
+    {
+        printf("%s is not a snapshot\n", filename);
+        return -1;
+    }
+
+    const Snapshot_header_t* header = (const Snapshot_header_t*) mapped;
+    int64_t values_cnt = header->stack_cnt + header->call_stack_cnt + header->frames_cnt + header->frame_links_cnt +
+                         header->memory_used;
+    int result = 0;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH) || (header->word_kind != WORD_KIND) ||
+        (values_cnt < 0) || (size != sizeof(*header) + values_cnt * sizeof(CPU_word_t)))
+    {
+        printf("%s is not a snapshot of this processor\n", filename);
+        result = -1;
+    } else if ((header->commands_cnt != commands_cnt) ||
+               ((unsigned) header->hash != CPU_commands_hash(commands, commands_cnt)) || (header->command < 0) ||
+               (header->command >= commands_cnt))
+    {
+        printf("Snapshot %s is of another program\n", filename);
+        result = -1;
+    } else if ((header->memory_size != This->memory_size) &&
+               ((header->memory_size > INT32_MAX) || (CPU_memory_resize(This, header->memory_size) != 0)))
+    {
+        printf("Cannot allocate memory of %lld cells of the snapshot\n", (long long) header->memory_size);
+        result = -1;
+    }
+
+    const CPU_word_t* values = (const CPU_word_t*) (header + 1);
+    if ((result == 0) &&
+        ((restore_stack(This->cstack, &values, header->stack_cnt) != 0) ||
+         (restore_stack(This->call_stack, &values, header->call_stack_cnt) != 0) ||
+         (restore_stack(This->frames, &values, header->frames_cnt) != 0) ||
+         (restore_stack(This->frame_links, &values, header->frame_links_cnt) != 0) ||
+         (header->frame < 0) || (header->frame > header->frames_cnt) || (header->memory_used < 0) ||
+         (header->memory_used > header->memory_size)))
+    {
+        printf("Snapshot %s is corrupt\n", filename);
+        result = -1;
+    }
+    if (result == 0)
+    {
+        memcpy(This->memory, values, header->memory_used * sizeof(*values));
+        memset(This->memory + header->memory_used, 0,
+               (This->memory_size - header->memory_used) * sizeof(*This->memory));
+        This->frame = header->frame;
+        This->rax = header->registers[RAX];
+        This->rbx = header->registers[RBX];
+        This->rcx = header->registers[RCX];
+        This->rdx = header->registers[RDX];
+        This->inputs = header->inputs;
+        This->outputs = header->outputs;
+        This->start = header->command;
+    } else
+        CPU_reset(This);
+    munmap(mapped, size);
+
+    ASSERT_OK(CPU, This);
+    return result;
+}
+
+/*
+ * CPU_run_program() writing the snapshot when the run first reaches command
+ * at, which is swapped for BREAK until then, so finding it costs the run
+ * nothing. Returns like CPU_run_program() or -1 if writing failed.
+ */
+int CPU_run_snapshot(CPU_t* This, CPU_command_t* commands, int commands_cnt, int at, const char* filename)
+{
+    ASSERT_OK(CPU, This);
+    assert(commands);
+    assert((at >= 0) && (at < commands_cnt));
+
+    CPU_command_t original = commands[at];
+    commands[at].command = BREAK;
+    int command_index = This->start;
+    int result = 0;
+    while ((commands[command_index].command != END) &&
+           ((result = CPU_step(This, commands, &command_index)) == 0))
+        ;
+    commands[at] = original;
+
+    // CPU_step() returns 1 at the breakpoint, a watchdog or an error stop is the result of the run
+    if ((result != 0) && (result != 1))
+        return result;
+    if (result == 0)
+    {
+        printf("Program ended before %s, no snapshot written\n", Symbols_where(at));
+        return 0;
+    }
+    if (CPU_snapshot_write(This, filename, commands, commands_cnt, at) != 0)
+        return -1;
+    printf("Snapshot at %s written to %s\n", Symbols_where(at), filename);
+    This->start = at;
+
+    return CPU_run_program(This, commands);
+}
@@ -0,0 +1,43 @@
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include <stdint.h>
+#include "commands.h"
+#include "processor.h"
+
+#define SNAPSHOT_MAGIC "CPUSNAP1"
+#define SNAPSHOT_MAGIC_LENGTH 8
+
+/*
+ * State of a run stopped at a command, to be resumed there by another run
+ * of the same program. The header is followed by the values of the data
+ * stack, the call stack, the local frames, the frame links and the memory,
+ * all machine words. Memory is written up to its last nonzero cell only.
+ * Fields are of fixed width, so snapshots move between hosts of the same
+ * byte order.
+ */
+typedef struct
+{
+    char magic[SNAPSHOT_MAGIC_LENGTH];
+    int64_t word_kind;
+    int64_t commands_cnt;       // of the program, which is also checked by its hash
+    int64_t hash;
+    int64_t command;            // the run resumes here
+    int64_t frame;
+    int64_t inputs;             // I/O position: values taken by IN and printed by OUT
+    int64_t outputs;
+    int64_t stack_cnt;
+    int64_t call_stack_cnt;
+    int64_t frames_cnt;
+    int64_t frame_links_cnt;
+    int64_t memory_size;
+    int64_t memory_used;        // cells written, the rest are zeros
+    CPU_word_t registers[4];
+} Snapshot_header_t;
+
+int CPU_snapshot_write(CPU_t* This, const char* filename, const CPU_command_t* commands, int commands_cnt,
+                       int command);
+int CPU_snapshot_restore(CPU_t* This, const char* filename, const CPU_command_t* commands, int commands_cnt);
+int CPU_run_snapshot(CPU_t* This, CPU_command_t* commands, int commands_cnt, int at, const char* filename);
+
+#endif // SNAPSHOT_H_INCLUDED
@@ -11,7 +11,23 @@ int Stack_ctor(Stack_t* This, int size)
 
     This->size = size;
     This->count = 0;
-    This->data = (float*) calloc(size, sizeof(*This->data));
+    This->data = (CPU_word_t*) calloc(size, sizeof(*This->data));
+
+    ASSERT_OK(Stack, This);
+
+    return 0;
+}
+
+// stack over storage of the caller, which is never freed by the stack
+int Stack_ctor_at(Stack_t* This, CPU_word_t* data, int size)
+{
+    assert(This);
+    assert(data);
+    assert(size > 0);
+
+    This->size = size;
+    This->count = 0;
+    This->data = data;
 
     ASSERT_OK(Stack, This);
 
@@ -58,7 +74,7 @@ int Stack_dump(Stack_t* This, char* name)
            name, Stack_ok(This) ? "ok" : "NOT OK!!!", This->size, This->count);
     if (This->data)
         for (int i = 0; i < This->size; ++i)
-            printf("        [%d]%s%g\n", i, i < This->count ? " " : " * ", This->data[i]);
+            printf("        [%d]%s" WORD_PRINT "\n", i, i < This->count ? " " : " * ", This->data[i]);
     else
         printf("        NULL pointer here :(\n");
     printf("    }\n"
@@ -67,7 +83,7 @@ int Stack_dump(Stack_t* This, char* name)
     return 0;
 }
 
-int Stack_push(Stack_t* This, float value)
+int Stack_push(Stack_t* This, CPU_word_t value)
 {
     ASSERT_OK(Stack, This);
 
@@ -78,11 +94,11 @@ int Stack_push(Stack_t* This, float value)
     return 0;
 }
 
-float Stack_pop(Stack_t* This)
+CPU_word_t Stack_pop(Stack_t* This)
 {
     ASSERT_OK(Stack, This);
 
-    float value = 0;
+    CPU_word_t value = 0;
     if (This->count > 0)
         value = This->data[This->count - 1];
     //This->data[This->count - 1] = 0;
@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "symbols.h"
+#include "commands.h"
+
+#define LOCATION_BUFFERS 4  // locations that can be used in one printf
+#define MAX_POSITION (MAX_SOURCE_NAME + 24) // "source:line:column" with the longest name and numbers
+#define MAX_LABEL (MAX_SYMBOL_NAME + 16)    // "label:+offset"
+
+// the index, the position, the label and ' (', ', ', ')' fit any location
+_Static_assert(MAX_LOCATION >= 11 + MAX_POSITION + MAX_LABEL + 4, "MAX_LOCATION is too short");
+
+static const char* program_file = 0;
+static pthread_once_t load_once = PTHREAD_ONCE_INIT;
+static CPU_debug_t debug = {};
+static int commands_cnt = 0;
+
+static int compare_symbols(const void* a, const void* b)
+{
+    return ((const CPU_symbol_t*) a)->index - ((const CPU_symbol_t*) b)->index;
+}
+
+// skips the word tag, the natives table and the commands, then reads the debug section if there is one
+static void load()
+{
+    if (!program_file)
+        return;
+    FILE* stream = fopen(program_file, "rb");
+    if (!stream)
+        return;
+
+    char** natives = 0;
+    int natives_cnt = 0;
+    int params_cnt = 0;
+    int result = -1;
+    if ((CPU_word_read(stream) == 0) && (CPU_natives_read(stream, &natives, &natives_cnt) == 0) &&
+        (fscanf(stream, "%d %d", &commands_cnt, &params_cnt) == 2))
+    {
+        CPU_command_t command = {};
+        int i = 0;
+        while ((i < commands_cnt) && (CPU_command_read(&command, stream) == 0))
+            ++i;
+        if (i == commands_cnt)
+            result = CPU_debug_read(stream, &debug);
+    }
+    CPU_natives_free(natives, natives_cnt);
+    fclose(stream);
+
+    if (result < 0)
+        printf("Debug section of %s is corrupt\n", program_file);
+    if (result != 0)
+        return;
+    qsort(debug.symbols, debug.symbols_cnt, sizeof(*debug.symbols), compare_symbols);
+}
+
+int Symbols_attach(const char* filename)
+{
+    assert(filename);
+
+    program_file = filename;
+
+    return 0;
+}
+
+int Symbols_release()
+{
+    CPU_debug_free(&debug);
+    program_file = 0;
+
+    return 0;
+}
+
+// last line entry at or before index, -1 if there is none
+static int find_line(int index)
+{
+    int low = 0;
+    int high = debug.lines_cnt;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (debug.lines[middle].index <= index)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low - 1;
+}
+
+// last label at or before index, -1 if there is none
+static int find_symbol(int index)
+{
+    int low = 0;
+    int high = debug.symbols_cnt;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (debug.symbols[middle].index <= index)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low - 1;
+}
+
+/*
+ * Command index with its source position and the label it follows when the
+ * program has a debug section, e.g. "12 (square.in:42:1, two_roots:+3)".
+ * The text stays valid until LOCATION_BUFFERS more calls in the same thread.
+ */
+const char* Symbols_where(int index)
+{
+    static _Thread_local char buffers[LOCATION_BUFFERS][MAX_LOCATION];
+    static _Thread_local int next = 0;
+
+    pthread_once(&load_once, load);
+
+    char* buffer = buffers[next];
+    next = (next + 1) % LOCATION_BUFFERS;
+    int line = -1;
+    int symbol = -1;
+    if (debug.source && (index >= 0) && (index < commands_cnt))
+    {
+        line = find_line(index);
+        symbol = find_symbol(index);
+    }
+
+    char position[MAX_POSITION] = "";
+    char label[MAX_LABEL] = "";
+    if (line >= 0)
+        snprintf(position, sizeof(position), "%s:%d:%d", debug.source, debug.lines[line].line,
+                 debug.lines[line].column);
+    if ((symbol >= 0) && (index != debug.symbols[symbol].index))
+        snprintf(label, sizeof(label), "%s:+%d", debug.symbols[symbol].name, index - debug.symbols[symbol].index);
+    else if (symbol >= 0)
+        snprintf(label, sizeof(label), "%s:", debug.symbols[symbol].name);
+
+    if ((line >= 0) && (symbol >= 0))
+        snprintf(buffer, MAX_LOCATION, "%d (%s, %s)", index, position, label);
+    else if ((line >= 0) || (symbol >= 0))
+        snprintf(buffer, MAX_LOCATION, "%d (%s)", index, (line >= 0) ? position : label);
+    else
+        snprintf(buffer, MAX_LOCATION, "%d", index);
+
+    return buffer;
+}
+
+// index of the label, the trailing ':' may be given, -1 if it is unknown or there is no debug section
+int Symbols_find(const char* name)
+{
+    assert(name);
+
+    pthread_once(&load_once, load);
+
+    size_t length = strlen(name);
+    if (length && (name[length - 1] == ':'))
+        --length;
+    for (int i = 0; i < debug.symbols_cnt; ++i)
+        if ((strlen(debug.symbols[i].name) == length) && !strncmp(debug.symbols[i].name, name, length))
+            return debug.symbols[i].index;
+    return -1;
+}
+
+// name of the last label at or before index, 0 if there is none
+const char* Symbols_label(int index)
+{
+    pthread_once(&load_once, load);
+
+    if (!debug.source || (index < 0) || (index >= commands_cnt))
+        return 0;
+    int symbol = find_symbol(index);
+
+    return (symbol >= 0) ? debug.symbols[symbol].name : 0;
+}
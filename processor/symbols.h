@@ -0,0 +1,17 @@
+#ifndef SYMBOLS_H_INCLUDED
+#define SYMBOLS_H_INCLUDED
+
+#define MAX_LOCATION 384
+
+/*
+ * Source positions and labels from the debug section of the program file.
+ * Attaching only remembers the file: the section is read the first time a
+ * position is asked for, so runs that report nothing never touch it.
+ */
+int Symbols_attach(const char* filename);
+int Symbols_release();
+const char* Symbols_where(int index);
+int Symbols_find(const char* name);
+const char* Symbols_label(int index);
+
+#endif // SYMBOLS_H_INCLUDED
@@ -0,0 +1,826 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+#include "trace.h"
+#include "commands.h"
+#include "processor.h"
+#include "myassert.h"
+#include "stack.h"
+#include "natives.h"
+#include "symbols.h"
+
+/*
+ * Loops are found by counting backward jumps to every command. When a
+ * command gets hot, the interpreter records the path it takes from there
+ * until it jumps back, calls and returns included. Conditional jumps turn
+ * into guards that leave the trace at the other direction. The recorded
+ * trace is optimised and then run by CPU_run_trace() until a guard fails.
+ */
+
+#define BLACKLISTED (INT_MIN / 2)
+#define MAX_RECORDED_OPS 7      // ops one command can be recorded as
+
+int Tracer_ctor(Tracer_t* This, const CPU_command_t* commands, int commands_cnt)
+{
+    assert(This);
+    assert(commands);
+    assert(commands_cnt > 0);
+
+    This->commands = commands;
+    This->commands_cnt = commands_cnt;
+    This->counters = (int*) calloc(commands_cnt, sizeof(*This->counters));
+    This->by_head = (Trace_t**) calloc(commands_cnt, sizeof(*This->by_head));
+    This->traces_cnt = 0;
+    This->recording = -1;
+    This->buffer_cnt = 0;
+    This->buffer_length = 0;
+    This->buffer = (Trace_op_t*) calloc(TRACE_MAX_LENGTH, sizeof(*This->buffer));
+    This->aborted = 0;
+
+    ASSERT_OK(Tracer, This);
+
+    return 0;
+}
+
+int Tracer_dtor(Tracer_t* This)
+{
+    assert(This);
+
+    for (int i = 0; This->by_head && (i < This->commands_cnt); ++i)
+        if (This->by_head[i])
+        {
+            free(This->by_head[i]->ops);
+            free(This->by_head[i]);
+        }
+    free(This->by_head);
+    free(This->counters);
+    free(This->buffer);
+    This->by_head = 0;
+    This->counters = 0;
+    This->buffer = 0;
+    This->commands = 0;
+    This->commands_cnt = -1;
+    This->traces_cnt = -1;
+
+    return 0;
+}
+
+int Tracer_ok(Tracer_t* This)
+{
+    if (!This)
+        return 0;
+    if (!This->commands || !This->counters || !This->by_head || !This->buffer)
+        return 0;
+    if ((This->commands_cnt <= 0) || (This->traces_cnt < 0))
+        return 0;
+    if ((This->buffer_cnt < 0) || (This->buffer_cnt > TRACE_MAX_LENGTH))
+        return 0;
+    if ((This->recording < -1) || (This->recording >= This->commands_cnt))
+        return 0;
+    return 1;
+}
+
+int Tracer_dump(Tracer_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Tracer_t(%s)\n"
+           "{\n"
+           "    commands_cnt = %d\n"
+           "    traces_cnt = %d\n"
+           "    recording = %d\n"
+           "    buffer_cnt = %d\n"
+           "    aborted = %lld\n"
+           "}\n",
+           name, Tracer_ok(This) ? "ok" : "NOT OK!!!", This->commands_cnt, This->traces_cnt, This->recording,
+           This->buffer_cnt, This->aborted);
+
+    return 0;
+}
+
+int Tracer_print_stats(Tracer_t* This)
+{
+    ASSERT_OK(Tracer, This);
+
+    long long entered = 0;
+    long long iterations = 0;
+    long long exits = 0;
+    printf("Trace statistics:\n"
+           "  recorded\toptimised\tentered\titerations\texits\thead\n");
+    for (int i = 0; i < This->commands_cnt; ++i)
+    {
+        Trace_t* trace = This->by_head[i];
+        if (!trace)
+            continue;
+        printf("  %d\t\t%d\t\t%lld\t%lld\t\t%lld\t%s\n", trace->recorded_cnt, trace->ops_cnt,
+               trace->entered, trace->iterations, trace->exits, Symbols_where(trace->head));
+        entered += trace->entered;
+        iterations += trace->iterations;
+        exits += trace->exits;
+    }
+    printf("  traces %d, aborted recordings %lld, entered %lld, iterations %lld, guard exits %lld\n",
+           This->traces_cnt, This->aborted, entered, iterations, exits);
+
+    return 0;
+}
+
+static int is_conditional(int command)
+{
+    return ((command >= JA) && (command <= JNE)) || ((command >= JA_RR) && (command <= JNE_RR)) ||
+           ((command >= JA_RI) && (command <= JNE_RI)) || (command == LOOP);
+}
+
+static int condition(int command, CPU_word_t a, CPU_word_t b)
+{
+    switch (command)
+    {
+    case JA:
+        return a > b;
+    case JAE:
+        return a >= b;
+    case JB:
+        return a < b;
+    case JBE:
+        return a <= b;
+    case JE:
+        return a == b;
+    case JNE:
+        return a != b;
+    default:
+        return 0;
+    }
+}
+
+static CPU_word_t fold(int op, CPU_word_t a, CPU_word_t b)
+{
+    switch (op)
+    {
+    case T_ADD:
+        return word_add(a, b);
+    case T_SUB:
+        return word_sub(a, b);
+    case T_MUL:
+        return word_mul(a, b);
+    case T_DIV:
+        return word_div(a, b);
+    case T_POW:
+        return word_pow(a, b);
+    default:
+        return 0;
+    }
+}
+
+static int is_arithmetic(int op)
+{
+    return (op == T_ADD) || (op == T_SUB) || (op == T_MUL) || (op == T_DIV) || (op == T_POW);
+}
+
+// removes T_NOP ops, returns the number of removed ones
+static int compact(Trace_t* This)
+{
+    int ops_cnt = 0;
+    for (int i = 0; i < This->ops_cnt; ++i)
+        if (This->ops[i].op != T_NOP)
+            This->ops[ops_cnt++] = This->ops[i];
+    int removed = This->ops_cnt - ops_cnt;
+    This->ops_cnt = ops_cnt;
+    return removed;
+}
+
+// push/pop pairs and constant folding on adjacent ops
+static int peephole(Trace_t* This)
+{
+    int changed = 0;
+    Trace_op_t* ops = This->ops;
+    for (int i = 0; i + 1 < This->ops_cnt; ++i)
+    {
+        Trace_op_t* first = &ops[i];
+        Trace_op_t* second = &ops[i + 1];
+        if ((first->op == T_PUSH) && (second->op == T_POP_REG))
+        {
+            second->op = T_SET_REG;
+            second->value = first->value;
+            first->op = T_NOP;
+            changed = 1;
+        } else if ((first->op == T_PUSH_REG) && (second->op == T_POP_REG))
+        {
+            second->op = (first->reg == second->reg) ? T_NOP : T_MOV_REG;
+            second->reg2 = first->reg;
+            first->op = T_NOP;
+            changed = 1;
+        } else if ((first->op == T_PUSH) && (second->op == T_DUP))
+        {
+            *second = *first;
+            changed = 1;
+        } else if ((i + 2 < This->ops_cnt) && (first->op == T_PUSH) && (second->op == T_PUSH))
+        {
+            Trace_op_t* third = &ops[i + 2];
+            if (is_arithmetic(third->op))
+            {
+                third->value = fold(third->op, second->value, first->value);
+                third->op = T_PUSH;
+                first->op = T_NOP;
+                second->op = T_NOP;
+                changed = 1;
+            } else if ((third->op == T_GUARD) &&
+                       (condition(third->command, second->value, first->value) == third->taken))
+            {
+                first->op = T_NOP;
+                second->op = T_NOP;
+                third->op = T_NOP;
+                changed = 1;
+            }
+        }
+    }
+    compact(This);
+    return changed;
+}
+
+// forwards known register values and copies into later reads
+static int forward_registers(Trace_t* This)
+{
+    int changed = 0;
+    int known[4] = {};
+    CPU_word_t values[4] = {};
+    int alias[4] = {-1, -1, -1, -1};
+    for (int i = 0; i < This->ops_cnt; ++i)
+    {
+        Trace_op_t* op = &This->ops[i];
+        switch (op->op)
+        {
+        case T_PUSH_REG:
+            if (known[op->reg])
+            {
+                op->op = T_PUSH;
+                op->value = values[op->reg];
+                changed = 1;
+            } else if (alias[op->reg] >= 0)
+            {
+                op->reg = alias[op->reg];
+                changed = 1;
+            }
+            break;
+        case T_MOV_REG:
+            if (known[op->reg2])
+            {
+                op->op = T_SET_REG;
+                op->value = values[op->reg2];
+                changed = 1;
+            } else if (alias[op->reg2] >= 0)
+            {
+                op->reg2 = alias[op->reg2];
+                changed = 1;
+            }
+            break;
+        default:
+            break;
+        }
+
+        // op writes a register: forget what depended on its old value
+        if ((op->op == T_POP_REG) || (op->op == T_SET_REG) || (op->op == T_MOV_REG))
+        {
+            for (int reg = 0; reg < 4; ++reg)
+                if (alias[reg] == op->reg)
+                    alias[reg] = -1;
+            known[op->reg] = (op->op == T_SET_REG);
+            values[op->reg] = op->value;
+            alias[op->reg] = ((op->op == T_MOV_REG) && (op->reg2 != op->reg)) ? op->reg2 : -1;
+        }
+    }
+    return changed;
+}
+
+static void stack_bounds(Trace_t* This)
+{
+    int depth = 0;
+    This->need = 0;
+    This->peak = 0;
+    for (int i = 0; i < This->ops_cnt; ++i)
+    {
+        int pops = 0;
+        int pushes = 0;
+        switch (This->ops[i].op)
+        {
+        case T_PUSH:
+        case T_PUSH_REG:
+        case T_IN:
+        case T_LOAD_LOCAL:
+            pushes = 1;
+            break;
+        case T_LOAD_MEM:
+            pops = 1;
+            pushes = 1;
+            break;
+        case T_STORE_MEM:
+            pops = 2;
+            break;
+        case T_NATIVE:
+        {
+            const Native_t* native = Natives_get(This->ops[i].value);
+            pops = native->arity;
+            pushes = native->results;
+            break;
+        }
+        case T_POP_REG:
+        case T_OUT:
+        case T_STORE_LOCAL:
+            pops = 1;
+            break;
+        case T_DUP:
+            pops = 1;
+            pushes = 2;
+            break;
+        case T_GUARD:
+            pops = 2;
+            break;
+        default:
+            if (is_arithmetic(This->ops[i].op))
+            {
+                pops = 2;
+                pushes = 1;
+            }
+            break;
+        }
+        depth -= pops;
+        if (-depth > This->need)
+            This->need = -depth;
+        depth += pushes;
+        if (depth > This->peak)
+            This->peak = depth;
+    }
+    // iterations may grow the stack, so the bound of the next one is checked again
+}
+
+int Trace_optimise(Trace_t* This)
+{
+    assert(This);
+
+    while (peephole(This) || forward_registers(This))
+        ;
+    compact(This);
+    stack_bounds(This);
+
+    return 0;
+}
+
+int CPU_run_trace(CPU_t* This, Trace_t* trace, int* current_command)
+{
+    ASSERT_OK(CPU, This);
+    assert(trace);
+
+    CPU_word_t* regs[4] = {&This->rax, &This->rbx, &This->rcx, &This->rdx};
+    Stack_t* stack = This->cstack;
+    Stack_t* call_stack = This->call_stack;
+    const Trace_op_t* ops = trace->ops;
+    const Trace_op_t* end = ops + trace->ops_cnt;
+
+    ++trace->entered;
+    This->position = trace->head;
+    for (;;)
+    {
+        if ((stack->count < trace->need) || (stack->count + trace->peak > stack->size))
+        {
+            *current_command = trace->head;
+            return 0;
+        }
+        ++trace->iterations;
+        for (const Trace_op_t* op = ops; op != end; ++op)
+        {
+            CPU_word_t a = 0;
+            CPU_word_t b = 0;
+            switch (op->op)
+            {
+            case T_PUSH:
+                stack->data[stack->count++] = op->value;
+                break;
+            case T_PUSH_REG:
+                stack->data[stack->count++] = *regs[op->reg];
+                break;
+            case T_POP_REG:
+                *regs[op->reg] = stack->data[--stack->count];
+                break;
+            case T_SET_REG:
+                *regs[op->reg] = op->value;
+                break;
+            case T_MOV_REG:
+                *regs[op->reg] = *regs[op->reg2];
+                break;
+            case T_ADD:
+                a = stack->data[--stack->count];
+                stack->data[stack->count - 1] = word_add(a, stack->data[stack->count - 1]);
+                break;
+            case T_SUB:
+                a = stack->data[--stack->count];
+                stack->data[stack->count - 1] = word_sub(a, stack->data[stack->count - 1]);
+                break;
+            case T_MUL:
+                a = stack->data[--stack->count];
+                stack->data[stack->count - 1] = word_mul(a, stack->data[stack->count - 1]);
+                break;
+            case T_DIV:
+                a = stack->data[--stack->count];
+                stack->data[stack->count - 1] = word_div(a, stack->data[stack->count - 1]);
+                break;
+            case T_POW:
+                a = stack->data[--stack->count];
+                stack->data[stack->count - 1] = word_pow(a, stack->data[stack->count - 1]);
+                break;
+            case T_DUP:
+                a = stack->data[stack->count - 1];
+                stack->data[stack->count++] = a;
+                break;
+            case T_IN:
+                CPU_in(This);
+                break;
+            case T_OUT:
+                CPU_out(This);
+                break;
+            case T_GUARD:
+                a = stack->data[--stack->count];
+                b = stack->data[--stack->count];
+                if (condition(op->command, a, b) != op->taken)
+                {
+                    ++trace->exits;
+                    *current_command = op->exit;
+                    return 0;
+                }
+                break;
+            case T_CALL:
+                if (call_stack->count >= call_stack->size)
+                {
+                    printf("Call stack overflow\n");
+                    return -1;
+                }
+                call_stack->data[call_stack->count++] = op->value;
+                CPU_frame_push(This);
+                break;
+            case T_RET:
+                if (call_stack->count <= 0)
+                {
+                    printf("Call stack underflow\n");
+                    return -1;
+                }
+                a = call_stack->data[--call_stack->count];
+                CPU_frame_pop(This);
+                if (a != op->value)
+                {
+                    ++trace->exits;
+                    *current_command = a;
+                    return 0;
+                }
+                break;
+            case T_ENTER:
+                if (CPU_enter(This, op->value) != 0)
+                    return -1;
+                break;
+            case T_LOAD_LOCAL:
+                if (CPU_load_local(This, op->value) != 0)
+                    return -1;
+                break;
+            case T_STORE_LOCAL:
+                if (CPU_store_local(This, op->value) != 0)
+                    return -1;
+                break;
+            case T_LOAD_MEM:
+                a = stack->data[stack->count - 1];
+                if (CPU_memory_check(This, a, 1) != 0)
+                    return -1;
+                stack->data[stack->count - 1] = This->memory[(int) a];
+                break;
+            case T_STORE_MEM:
+                a = stack->data[--stack->count];
+                b = stack->data[--stack->count];
+                if (CPU_memory_check(This, a, 1) != 0)
+                    return -1;
+                This->memory[(int) a] = b;
+                break;
+            case T_NATIVE:
+                if (CPU_native(This, op->value) != 0)
+                    return -1;
+                break;
+            default:
+                break;
+            }
+        }
+        // every iteration ends with the backward jump, the watchdog is charged for all of it there
+        if (This->watchdog && (CPU_checkpoint(This, trace->tail, trace->length) != 0))
+        {
+            This->position = trace->tail;
+            *current_command = trace->tail;
+            return CPU_EXPIRED;
+        }
+    }
+}
+
+static void abort_recording(Tracer_t* This)
+{
+    This->counters[This->recording] = BLACKLISTED;
+    This->recording = -1;
+    This->buffer_cnt = 0;
+    This->buffer_length = 0;
+    ++This->aborted;
+}
+
+static Trace_op_t* append(Tracer_t* This, int op, int reg, CPU_word_t value)
+{
+    Trace_op_t* appended = &This->buffer[This->buffer_cnt++];
+    Trace_op_t empty = {};
+    *appended = empty;
+    appended->op = op;
+    appended->reg = reg;
+    appended->value = value;
+    return appended;
+}
+
+/*
+ * Register operand commands have no ops of their own: reg = reg op x is
+ * recorded as push x, push reg, op, pop reg, a register comparison as
+ * push reg2, push reg, guard and loop as a decrement followed by a guard,
+ * so the stack passes see through them.
+ */
+// returns 1 if the command is recorded, 0 if it is not one of these, -1 if it cannot be traced
+static int record_register_command(Tracer_t* This, int index, int next)
+{
+    const CPU_command_t* command = &This->commands[index];
+    static const int arithmetic[] = {T_ADD, T_SUB, T_MUL, T_DIV};
+    switch (command->command)
+    {
+    case MOV_RR:
+        append(This, T_MOV_REG, command->reg, 0)->reg2 = command->reg2;
+        return 1;
+    case MOV_RI:
+        append(This, T_SET_REG, command->reg, command->parameter);
+        return 1;
+    case ADD_RR:
+    case SUB_RR:
+    case MUL_RR:
+    case DIV_RR:
+        append(This, T_PUSH_REG, command->reg2, 0);
+        append(This, T_PUSH_REG, command->reg, 0);
+        append(This, arithmetic[(command->command - ADD_RR) / 2], 0, 0);
+        append(This, T_POP_REG, command->reg, 0);
+        return 1;
+    case ADD_RI:
+    case SUB_RI:
+    case MUL_RI:
+    case DIV_RI:
+        append(This, T_PUSH, 0, command->parameter);
+        append(This, T_PUSH_REG, command->reg, 0);
+        append(This, arithmetic[(command->command - ADD_RI) / 2], 0, 0);
+        append(This, T_POP_REG, command->reg, 0);
+        return 1;
+    case INC:
+    case DEC:
+        append(This, T_PUSH, 0, 1);
+        append(This, T_PUSH_REG, command->reg, 0);
+        append(This, (command->command == INC) ? T_ADD : T_SUB, 0, 0);
+        append(This, T_POP_REG, command->reg, 0);
+        return 1;
+    case JA_RR:
+    case JAE_RR:
+    case JB_RR:
+    case JBE_RR:
+    case JE_RR:
+    case JNE_RR:
+    {
+        append(This, T_PUSH_REG, command->reg2, 0);
+        append(This, T_PUSH_REG, command->reg, 0);
+        Trace_op_t* guard = append(This, T_GUARD, 0, 0);
+        guard->command = JA + (command->command - JA_RR);
+        guard->taken = (next != index + 1);
+        guard->exit = guard->taken ? index + 1 : (int) command->parameter;
+        return 1;
+    }
+    case JA_RI:
+    case JAE_RI:
+    case JB_RI:
+    case JBE_RI:
+    case JE_RI:
+    case JNE_RI:
+    {
+        append(This, T_PUSH, 0, command[1].parameter);
+        append(This, T_PUSH_REG, command->reg, 0);
+        Trace_op_t* guard = append(This, T_GUARD, 0, 0);
+        guard->command = JA + (command->command - JA_RI);
+        guard->taken = (next != index + 2);
+        guard->exit = guard->taken ? index + 2 : (int) command->parameter;
+        return 1;
+    }
+    case LOOP:
+    {
+        append(This, T_PUSH, 0, 1);
+        append(This, T_PUSH_REG, command->reg, 0);
+        append(This, T_SUB, 0, 0);
+        append(This, T_POP_REG, command->reg, 0);
+        append(This, T_PUSH, 0, 0);
+        append(This, T_PUSH_REG, command->reg, 0);
+        Trace_op_t* guard = append(This, T_GUARD, 0, 0);
+        guard->command = JNE;
+        guard->taken = (next != index + 1);
+        guard->exit = guard->taken ? index + 1 : (int) command->parameter;
+        return 1;
+    }
+    case LOAD_R:
+    case LOAD_I:
+    case STORE_R:
+    case STORE_I:
+        // the address is pushed, so known registers fold it into a constant
+        if ((command->command == LOAD_R) || (command->command == STORE_R))
+            append(This, T_PUSH_REG, command->reg, 0);
+        else
+            append(This, T_PUSH, 0, command->parameter);
+        append(This, ((command->command == LOAD_R) || (command->command == LOAD_I)) ? T_LOAD_MEM : T_STORE_MEM, 0, 0);
+        return 1;
+    case SWITCH:
+    {
+        // the case taken becomes a guard on the register value, other ones run the switch again
+        const CPU_command_t* cases = &command[3];
+        int entry = 0;
+        while ((entry < (int) command->parameter) && (cases[entry].parameter != next))
+            ++entry;
+        if (entry == (int) command->parameter)
+            return -1;
+        append(This, T_PUSH, 0, command[1].parameter + entry);
+        append(This, T_PUSH_REG, command->reg, 0);
+        Trace_op_t* guard = append(This, T_GUARD, 0, 0);
+        guard->command = JE;
+        guard->taken = 1;
+        guard->exit = index;
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+// appends the command about to run at index, next is where it went
+static void record(Tracer_t* This, int index, int next)
+{
+    const CPU_command_t* command = &This->commands[index];
+    // a word out of the int range is no register and is not cast
+    int reg = ((command->parameter >= RAX) && (command->parameter <= RDX)) ? (int) command->parameter : -1;
+    int valid_reg = (reg >= 0) && (reg == command->parameter);
+    if (This->buffer_cnt + MAX_RECORDED_OPS > TRACE_MAX_LENGTH)
+    {
+        abort_recording(This);
+        return;
+    }
+    ++This->buffer_length;
+    int recorded = record_register_command(This, index, next);
+    if (recorded < 0)
+        abort_recording(This);
+    if (recorded)
+        return;
+
+    Trace_op_t op = {};
+    op.value = command->parameter;
+    op.reg = valid_reg ? reg : 0;
+    switch (command->command)
+    {
+    case PUSH:
+        op.op = T_PUSH;
+        break;
+    case PUSH_VAR:
+        op.op = valid_reg ? T_PUSH_REG : -1;
+        break;
+    case POP:
+        op.op = valid_reg ? T_POP_REG : -1;
+        break;
+    case ADD:
+        op.op = T_ADD;
+        break;
+    case SUB:
+        op.op = T_SUB;
+        break;
+    case MUL:
+        op.op = T_MUL;
+        break;
+    case DIV:
+        op.op = T_DIV;
+        break;
+    case POW:
+        op.op = T_POW;
+        break;
+    case DUP:
+        op.op = T_DUP;
+        break;
+    case IN:
+        op.op = T_IN;
+        break;
+    case OUT:
+        op.op = T_OUT;
+        break;
+    case ENTER:
+        op.op = T_ENTER;
+        break;
+    case LOAD_LOCAL:
+        op.op = T_LOAD_LOCAL;
+        break;
+    case STORE_LOCAL:
+        op.op = T_STORE_LOCAL;
+        break;
+    case NATIVE:
+        op.op = T_NATIVE;
+        break;
+    case NOP:
+    case JMP:
+        return;
+    case JA:
+    case JAE:
+    case JB:
+    case JBE:
+    case JE:
+    case JNE:
+        op.op = T_GUARD;
+        op.command = command->command;
+        op.taken = (next != index + 1);
+        op.exit = op.taken ? index + 1 : (int) command->parameter;
+        break;
+    case CALL:
+        op.op = T_CALL;
+        op.value = index + 1;
+        break;
+    case RET:
+        op.op = T_RET;
+        op.value = next;
+        break;
+    default:
+        op.op = -1;
+        break;
+    }
+
+    if (op.op < 0)
+        abort_recording(This);
+    else
+        This->buffer[This->buffer_cnt++] = op;
+}
+
+// tail is the backward jump that closed the loop
+static void finish_recording(Tracer_t* This, int tail)
+{
+    Trace_t* trace = (Trace_t*) calloc(1, sizeof(*trace));
+    trace->head = This->recording;
+    trace->tail = tail;
+    trace->recorded_cnt = This->buffer_cnt;
+    trace->length = This->buffer_length;
+    trace->ops_cnt = This->buffer_cnt;
+    trace->ops = (Trace_op_t*) calloc(This->buffer_cnt + 1, sizeof(*trace->ops));
+    for (int i = 0; i < This->buffer_cnt; ++i)
+        trace->ops[i] = This->buffer[i];
+    Trace_optimise(trace);
+
+    This->by_head[trace->head] = trace;
+    ++This->traces_cnt;
+    This->recording = -1;
+    This->buffer_cnt = 0;
+    This->buffer_length = 0;
+}
+
+int CPU_run_traced(CPU_t* This, Tracer_t* tracer)
+{
+    ASSERT_OK(CPU, This);
+    ASSERT_OK(Tracer, tracer);
+
+    const CPU_command_t* commands = tracer->commands;
+    int command_index = This->start;
+    while ((command_index >= 0) && (command_index < tracer->commands_cnt))
+    {
+        const CPU_command_t* command = &commands[command_index];
+        if (command->command == END)
+        {
+            if (tracer->recording >= 0)
+                abort_recording(tracer);
+            return 0;
+        }
+
+        int index = command_index;
+        This->position = index;
+        int result = CPU_step(This, commands, &command_index);
+        if (result != 0)
+            return result;
+        if (tracer->recording >= 0)
+            record(tracer, index, command_index);
+
+        int backward = (command_index <= index) && ((command->command == JMP) || is_conditional(command->command));
+        if (!backward || (command_index < 0))
+            continue;
+
+        int head = command_index;
+        if (tracer->recording == head)
+            finish_recording(tracer, index);
+        else if ((tracer->recording >= 0) && tracer->by_head[head])
+            abort_recording(tracer);
+        if (tracer->by_head[head])
+        {
+            int trace_result = CPU_run_trace(This, tracer->by_head[head], &command_index);
+            if (trace_result != 0)
+                return trace_result;
+        } else if ((tracer->recording < 0) && (++tracer->counters[head] >= TRACE_THRESHOLD))
+            tracer->recording = head;
+    }
+
+    printf("Jump to %d is out of the program\n", command_index);
+    return -1;
+}
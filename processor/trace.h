@@ -0,0 +1,85 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include "commands.h"
+#include "processor.h"
+
+#define TRACE_THRESHOLD 50
+#define TRACE_MAX_LENGTH 1024
+
+enum TRACE_OP {
+    T_NOP = 0,
+    T_PUSH,         // push value
+    T_PUSH_REG,     // push register reg
+    T_POP_REG,      // pop into register reg
+    T_SET_REG,      // reg = value
+    T_MOV_REG,      // reg = reg2
+    T_ADD,
+    T_SUB,
+    T_MUL,
+    T_DIV,
+    T_POW,
+    T_DUP,
+    T_IN,
+    T_OUT,
+    T_GUARD,        // conditional jump command went the recorded way, exit otherwise
+    T_CALL,         // push return address value
+    T_RET,          // pop return address, exit unless it is value
+    T_ENTER,        // give the current frame value local slots
+    T_LOAD_LOCAL,   // push local slot value
+    T_STORE_LOCAL,  // pop into local slot value
+    T_LOAD_MEM,     // pop address, push memory there
+    T_STORE_MEM,    // pop address, pop value to memory there
+    T_NATIVE        // call native function value with stack arguments
+};
+
+typedef struct
+{
+    int op;
+    int reg;
+    int reg2;
+    int command;    // conditional jump checked by T_GUARD
+    int taken;      // recorded direction of the jump
+    int exit;       // command to resume at when the guard fails
+    CPU_word_t value;
+} Trace_op_t;
+
+typedef struct
+{
+    int head;               // command index the loop starts at
+    int tail;               // backward jump closing the loop
+    int recorded_cnt;       // ops before optimisation
+    int length;             // commands of one iteration, charged to the watchdog
+    int ops_cnt;
+    Trace_op_t* ops;
+    int need;               // stack bounds of one iteration, like in Block_t
+    int peak;
+    long long entered;
+    long long iterations;
+    long long exits;
+} Trace_t;
+
+typedef struct
+{
+    const CPU_command_t* commands;
+    int commands_cnt;
+    int* counters;          // backward branches taken to the command
+    Trace_t** by_head;      // owns the traces
+    int traces_cnt;
+    int recording;          // head of the trace being recorded, -1 if none
+    int buffer_cnt;
+    int buffer_length;      // commands recorded into the buffer
+    Trace_op_t* buffer;
+    long long aborted;
+} Tracer_t;
+
+int Tracer_ctor(Tracer_t* This, const CPU_command_t* commands, int commands_cnt);
+int Tracer_dtor(Tracer_t* This);
+int Tracer_ok(Tracer_t* This);
+int Tracer_dump(Tracer_t* This, char* name);
+int Tracer_print_stats(Tracer_t* This);
+int Trace_optimise(Trace_t* This);
+int CPU_run_trace(CPU_t* This, Trace_t* trace, int* current_command);
+int CPU_run_traced(CPU_t* This, Tracer_t* tracer);
+
+#endif // TRACE_H_INCLUDED
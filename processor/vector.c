@@ -0,0 +1,422 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "vector.h"
+#include "commands.h"
+#include "processor.h"
+#include "myassert.h"
+#include "stack.h"
+
+// the SIMD kernels are written for float words, other words run the scalar ones
+#if (defined(__x86_64__) || defined(__i386__)) && (WORD_KIND == WORD_FLOAT)
+#define VECTOR_X86
+#include <immintrin.h>
+#endif
+
+static void scalar_add(CPU_word_t* dst, const CPU_word_t* a, const CPU_word_t* b, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = word_add(a[i], b[i]);
+}
+
+static void scalar_mul(CPU_word_t* dst, const CPU_word_t* a, const CPU_word_t* b, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = word_mul(a[i], b[i]);
+}
+
+static void scalar_fma(CPU_word_t* dst, const CPU_word_t* a, const CPU_word_t* b, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = word_add(dst[i], word_mul(a[i], b[i]));
+}
+
+static CPU_word_t scalar_sum(const CPU_word_t* a, int n)
+{
+    CPU_word_t sum = 0;
+    for (int i = 0; i < n; ++i)
+        sum = word_add(sum, a[i]);
+    return sum;
+}
+
+static CPU_word_t scalar_min(const CPU_word_t* a, int n)
+{
+    CPU_word_t min = a[0];
+    for (int i = 1; i < n; ++i)
+        if (a[i] < min)
+            min = a[i];
+    return min;
+}
+
+static CPU_word_t scalar_max(const CPU_word_t* a, int n)
+{
+    CPU_word_t max = a[0];
+    for (int i = 1; i < n; ++i)
+        if (a[i] > max)
+            max = a[i];
+    return max;
+}
+
+static CPU_word_t scalar_dot(const CPU_word_t* a, const CPU_word_t* b, int n)
+{
+    CPU_word_t dot = 0;
+    for (int i = 0; i < n; ++i)
+        dot = word_add(dot, word_mul(a[i], b[i]));
+    return dot;
+}
+
+static const Vector_kernels_t scalar_kernels = {"scalar", scalar_add, scalar_mul, scalar_fma, scalar_sum,
+                                                scalar_min, scalar_max, scalar_dot};
+
+#ifdef VECTOR_X86
+
+/*
+ * Vector kernels run over whole registers and leave the tail to the scalar
+ * ones. Reductions keep one partial result per lane, so their rounding may
+ * differ from the scalar order in the last bits.
+ */
+
+__attribute__((target("sse2")))
+static float sse_horizontal_sum(__m128 v)
+{
+    __m128 shuffled = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sums);
+    sums = _mm_add_ss(sums, shuffled);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse2")))
+static void sse_add(float* dst, const float* a, const float* b, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    scalar_add(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse_mul(float* dst, const float* a, const float* b, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    scalar_mul(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void sse_fma(float* dst, const float* a, const float* b, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 product = _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), product));
+    }
+    scalar_fma(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static float sse_sum(const float* a, int n)
+{
+    __m128 sums = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        sums = _mm_add_ps(sums, _mm_loadu_ps(a + i));
+    return sse_horizontal_sum(sums) + scalar_sum(a + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static float sse_min(const float* a, int n)
+{
+    if (n < 4)
+        return scalar_min(a, n);
+    __m128 mins = _mm_loadu_ps(a);
+    int i = 4;
+    for (; i + 4 <= n; i += 4)
+        mins = _mm_min_ps(mins, _mm_loadu_ps(a + i));
+    float lanes[4] = {};
+    _mm_storeu_ps(lanes, mins);
+    float min = scalar_min(lanes, 4);
+    if (i < n)
+    {
+        float tail = scalar_min(a + i, n - i);
+        min = (tail < min) ? tail : min;
+    }
+    return min;
+}
+
+__attribute__((target("sse2")))
+static float sse_max(const float* a, int n)
+{
+    if (n < 4)
+        return scalar_max(a, n);
+    __m128 maxs = _mm_loadu_ps(a);
+    int i = 4;
+    for (; i + 4 <= n; i += 4)
+        maxs = _mm_max_ps(maxs, _mm_loadu_ps(a + i));
+    float lanes[4] = {};
+    _mm_storeu_ps(lanes, maxs);
+    float max = scalar_max(lanes, 4);
+    if (i < n)
+    {
+        float tail = scalar_max(a + i, n - i);
+        max = (tail > max) ? tail : max;
+    }
+    return max;
+}
+
+__attribute__((target("sse2")))
+static float sse_dot(const float* a, const float* b, int n)
+{
+    __m128 sums = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        sums = _mm_add_ps(sums, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    return sse_horizontal_sum(sums) + scalar_dot(a + i, b + i, n - i);
+}
+
+static const Vector_kernels_t sse_kernels = {"sse", sse_add, sse_mul, sse_fma, sse_sum, sse_min, sse_max, sse_dot};
+
+__attribute__((target("avx2,fma")))
+static float avx2_horizontal_sum(__m256 v)
+{
+    __m128 sums = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuffled = _mm_movehdup_ps(sums);
+    sums = _mm_add_ps(sums, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sums);
+    sums = _mm_add_ss(sums, shuffled);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("avx2,fma")))
+static void avx2_add(float* dst, const float* a, const float* b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    sse_add(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void avx2_mul(float* dst, const float* a, const float* b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    sse_mul(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static void avx2_fma(float* dst, const float* a, const float* b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i),
+                                                  _mm256_loadu_ps(dst + i)));
+    sse_fma(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float avx2_sum(const float* a, int n)
+{
+    __m256 sums = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        sums = _mm256_add_ps(sums, _mm256_loadu_ps(a + i));
+    return avx2_horizontal_sum(sums) + sse_sum(a + i, n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float avx2_min(const float* a, int n)
+{
+    if (n < 8)
+        return sse_min(a, n);
+    __m256 mins = _mm256_loadu_ps(a);
+    int i = 8;
+    for (; i + 8 <= n; i += 8)
+        mins = _mm256_min_ps(mins, _mm256_loadu_ps(a + i));
+    float lanes[8] = {};
+    _mm256_storeu_ps(lanes, mins);
+    float min = scalar_min(lanes, 8);
+    if (i < n)
+    {
+        float tail = sse_min(a + i, n - i);
+        min = (tail < min) ? tail : min;
+    }
+    return min;
+}
+
+__attribute__((target("avx2,fma")))
+static float avx2_max(const float* a, int n)
+{
+    if (n < 8)
+        return sse_max(a, n);
+    __m256 maxs = _mm256_loadu_ps(a);
+    int i = 8;
+    for (; i + 8 <= n; i += 8)
+        maxs = _mm256_max_ps(maxs, _mm256_loadu_ps(a + i));
+    float lanes[8] = {};
+    _mm256_storeu_ps(lanes, maxs);
+    float max = scalar_max(lanes, 8);
+    if (i < n)
+    {
+        float tail = sse_max(a + i, n - i);
+        max = (tail > max) ? tail : max;
+    }
+    return max;
+}
+
+__attribute__((target("avx2,fma")))
+static float avx2_dot(const float* a, const float* b, int n)
+{
+    __m256 sums = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+        sums = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sums);
+    return avx2_horizontal_sum(sums) + sse_dot(a + i, b + i, n - i);
+}
+
+static const Vector_kernels_t avx2_kernels = {"avx2", avx2_add, avx2_mul, avx2_fma, avx2_sum,
+                                              avx2_min, avx2_max, avx2_dot};
+
+#endif // VECTOR_X86
+
+static const Vector_kernels_t* selected_kernels = 0;
+
+// best kernels the running CPU supports, detected on the first call
+const Vector_kernels_t* Vector_kernels()
+{
+    if (selected_kernels)
+        return selected_kernels;
+
+    selected_kernels = &scalar_kernels;
+#ifdef VECTOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        selected_kernels = &avx2_kernels;
+    else if (__builtin_cpu_supports("sse2"))
+        selected_kernels = &sse_kernels;
+#endif
+
+    return selected_kernels;
+}
+
+// forces kernels by name ("auto" detects them), returns 0 if the CPU supports them
+int Vector_select(const char* name)
+{
+    assert(name);
+
+    selected_kernels = 0;
+    if (!strcmp(name, "auto"))
+        Vector_kernels();
+    else if (!strcmp(name, "scalar"))
+        selected_kernels = &scalar_kernels;
+#ifdef VECTOR_X86
+    else if (!strcmp(name, "sse") && __builtin_cpu_supports("sse2"))
+        selected_kernels = &sse_kernels;
+    else if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        selected_kernels = &avx2_kernels;
+#endif
+
+    return selected_kernels ? 0 : -1;
+}
+
+// pops cnt command operands from the top down into operands, returns 0 if there were enough of them
+static int pop_operands(CPU_t* This, CPU_word_t* operands, int cnt)
+{
+    if (This->cstack->count < cnt)
+    {
+        printf("Not enough operands for vector command\n");
+        return -1;
+    }
+    for (int i = cnt - 1; i >= 0; --i)
+        operands[i] = Stack_pop(This->cstack);
+    return 0;
+}
+
+/*
+ * Bulk commands take their operands from the stack, pushed in this order:
+ *   vadd, vmul, vfma:         dst, a, b, count
+ *   vsum, vmin, vmax, vout:   a, count
+ *   vdot:                     a, b, count
+ *   vin:                      dst, count
+ * Addresses and counts are memory indices; reductions push their result.
+ */
+int CPU_vector(CPU_t* This, int command)
+{
+    ASSERT_OK(CPU, This);
+
+    const Vector_kernels_t* kernels = Vector_kernels();
+    CPU_word_t operands[4] = {};
+    CPU_word_t* memory = This->memory;
+    int result = 0;
+    switch (command)
+    {
+    case VADD:
+    case VMUL:
+    case VFMA:
+    {
+        if ((pop_operands(This, operands, 4) != 0) || (CPU_memory_check(This, operands[0], operands[3]) != 0) ||
+            (CPU_memory_check(This, operands[1], operands[3]) != 0) ||
+            (CPU_memory_check(This, operands[2], operands[3]) != 0))
+            return -1;
+        CPU_word_t* dst = memory + (int) operands[0];
+        const CPU_word_t* a = memory + (int) operands[1];
+        const CPU_word_t* b = memory + (int) operands[2];
+        int count = operands[3];
+        if (command == VADD)
+            kernels->add(dst, a, b, count);
+        else if (command == VMUL)
+            kernels->mul(dst, a, b, count);
+        else
+            kernels->fma(dst, a, b, count);
+        break;
+    }
+    case VSUM:
+    case VMIN:
+    case VMAX:
+    {
+        if ((pop_operands(This, operands, 2) != 0) || (CPU_memory_check(This, operands[0], operands[1]) != 0))
+            return -1;
+        const CPU_word_t* a = memory + (int) operands[0];
+        int count = operands[1];
+        if ((count == 0) && (command != VSUM))
+        {
+            printf("Empty range for vector command\n");
+            return -1;
+        }
+        if (command == VSUM)
+            CPU_push(This, kernels->sum(a, count));
+        else if (command == VMIN)
+            CPU_push(This, kernels->min(a, count));
+        else
+            CPU_push(This, kernels->max(a, count));
+        break;
+    }
+    case VDOT:
+        if ((pop_operands(This, operands, 3) != 0) || (CPU_memory_check(This, operands[0], operands[2]) != 0) ||
+            (CPU_memory_check(This, operands[1], operands[2]) != 0))
+            return -1;
+        CPU_push(This, kernels->dot(memory + (int) operands[0], memory + (int) operands[1], operands[2]));
+        break;
+    case VIN:
+        if ((pop_operands(This, operands, 2) != 0) || (CPU_memory_check(This, operands[0], operands[1]) != 0))
+            return -1;
+        for (int i = 0; i < (int) operands[1]; ++i)
+            memory[(int) operands[0] + i] = CPU_input(This);
+        break;
+    case VOUT:
+        if ((pop_operands(This, operands, 2) != 0) || (CPU_memory_check(This, operands[0], operands[1]) != 0))
+            return -1;
+        for (int i = 0; i < (int) operands[1]; ++i)
+            CPU_output(This, memory[(int) operands[0] + i]);
+        break;
+    default:
+        result = -1;
+        break;
+    }
+
+    ASSERT_OK(CPU, This);
+    return result;
+}
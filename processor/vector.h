@@ -0,0 +1,23 @@
+#ifndef VECTOR_H_INCLUDED
+#define VECTOR_H_INCLUDED
+
+#include "processor.h"
+
+// kernels of the bulk memory commands, one set per instruction set
+typedef struct
+{
+    const char* name;
+    void (*add)(CPU_word_t* dst, const CPU_word_t* a, const CPU_word_t* b, int n);
+    void (*mul)(CPU_word_t* dst, const CPU_word_t* a, const CPU_word_t* b, int n);
+    void (*fma)(CPU_word_t* dst, const CPU_word_t* a, const CPU_word_t* b, int n);    // dst += a * b
+    CPU_word_t (*sum)(const CPU_word_t* a, int n);
+    CPU_word_t (*min)(const CPU_word_t* a, int n);
+    CPU_word_t (*max)(const CPU_word_t* a, int n);
+    CPU_word_t (*dot)(const CPU_word_t* a, const CPU_word_t* b, int n);
+} Vector_kernels_t;
+
+const Vector_kernels_t* Vector_kernels();
+int Vector_select(const char* name);
+int CPU_vector(CPU_t* This, int command);
+
+#endif // VECTOR_H_INCLUDED
@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include "watchdog.h"
+#include "myassert.h"
+
+static long long now()
+{
+    struct timespec time = {};
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000LL + time.tv_nsec / 1000000;
+}
+
+// limits are 0 when not set, the watchdog starts counting at Watchdog_start()
+int Watchdog_ctor(Watchdog_t* This, long long max_instructions, long long timeout)
+{
+    assert(This);
+    assert(max_instructions >= 0);
+    assert(timeout >= 0);
+
+    *This = (Watchdog_t) {};
+    This->max_instructions = max_instructions;
+    This->timeout = timeout;
+    Watchdog_start(This);
+
+    ASSERT_OK(Watchdog, This);
+
+    return 0;
+}
+
+int Watchdog_dtor(Watchdog_t* This)
+{
+    assert(This);
+
+    *This = (Watchdog_t) {};
+
+    return 0;
+}
+
+int Watchdog_ok(Watchdog_t* This)
+{
+    if (!This)
+        return 0;
+    if ((This->max_instructions < 0) || (This->timeout < 0))
+        return 0;
+    if ((This->expired != 0) && (This->expired != WATCHDOG_BUDGET) && (This->expired != WATCHDOG_TIMEOUT))
+        return 0;
+    return 1;
+}
+
+int Watchdog_dump(Watchdog_t* This, char* name)
+{
+    assert(This);
+
+    printf("%s = Watchdog_t(%s)\n"
+           "{\n"
+           "    max_instructions = %lld\n"
+           "    timeout = %lld\n"
+           "    budget = %lld\n"
+           "    deadline = %lld\n"
+           "    clock_countdown = %d\n"
+           "    expired = %d\n"
+           "    command = %d\n"
+           "}\n",
+           name, Watchdog_ok(This) ? "ok" : "NOT OK!!!", This->max_instructions, This->timeout, This->budget,
+           This->deadline, This->clock_countdown, This->expired, This->command);
+
+    return 0;
+}
+
+// gives the run its full budget and time again
+int Watchdog_start(Watchdog_t* This)
+{
+    assert(This);
+
+    This->budget = This->max_instructions ? This->max_instructions : LLONG_MAX;
+    This->deadline = This->timeout ? now() + This->timeout : 0;
+    This->clock_countdown = WATCHDOG_CLOCK_PERIOD;
+    This->expired = 0;
+    This->command = 0;
+
+    return 0;
+}
+
+// takes cost commands off the budget at a checkpoint, returns 0 while neither limit has run out
+int Watchdog_charge(Watchdog_t* This, long long cost)
+{
+    if (This->expired)
+        return This->expired;
+
+    This->budget -= cost;
+    if (This->budget < 0)
+        This->expired = WATCHDOG_BUDGET;
+    else if (This->deadline && (--This->clock_countdown <= 0))
+    {
+        This->clock_countdown = WATCHDOG_CLOCK_PERIOD;
+        if (now() >= This->deadline)
+            This->expired = WATCHDOG_TIMEOUT;
+    }
+
+    return This->expired;
+}
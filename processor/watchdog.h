@@ -0,0 +1,37 @@
+#ifndef WATCHDOG_H_INCLUDED
+#define WATCHDOG_H_INCLUDED
+
+// why the watchdog stopped the program
+enum WATCHDOG_EXPIRED {
+    WATCHDOG_BUDGET = 1,
+    WATCHDOG_TIMEOUT
+};
+
+#define WATCHDOG_CLOCK_PERIOD 1024  // checkpoints between readings of the clock
+
+/*
+ * Limits of a run in commands and in wall-clock time. Straight-line code is
+ * bounded by the length of the program, so the engines charge the watchdog
+ * only where a program can repeat itself: a backward jump is charged the
+ * commands it spans, CALL and RET one each. The budget may thus be overrun
+ * by up to the length of the program.
+ */
+typedef struct
+{
+    long long max_instructions; // 0 for no limit
+    long long timeout;          // in milliseconds, 0 for no limit
+    long long budget;           // commands left to run
+    long long deadline;         // monotonic time in milliseconds to stop at
+    int clock_countdown;        // checkpoints before the clock is read again
+    int expired;                // WATCHDOG_BUDGET or WATCHDOG_TIMEOUT once a limit has run out
+    int command;                // index of the command the program stopped at
+} Watchdog_t;
+
+int Watchdog_ctor(Watchdog_t* This, long long max_instructions, long long timeout);
+int Watchdog_dtor(Watchdog_t* This);
+int Watchdog_ok(Watchdog_t* This);
+int Watchdog_dump(Watchdog_t* This, char* name);
+int Watchdog_start(Watchdog_t* This);
+int Watchdog_charge(Watchdog_t* This, long long cost);
+
+#endif // WATCHDOG_H_INCLUDED
@@ -0,0 +1,157 @@
+#ifndef WORD_H_INCLUDED
+#define WORD_H_INCLUDED
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Machine word of registers, stack, memory and command parameters, chosen
+ * when the processor and its tools are built:
+ *   (default)           float
+ *   -DCPU_WORD_DOUBLE   double
+ *   -DCPU_WORD_INT64    64-bit integer
+ * Every build reads and writes the programs of its own word only, see
+ * CPU_word_read(). WORD_SCAN, WORD_PRINT and WORD_WRITE are the formats of
+ * the word, word_parse(str, end) reads one as strtod() reads a double.
+ */
+#if defined(CPU_WORD_DOUBLE) && defined(CPU_WORD_INT64)
+#error "CPU_WORD_DOUBLE and CPU_WORD_INT64 cannot be both defined"
+#endif
+
+// values of WORD_KIND, macros to be usable in #if
+#define WORD_FLOAT 0
+#define WORD_DOUBLE 1
+#define WORD_INT64 2
+
+#if defined(CPU_WORD_DOUBLE)
+
+typedef double CPU_word_t;
+#define WORD_KIND WORD_DOUBLE
+#define WORD_NAME "double"
+#define WORD_SCAN "%lf"
+#define WORD_PRINT "%.15g"      // for people
+#define WORD_WRITE "%.17g"      // for files, reads back exactly
+#define word_parse strtod
+
+#elif defined(CPU_WORD_INT64)
+
+typedef int64_t CPU_word_t;
+#define WORD_KIND WORD_INT64
+#define WORD_NAME "int64"
+#define WORD_SCAN "%" SCNd64
+#define WORD_PRINT "%" PRId64
+#define WORD_WRITE "%" PRId64
+#define word_parse(str, end) strtoll(str, end, 10)
+
+#else
+
+typedef float CPU_word_t;
+#define WORD_KIND WORD_FLOAT
+#define WORD_NAME "float"
+#define WORD_SCAN "%f"
+#define WORD_PRINT "%g"
+#define WORD_WRITE "%g"
+#define word_parse strtof
+
+#endif
+
+// programs of words other than float start with "word <name>"
+#define WORD_MAGIC "word"
+
+/*
+ * DIV and POW of integer words: division truncates toward zero, division
+ * by zero gives 0 and INT64_MIN / -1 gives INT64_MIN. Powers are taken
+ * by squaring and wrap around like add, sub and mul do; a negative
+ * exponent gives 0 unless the base is 1 or -1.
+ */
+#if defined(CPU_WORD_INT64)
+
+static inline CPU_word_t word_wrap(uint64_t value)
+{
+    CPU_word_t result = 0;
+    memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+static inline CPU_word_t word_add(CPU_word_t a, CPU_word_t b)
+{
+    return word_wrap((uint64_t) a + (uint64_t) b);
+}
+
+static inline CPU_word_t word_sub(CPU_word_t a, CPU_word_t b)
+{
+    return word_wrap((uint64_t) a - (uint64_t) b);
+}
+
+static inline CPU_word_t word_mul(CPU_word_t a, CPU_word_t b)
+{
+    return word_wrap((uint64_t) a * (uint64_t) b);
+}
+
+static inline CPU_word_t word_div(CPU_word_t a, CPU_word_t b)
+{
+    if (b == 0)
+        return 0;
+    if ((b == -1) && (a == INT64_MIN))
+        return INT64_MIN;
+    return a / b;
+}
+
+static inline CPU_word_t word_pow(CPU_word_t a, CPU_word_t b)
+{
+    if (b < 0)
+        return (a == 1) ? 1 : (a == -1) ? ((b & 1) ? -1 : 1) : 0;
+    uint64_t result = 1;
+    uint64_t base = a;
+    for (; b; b >>= 1)
+    {
+        if (b & 1)
+            result *= base;
+        base *= base;
+    }
+    return word_wrap(result);
+}
+
+static inline int word_is_nan(CPU_word_t value)
+{
+    return 0;
+}
+
+#else
+
+static inline CPU_word_t word_add(CPU_word_t a, CPU_word_t b)
+{
+    return a + b;
+}
+
+static inline CPU_word_t word_sub(CPU_word_t a, CPU_word_t b)
+{
+    return a - b;
+}
+
+static inline CPU_word_t word_mul(CPU_word_t a, CPU_word_t b)
+{
+    return a * b;
+}
+
+static inline CPU_word_t word_div(CPU_word_t a, CPU_word_t b)
+{
+    return a / b;
+}
+
+static inline CPU_word_t word_pow(CPU_word_t a, CPU_word_t b)
+{
+    return pow(a, b);
+}
+
+static inline int word_is_nan(CPU_word_t value)
+{
+    return value != value;
+}
+
+#endif
+
+#endif // WORD_H_INCLUDED